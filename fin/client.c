@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <errno.h>
 #include <signal.h>
@@ -9,17 +10,71 @@
 #include <pthread.h>
 
 #include <arpa/inet.h>
+#include <sys/un.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/file.h>
 #include <sys/time.h>
+#include <time.h>
+
+// Latency histogram, the same log-linear buckets as in server
+#define HIST_SUB_BITS       4
+#define HIST_SUB_COUNT      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS        (HIST_SUB_COUNT * 40)
+
+#define BENCH_THREADS_MAX   1024
+#define BENCH_TIMEOUT       30      // Seconds to wait for response in benchmark mode
 
 typedef struct {
     char *pPath;
     char *pAddr;
+    char *pSocket;  // AF_UNIX socket of server, NULL means TCP
+    int nShm;       // Receive large responses through shared memory
     int nPort;
-    int nID;
+    int nID;        // -1 means all clients of query file
+    int nBenchmark;
+    int nThreads;   // 0 means one thread for every client ID
+    int nRate;      // 0 means closed-loop
+    int nWarmup;
+    int nDuration;
+    int nTimeout;   // Query deadline in msecs, 0 means server default
 } ClientArgs;
 
+typedef struct {
+    uint64_t nCounts[HIST_BUCKETS];
+    uint64_t nTotal;
+    uint64_t nSum;
+    uint64_t nMax;
+} Histogram;
+
+typedef struct {
+    char **pQueries;
+    int nCount;
+} QueryList;
+
+// Shared memory of client thread, server writes large responses into the memfd
+typedef struct {
+    char *pMap;
+    size_t nMapSize;
+    int nFD;
+} ShmBuffer;
+
+typedef struct {
+    ClientArgs *pArgs;
+    QueryList *pList;
+    ShmBuffer shm;
+    Histogram latency;  // Measured from intended send time
+    Histogram service;  // Measured from actual send time
+    uint64_t nStartTime;
+    uint64_t nStopTime;
+    double fInterval;   // Usecs between requests in open-loop mode
+    int nFirst;         // First query of this thread in the list
+    int nClientID;
+    int nCompleted;
+    int nRejected;
+    int nErrors;
+} BenchThread;
+
 typedef struct {
     char *pData;
     int nSize;
@@ -58,7 +113,7 @@ void stringClear(String *pStr)
 // But here we are using them for receiving responses
 size_t stringAppend(String *pStr, char *pData, size_t nSize)
 {
-    if (pStr->nSize - pStr->nUsed < nSize)
+    if (pStr->nSize - pStr->nUsed <= nSize)
     {
         pStr->nSize = pStr->nSize + nSize + 1;
         pStr->pData = realloc(pStr->pData, pStr->nSize);
@@ -83,6 +138,77 @@ uint32_t timeStamp()
     return tv.tv_sec * 1000000 + tv.tv_usec;
 }
 
+// This function returns monotonic timestamp in usecs
+uint64_t monotonicTime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// This histogram functions are exactly the same in server
+int histogramBucket(uint64_t nValue)
+{
+    if (nValue < HIST_SUB_COUNT) return (int)nValue;
+
+    int nShift = 63 - __builtin_clzll(nValue) - HIST_SUB_BITS;
+    int nBucket = (nShift + 1) * HIST_SUB_COUNT + (int)((nValue >> nShift) - HIST_SUB_COUNT);
+    return nBucket < HIST_BUCKETS ? nBucket : HIST_BUCKETS - 1;
+}
+
+// This histogram functions are exactly the same in server
+uint64_t histogramValue(int nBucket)
+{
+    if (nBucket < HIST_SUB_COUNT) return nBucket;
+
+    int nShift = nBucket / HIST_SUB_COUNT - 1;
+    uint64_t nLower = (uint64_t)(HIST_SUB_COUNT + nBucket % HIST_SUB_COUNT) << nShift;
+    return nLower + ((uint64_t)1 << nShift) - 1;
+}
+
+// Histograms are owned by single thread in client, so no atomics here
+void histogramRecord(Histogram *pHist, uint64_t nValue)
+{
+    pHist->nCounts[histogramBucket(nValue)]++;
+    pHist->nTotal++;
+    pHist->nSum += nValue;
+    if (nValue > pHist->nMax) pHist->nMax = nValue;
+}
+
+void histogramMerge(Histogram *pDst, Histogram *pSrc)
+{
+    int i;
+    for (i = 0; i < HIST_BUCKETS; i++)
+        pDst->nCounts[i] += pSrc->nCounts[i];
+
+    pDst->nTotal += pSrc->nTotal;
+    pDst->nSum += pSrc->nSum;
+    if (pSrc->nMax > pDst->nMax) pDst->nMax = pSrc->nMax;
+}
+
+// This histogram functions are exactly the same in server
+uint64_t histogramPercentile(Histogram *pHist, double fPercentile)
+{
+    if (!pHist->nTotal) return 0;
+
+    uint64_t nRank = (uint64_t)(fPercentile / 100.0 * pHist->nTotal + 0.5);
+    uint64_t nSeen = 0;
+    int i;
+
+    if (nRank < 1) nRank = 1;
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        nSeen += pHist->nCounts[i];
+        if (nSeen >= nRank)
+        {
+            uint64_t nValue = histogramValue(i);
+            return nValue < pHist->nMax ? nValue : pHist->nMax;
+        }
+    }
+
+    return pHist->nMax;
+}
+
 // This fucntion creates client socket and connects to newely created socket
 int createClientSocket(const char *pAddr, uint16_t nPort)
 {
@@ -111,12 +237,151 @@ int createClientSocket(const char *pAddr, uint16_t nPort)
     return fd;
 }
 
+// This function creates AF_UNIX client socket and connects to local server
+int createLocalSocket(const char *pPath)
+{
+    struct sockaddr_un sockAddr;
+    memset(&sockAddr, 0, sizeof(sockAddr));
+    sockAddr.sun_family = AF_UNIX;
+    strncpy(sockAddr.sun_path, pPath, sizeof(sockAddr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Can not create local socket: %s (%s)\n", pPath, strerror(errno));
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr*)&sockAddr, sizeof(sockAddr)) < 0)
+    {
+        fprintf(stderr, "Can not connect to the local socket: %s (%s)\n", pPath, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// This function creates memfd of shared memory responses, it is mapped when first response arrives
+void shmInit(ShmBuffer *pShm, int nEnabled)
+{
+    pShm->pMap = NULL;
+    pShm->nMapSize = 0;
+    pShm->nFD = -1;
+    if (!nEnabled) return;
+
+    pShm->nFD = memfd_create("fin-response", MFD_CLOEXEC);
+    if (pShm->nFD < 0)
+    {
+        fprintf(stderr, "Can not create shared memory: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+// This function unmaps and closes shared memory
+void shmClear(ShmBuffer *pShm)
+{
+    if (pShm->pMap != NULL) munmap(pShm->pMap, pShm->nMapSize);
+    if (pShm->nFD >= 0) close(pShm->nFD);
+    pShm->pMap = NULL;
+    pShm->nMapSize = 0;
+    pShm->nFD = -1;
+}
+
+// This function returns mapped response of given length, memfd is
+// grown by server, so mapping is recreated when response is larger.
+// Size of memfd is checked first, so reading mapping never faults
+const char* shmMap(ShmBuffer *pShm, size_t nLength)
+{
+    struct stat st;
+    if (fstat(pShm->nFD, &st) < 0) return NULL;
+    if ((size_t)st.st_size < nLength)
+    {
+        errno = EIO;
+        return NULL;
+    }
+
+    if (nLength > pShm->nMapSize)
+    {
+        if (pShm->pMap != NULL) munmap(pShm->pMap, pShm->nMapSize);
+        pShm->pMap = mmap(NULL, nLength, PROT_READ, MAP_SHARED, pShm->nFD, 0);
+        pShm->nMapSize = nLength;
+
+        if (pShm->pMap == MAP_FAILED)
+        {
+            pShm->pMap = NULL;
+            pShm->nMapSize = 0;
+            return NULL;
+        }
+    }
+
+    return pShm->pMap;
+}
+
+// This function reads exactly nSize bytes, short reads are repeated. Returns 0 on success,
+// -1 on error or when connection is closed before all bytes arrive
+int readFull(int nFD, void *pData, size_t nSize)
+{
+    size_t nRead = 0;
+    while (nRead < nSize)
+    {
+        ssize_t nBytes = read(nFD, (char*)pData + nRead, nSize - nRead);
+        if (nBytes < 0 && errno == EINTR) continue;
+        if (nBytes <= 0)
+        {
+            if (nBytes == 0) errno = ECONNRESET;
+            return -1;
+        }
+
+        nRead += nBytes;
+    }
+
+    return 0;
+}
+
+// This function sends request, memfd of shared memory client is passed along with it
+ssize_t sendRequest(int nFD, ShmBuffer *pShm, const char *pData, int nLength)
+{
+    if (pShm->nFD < 0) return write(nFD, pData, nLength);
+
+    struct iovec iov;
+    iov.iov_base = (void*)pData;
+    iov.iov_len = nLength;
+
+    char sControl[CMSG_SPACE(sizeof(int))];
+    memset(sControl, 0, sizeof(sControl));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = sControl;
+    msg.msg_controllen = sizeof(sControl);
+
+    struct cmsghdr *pCmsg = CMSG_FIRSTHDR(&msg);
+    pCmsg->cmsg_level = SOL_SOCKET;
+    pCmsg->cmsg_type = SCM_RIGHTS;
+    pCmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(pCmsg), &pShm->nFD, sizeof(int));
+
+    return sendmsg(nFD, &msg, 0);
+}
+
 // This function parses command line arguments
 void parseArgs(int argc, char *argv[], ClientArgs *pConf)
 {
     int nOpt = 0, nCount = 0;
-
-    while ((nOpt = getopt(argc, argv, "a:p:o:i:")) != -1) 
+    pConf->nID = -1;
+    pConf->nBenchmark = 0;
+    pConf->nThreads = 0;
+    pConf->nRate = 0;
+    pConf->nWarmup = 0;
+    pConf->nDuration = 10;
+    pConf->nTimeout = 0;
+    pConf->pSocket = NULL;
+    pConf->nShm = 0;
+
+    while ((nOpt = getopt(argc, argv, "a:p:o:i:bn:r:w:t:T:u:m")) != -1) 
     {
         switch (nOpt)
         {
@@ -136,20 +401,144 @@ void parseArgs(int argc, char *argv[], ClientArgs *pConf)
                 pConf->pPath = optarg;
                 nCount++;
                 break;
+            case 'b':
+                pConf->nBenchmark = 1;
+                break;
+            case 'n':
+                pConf->nThreads = atoi(optarg);
+                break;
+            case 'r':
+                pConf->nRate = atoi(optarg);
+                break;
+            case 'w':
+                pConf->nWarmup = atoi(optarg);
+                break;
+            case 't':
+                pConf->nDuration = atoi(optarg);
+                break;
+            case 'T':
+                pConf->nTimeout = atoi(optarg);
+                break;
+            case 'u':
+                pConf->pSocket = optarg;
+                break;
+            case 'm':
+                pConf->nShm = 1;
+                break;
             default:
                 break;
         }
     }
 
+    // Client ID is optional in benchmark mode
+    if (pConf->nBenchmark && pConf->nID < 0) nCount++;
+
+    // Local socket replaces server address and port
+    if (pConf->pSocket != NULL) nCount += 2;
+
     // Validate command line arguments
-    if (nCount != 4)
+    if (nCount != 4 || pConf->nThreads < 0 || pConf->nThreads > BENCH_THREADS_MAX ||
+        pConf->nRate < 0 || pConf->nWarmup < 0 || pConf->nDuration <= 0 || pConf->nTimeout < 0 ||
+        (pConf->nShm && pConf->pSocket == NULL))
     {
         printf("Invalid or missing command line parameters\n");
-        printf("Usage: %s -a serverAddr -p PORT -o pathToQueryFile –i clientId\n", argv[0]);
+        printf("Usage: %s -a serverAddr -p PORT|-u localSocket [-m] -o pathToQueryFile –i clientId [-T timeoutMs]\n", argv[0]);
+        printf("       %s -b -a serverAddr -p PORT|-u localSocket [-m] -o pathToQueryFile [-i clientId] [-n threads] "
+               "[-r queriesPerSecond] [-w warmupSeconds] [-t durationSeconds] [-T timeoutMs]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 }
 
+// This function connects to server, sends query and reads whole response,
+// returns socket error as -1, otherwise saves record count in pCount. Query is
+// prefixed with request header, server uses client ID for fair queuing.
+// Shared memory client receives length of response in memfd after record count
+int exchangeQuery(ClientArgs *pArgs, int nClientID, const char *pQuery, String *pResponse, int *pCount, ShmBuffer *pShm)
+{
+    // Connect to server
+    int nFD = pArgs->pSocket != NULL ? createLocalSocket(pArgs->pSocket) : createClientSocket(pArgs->pAddr, pArgs->nPort);
+    if (nFD < 0) return -1;
+
+    if (!pArgs->nBenchmark)
+        printf("Client-%d connected and sending query ‘%s’\n", pArgs->nID, pQuery);
+    else
+    {
+        // Lost response must not stop benchmark thread forever
+        struct timeval tv;
+        tv.tv_sec = BENCH_TIMEOUT;
+        tv.tv_usec = 0;
+        setsockopt(nFD, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+
+    char sHeader[LINE_MAX];
+    int nLength = pArgs->nTimeout ?
+        snprintf(sHeader, sizeof(sHeader), "@client=%d timeout=%d\n", nClientID, pArgs->nTimeout) :
+        snprintf(sHeader, sizeof(sHeader), "@client=%d\n", nClientID);
+
+    String request;
+    stringInit(&request, LINE_MAX);
+    stringAppend(&request, sHeader, nLength);
+
+    // Statements of batch follow their length, so server knows how much to read
+    if (!strncmp(pQuery, "BATCH ", 6))
+    {
+        nLength = snprintf(sHeader, sizeof(sHeader), "BATCH %d\n", (int)strlen(pQuery + 6));
+        stringAppend(&request, sHeader, nLength);
+        stringAppend(&request, (char*)pQuery + 6, strlen(pQuery + 6));
+    }
+    else stringAppend(&request, (char*)pQuery, strlen(pQuery));
+
+    // Send query to server
+    ssize_t nSent = sendRequest(nFD, pShm, request.pData, request.nUsed);
+    stringClear(&request);
+    if (nSent < 0)
+    {
+        fprintf(stderr, "Can not send query to server: %s\n", strerror(errno));
+        close(nFD);
+        return -1;
+    }
+
+    // Read response from server
+    *pCount = 0;
+    if (readFull(nFD, pCount, sizeof(int)) < 0)
+    {
+        fprintf(stderr, "Can not read response from server: %s\n", strerror(errno));
+        close(nFD);
+        return -1;
+    }
+
+    // Negative length means that response follows inline
+    int nShmLength = -1;
+    if (pShm->nFD >= 0 && readFull(nFD, &nShmLength, sizeof(int)) < 0)
+    {
+        fprintf(stderr, "Can not read response from server: %s\n", strerror(errno));
+        close(nFD);
+        return -1;
+    }
+
+    if (nShmLength >= 0)
+    {
+        const char *pData = shmMap(pShm, nShmLength);
+        if (pData == NULL)
+        {
+            fprintf(stderr, "Can not map shared memory: %s\n", strerror(errno));
+            close(nFD);
+            return -1;
+        }
+
+        stringAppend(pResponse, (char*)pData, nShmLength);
+    }
+
+    char sBuffer[512];
+    int nBytes = 0;
+
+    while ((nBytes = read(nFD, sBuffer, sizeof(sBuffer))) > 0)
+        stringAppend(pResponse, sBuffer, nBytes);
+
+    close(nFD);
+    return 0;
+}
+
 // This function line by line reads sql queries from input file and sends to server, 
 // receives responses and prints them in the terminal
 int sendQueries(ClientArgs *pArgs)
@@ -166,6 +555,10 @@ int sendQueries(ClientArgs *pArgs)
     ssize_t nRead = 0;
     int nCount = 0;
 
+    // The same memfd is passed with every query
+    ShmBuffer shm;
+    shmInit(&shm, pArgs->nShm);
+
     // Line-by-line read input csv file
     while ((nRead = getline(&pLine, &nLength, fp)) != -1) 
     {
@@ -181,48 +574,25 @@ int sendQueries(ClientArgs *pArgs)
             char *pParsedQuery = strtok_r(pQuery, "\n", &savePtr);
             if (pParsedQuery != NULL)
             {
-                printf("Client-%d connecting to %s:%d\n", pArgs->nID, pArgs->pAddr, pArgs->nPort);
+                if (pArgs->pSocket != NULL) printf("Client-%d connecting to %s\n", pArgs->nID, pArgs->pSocket);
+                else printf("Client-%d connecting to %s:%d\n", pArgs->nID, pArgs->pAddr, pArgs->nPort);
                 uint32_t nStartTime = timeStamp();
 
-                // Connect to server
-                int nFD = createClientSocket(pArgs->pAddr, pArgs->nPort);
-                if (nFD < 0)
-                {
-                    fprintf(stderr, "Can not connect to server: %s\n", strerror(errno));
-                    exit(EXIT_FAILURE);
-                }
-
-                printf("Client-%d connected and sending query ‘%s’\n", pArgs->nID, pParsedQuery);
-
-                // Send query to server
-                if (write(nFD, pParsedQuery, strlen(pParsedQuery)) < 0){
-                    fprintf(stderr, "Can not send query to server: %s\n",strerror(errno));
-                    break;
-                } 
-                
-                char sBuffer[512];
-                int nBytes = 0;
-
-                // Read response from server and print
-                int nCount = 0;
-                if (read(nFD, &nCount, sizeof(int)) < 0){
-                    fprintf(stderr, "Can not read response from server: %s\n",strerror(errno));
-                    break;
-                } 
-
                 String response;
                 stringInit(&response, 512);
 
-                while ((nBytes = read(nFD, sBuffer, sizeof(sBuffer))) > 0)
+                // Send query and read response from server
+                int nRecords = 0;
+                if (exchangeQuery(pArgs, pArgs->nID, pParsedQuery, &response, &nRecords, &shm) < 0)
                 {
-                    sBuffer[nBytes] = 0;
-                    stringAppend(&response, sBuffer, strlen(sBuffer));
+                    fprintf(stderr, "Can not execute query on server: %s\n", strerror(errno));
+                    exit(EXIT_FAILURE);
                 }
 
                 // Log statistics into file
                 uint32_t nEndTime = timeStamp();
                 double fDiff = (double)(nEndTime - nStartTime) / (double)1000000;
-                printf("Server’s response to Client-%d is %d records, and arrived in %f seconds\n", pArgs->nID, nCount, fDiff);
+                printf("Server’s response to Client-%d is %d records, and arrived in %f seconds\n", pArgs->nID, nRecords, fDiff);
 
                 int i;
                 for (i = 0; i < response.nUsed; i++)
@@ -233,8 +603,6 @@ int sendQueries(ClientArgs *pArgs)
 
                 printf("%s\n", response.pData);
                 stringClear(&response);
-
-                close(nFD);
                 nCount++;
             }
         }
@@ -243,10 +611,238 @@ int sendQueries(ClientArgs *pArgs)
     // Clean line and close file
     free(pLine); // this variable is allocated by getline() function
     fclose(fp);
+    shmClear(&shm);
 
     return nCount;
 }
 
+////////////////////////////////////////////////////////////////////////
+// BENCHMARK
+////////////////////////////////////////////////////////////////////////
+
+// This function appends query in the list
+void appendQuery(QueryList *pList, const char *pQuery)
+{
+    pList->pQueries = realloc(pList->pQueries, sizeof(char*) * (pList->nCount + 1));
+    if (pList->pQueries == NULL)
+    {
+        fprintf(stderr, "Can not realloc memory for queries\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pList->pQueries[pList->nCount] = strdup(pQuery);
+    if (pList->pQueries[pList->nCount] == NULL)
+    {
+        fprintf(stderr, "Can not alloc memory for query\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pList->nCount++;
+}
+
+// This function reads queries of the query file into lists, if client ID is given all queries
+// are saved in the first list, otherwise every client ID gets its own list. Returns count of lists
+int loadQueries(ClientArgs *pArgs, QueryList *pLists, int *pIDS, int nMaxLists)
+{
+    FILE *fp = fopen(pArgs->pPath, "r");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Can not open intput file: %s\n", pArgs->pPath);
+        exit(EXIT_FAILURE);
+    }
+
+    char *pLine = NULL;
+    size_t nLength = 0;
+    int i, nLists = 0;
+
+    while (getline(&pLine, &nLength, fp) != -1)
+    {
+        int nID = atoi(pLine);
+        if (pArgs->nID >= 0 && nID != pArgs->nID) continue;
+
+        char *pQuery = strstr(pLine, " ");
+        if (pQuery == NULL) continue;
+
+        char *savePtr;
+        char *pParsedQuery = strtok_r(pQuery + 1, "\n", &savePtr);
+        if (pParsedQuery == NULL) continue;
+
+        // Find list of this client
+        if (pArgs->nThreads || pArgs->nID >= 0) nID = 0;
+        for (i = 0; i < nLists; i++)
+            if (pIDS[i] == nID) break;
+
+        if (i == nLists)
+        {
+            if (nLists == nMaxLists) continue;
+            pLists[nLists].pQueries = NULL;
+            pLists[nLists].nCount = 0;
+            pIDS[nLists++] = nID;
+        }
+
+        appendQuery(&pLists[i], pParsedQuery);
+    }
+
+    free(pLine);
+    fclose(fp);
+    return nLists;
+}
+
+// Benchmark thread repeats its queries until the end of benchmark. In open-loop mode requests are
+// scheduled with fixed interval and latency is measured from scheduled time, so time spent waiting
+// for late responses is not hidden from results (coordinated omission correction)
+void* benchThread(void *pArg)
+{
+    BenchThread *pCtx = (BenchThread*)pArg;
+    uint64_t nMeasureFrom = pCtx->nStartTime + (uint64_t)pCtx->pArgs->nWarmup * 1000000;
+    uint64_t nRequest = 0;
+    int nQuery = pCtx->nFirst;
+
+    String response;
+    stringInit(&response, 512);
+    shmInit(&pCtx->shm, pCtx->pArgs->nShm);
+
+    while (1)
+    {
+        uint64_t nNow = monotonicTime();
+        uint64_t nIntended = nNow;
+
+        if (pCtx->fInterval > 0)
+        {
+            nIntended = pCtx->nStartTime + (uint64_t)(pCtx->fInterval * nRequest++);
+            if (nIntended >= pCtx->nStopTime) break;
+            if (nIntended > nNow) usleep(nIntended - nNow);
+        }
+        else if (nIntended >= pCtx->nStopTime) break;
+
+        // Send next query of this thread
+        int nRecords = 0;
+        uint64_t nSendTime = monotonicTime();
+        response.nUsed = 0;
+
+        int nResult = exchangeQuery(pCtx->pArgs, pCtx->nClientID, pCtx->pList->pQueries[nQuery], &response, &nRecords, &pCtx->shm);
+        uint64_t nEndTime = monotonicTime();
+        nQuery = (nQuery + 1) % pCtx->pList->nCount;
+
+        // Warmup requests are not measured
+        if (nIntended < nMeasureFrom) continue;
+
+        if (nResult < 0)
+        {
+            pCtx->nErrors++;
+            continue;
+        }
+
+        histogramRecord(&pCtx->latency, nEndTime - nIntended);
+        histogramRecord(&pCtx->service, nEndTime - nSendTime);
+        if (nRecords < 0) pCtx->nRejected++;
+        pCtx->nCompleted++;
+    }
+
+    stringClear(&response);
+    shmClear(&pCtx->shm);
+    return NULL;
+}
+
+// This function prints one line of latency report
+void printHistogram(const char *pName, Histogram *pHist)
+{
+    printf("%-14s mean %8lu  p50 %8lu  p90 %8lu  p99 %8lu  p999 %8lu  max %8lu\n", pName,
+           (unsigned long)(pHist->nTotal ? pHist->nSum / pHist->nTotal : 0),
+           (unsigned long)histogramPercentile(pHist, 50.0),
+           (unsigned long)histogramPercentile(pHist, 90.0),
+           (unsigned long)histogramPercentile(pHist, 99.0),
+           (unsigned long)histogramPercentile(pHist, 99.9),
+           (unsigned long)pHist->nMax);
+}
+
+// This function runs benchmark threads and prints throughput and latency percentiles
+int runBenchmark(ClientArgs *pArgs)
+{
+    QueryList lists[BENCH_THREADS_MAX];
+    int nIDS[BENCH_THREADS_MAX];
+    int i, nLists = loadQueries(pArgs, lists, nIDS, BENCH_THREADS_MAX);
+
+    if (!nLists)
+    {
+        fprintf(stderr, "No queries found in %s\n", pArgs->pPath);
+        return 0;
+    }
+
+    // Every client ID gets its own thread if count of threads is not given
+    int nThreads = pArgs->nThreads ? pArgs->nThreads : nLists;
+    BenchThread *pThreads = calloc(nThreads, sizeof(BenchThread));
+    pthread_t *pIDs = calloc(nThreads, sizeof(pthread_t));
+    if (pThreads == NULL || pIDs == NULL)
+    {
+        fprintf(stderr, "Can not alloc memory for benchmark threads\n");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t nStartTime = monotonicTime() + 10000;
+    uint64_t nStopTime = nStartTime + (uint64_t)(pArgs->nWarmup + pArgs->nDuration) * 1000000;
+    double fInterval = pArgs->nRate ? 1000000.0 * nThreads / pArgs->nRate : 0;
+
+    printf("Benchmark: %d threads, %s", nThreads, pArgs->nRate ? "open-loop" : "closed-loop");
+    if (pArgs->pSocket != NULL) printf(", %s transport", pArgs->nShm ? "shared memory" : "local socket");
+    if (pArgs->nRate) printf(" at %d queries/second", pArgs->nRate);
+    printf(", warmup %d seconds, duration %d seconds\n", pArgs->nWarmup, pArgs->nDuration);
+
+    for (i = 0; i < nThreads; i++)
+    {
+        BenchThread *pCtx = &pThreads[i];
+        pCtx->pArgs = pArgs;
+        pCtx->pList = &lists[pArgs->nThreads ? 0 : i];
+        pCtx->nFirst = pArgs->nThreads ? i % pCtx->pList->nCount : 0;
+        pCtx->nClientID = pArgs->nThreads ? (pArgs->nID >= 0 ? pArgs->nID : i) : nIDS[i];
+        pCtx->fInterval = fInterval;
+        pCtx->nStopTime = nStopTime;
+
+        // Spread open-loop schedules of threads evenly in the interval
+        pCtx->nStartTime = nStartTime + (uint64_t)(fInterval * i / nThreads);
+
+        if (pthread_create(&pIDs[i], NULL, benchThread, pCtx))
+        {
+            fprintf(stderr, "Can not create benchmark thread: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Merge results of all threads
+    Histogram *pLatency = calloc(1, sizeof(Histogram));
+    Histogram *pService = calloc(1, sizeof(Histogram));
+    int nCompleted = 0, nRejected = 0, nErrors = 0;
+
+    for (i = 0; i < nThreads; i++)
+    {
+        pthread_join(pIDs[i], NULL);
+        histogramMerge(pLatency, &pThreads[i].latency);
+        histogramMerge(pService, &pThreads[i].service);
+        nCompleted += pThreads[i].nCompleted;
+        nRejected += pThreads[i].nRejected;
+        nErrors += pThreads[i].nErrors;
+    }
+
+    printf("Completed %d queries, %d rejected or invalid, %d connection errors\n", nCompleted, nRejected, nErrors);
+    printf("Throughput: %.2f queries/second\n", (double)nCompleted / pArgs->nDuration);
+    printf("Latencies in usecs:\n");
+    printHistogram("response time", pLatency);
+    printHistogram("service time", pService);
+
+    for (i = 0; i < nLists; i++)
+    {
+        int j;
+        for (j = 0; j < lists[i].nCount; j++) free(lists[i].pQueries[j]);
+        free(lists[i].pQueries);
+    }
+
+    free(pLatency);
+    free(pService);
+    free(pThreads);
+    free(pIDs);
+    return nCompleted;
+}
+
 
 // Main function
 int main(int argc, char *argv[])
@@ -255,9 +851,16 @@ int main(int argc, char *argv[])
     ClientArgs args;
     parseArgs(argc, argv, &args);
 
+    // Run benchmark instead of printing responses
+    if (args.nBenchmark)
+    {
+        runBenchmark(&args);
+        return 0;
+    }
+
     // Send queries
     int nCount = sendQueries(&args);
     printf("A total of %d queries were executed, client is terminating.\n", nCount);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,64 @@
+#!/bin/sh
+# Starts local cluster for testing: SHARDS fin servers, every one loads rows of its hash partition
+# of the dataset, and router in front of them. Router listens on PORT, shards on the following ports.
+# Logs are written into LOG_DIR (default /tmp/fin-cluster).
+#
+# Usage: ./cluster.sh start datasetDir|dataset.csv keyColumn [shards] [port] [poolSize]
+#        ./cluster.sh stop [shards] [port]
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+SERVER="$DIR/server"
+LOG_DIR=${LOG_DIR:-/tmp/fin-cluster}
+
+usage()
+{
+    echo "Usage: $0 start datasetDir|dataset.csv keyColumn [shards] [port] [poolSize]"
+    echo "       $0 stop [shards] [port]"
+    exit 1
+}
+
+# Server runs as daemon, so it is found by its command line
+stop_server()
+{
+    pkill -INT -f "^$SERVER -p $1 " && echo "Stopped server on port $1"
+}
+
+case "$1" in
+    start)
+        [ $# -ge 3 ] || usage
+        DATA=$(realpath "$2") || exit 1
+        KEY=$3
+        SHARDS=${4:-4}
+        PORT=${5:-8000}
+        POOL=${6:-4}
+        [ -x "$SERVER" ] || { echo "Build server first: make -C $DIR"; exit 1; }
+        mkdir -p "$LOG_DIR"
+
+        HOSTS=""
+        i=0
+        while [ $i -lt "$SHARDS" ]; do
+            SHARD_PORT=$((PORT + i + 1))
+            "$SERVER" -p $SHARD_PORT -o "$LOG_DIR/shard$i.log" -l "$POOL" -d "$DATA" -S $i/"$SHARDS" -K "$KEY" || exit 1
+            HOSTS="$HOSTS${HOSTS:+,}127.0.0.1:$SHARD_PORT"
+            echo "Started shard $i/$SHARDS on port $SHARD_PORT"
+            i=$((i + 1))
+        done
+
+        # Shards load datasets in background, router forwards queries once they listen
+        "$SERVER" -p "$PORT" -o "$LOG_DIR/router.log" -l "$POOL" -R "$HOSTS" -K "$KEY" || exit 1
+        echo "Started router on port $PORT, logs are in $LOG_DIR"
+        ;;
+    stop)
+        SHARDS=${2:-4}
+        PORT=${3:-8000}
+        stop_server "$PORT"
+        i=0
+        while [ $i -lt "$SHARDS" ]; do
+            stop_server $((PORT + i + 1))
+            i=$((i + 1))
+        done
+        ;;
+    *)
+        usage
+        ;;
+esac
@@ -1,17 +1,31 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <errno.h>
 #include <signal.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <limits.h>
 #include <stdarg.h>
 #include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <poll.h>
 
 #include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/un.h>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <sys/file.h>
 #include <sys/time.h>
+#include <time.h>
 
 #ifdef LINE_MAX
 #define DATA_MAX    LINE_MAX
@@ -20,6 +34,214 @@
 #endif
 #define LOG_MAX     (1024 * 8)
 
+// CPU placement
+#define NUMA_NODES_MAX      64
+#define NUMA_PLACE_MIN      4096    // Min rows of table which is spread over NUMA nodes
+
+// Tables
+#define TABLES_MAX          64          // Max count of loaded CSV files
+#define TABLE_NAME_MAX      64
+#define TABLE_DEFAULT       "TABLE"     // Alias of the first table, queries without FROM use it too
+
+// Column types
+#define TYPE_TEXT           0
+#define TYPE_INT            1   // 64-bit integer
+#define TYPE_DOUBLE         2
+#define TYPE_DATE           3   // YYYY-MM-DD, stored as days since 1970-01-01
+#define TYPE_COUNT          4
+#define TYPE_BOOL           TYPE_COUNT  // Result of condition, only expressions have it
+#define TYPE_SAMPLE_ROWS    1024    // Rows sampled to infer column types
+
+// Zone maps
+#define ZONE_ROWS           8192    // Rows of block summarized by zone map
+#define BLOOM_BITS_DEFAULT  10      // Bits per key of Bloom filters, about 1% false positives
+#define BLOOM_BITS_MAX      64
+
+// Predicate operators, comparison bits tell which results satisfy operator
+#define PRED_LESS           1
+#define PRED_EQUAL          2
+#define PRED_GREATER        4
+#define PRED_IS_NULL        8
+#define PRED_NOT_NULL       16
+
+// Ordering limits
+#define ORDER_MAX           16          // Max columns in ORDER BY clause
+#define TOPK_MAX            4096        // Max LIMIT + OFFSET served by top-K heap
+#define PARALLEL_SORT_MIN   (1 << 16)   // Min rows to sort in parallel
+#define SORT_THREADS_MAX    8
+
+// Joins
+#define JOIN_RADIX_MIN      (1 << 16)   // Min build rows to partition join
+#define JOIN_RADIX_BITS     6
+#define JOIN_PARTITIONS     (1 << JOIN_RADIX_BITS)
+
+// Result cache
+#define CACHE_SIZE_DEFAULT  128                 // Default count of cached responses
+#define CACHE_BYTES_MAX     (64 * 1024 * 1024)  // Max memory used by cached responses
+
+// Statistics
+#define HIST_SUB_BITS       4
+#define HIST_SUB_COUNT      (1 << HIST_SUB_BITS)    // Linear buckets in every power of two
+#define HIST_BUCKETS        (HIST_SUB_COUNT * 40)   // Values up to 2^43 usecs
+#define STATS_INTERVAL      60                      // Default seconds between stats dumps
+
+// Query types
+#define QUERY_SELECT        0
+#define QUERY_UPDATE        1
+#define QUERY_STATS         2
+#define QUERY_INVALID       3
+#define QUERY_TYPE_COUNT    4
+
+// Response statuses, non-negative status is count of records
+#define STATUS_INVALID      -1
+#define STATUS_BUSY         -2
+#define STATUS_CANCELLED    -3
+
+// Query deadlines
+#define QUERY_TIMEOUT_DEFAULT   30000   // Default msecs from accept until query is cancelled
+#define QUERY_CHECK_ROWS        4096    // Rows scanned between cancellation checks
+
+// I/O engines
+#define ENGINE_BLOCKING     0
+#define ENGINE_URING        1
+#define URING_ENTRIES       256     // Submission queue size of acceptor ring
+#define URING_BUFFERS       256     // Provided receive buffers, power of two
+#define URING_BUF_GROUP     0
+#define URING_TAG_ACCEPT    1       // User data of accept, other small values are not pointers
+#define URING_TAG_TIMEOUT   2
+#define URING_TAG_CANCEL    3
+
+// Worker pool
+#define SPAWN_WAIT_DEFAULT      100     // Default msecs of queue wait which spawns new worker
+#define IDLE_TIMEOUT_DEFAULT    30000   // Default msecs after idle worker above minimum is retired
+
+// Worker states
+#define WORKER_STOPPED      0
+#define WORKER_RUNNING      1
+#define WORKER_RETIRED      2   // Thread exited and must be joined before its slot is reused
+
+// Admission control
+#define QUEUE_LIMIT_DEFAULT     1024    // Default max count of pending requests
+#define QUEUE_BUCKETS           256     // Hash buckets of per-client queues
+#define REQUEST_READ_TIMEOUT    200     // Msecs to wait for query after accept
+#define REQUEST_BODY_TIMEOUT    10000   // Msecs to receive whole body of large request, even without deadline
+#define PENDING_READS_MAX       1024    // Accepted connections waiting for their query, accept pauses beyond it
+
+// Local transport
+#define SHM_INLINE_MAX      4096    // Smaller responses are sent inline even to shared memory clients
+
+// Batches
+#define BATCH_MAX           (16 << 20)  // Max bytes of statements in BATCH request
+
+// Compaction
+#define COMPACT_PERCENT_DEFAULT 25      // Default percent of deleted rows which makes partition rewritten
+#define COMPACT_INTERVAL        1000    // Msecs between checks of compaction thread
+
+// Reload
+#define RELOAD_VERSION_STEP (1UL << 32) // Reloaded table starts with version far above the old one
+
+// Replication
+#define REPLICA_LOG_MAX     (64 << 20)  // Unsent bytes of follower which make it disconnected and resynchronized
+#define REPLICA_HEARTBEAT   100         // Msecs between heartbeats of idle replication stream
+#define REPLICA_RETRY       1000        // Msecs between connection attempts of follower
+#define REPLICA_HEADER_SIZE 32          // Bytes of header on the wire, fields are big endian
+#define REPLICA_MESSAGE_MAX (1 << 30)   // Max payload of replication message, larger one breaks the stream
+
+// Replication messages
+#define REPLICA_MSG_TABLE   1   // Snapshot of table, payload is name, columns, types and rows, one per line
+#define REPLICA_MSG_WRITE   2   // Write query applied by primary
+#define REPLICA_MSG_READY   3   // Snapshots of all tables were sent
+#define REPLICA_MSG_PING    4   // Heartbeat of idle stream
+
+// Cluster
+#define SHARDS_MAX          64
+#define CONNECT_TIMEOUT     3000    // Max msecs to connect to shard or primary, query deadline may shorten it
+
+// Tracing
+#define TRACE_SAMPLE_DEFAULT    100         // Default sampling, every Nth query is traced
+#define TRACE_FLUSH_BYTES       (64 * 1024) // Buffered events of worker which are written into trace file at once
+#define TRACE_FLUSH_INTERVAL    1000        // Max msecs events of traced query stay buffered
+
+// Arena
+#define ARENA_BLOCK_SIZE    (1 << 20)   // Size of arena block, larger allocations get their own block
+#define ARENA_KEEP_MAX      (64 << 20)  // Arena which grew above this returns extra blocks at reset
+#define OUTPUT_KEEP_MAX     (16 << 20)  // Output buffer of worker which grew above this is shrunk after response
+
+// Query tokens
+#define TOKEN_END           0
+#define TOKEN_WORD          1   // Keyword, name or bare value
+#define TOKEN_STRING        2   // Quoted value, text of token is without quotes
+#define TOKEN_OPERATOR      3   // Comparison operator, its PRED_* bits are kept in token
+#define TOKEN_SYMBOL        4   // One of , ; ( ) * or + - / standing alone
+
+// Statement types
+#define STATEMENT_SELECT    0
+#define STATEMENT_UPDATE    1
+#define STATEMENT_DELETE    2
+
+// Plan operators, they run in order they are saved in plan
+#define PLAN_SCAN           0   // Rows of table in load order, deleted rows are skipped
+#define PLAN_FILTER         1   // Rows which satisfy WHERE predicate
+#define PLAN_SORT           2   // Rows ordered by ORDER BY keys
+#define PLAN_PROJECT        3   // Columns of rows appended into response
+#define PLAN_DISTINCT       4   // Projected rows which were not appended yet
+#define PLAN_LIMIT          5   // OFFSET and LIMIT of projected rows
+#define PLAN_UPDATE         6   // New values of rows
+#define PLAN_DELETE         7   // Tombstones of rows
+#define PLAN_OPS_MAX        8
+
+// Plan cache
+#define PLAN_CACHE_SIZE     64  // Plans cached by every worker, slot is chosen by hash of query text
+
+// Expression nodes
+#define EXPR_VALUE          0   // Column or value, bare word is column if table has such column
+#define EXPR_COMPARE        1
+#define EXPR_IS_NULL        2   // Operator is PRED_IS_NULL or PRED_NOT_NULL
+#define EXPR_ARITHMETIC     3   // Operator is symbol + - * or /
+#define EXPR_AND            4
+#define EXPR_OR             5
+#define EXPR_NOT            6
+#define EXPR_DEPTH_MAX      32  // Max nesting of parentheses
+
+// Operands of expression compiler
+#define OPERAND_LITERAL     0   // Value of query, it gets type of the other operand
+#define OPERAND_CONSTANT    1   // Typed value, operators of constants are folded
+#define OPERAND_COLUMN      2   // Column which is not loaded into register yet
+#define OPERAND_REGISTER    3
+
+// Expression VM opcodes, every instruction processes all rows of batch
+#define VM_LOAD_PACKED      0   // Values of INT, DATE or DOUBLE column
+#define VM_LOAD_TEXT        1   // Fields of column, empty field is NULL
+#define VM_CONST_INT        2   // Constant repeated for every row
+#define VM_CONST_DOUBLE     3
+#define VM_CONST_TEXT       4
+#define VM_CONST_BOOL       5
+#define VM_TO_DOUBLE        6
+#define VM_ARITH_INT        7   // Argument is symbol of operator
+#define VM_ARITH_DOUBLE     8
+#define VM_CMP_INT          9   // Argument is PRED_* bits of comparison
+#define VM_CMP_DOUBLE       10
+#define VM_CMP_TEXT         11
+#define VM_CMP_INT_CONST    12
+#define VM_CMP_DOUBLE_CONST 13
+#define VM_CMP_TEXT_CONST   14
+#define VM_CMP_COLUMN_INT   15  // Column is compared with constant without loading it into register
+#define VM_CMP_COLUMN_DOUBLE 16
+#define VM_CMP_COLUMN_TEXT  17
+#define VM_IS_NULL          18  // Argument is PRED_IS_NULL or PRED_NOT_NULL
+#define VM_AND              19
+#define VM_OR               20
+#define VM_NOT              21
+#define VM_BATCH_ROWS       1024    // Rows evaluated by every instruction, divides ZONE_ROWS
+#define VM_REGISTERS_MAX    64
+
+// Lock profiler, it is compiled in by -DLOCK_PROFILE
+#define LOCK_SITES_MAX      256 // Call sites of lock functions counted by every thread
+#define LOCK_HELD_MAX       16  // Locks held by thread at once whose hold time is measured
+#define LOCK_KIND_MUTEX     0
+#define LOCK_KIND_READ      1
+#define LOCK_KIND_WRITE     2
+
 // Log types
 #define ERROR 0
 #define INFO  1
@@ -27,74 +249,506 @@
 typedef struct {
     const char *pLogFile;
     const char *pDBPath;
+    int nCacheSize;
+    int nStatsInterval;
+    int nQueueLimit;
+    int nQueryTimeout;
     int nPoolSize;
+    int nMaxPoolSize;
+    int nSpawnWait;
+    int nIdleTimeout;
+    int nPinning;   // Pin workers to CPUs
+    int nNuma;      // Spread rows and scans over NUMA nodes
+    int nEngine;
     int nPort;
+    const char *pLocalPath; // AF_UNIX socket of co-located clients, NULL if disabled
+    const char *pBloomColumns;
+    int nBloomBits;
+    int nCompactPercent;    // 0 disables compaction
+    const char *pPrimary;   // host:port of primary which is followed, NULL if tables are loaded from files
+    const char *pShards;    // Comma separated host:port of shards served by router, NULL if this server is not router
+    const char *pShardKey;  // Column which rows are sharded by
+    int nShard;             // Shard of this server, rows of other shards are not loaded
+    int nShardCount;        // 0 if this server is not shard
+    const char *pTracePath; // Chrome trace file of sampled queries, NULL if tracing is disabled
+    int nTraceSample;
 } ServerConfig;
 
+typedef struct {
+    char *pData;
+    int nSize;
+    int nUsed;
+} String;
+
+// Block of arena, data follows header. Blocks stay allocated and are reused after reset
+typedef struct ArenaBlock {
+    struct ArenaBlock *pNext;
+    size_t nSize;
+    size_t nUsed;
+} ArenaBlock;
+
+// Bump allocator of worker, temporaries of query are released all at once after response is sent
+typedef struct {
+    ArenaBlock *pFirst;
+    ArenaBlock *pCurrent;
+    size_t nTotal;  // Bytes of all blocks
+} Arena;
+
 typedef struct {
     char sData[DATA_MAX];
 } RowData;
 
+// Summary of column in block of ZONE_ROWS rows, min and max are kept for typed columns only
+typedef struct {
+    union {
+        int64_t nMin;
+        double fMin;
+    };
+    union {
+        int64_t nMax;
+        double fMax;
+    };
+    int nNullCount; // Empty or missing fields
+} Zone;
+
+// Column of table, values of typed columns are also kept in packed native array
+typedef struct {
+    union {
+        int64_t *pInts;     // INT and DATE values
+        double *pDoubles;   // DOUBLE values
+    };
+    Zone *pZones;
+    uint64_t *pBloom;   // Bloom filter of every zone, NULL if column has no filters
+    int nBloomWords;    // Words of filter of single zone
+    int nBloomHashes;
+    int nType;
+} Column;
+
 typedef struct {
     pthread_rwlock_t rwLock;
+    char sName[TABLE_NAME_MAX];
+    char sPath[PATH_MAX];
     char sColumns[DATA_MAX];
-    RowData *pRows;
+    RowData **pChunks;      // Rows in chunks of ZONE_ROWS, chunks do not move when table grows
+    Column *pColumns;       // Types and packed values, rows keep CSV text used in responses
+    uint64_t *pDeleted;     // Tombstones of deleted rows, scans skip them until partition is compacted
+    int *pChunkDeleted;     // Count of deleted rows in every chunk
+    unsigned long nVersion; // Incremented by every update
+    unsigned long nSchemaEpoch; // Changed when column type changes, plans of older epoch are compiled again
+    int nNodeRows[NUMA_NODES_MAX + 1]; // First row of every NUMA node
+    int nNodeCount; // Zero if rows are not spread over NUMA nodes
     int nColumnCount;
     int nRowCount;
-    int nRowSize;
+    int nDeletedCount;
+    int nChunkCount;
+    int nChunkSize; // Capacity of chunk table, packed values and zones have room for all its rows
+    int nRefCount;  // Catalog holds one reference while table is current, queries hold others
+    int nSlot;      // Position in catalog, reloaded version takes the same position
     int isInit;
 } Database;
 
+// CPUs which server may use, grouped by NUMA nodes
+typedef struct {
+    int nCpus[CPU_SETSIZE];
+    int nNodeStart[NUMA_NODES_MAX + 1]; // First CPU of every node in nCpus
+    int nCpuCount;
+    int nNodeCount;
+    int nPinning;
+    int nNuma;
+} Topology;
+
+// All tables served by server, every table has its own lock and version
+typedef struct {
+    pthread_mutex_t mutex;  // Guards table pointers and taking of references
+    Database **pTables;     // Current version of every table, reload replaces it
+    int nTableCount;
+    const char *pBloomColumns; // Comma separated columns which get Bloom filters, NULL if none
+    int nBloomBits;
+    int nCompactPercent;
+    const char *pShardKey;  // Column which rows are sharded by, tables without it are kept by shard 0
+    int nShard;
+    int nShardCount;        // 0 if all rows are kept
+    pthread_t compactThread;
+    pthread_t reloadThread;
+    pthread_t signalThread;
+    int nReloadSlot;    // Table loaded by reload thread, -1 means all tables
+    int isReloading;
+    int isReloadInit;   // Reload thread was started and must be joined
+    int isCompactInit;
+    int isSignalInit;
+    int isInit;
+} Catalog;
+
+// Tables loaded by loader threads, every thread takes next unloaded table
+typedef struct {
+    Catalog *pCatalog;
+    Database **pTables;
+    int nLoaded[TABLES_MAX];
+    int nCount;
+    int nNextLoad;
+} LoadTask;
+
+// Header of replication message, payload of nLength bytes follows it. It is sent
+// as REPLICA_HEADER_SIZE bytes of fixed width fields in the order of this struct
+typedef struct {
+    int nType;
+    int nSlot;      // Catalog position of table, -1 if message has no table
+    int nLength;
+    int nReserved;
+    uint64_t nSeq;  // Writes shipped by primary until this message
+    uint64_t nTime; // Wall clock usecs of primary when message was queued
+} ReplicaHeader;
+
+// Follower connected to this server, messages are buffered until its sender thread writes them
+typedef struct Follower {
+    struct Follower *pNext;
+    String log;         // Unsent messages
+    uint64_t nTables;   // Bit of every catalog position whose snapshot was queued
+    pthread_t thread;
+    int nSocket;
+    int isClosed;       // Connection failed or log overflowed, sender thread stops
+    int isDone;         // Sender thread stopped, follower can be joined and freed
+} Follower;
+
+// Replication state, every server ships its writes to followers and
+// follower also receives snapshots and writes from its primary
+typedef struct {
+    pthread_mutex_t mutex;  // Guards followers and keeps order of shipped messages
+    pthread_cond_t cond;    // Signalled when messages are queued
+    Follower *pFollowers;
+    uint64_t nSeq;          // Writes shipped to followers
+    int nFollowerCount;     // Followers with running sender thread
+    const char *pPrimary;   // host:port of primary, NULL if this server is not follower
+    pthread_t thread;       // Receives messages of primary
+    uint64_t nAppliedSeq;   // Sequence of primary applied by follower
+    uint64_t nPrimaryTime;  // Primary time of the last received message
+    int nPrimarySocket;
+    int isSynced;           // Follower has snapshots of all tables
+    int isThreadInit;
+    int isInit;
+} Replication;
+
+// Shards of cluster, router sends point queries to one shard and other queries to all of them
+typedef struct {
+    char *pHosts[SHARDS_MAX];   // host:port of every shard, position is shard number
+    char *pList;                // Buffer of host names
+    const char *pKey;           // Column which rows are sharded by
+    int nCount;                 // 0 if this server is not router
+} Router;
+
+// Response of shard to routed query
+typedef struct {
+    String data;
+    int nSocket;
+    int nStatus;
+} ShardReply;
+
 typedef struct {
     pthread_mutex_t mutex;
     const char *pPath;
     int isInit;
 } Logger;
 
+// Writer of Chrome trace file, events of sampled queries are buffered by workers and appended in batches
 typedef struct {
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
-    int nInterrupt;
+    pthread_mutex_t mutex;  // Keeps batches of different workers apart
+    uint64_t nQueries;      // Queries seen by sampling
+    int nSampleRate;        // Every Nth query is traced
+    int nFile;
+    int nPid;
+    int isFirst;            // No event was written yet, so the next one is not preceded by comma
+    int isInit;
+} Tracer;
+
+// Trace events of single worker thread, every event is preceded by comma
+typedef struct {
+    String events;
+    uint64_t nLastFlush;
+    uint64_t nQuery;    // Sequence number of traced query, it is id of its async events
+    int nWorkerID;
+    int isSampled;      // Query executed by worker is traced
+} TraceBuffer;
+
+// Deadline and connection of the query executed by worker
+typedef struct {
+    uint64_t nDeadline; // 0 means no deadline
+    unsigned int nTicks;
+    int nClientFD;
+    int nCancelled;
+    int nPeerClosed;
+} QueryContext;
+
+typedef struct {
+    uint64_t nCounts[HIST_BUCKETS];
+    uint64_t nTotal;
+    uint64_t nSum;
+    uint64_t nMax;
+} Histogram;
+
+// Counters of single worker thread, only owner thread writes them
+typedef struct {
+    Histogram latency[QUERY_TYPE_COUNT];
+    Histogram queueWait;
+    Histogram lockWait;
+    uint64_t nBusyTime;
+    uint64_t nBytesSent;
+} WorkerStats;
+
+typedef struct {
+    uint64_t nStartTime;
+    uint64_t nAccepted;
+    uint64_t nWaits;    // Times request was queued while all workers are busy
+    uint64_t nRejected; // Requests answered with "server busy"
+    uint64_t nCancelled;
+    uint64_t nSyscalls; // Syscalls of socket I/O, including io_uring_enter
+    uint64_t nShmResponses; // Responses written into memfd of local clients
+    uint64_t nZonesScanned; // Blocks scanned by filters
+    uint64_t nZonesSkipped; // Blocks skipped by zone maps
+    uint64_t nBloomSkipped; // Blocks skipped by Bloom filters
+    uint64_t nCompactions;  // Partition rewrites of compaction thread
+    uint64_t nCompactedRows; // Deleted rows removed by compaction
+    uint64_t nReloads;      // Tables replaced by reload
+    uint64_t nRoutedSingle; // Queries sent by router to one shard
+    uint64_t nRoutedScatter; // Queries sent by router to all shards
+    uint64_t nShardErrors;  // Shards which router could not reach
+    uint64_t nPlanHits;     // Queries which reused plan cached by worker
+    uint64_t nPlanMisses;   // Queries which were compiled by worker
+    uint64_t nVmBatches;    // Batches of rows evaluated by expression programs
+    int nQueueDepth;    // Accepted connections which are not delegated yet
+    int nMaxQueueDepth;
+    pthread_t statsThread;
+    int isThreadInit;
+    int isInit;
+} ServerStats;
+
+// Worker slot, statistics of the slot survive retirement of its thread
+typedef struct {
+    WorkerStats *pStats;
+    pthread_t thread;
+    uint64_t nSpawnTime;
+    uint64_t nLiveTime; // Usecs lived by retired threads of this slot
+    String output;      // Response buffer reused by queries of worker thread
     int nWorkerID;
     int nClientFD;
+    int nState;
     int isInit;
-    int nBusy;
 } WorkerContext;
 
+// Elastic pool of workers, it grows when requests wait in queue and shrinks when workers are idle
 typedef struct {
-    WorkerContext *pWorkers;
-    int nWorkerCount;
+    pthread_mutex_t mutex;
+    WorkerContext **pWorkers;
+    uint64_t nSpawned;
+    uint64_t nRetired;
+    int nSlotCount;     // Slots with allocated context
+    int nWorkerCount;   // Running workers
+    int nMinWorkers;
+    int nMaxWorkers;
+    int nSpawnWait;
+    int nIdleTimeout;
+    int nEngine;        // I/O engine of workers
+    uint64_t nLastSpawn;
     int isInit;
 } WorkerThreads;
 
+typedef struct CacheEntry {
+    struct CacheEntry *pHashNext;
+    struct CacheEntry *pPrev; // LRU list, head is most recently used
+    struct CacheEntry *pNext;
+    unsigned long nVersion;
+    uint32_t nHash;
+    char *pKey;
+    char *pData;
+    int nLength;
+    int nStatus;
+} CacheEntry;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    CacheEntry **pBuckets;
+    CacheEntry *pHead;
+    CacheEntry *pTail;
+    unsigned long nHits;    // Changed under lock and read atomically by stats
+    unsigned long nMisses;
+    size_t nBytes;
+    int nBucketCount;
+    int nCapacity;
+    int nCount;
+    int isInit;
+} ResultCache;
+
+typedef struct Request {
+    struct Request *pNext;
+    uint64_t nAcceptTime;
+    uint64_t nClientKey;    // Client ID from request header or peer address
+    int nTimeout;           // Msecs, 0 means no deadline
+    int nClientFD;
+    int nShmFD;             // Memfd of shared memory client, -1 otherwise
+    int nLength;
+    char sData[DATA_MAX];
+} Request;
+
+// Pending requests of single client
+typedef struct ClientQueue {
+    struct ClientQueue *pHashNext;
+    struct ClientQueue *pNextActive;
+    Request *pHead;
+    Request *pTail;
+    uint64_t nKey;
+    int nCount;
+} ClientQueue;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    ClientQueue *pBuckets[QUEUE_BUCKETS];
+    ClientQueue *pActiveHead; // Round-robin ring of clients with pending requests
+    ClientQueue *pActiveTail;
+    int nLimit;
+    int nCount;
+    int nIdleWorkers;
+    int nShutdown;
+    int isInit;
+} RequestQueue;
+
+// Listener of co-located clients, it has its own acceptor thread
+typedef struct {
+    pthread_t thread;
+    const char *pPath;
+    int nSocket;
+    int nTimeout;
+    int isThreadInit;
+} LocalListener;
+
+// Mapped io_uring instance, used through raw syscalls
+typedef struct {
+    struct io_uring_sqe *pSqes;
+    struct io_uring_cqe *pCqes;
+    unsigned *pSqHead;
+    unsigned *pSqTail;
+    unsigned *pCqHead;
+    unsigned *pCqTail;
+    unsigned nSqMask;
+    unsigned nCqMask;
+    unsigned nSqEntries;
+    unsigned nSqeTail;  // Prepared entries, kernel sees them after submit
+    void *pSqMap;
+    void *pCqMap;
+    size_t nSqMapSize;
+    size_t nCqMapSize;
+    int nRingFD;
+} Ring;
+
+#ifdef LOCK_PROFILE
+// Counters of locks taken at one call site by one thread, only owner thread writes them
+typedef struct {
+    const char *pFunction;  // NULL if entry is free, it is published after other fields
+    int nLine;
+    int nKind;
+    uint64_t nAcquired;
+    uint64_t nContended;    // Acquisitions which found lock taken and waited for it
+    uint64_t nWaitTime;
+    uint64_t nMaxWait;
+    uint64_t nHoldTime;
+    uint64_t nMaxHold;
+} LockSite;
+
+// Lock held by thread, its hold time is counted for site which acquired it
+typedef struct {
+    void *pLock;
+    LockSite *pSite;
+    uint64_t nAcquireTime;
+} HeldLock;
+
+// Lock counters of one thread, profile of exited thread is taken over by the next new thread
+typedef struct LockProfile {
+    struct LockProfile *pNext;
+    LockSite sites[LOCK_SITES_MAX];
+    HeldLock held[LOCK_HELD_MAX];
+    int nHeldCount;
+    int isOwned;
+} LockProfile;
+
+// Profiles of all threads, registry mutex is not profiled
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_key_t key;      // Destructor releases profile of exiting thread
+    LockProfile *pProfiles;
+    int isInit;
+} LockRegistry;
+#endif
+
 // Global variables for gracefull termination
 static int g_nListenerSock = -1;
 static int g_nInterrupted = 0;
-static int g_syncInit = 0;
-static pthread_mutex_t g_mutex;
-static pthread_cond_t g_cond;
+static RequestQueue g_queue;
 static WorkerThreads g_workers;
-static Database g_dataBase;
+static Catalog g_catalog;
+static Topology g_topology;
+static ResultCache g_cache;
+static ServerStats g_stats;
 static Logger g_logger;
+static Tracer g_trace;
+static LocalListener g_local;
+static Replication g_replica;
+static Router g_router;
+#ifdef LOCK_PROFILE
+static LockRegistry g_locks;
+#endif
 
 // Forward declarations
-void destroyDatabase(Database *pDB);
+void destroyCatalog(Catalog *pCatalog);
+void destroyCache(ResultCache *pCache);
+double cacheHitRatio(ResultCache *pCache);
 void exitFailure(const char *pMessage);
+void initMutex(pthread_mutex_t *pMutex);
 void lockMutex(pthread_mutex_t *pMutex);
 void unlockMutex(pthread_mutex_t *pMutex);
 void destroyWorker(WorkerContext *pCtx);
+void growPool(WorkerThreads *pPool, RequestQueue *pQueue);
+void queueRequest(RequestQueue *pQueue, Request *pReq);
+uint64_t localPeerKey(int nClientFD);
+void freeRequest(Request *pReq);
+int shrinkPool(WorkerThreads *pPool);
+void shutdownQueue(RequestQueue *pQueue);
+void stopLocalListener(LocalListener *pLocal);
+ssize_t sendAndClose(int nClientFD, struct iovec *pIov, int nCount);
+void destroyQueue(RequestQueue *pQueue);
 void logToFile(int nType, char *pStr, ...);
+const char* getField(const char *pRow, int nID, int *pLen);
+int findColumn(Database *pDB, const char *pName, int nLength);
+int buildZones(Database *pDB);
+uint32_t hashData(const char *pData, int nLength);
+void replicateWrite(Database *pDB, const char *pQuery);
+void destroyReplication(Replication *pRepl);
+
+// Lock profiler replaces lock functions by wrappers which count waits and holds of every call site,
+// definitions of replaced functions have their names in parentheses so they are not expanded
+#ifdef LOCK_PROFILE
+void profiledLockMutex(pthread_mutex_t *pMutex, const char *pFunction, int nLine);
+void profiledUnlockMutex(pthread_mutex_t *pMutex);
+void profiledLockRead(pthread_rwlock_t *pLock, const char *pFunction, int nLine);
+void profiledLockWrite(pthread_rwlock_t *pLock, const char *pFunction, int nLine);
+void profiledUnlockRW(pthread_rwlock_t *pLock);
+void pauseLockHold(void *pLock);
+void resumeLockHold(void *pLock);
+void destroyLockRegistry(LockRegistry *pRegistry);
+void logLockStats();
+
+#define lockMutex(pMutex)   profiledLockMutex(pMutex, __func__, __LINE__)
+#define unlockMutex(pMutex) profiledUnlockMutex(pMutex)
+#define lockRead(pLock)     profiledLockRead(pLock, __func__, __LINE__)
+#define lockWrite(pLock)    profiledLockWrite(pLock, __func__, __LINE__)
+#define unlockRW(pLock)     profiledUnlockRW(pLock)
+#else
+#define pauseLockHold(pLock)
+#define resumeLockHold(pLock)
+#endif
 
 ////////////////////////////////////////////////////////////////////////
 // DYNAMIC STRINGS
 ////////////////////////////////////////////////////////////////////////
 
-typedef struct {
-    char *pData;
-    int nSize;
-    int nUsed;
-} String;
-
 // This function removes specified character from back, 
 // we need this function to remove new line characters (\n)
 // from the line while parsing input csv file 
@@ -112,6 +766,17 @@ void removeCharacter(char *pDst, int nSize, const char *pStr, char nChar)
     }
 }
 
+// This function appends data into fixed size buffer and returns its new length, data which does not fit is cut
+int appendBounded(char *pDst, int nSize, int nUsed, const char *pData, int nLength)
+{
+    if (nLength > nSize - 1 - nUsed) nLength = nSize - 1 - nUsed;
+    if (nLength > 0) memcpy(pDst + nUsed, pData, nLength);
+    else nLength = 0;
+
+    pDst[nUsed + nLength] = '\0';
+    return nUsed + nLength;
+}
+
 // Function initializes dynamically alloated string
 // We need this string to assemble responses with various size
 void stringInit(String *pStr, size_t nSize)
@@ -142,9 +807,10 @@ void stringClear(String *pStr)
 // This function reallocates string size and appends new data to the string
 size_t stringAppend(String *pStr, char *pData, size_t nSize)
 {
-    if (pStr->nSize - pStr->nUsed < nSize)
+    if (pStr->nSize - pStr->nUsed <= nSize)
     {
-        pStr->nSize = pStr->nSize + nSize + 1;
+        // Size grows geometrically, so long responses are reallocated only a few times
+        pStr->nSize = pStr->nSize * 2 > pStr->nUsed + nSize + 1 ? pStr->nSize * 2 : pStr->nUsed + nSize + 1;
         pStr->pData = realloc(pStr->pData, pStr->nSize);
         if (pStr->pData == NULL)
         {
@@ -159,6 +825,129 @@ size_t stringAppend(String *pStr, char *pData, size_t nSize)
     return pStr->nUsed;
 }
 
+////////////////////////////////////////////////////////////////////////
+// ARENA
+////////////////////////////////////////////////////////////////////////
+
+// Arena of worker thread, other threads allocate query temporaries from heap
+static __thread Arena *t_pArena = NULL;
+
+// Data of block starts at aligned offset
+#define ARENA_HEADER    ((sizeof(ArenaBlock) + 15) & ~(size_t)15)
+
+// This function allocates empty arena block
+ArenaBlock* newArenaBlock(size_t nSize)
+{
+    ArenaBlock *pBlock = malloc(ARENA_HEADER + nSize);
+    if (pBlock == NULL)
+    {
+        logToFile(ERROR, "Can not alloc memory for arena");
+        exitFailure(NULL);
+    }
+
+    pBlock->pNext = NULL;
+    pBlock->nSize = nSize;
+    pBlock->nUsed = 0;
+    return pBlock;
+}
+
+// This function initializes arena with its first block, which is never freed until destroy
+void initArena(Arena *pArena)
+{
+    pArena->pFirst = newArenaBlock(ARENA_BLOCK_SIZE);
+    pArena->pCurrent = pArena->pFirst;
+    pArena->nTotal = ARENA_BLOCK_SIZE;
+}
+
+// This function frees blocks following the given one
+void freeArenaBlocks(Arena *pArena, ArenaBlock *pLast)
+{
+    ArenaBlock *pBlock = pLast->pNext;
+    while (pBlock != NULL)
+    {
+        ArenaBlock *pNext = pBlock->pNext;
+        pArena->nTotal -= pBlock->nSize;
+        free(pBlock);
+        pBlock = pNext;
+    }
+
+    pLast->pNext = NULL;
+}
+
+void destroyArena(Arena *pArena)
+{
+    freeArenaBlocks(pArena, pArena->pFirst);
+    free(pArena->pFirst);
+    pArena->pFirst = NULL;
+    pArena->pCurrent = NULL;
+}
+
+// This function allocates memory from arena, it moves to the next block when the current one
+// is full and appends new block only when all blocks are used. Memory is 16-byte aligned
+void* arenaAlloc(Arena *pArena, size_t nSize)
+{
+    nSize = (nSize + 15) & ~(size_t)15;
+    ArenaBlock *pBlock = pArena->pCurrent;
+
+    while (pBlock->nUsed + nSize > pBlock->nSize)
+    {
+        if (pBlock->pNext == NULL)
+        {
+            size_t nBlockSize = nSize > ARENA_BLOCK_SIZE ? nSize : ARENA_BLOCK_SIZE;
+            pBlock->pNext = newArenaBlock(nBlockSize);
+            pArena->nTotal += nBlockSize;
+        }
+
+        // Blocks after the current one are empty since reset
+        pBlock = pBlock->pNext;
+        pBlock->nUsed = 0;
+    }
+
+    pArena->pCurrent = pBlock;
+    void *pData = (char*)pBlock + ARENA_HEADER + pBlock->nUsed;
+    pBlock->nUsed += nSize;
+    return pData;
+}
+
+// This function releases all memory of arena at once, blocks are kept for the next query
+// unless a large query made arena grow above ARENA_KEEP_MAX
+void resetArena(Arena *pArena)
+{
+    if (pArena->nTotal > ARENA_KEEP_MAX) freeArenaBlocks(pArena, pArena->pFirst);
+    pArena->pFirst->nUsed = 0;
+    pArena->pCurrent = pArena->pFirst;
+}
+
+// This function allocates temporary memory of the current query, it is taken from arena
+// of worker thread and released when response is sent. Other threads get heap memory
+void* queryAlloc(size_t nSize)
+{
+    if (t_pArena != NULL) return arenaAlloc(t_pArena, nSize);
+
+    void *pData = malloc(nSize ? nSize : 1);
+    if (pData == NULL)
+    {
+        logToFile(ERROR, "Can not alloc memory for query");
+        exitFailure(NULL);
+    }
+
+    return pData;
+}
+
+// This function allocates zeroed temporary memory of the current query
+void* queryCalloc(size_t nCount, size_t nSize)
+{
+    void *pData = queryAlloc(nCount * nSize);
+    memset(pData, 0, nCount * nSize);
+    return pData;
+}
+
+// This function frees temporary memory of the current query, arena memory is released by reset
+void queryFree(void *pData)
+{
+    if (t_pArena == NULL) free(pData);
+}
+
 ////////////////////////////////////////////////////////////////////////
 // SIMPLE UTILS
 ////////////////////////////////////////////////////////////////////////
@@ -171,9 +960,19 @@ uint32_t timeStamp()
     return tv.tv_sec * 1000000 + tv.tv_usec;
 }
 
+// This function returns count of online processors
+int getCpuCount()
+{
+    long nCount = sysconf(_SC_NPROCESSORS_ONLN);
+    return nCount > 0 ? (int)nCount : 1;
+}
+
 // This function receives various arguments, opens file and writes input into file
 void logToFile(int nType, char *pStr, ...)
 {
+    // Error of the failed call is saved before it is overwritten
+    int nError = errno;
+
     // Log logger mutex
     lockMutex(&g_logger.mutex);
     uint32_t nTimeStamp = timeStamp();
@@ -187,734 +986,9061 @@ void logToFile(int nType, char *pStr, ...)
     vsnprintf(sInput, sizeof(sInput), pStr, args);
     va_end(args);
 
+    // Line is formatted on stack, so logging does not allocate memory of stdio stream
+    char sLine[LOG_MAX + 128];
+    int nLen;
+    if (nType == INFO) nLen = snprintf(sLine, sizeof(sLine), "[%u] %s\n", nTimeStamp, sInput);
+    else nLen = snprintf(sLine, sizeof(sLine), "[%u] %s: %s\n", nTimeStamp, sInput, strerror(nError));
+    if (nLen >= (int)sizeof(sLine)) nLen = sizeof(sLine) - 1;
+
     // Open output file
-    FILE *pFile = fopen(g_logger.pPath, "a");
-    if (pFile == NULL) exitFailure("Can not open log file");
+    int nFile = open(g_logger.pPath, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (nFile < 0) exitFailure("Can not open log file");
 
     // Append log to file
-    if (nType == INFO) fprintf(pFile, "[%u] %s\n", nTimeStamp, sInput);
-    else fprintf(pFile, "[%u] %s: %s\n", nTimeStamp, sInput, strerror(errno));
+    ssize_t nWritten = write(nFile, sLine, nLen);
+    (void)nWritten;
 
     // Close file and unlock mutex
-    fclose(pFile);
+    close(nFile);
     unlockMutex(&g_logger.mutex);
 }
 
 ////////////////////////////////////////////////////////////////////////
-// EXIT RELATED STUFF
+// STATISTICS
 ////////////////////////////////////////////////////////////////////////
 
-// This function destroys absolutely all allocated memory by server
-void globalDestroy()
+// Statistics of the current worker thread, NULL for other threads
+static __thread WorkerStats *t_pStats = NULL;
+
+// Query executed by the current worker thread, NULL for other threads
+static __thread QueryContext *t_pQuery = NULL;
+
+// This function returns monotonic timestamp in usecs,
+// it is used for measuring durations without wrapping
+uint64_t monotonicTime()
 {
-    // Stop and destroy worker threads
-    if (g_workers.isInit)
-    {
-        int i;
-        for (i = 0; i < g_workers.nWorkerCount; i++)
-        {
-            WorkerContext *pWorker = &g_workers.pWorkers[i];
-            destroyWorker(pWorker); // Cleanup worker related data
-        }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-        g_workers.isInit = 0;
-    }
+// This function returns wall clock time in usecs, it is compared between processes
+uint64_t wallTime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-    logToFile(INFO, "All threads have terminated, server shutting down.");
-    
-    // Close listener socket
-    if (g_nListenerSock >= 0)
-    {
-        close(g_nListenerSock);
-        g_nListenerSock = -1;
-    }
+// This function returns log-linear bucket of the value, values below HIST_SUB_COUNT
+// have own buckets and every next power of two is split to HIST_SUB_COUNT buckets
+int histogramBucket(uint64_t nValue)
+{
+    if (nValue < HIST_SUB_COUNT) return (int)nValue;
 
-    // Cleanup database
-    destroyDatabase(&g_dataBase);
+    int nShift = 63 - __builtin_clzll(nValue) - HIST_SUB_BITS;
+    int nBucket = (nShift + 1) * HIST_SUB_COUNT + (int)((nValue >> nShift) - HIST_SUB_COUNT);
+    return nBucket < HIST_BUCKETS ? nBucket : HIST_BUCKETS - 1;
+}
 
-    // Destroy logger
-    pthread_mutex_destroy(&g_logger.mutex);
-    g_logger.isInit = 0;
+// This function returns the highest value which falls into the bucket
+uint64_t histogramValue(int nBucket)
+{
+    if (nBucket < HIST_SUB_COUNT) return nBucket;
 
-    if (g_syncInit)
-    {
-        // Destroy global sync if initialized
-        pthread_mutex_destroy(&g_mutex);
-        pthread_cond_destroy(&g_cond);
-        g_syncInit = 0;
-    }
+    int nShift = nBucket / HIST_SUB_COUNT - 1;
+    uint64_t nLower = (uint64_t)(HIST_SUB_COUNT + nBucket % HIST_SUB_COUNT) << nShift;
+    return nLower + ((uint64_t)1 << nShift) - 1;
+}
 
-    // This is not any kind of synchronization
-    // Just making valgrind happy, nothing more
-    usleep(10000);
+// This function records value in the histogram, histograms are written only by
+// owner thread so relaxed atomics are enough to keep readers away from torn values
+void histogramRecord(Histogram *pHist, uint64_t nValue)
+{
+    __atomic_fetch_add(&pHist->nCounts[histogramBucket(nValue)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&pHist->nTotal, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&pHist->nSum, nValue, __ATOMIC_RELAXED);
+    if (nValue > __atomic_load_n(&pHist->nMax, __ATOMIC_RELAXED))
+        __atomic_store_n(&pHist->nMax, nValue, __ATOMIC_RELAXED);
 }
 
-// This function prints error mesage, cleanups allocated memory and exits with failure
-void exitFailure(const char *pMessage)
+// This function adds histogram of other thread into pDst
+void histogramMerge(Histogram *pDst, Histogram *pSrc)
 {
-    if (pMessage != NULL) // Display error message
-        fprintf(stderr, "%s: %s\n", pMessage, strerror(errno));
+    int i;
+    for (i = 0; i < HIST_BUCKETS; i++)
+        pDst->nCounts[i] += __atomic_load_n(&pSrc->nCounts[i], __ATOMIC_RELAXED);
 
-    // Cleanup and exit
-    globalDestroy();
-    exit(EXIT_FAILURE);
+    pDst->nTotal += __atomic_load_n(&pSrc->nTotal, __ATOMIC_RELAXED);
+    pDst->nSum += __atomic_load_n(&pSrc->nSum, __ATOMIC_RELAXED);
+
+    uint64_t nMax = __atomic_load_n(&pSrc->nMax, __ATOMIC_RELAXED);
+    if (nMax > pDst->nMax) pDst->nMax = nMax;
 }
 
-// SIGINT signal callback
-void exitHandler(int sig)
+// This function returns value at given percentile of the histogram
+uint64_t histogramPercentile(Histogram *pHist, double fPercentile)
 {
-    if (sig == SIGINT)
-        logToFile(INFO, "Termination signal received, waiting for ongoing threads to complete.");
+    if (!pHist->nTotal) return 0;
 
-    g_nInterrupted = 1;
+    uint64_t nRank = (uint64_t)(fPercentile / 100.0 * pHist->nTotal + 0.5);
+    uint64_t nSeen = 0;
+    int i;
+
+    if (nRank < 1) nRank = 1;
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        nSeen += pHist->nCounts[i];
+        if (nSeen >= nRank)
+        {
+            uint64_t nValue = histogramValue(i);
+            return nValue < pHist->nMax ? nValue : pHist->nMax;
+        }
+    }
+
+    return pHist->nMax;
 }
 
-////////////////////////////////////////////////////////////////////////
-// CONDITION VARIABLES
-////////////////////////////////////////////////////////////////////////
+// This function adds value into the counter of current worker thread
+void statsAdd(uint64_t *pCounter, uint64_t nValue)
+{
+    __atomic_fetch_add(pCounter, nValue, __ATOMIC_RELAXED);
+}
 
-// This function just calls pthread_cond_wait() and exits if call is not successfull, nothing more
-void waitCondition(pthread_cond_t *pCond, pthread_mutex_t *pMutex)
+// This function counts syscalls made for socket I/O
+void statsSyscalls(int nCount)
 {
-    if (pthread_cond_wait(pCond, pMutex))
-    {
-        logToFile(ERROR, "Can not wait condition variable");
-        exitFailure(NULL);
-    }
+    __atomic_fetch_add(&g_stats.nSyscalls, nCount, __ATOMIC_RELAXED);
 }
 
-// This function just calls pthread_cond_signal() and exits if call is not successfull, nothing more
-void signalCondition(pthread_cond_t *pCond)
+// This function records time spent by current thread while waiting database lock
+void statsLockWait(uint64_t nStartTime)
 {
-    if (pthread_cond_signal(pCond))
-    {
-        logToFile(ERROR, "Can not signal condition variable");
-        exitFailure(NULL);
-    }
+    if (t_pStats == NULL) return;
+
+    uint64_t nWait = monotonicTime() - nStartTime;
+    histogramRecord(&t_pStats->lockWait, nWait);
 }
 
 ////////////////////////////////////////////////////////////////////////
-// MUTEX AND LOCKS
+// TRACING
 ////////////////////////////////////////////////////////////////////////
 
-void initMutex(pthread_mutex_t *pMutex)
+// Trace buffer of the current worker thread, NULL if tracing is disabled or for other threads
+static __thread TraceBuffer *t_pTrace = NULL;
+
+// This function opens trace file, it is JSON array of Chrome trace events which is closed at shutdown.
+// Trace viewers also load file of running server, array without its end is accepted by them
+void initTracer(Tracer *pTracer, const char *pPath, int nSampleRate)
 {
-    pthread_mutexattr_t mutexAttr;
-    if (pthread_mutexattr_init(&mutexAttr) ||
-        pthread_mutexattr_settype(&mutexAttr, PTHREAD_MUTEX_RECURSIVE) ||
-        pthread_mutex_init(pMutex, &mutexAttr) ||
-        pthread_mutexattr_destroy(&mutexAttr))
+    pTracer->nFile = open(pPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (pTracer->nFile < 0)
     {
-        exitFailure("Can not initialize mutex");
+        logToFile(ERROR, "Can not open trace file %s", pPath);
+        exitFailure(NULL);
     }
-}
 
+    ssize_t nWritten = write(pTracer->nFile, "[\n", 2);
+    (void)nWritten;
 
-// This function just calls pthread_mutex_lock() and exits if call is not successfull, nothing more
-void lockMutex(pthread_mutex_t *pMutex)
-{
-    if (pthread_mutex_lock(pMutex))
-        exitFailure("Can not lock mutex");
+    initMutex(&pTracer->mutex);
+    pTracer->nQueries = 0;
+    pTracer->nSampleRate = nSampleRate;
+    pTracer->isFirst = 1;
+    pTracer->isInit = 1;
 }
 
-
-// This function just calls pthread_mutex_unlock() and exits if call is not successfull, nothing more
-void unlockMutex(pthread_mutex_t *pMutex)
+// This function closes JSON array of trace file, buffers of workers must be flushed before
+void destroyTracer(Tracer *pTracer)
 {
-    if (pthread_mutex_unlock(pMutex))
-        exitFailure("Can not unlock mutex");
-}
+    if (!pTracer->isInit) return;
+    pTracer->isInit = 0;
 
+    ssize_t nWritten = write(pTracer->nFile, "\n]\n", 3);
+    (void)nWritten;
 
-// This function just calls pthread_rwlock_wrlock() and exits if call is not successfull, nothing more
-void lockWrite(pthread_rwlock_t *pLock)
-{
-    if (pthread_rwlock_wrlock(pLock))
-        exitFailure("Can not lock mutex");
+    close(pTracer->nFile);
+    pthread_mutex_destroy(&pTracer->mutex);
 }
 
-
-// This function just calls pthread_rwlock_rdlock() and exits if call is not successfull, nothing more
-void lockRead(pthread_rwlock_t *pLock)
+// This function appends formatted event into trace buffer, pid is taken after daemon() changed it
+void traceAppend(TraceBuffer *pTrace, const char *pFormat, ...)
 {
-    if (pthread_rwlock_rdlock(pLock))
-        exitFailure("Failet to read lock");
-}
+    char sEvent[DATA_MAX * 2];
+    int nLen = snprintf(sEvent, sizeof(sEvent), ",\n{\"pid\":%d,\"tid\":%d,", g_trace.nPid, pTrace->nWorkerID);
 
+    va_list args;
+    va_start(args, pFormat);
+    nLen += vsnprintf(sEvent + nLen, sizeof(sEvent) - nLen, pFormat, args);
+    va_end(args);
 
-// This function just calls pthread_rwlock_unlock() and exits if call is not successfull, nothing more
-void unlockRW(pthread_rwlock_t *pLock)
-{
-    if (pthread_rwlock_unlock(pLock))
-        exitFailure("Failet to unloc rw lock");
+    if (nLen >= (int)sizeof(sEvent) - 1) return; // Event which does not fit would break JSON
+    stringAppend(&pTrace->events, sEvent, nLen);
+    stringAppend(&pTrace->events, "}", 1);
 }
 
-////////////////////////////////////////////////////////////////////////
-// SOCKETS
-////////////////////////////////////////////////////////////////////////
+// This function initializes trace buffer of worker, its thread is named in trace
+void initTraceBuffer(TraceBuffer *pTrace, int nWorkerID)
+{
+    stringInit(&pTrace->events, TRACE_FLUSH_BYTES);
+    pTrace->nLastFlush = monotonicTime();
+    pTrace->nQuery = 0;
+    pTrace->nWorkerID = nWorkerID;
+    pTrace->isSampled = 0;
+
+    traceAppend(pTrace, "\"ph\":\"M\",\"name\":\"thread_name\",\"args\":{\"name\":\"worker #%d\"}", nWorkerID);
+}
+
+// This function writes buffered events into trace file
+void flushTraceBuffer(TraceBuffer *pTrace)
+{
+    pTrace->nLastFlush = monotonicTime();
+    if (!pTrace->events.nUsed) return;
+
+    lockMutex(&g_trace.mutex);
+
+    // The first event of file is not preceded by comma
+    int nSkip = g_trace.isFirst ? 1 : 0;
+    g_trace.isFirst = 0;
+
+    const char *pData = pTrace->events.pData + nSkip;
+    int nLeft = pTrace->events.nUsed - nSkip;
+    while (nLeft > 0)
+    {
+        ssize_t nWritten = write(g_trace.nFile, pData, nLeft);
+        if (nWritten <= 0) break;
+
+        pData += nWritten;
+        nLeft -= nWritten;
+    }
+
+    unlockMutex(&g_trace.mutex);
+
+    pTrace->events.nUsed = 0;
+    pTrace->events.pData[0] = '\0';
+}
+
+// This function flushes remaining events and frees trace buffer
+void destroyTraceBuffer(TraceBuffer *pTrace)
+{
+    flushTraceBuffer(pTrace);
+    stringClear(&pTrace->events);
+}
+
+// This function returns current time if query of worker is traced, otherwise 0 is returned
+// without reading clock, so untraced queries do not pay for timestamps of spans
+uint64_t traceTime()
+{
+    TraceBuffer *pTrace = t_pTrace;
+    return pTrace != NULL && pTrace->isSampled ? monotonicTime() : 0;
+}
+
+// This function records span of traced query which started at nStartTime and ends now
+void traceSpan(const char *pName, uint64_t nStartTime)
+{
+    TraceBuffer *pTrace = t_pTrace;
+    if (pTrace == NULL || !pTrace->isSampled) return;
+
+    uint64_t nEndTime = monotonicTime();
+    traceAppend(pTrace, "\"ph\":\"X\",\"cat\":\"query\",\"name\":\"%s\",\"ts\":%lu,\"dur\":%lu",
+                pName, (unsigned long)nStartTime, (unsigned long)(nEndTime - nStartTime));
+}
+
+// This function decides if query dispatched to worker is traced, wait of traced query in queue is recorded
+// as async span from accept until dispatch, because other queries run on the worker meanwhile
+void traceStart(uint64_t nAcceptTime, uint64_t nDispatchTime)
+{
+    TraceBuffer *pTrace = t_pTrace;
+    if (pTrace == NULL) return;
+
+    uint64_t nQuery = __atomic_fetch_add(&g_trace.nQueries, 1, __ATOMIC_RELAXED);
+    pTrace->isSampled = nQuery % g_trace.nSampleRate == 0;
+    if (!pTrace->isSampled) return;
+
+    pTrace->nQuery = nQuery;
+    traceAppend(pTrace, "\"ph\":\"b\",\"cat\":\"queue\",\"name\":\"queue wait\",\"id\":%lu,\"ts\":%lu",
+                (unsigned long)nQuery, (unsigned long)nAcceptTime);
+    traceAppend(pTrace, "\"ph\":\"e\",\"cat\":\"queue\",\"name\":\"queue wait\",\"id\":%lu,\"ts\":%lu",
+                (unsigned long)nQuery, (unsigned long)nDispatchTime);
+}
+
+// This function records span of the whole traced query with its text and status
+void traceQuery(const char *pQuery, int nStatus, uint64_t nStartTime)
+{
+    TraceBuffer *pTrace = t_pTrace;
+    if (pTrace == NULL || !pTrace->isSampled) return;
+
+    // Query is escaped for JSON string, text which does not fit is cut. Bytes above ASCII are escaped
+    // one by one, because query may be any bytes and raw text which is not UTF-8 breaks JSON
+    char sQuery[DATA_MAX];
+    int nLen = 0;
+    for (; *pQuery && nLen < (int)sizeof(sQuery) - 8; pQuery++)
+    {
+        unsigned char c = (unsigned char)*pQuery;
+        if (c == '"' || c == '\\') nLen += snprintf(sQuery + nLen, sizeof(sQuery) - nLen, "\\%c", c);
+        else if (c < 0x20 || c >= 0x7f) nLen += snprintf(sQuery + nLen, sizeof(sQuery) - nLen, "\\u%04x", c);
+        else sQuery[nLen++] = c;
+    }
+
+    sQuery[nLen] = '\0';
+
+    uint64_t nEndTime = monotonicTime();
+    traceAppend(pTrace, "\"ph\":\"X\",\"cat\":\"query\",\"name\":\"query\",\"ts\":%lu,\"dur\":%lu,"
+                "\"args\":{\"id\":%lu,\"query\":\"%s\",\"status\":%d}",
+                (unsigned long)nStartTime, (unsigned long)(nEndTime - nStartTime),
+                (unsigned long)pTrace->nQuery, sQuery, nStatus);
+}
+
+// This function returns msecs until buffered trace events of worker must be flushed,
+// 0 if they wait too long already and -1 if nothing is buffered
+int traceFlushWait()
+{
+    TraceBuffer *pTrace = t_pTrace;
+    if (pTrace == NULL || !pTrace->events.nUsed) return -1;
+
+    uint64_t nNow = monotonicTime(), nDue = pTrace->nLastFlush + (uint64_t)TRACE_FLUSH_INTERVAL * 1000;
+    return nNow >= nDue ? 0 : (int)((nDue - nNow + 999) / 1000);
+}
+
+// This function ends tracing of query after worker finished it, buffer is flushed when it is
+// big enough or when its events wait too long. Idle worker flushes it while waiting for requests
+void traceEnd()
+{
+    TraceBuffer *pTrace = t_pTrace;
+    if (pTrace == NULL || !pTrace->isSampled) return;
+
+    pTrace->isSampled = 0;
+    if (pTrace->events.nUsed >= TRACE_FLUSH_BYTES ||
+        monotonicTime() - pTrace->nLastFlush >= (uint64_t)TRACE_FLUSH_INTERVAL * 1000) flushTraceBuffer(pTrace);
+}
+
+////////////////////////////////////////////////////////////////////////
+// CANCELLATION
+////////////////////////////////////////////////////////////////////////
+
+// This function is called by long scans for every row, every QUERY_CHECK_ROWS calls it checks
+// deadline of the current query and if client has closed connection. Returns 1 if query must stop
+int isQueryCancelled()
+{
+    QueryContext *pQuery = t_pQuery;
+    if (pQuery == NULL) return 0;
+    if (pQuery->nCancelled) return 1;
+    if (pQuery->nTicks++ % QUERY_CHECK_ROWS) return 0;
+
+    if (pQuery->nDeadline && monotonicTime() > pQuery->nDeadline)
+    {
+        pQuery->nCancelled = 1;
+        return 1;
+    }
+
+    // Peeking zero bytes from socket means client has closed connection
+    char c;
+    if (pQuery->nClientFD >= 0 && recv(pQuery->nClientFD, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0)
+    {
+        pQuery->nCancelled = 1;
+        pQuery->nPeerClosed = 1;
+        return 1;
+    }
+
+    return 0;
+}
+
+// This function is called by scans of packed columns once per QUERY_CHECK_ROWS rows,
+// so cancellation is checked on every call
+int isBlockCancelled()
+{
+    QueryContext *pQuery = t_pQuery;
+    if (pQuery == NULL) return 0;
+
+    pQuery->nTicks = 0;
+    return isQueryCancelled();
+}
+
+////////////////////////////////////////////////////////////////////////
+// EXIT RELATED STUFF
+////////////////////////////////////////////////////////////////////////
+
+// This function destroys absolutely all allocated memory by server
+void globalDestroy()
+{
+    // Stop stats thread first, it reads worker statistics
+    if (g_stats.isInit)
+    {
+        g_stats.isInit = 0;
+        if (g_stats.isThreadInit) pthread_join(g_stats.statsThread, NULL);
+    }
+
+    // Local acceptor queues requests, so it is stopped before queue
+    stopLocalListener(&g_local);
+
+    // Release workers waiting for requests
+    shutdownQueue(&g_queue);
+
+    // Stop and destroy worker threads, pool does not grow anymore
+    if (g_workers.isInit)
+    {
+        lockMutex(&g_workers.mutex);
+        g_workers.isInit = 0;
+        unlockMutex(&g_workers.mutex);
+
+        int i;
+        for (i = 0; i < g_workers.nSlotCount; i++)
+        {
+            WorkerContext *pWorker = g_workers.pWorkers[i];
+            destroyWorker(pWorker); // Cleanup worker related data
+            free(pWorker);
+        }
+
+        logToFile(INFO, "Worker pool spawned %lu and retired %lu threads.",
+                  (unsigned long)g_workers.nSpawned, (unsigned long)g_workers.nRetired);
+        free(g_workers.pWorkers);
+        g_workers.pWorkers = NULL;
+        pthread_mutex_destroy(&g_workers.mutex);
+    }
+
+    // Workers flushed their trace buffers when they exited
+    destroyTracer(&g_trace);
+
+    logToFile(INFO, "All threads have terminated, server shutting down.");
+    
+    // Close listener socket
+    if (g_nListenerSock >= 0)
+    {
+        close(g_nListenerSock);
+        g_nListenerSock = -1;
+    }
+
+    // Compaction thread rewrites tables, so it is stopped before they are destroyed
+    if (g_catalog.isCompactInit)
+    {
+        g_catalog.isCompactInit = 0;
+        pthread_join(g_catalog.compactThread, NULL);
+    }
+
+    // Signal thread is woken by SIGHUP, then ongoing reload is waited
+    if (g_catalog.isSignalInit)
+    {
+        g_catalog.isSignalInit = 0;
+        pthread_kill(g_catalog.signalThread, SIGHUP);
+        pthread_join(g_catalog.signalThread, NULL);
+    }
+
+    if (g_catalog.isReloadInit)
+    {
+        g_catalog.isReloadInit = 0;
+        pthread_join(g_catalog.reloadThread, NULL);
+    }
+
+    // Reload ships new tables and follower thread installs them, so replication is stopped after reload
+    destroyReplication(&g_replica);
+
+    // Cleanup database and cached responses
+    if (g_cache.isInit) logToFile(INFO, "Result cache hit ratio %.2f%% (%lu hits, %lu misses).",
+                                  cacheHitRatio(&g_cache), g_cache.nHits, g_cache.nMisses);
+    destroyCache(&g_cache);
+    destroyCatalog(&g_catalog);
+    free(g_router.pList);
+    g_router.pList = NULL;
+
+#ifdef LOCK_PROFILE
+    // Threads are stopped, so lock counters are final
+    logLockStats();
+#endif
+
+    // Destroy logger
+    pthread_mutex_destroy(&g_logger.mutex);
+    g_logger.isInit = 0;
+
+    // Close connections of pending requests
+    destroyQueue(&g_queue);
+
+#ifdef LOCK_PROFILE
+    destroyLockRegistry(&g_locks);
+#endif
+
+    // This is not any kind of synchronization
+    // Just making valgrind happy, nothing more
+    usleep(10000);
+}
+
+// This function prints error mesage, cleanups allocated memory and exits with failure
+void exitFailure(const char *pMessage)
+{
+    if (pMessage != NULL) // Display error message
+        fprintf(stderr, "%s: %s\n", pMessage, strerror(errno));
+
+    // Cleanup and exit
+    globalDestroy();
+    exit(EXIT_FAILURE);
+}
+
+// SIGINT signal callback
+void exitHandler(int sig)
+{
+    if (sig == SIGINT)
+        logToFile(INFO, "Termination signal received, waiting for ongoing threads to complete.");
+
+    g_nInterrupted = 1;
+}
+
+////////////////////////////////////////////////////////////////////////
+// CONDITION VARIABLES
+////////////////////////////////////////////////////////////////////////
+
+// This function just calls pthread_cond_wait() and exits if call is not successfull, nothing more
+void waitCondition(pthread_cond_t *pCond, pthread_mutex_t *pMutex)
+{
+    // Mutex is not held while condition is waited
+    pauseLockHold(pMutex);
+    if (pthread_cond_wait(pCond, pMutex))
+    {
+        logToFile(ERROR, "Can not wait condition variable");
+        exitFailure(NULL);
+    }
+
+    resumeLockHold(pMutex);
+}
+
+// This function waits condition variable at most given msecs, zero is returned on timeout
+int waitConditionTimed(pthread_cond_t *pCond, pthread_mutex_t *pMutex, int nTimeout)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += nTimeout / 1000;
+    ts.tv_nsec += (long)(nTimeout % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000)
+    {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    pauseLockHold(pMutex);
+    int nResult = pthread_cond_timedwait(pCond, pMutex, &ts);
+    resumeLockHold(pMutex);
+    if (nResult == ETIMEDOUT) return 0;
+    if (nResult)
+    {
+        logToFile(ERROR, "Can not wait condition variable");
+        exitFailure(NULL);
+    }
+
+    return 1;
+}
+
+// This function just calls pthread_cond_signal() and exits if call is not successfull, nothing more
+void signalCondition(pthread_cond_t *pCond)
+{
+    if (pthread_cond_signal(pCond))
+    {
+        logToFile(ERROR, "Can not signal condition variable");
+        exitFailure(NULL);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+// MUTEX AND LOCKS
+////////////////////////////////////////////////////////////////////////
+
+void initMutex(pthread_mutex_t *pMutex)
+{
+    pthread_mutexattr_t mutexAttr;
+    if (pthread_mutexattr_init(&mutexAttr) ||
+        pthread_mutexattr_settype(&mutexAttr, PTHREAD_MUTEX_RECURSIVE) ||
+        pthread_mutex_init(pMutex, &mutexAttr) ||
+        pthread_mutexattr_destroy(&mutexAttr))
+    {
+        exitFailure("Can not initialize mutex");
+    }
+}
+
+
+// This function just calls pthread_mutex_lock() and exits if call is not successfull, nothing more
+void (lockMutex)(pthread_mutex_t *pMutex)
+{
+    if (pthread_mutex_lock(pMutex))
+        exitFailure("Can not lock mutex");
+}
+
+
+// This function just calls pthread_mutex_unlock() and exits if call is not successfull, nothing more
+void (unlockMutex)(pthread_mutex_t *pMutex)
+{
+    if (pthread_mutex_unlock(pMutex))
+        exitFailure("Can not unlock mutex");
+}
+
+
+// This function just calls pthread_rwlock_wrlock() and exits if call is not successfull, nothing more
+void (lockWrite)(pthread_rwlock_t *pLock)
+{
+    uint64_t nStartTime = monotonicTime();
+    if (pthread_rwlock_wrlock(pLock))
+        exitFailure("Can not lock mutex");
+    statsLockWait(nStartTime);
+    traceSpan("lock write", nStartTime);
+}
+
+
+// This function just calls pthread_rwlock_rdlock() and exits if call is not successfull, nothing more
+void (lockRead)(pthread_rwlock_t *pLock)
+{
+    uint64_t nStartTime = monotonicTime();
+    if (pthread_rwlock_rdlock(pLock))
+        exitFailure("Failet to read lock");
+    statsLockWait(nStartTime);
+    traceSpan("lock read", nStartTime);
+}
+
+
+// This function just calls pthread_rwlock_unlock() and exits if call is not successfull, nothing more
+void (unlockRW)(pthread_rwlock_t *pLock)
+{
+    if (pthread_rwlock_unlock(pLock))
+        exitFailure("Failet to unloc rw lock");
+}
+
+////////////////////////////////////////////////////////////////////////
+// LOCK PROFILER
+////////////////////////////////////////////////////////////////////////
+
+#ifdef LOCK_PROFILE
+
+// Lock profile of the current thread, it is taken on the first lock
+static __thread LockProfile *t_pLocks = NULL;
+
+// This function releases profile of exiting thread, its counters are kept for reports
+void releaseLockProfile(void *pArg)
+{
+    LockProfile *pProfile = (LockProfile*)pArg;
+    __atomic_store_n(&pProfile->isOwned, 0, __ATOMIC_RELEASE);
+}
+
+// This function initializes registry of lock profiles, it is called before any lock is taken
+void initLockRegistry(LockRegistry *pRegistry)
+{
+    if (pthread_mutex_init(&pRegistry->mutex, NULL) || pthread_key_create(&pRegistry->key, releaseLockProfile))
+        exitFailure("Can not initialize lock profiler");
+
+    pRegistry->pProfiles = NULL;
+    pRegistry->isInit = 1;
+}
+
+// This function frees all lock profiles, other threads must be stopped before
+void destroyLockRegistry(LockRegistry *pRegistry)
+{
+    if (!pRegistry->isInit) return;
+    pRegistry->isInit = 0;
+    t_pLocks = NULL;
+
+    while (pRegistry->pProfiles != NULL)
+    {
+        LockProfile *pProfile = pRegistry->pProfiles;
+        pRegistry->pProfiles = pProfile->pNext;
+        free(pProfile);
+    }
+
+    pthread_key_delete(pRegistry->key);
+    pthread_mutex_destroy(&pRegistry->mutex);
+}
+
+// This function returns lock profile of the current thread, profile released by exited thread is
+// reused first. NULL is returned if profile can not be allocated, then locks are not counted
+LockProfile* threadLockProfile()
+{
+    if (t_pLocks != NULL || !g_locks.isInit) return t_pLocks;
+
+    pthread_mutex_lock(&g_locks.mutex);
+    LockProfile *pProfile = g_locks.pProfiles;
+    while (pProfile != NULL && __atomic_load_n(&pProfile->isOwned, __ATOMIC_ACQUIRE)) pProfile = pProfile->pNext;
+
+    if (pProfile == NULL && (pProfile = calloc(1, sizeof(LockProfile))) != NULL)
+    {
+        pProfile->pNext = g_locks.pProfiles;
+        g_locks.pProfiles = pProfile;
+    }
+
+    if (pProfile != NULL)
+    {
+        pProfile->isOwned = 1;
+        pProfile->nHeldCount = 0;
+        pthread_setspecific(g_locks.key, pProfile);
+    }
+
+    pthread_mutex_unlock(&g_locks.mutex);
+    t_pLocks = pProfile;
+    return pProfile;
+}
+
+// This function returns counters of call site, NULL is returned if table of sites is full
+LockSite* findLockSite(LockProfile *pProfile, const char *pFunction, int nLine, int nKind)
+{
+    uint32_t nHash = (uint32_t)((uintptr_t)pFunction >> 3) * 31 + nLine * 4 + nKind;
+    int i;
+
+    for (i = 0; i < LOCK_SITES_MAX; i++)
+    {
+        LockSite *pSite = &pProfile->sites[(nHash + i) % LOCK_SITES_MAX];
+        if (pSite->pFunction == NULL)
+        {
+            // Readers of other threads see site only after its key is complete
+            pSite->nLine = nLine;
+            pSite->nKind = nKind;
+            __atomic_store_n(&pSite->pFunction, pFunction, __ATOMIC_RELEASE);
+            return pSite;
+        }
+
+        if (pSite->pFunction == pFunction && pSite->nLine == nLine && pSite->nKind == nKind) return pSite;
+    }
+
+    return NULL;
+}
+
+// This function records lock acquired at call site, nWaitStart is 0 if lock was free
+void recordLockAcquired(void *pLock, const char *pFunction, int nLine, int nKind, uint64_t nWaitStart)
+{
+    LockProfile *pProfile = threadLockProfile();
+    if (pProfile == NULL) return;
+
+    LockSite *pSite = findLockSite(pProfile, pFunction, nLine, nKind);
+    if (pSite == NULL) return;
+
+    uint64_t nNow = monotonicTime();
+    __atomic_fetch_add(&pSite->nAcquired, 1, __ATOMIC_RELAXED);
+    if (nWaitStart)
+    {
+        uint64_t nWait = nNow - nWaitStart;
+        __atomic_fetch_add(&pSite->nContended, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&pSite->nWaitTime, nWait, __ATOMIC_RELAXED);
+        if (nWait > pSite->nMaxWait) __atomic_store_n(&pSite->nMaxWait, nWait, __ATOMIC_RELAXED);
+    }
+
+    if (pProfile->nHeldCount >= LOCK_HELD_MAX) return;
+
+    HeldLock *pHeld = &pProfile->held[pProfile->nHeldCount++];
+    pHeld->pLock = pLock;
+    pHeld->pSite = pSite;
+    pHeld->nAcquireTime = nNow;
+}
+
+// This function returns the latest held entry of lock, NULL if lock is not tracked
+HeldLock* findHeldLock(void *pLock)
+{
+    LockProfile *pProfile = t_pLocks;
+    if (pProfile == NULL) return NULL;
+
+    int i;
+    for (i = pProfile->nHeldCount - 1; i >= 0; i--)
+        if (pProfile->held[i].pLock == pLock) return &pProfile->held[i];
+
+    return NULL;
+}
+
+// This function adds time since lock was acquired or resumed to hold time of its site
+void countLockHold(HeldLock *pHeld)
+{
+    LockSite *pSite = pHeld->pSite;
+    uint64_t nHold = monotonicTime() - pHeld->nAcquireTime;
+
+    __atomic_fetch_add(&pSite->nHoldTime, nHold, __ATOMIC_RELAXED);
+    if (nHold > pSite->nMaxHold) __atomic_store_n(&pSite->nMaxHold, nHold, __ATOMIC_RELAXED);
+}
+
+// This function records lock released by the current thread
+void recordLockReleased(void *pLock)
+{
+    HeldLock *pHeld = findHeldLock(pLock);
+    if (pHeld == NULL) return;
+
+    countLockHold(pHeld);
+
+    // Locks are usually released in reverse order, so entries above are rarely moved
+    LockProfile *pProfile = t_pLocks;
+    HeldLock *pLast = &pProfile->held[--pProfile->nHeldCount];
+    memmove(pHeld, pHeld + 1, (char*)pLast - (char*)pHeld);
+}
+
+// This function stops hold time of mutex released by condition wait
+void pauseLockHold(void *pLock)
+{
+    HeldLock *pHeld = findHeldLock(pLock);
+    if (pHeld != NULL) countLockHold(pHeld);
+}
+
+// This function restarts hold time of mutex taken again after condition wait
+void resumeLockHold(void *pLock)
+{
+    HeldLock *pHeld = findHeldLock(pLock);
+    if (pHeld != NULL) pHeld->nAcquireTime = monotonicTime();
+}
+
+// Failed try of every wrapper means lock is contended, its wait is counted for call site
+
+void profiledLockMutex(pthread_mutex_t *pMutex, const char *pFunction, int nLine)
+{
+    uint64_t nWaitStart = 0;
+    if (pthread_mutex_trylock(pMutex))
+    {
+        nWaitStart = monotonicTime();
+        (lockMutex)(pMutex);
+    }
+
+    recordLockAcquired(pMutex, pFunction, nLine, LOCK_KIND_MUTEX, nWaitStart);
+}
+
+void profiledUnlockMutex(pthread_mutex_t *pMutex)
+{
+    recordLockReleased(pMutex);
+    (unlockMutex)(pMutex);
+}
+
+void profiledLockRead(pthread_rwlock_t *pLock, const char *pFunction, int nLine)
+{
+    uint64_t nStartTime = monotonicTime();
+    int isContended = pthread_rwlock_tryrdlock(pLock) != 0;
+    if (isContended) (lockRead)(pLock);
+    else
+    {
+        statsLockWait(nStartTime);
+        traceSpan("lock read", nStartTime);
+    }
+
+    recordLockAcquired(pLock, pFunction, nLine, LOCK_KIND_READ, isContended ? nStartTime : 0);
+}
+
+void profiledLockWrite(pthread_rwlock_t *pLock, const char *pFunction, int nLine)
+{
+    uint64_t nStartTime = monotonicTime();
+    int isContended = pthread_rwlock_trywrlock(pLock) != 0;
+    if (isContended) (lockWrite)(pLock);
+    else
+    {
+        statsLockWait(nStartTime);
+        traceSpan("lock write", nStartTime);
+    }
+
+    recordLockAcquired(pLock, pFunction, nLine, LOCK_KIND_WRITE, isContended ? nStartTime : 0);
+}
+
+void profiledUnlockRW(pthread_rwlock_t *pLock)
+{
+    recordLockReleased(pLock);
+    (unlockRW)(pLock);
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////
+// SOCKETS
+////////////////////////////////////////////////////////////////////////
 
 // This function creates server socket, binds the port and listens to the newely created socket
 int createServerSocket(int nPort)
 {
-    struct sockaddr_in inaddr;
-    inaddr.sin_family = AF_INET;
-    inaddr.sin_port = htons(nPort);
-    inaddr.sin_addr.s_addr = htonl(INADDR_ANY);;
+    struct sockaddr_in inaddr;
+    inaddr.sin_family = AF_INET;
+    inaddr.sin_port = htons(nPort);
+    inaddr.sin_addr.s_addr = htonl(INADDR_ANY);;
+
+    // Create listener socket file descriptor
+    int fd = socket(AF_INET, SOCK_STREAM | FD_CLOEXEC, IPPROTO_TCP);
+    if (fd < 0)
+    {
+        logToFile(ERROR, "Can not create server socket");
+        exitFailure(NULL);
+    }
+
+    // Restarted primary binds its port while connections of followers are in TIME_WAIT
+    int nReuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &nReuse, sizeof(nReuse));
+
+    // Bind socket
+    if (bind(fd, (struct sockaddr*)&inaddr, sizeof(inaddr)) < 0)
+    {
+        logToFile(ERROR, "Failed to bind socket");
+        close(fd);
+        exitFailure(NULL);
+    }
+
+    // Listen to socket
+    if (listen(fd, 120000) < 0) 
+    {
+        logToFile(ERROR, "Failed to listen socket");
+        close(fd);
+        exitFailure(NULL);
+    }
+
+    return fd;
+}
+
+// This function creates AF_UNIX listener socket of co-located clients, stale socket file is replaced
+int createLocalSocket(const char *pPath)
+{
+    struct sockaddr_un unaddr;
+    memset(&unaddr, 0, sizeof(unaddr));
+    unaddr.sun_family = AF_UNIX;
+    if (strlen(pPath) >= sizeof(unaddr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        logToFile(ERROR, "Invalid local socket path %s", pPath);
+        exitFailure(NULL);
+    }
+
+    strcpy(unaddr.sun_path, pPath);
+    unlink(pPath);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        logToFile(ERROR, "Can not create local socket");
+        exitFailure(NULL);
+    }
+
+    if (bind(fd, (struct sockaddr*)&unaddr, sizeof(unaddr)) < 0)
+    {
+        logToFile(ERROR, "Failed to bind local socket %s", pPath);
+        close(fd);
+        exitFailure(NULL);
+    }
+
+    if (listen(fd, 120000) < 0)
+    {
+        logToFile(ERROR, "Failed to listen local socket");
+        close(fd);
+        unlink(pPath);
+        exitFailure(NULL);
+    }
+
+    return fd;
+}
+
+////////////////////////////////////////////////////////////////////////
+// ROW STORAGE
+////////////////////////////////////////////////////////////////////////
+
+// This function returns row of table, rows are kept in chunks of ZONE_ROWS rows
+RowData* getRow(Database *pDB, int nRow)
+{
+    return &pDB->pChunks[nRow / ZONE_ROWS][nRow % ZONE_ROWS];
+}
+
+// This function returns 1 if row is deleted
+int isRowDeleted(Database *pDB, int nRow)
+{
+    return (pDB->pDeleted[nRow >> 6] >> (nRow & 63)) & 1;
+}
+
+// This function saves rows which are not deleted in pRows, at most nLimit rows are found unless nLimit is negative
+int liveRows(Database *pDB, int *pRows, int nLimit)
+{
+    int i, nCount = 0;
+    for (i = 0; i < pDB->nRowCount && (nLimit < 0 || nCount < nLimit); i++)
+    {
+        if (!(i % ZONE_ROWS) && isBlockCancelled()) break;
+        pRows[nCount] = i;
+        nCount += !isRowDeleted(pDB, i);
+    }
+
+    return nCount;
+}
+
+// This function doubles capacity of table. Chunk table, tombstones, zones and packed values
+// of columns are reallocated while rows stay in their chunks, so growth never copies rows
+void growTable(Database *pDB)
+{
+    int i, nSize = pDB->nChunkSize ? pDB->nChunkSize * 2 : 1;
+    size_t nRows = (size_t)nSize * ZONE_ROWS;
+
+    pDB->pChunks = realloc(pDB->pChunks, sizeof(RowData*) * nSize);
+    pDB->pDeleted = realloc(pDB->pDeleted, nRows / 8);
+    pDB->pChunkDeleted = realloc(pDB->pChunkDeleted, sizeof(int) * nSize);
+    if (pDB->pChunks == NULL || pDB->pDeleted == NULL || pDB->pChunkDeleted == NULL)
+    {
+        logToFile(ERROR, "Can not realloc memory for rows");
+        exitFailure(NULL);
+    }
+
+    // New rows are not deleted, zones of new chunks are initialized by their first row
+    memset(pDB->pDeleted + (size_t)pDB->nChunkSize * ZONE_ROWS / 64, 0, (nSize - pDB->nChunkSize) * (ZONE_ROWS / 8));
+    memset(pDB->pChunkDeleted + pDB->nChunkSize, 0, sizeof(int) * (nSize - pDB->nChunkSize));
+
+    for (i = 0; pDB->pColumns != NULL && i < pDB->nColumnCount; i++)
+    {
+        Column *pCol = &pDB->pColumns[i];
+        if (pCol->nType != TYPE_TEXT) pCol->pInts = realloc(pCol->pInts, sizeof(int64_t) * nRows);
+        pCol->pZones = realloc(pCol->pZones, sizeof(Zone) * nSize);
+        if (pCol->pBloom != NULL) pCol->pBloom = realloc(pCol->pBloom, sizeof(uint64_t) * pCol->nBloomWords * nSize);
+
+        if ((pCol->nType != TYPE_TEXT && pCol->pInts == NULL) || pCol->pZones == NULL ||
+            (pCol->nBloomWords && pCol->pBloom == NULL))
+        {
+            logToFile(ERROR, "Can not realloc memory for columns");
+            exitFailure(NULL);
+        }
+    }
+
+    pDB->nChunkSize = nSize;
+}
+
+////////////////////////////////////////////////////////////////////////
+// COLUMN TYPES
+////////////////////////////////////////////////////////////////////////
+
+static const char *g_pTypeNames[TYPE_COUNT] = { "text", "int", "double", "date" };
+
+// Value parsed for column of given type, numeric values have double form too
+typedef struct {
+    int64_t nValue; // INT and DATE values
+    double fValue;  // INT and DOUBLE values
+    int nType;
+} TypedValue;
+
+// This function parses whole field as 64-bit integer, zero is returned if it is not an integer
+int parseInt(const char *pData, int nLength, int64_t *pValue)
+{
+    int i = 0, nNegative = 0;
+    uint64_t nValue = 0;
+
+    if (nLength > 0 && (pData[0] == '-' || pData[0] == '+'))
+    {
+        nNegative = pData[0] == '-';
+        i++;
+    }
+
+    // At most 19 digits, so value can not overflow before range check
+    if (i == nLength || nLength - i > 19) return 0;
+
+    for (; i < nLength; i++)
+    {
+        if (pData[i] < '0' || pData[i] > '9') return 0;
+        nValue = nValue * 10 + (pData[i] - '0');
+    }
+
+    if (nValue > (uint64_t)INT64_MAX + nNegative) return 0;
+    *pValue = nNegative ? (int64_t)(0 - nValue) : (int64_t)nValue;
+    return 1;
+}
+
+// This function parses whole field as decimal floating point number, words like inf or nan are not numbers here
+int parseDouble(const char *pData, int nLength, double *pValue)
+{
+    char sBuffer[64];
+    if (nLength <= 0 || nLength >= (int)sizeof(sBuffer)) return 0;
+
+    int i;
+    for (i = 0; i < nLength; i++)
+    {
+        char c = pData[i];
+        if ((c < '0' || c > '9') && c != '.' && c != '-' && c != '+' && c != 'e' && c != 'E') return 0;
+        sBuffer[i] = c;
+    }
+
+    sBuffer[nLength] = '\0';
+    char *pEnd = NULL;
+    *pValue = strtod(sBuffer, &pEnd);
+    return pEnd == sBuffer + nLength;
+}
+
+// This function parses YYYY-MM-DD date into days since 1970-01-01 of Gregorian calendar
+int parseDate(const char *pData, int nLength, int64_t *pDays)
+{
+    static const int nMonthDays[12] = { 31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    if (nLength != 10 || pData[4] != '-' || pData[7] != '-') return 0;
+
+    int i, nPart = 0, nParts[3] = { 0, 0, 0 };
+    for (i = 0; i < nLength; i++)
+    {
+        if (i == 4 || i == 7)
+        {
+            nPart++;
+            continue;
+        }
+
+        if (pData[i] < '0' || pData[i] > '9') return 0;
+        nParts[nPart] = nParts[nPart] * 10 + (pData[i] - '0');
+    }
+
+    int nYear = nParts[0], nMonth = nParts[1], nDay = nParts[2];
+    if (nMonth < 1 || nMonth > 12 || nDay < 1 || nDay > nMonthDays[nMonth - 1]) return 0;
+    if (nMonth == 2 && nDay == 29 && (nYear % 4 || (nYear % 100 == 0 && nYear % 400))) return 0;
+
+    // Years start in March here, so leap day is the last day of year
+    int nShifted = nYear - (nMonth <= 2);
+    int nEra = (nShifted >= 0 ? nShifted : nShifted - 399) / 400;
+    int nYearOfEra = nShifted - nEra * 400;
+    int nDayOfYear = (153 * (nMonth + (nMonth > 2 ? -3 : 9)) + 2) / 5 + nDay - 1;
+    int nDayOfEra = nYearOfEra * 365 + nYearOfEra / 4 - nYearOfEra / 100 + nDayOfYear;
+
+    *pDays = (int64_t)nEra * 146097 + nDayOfEra - 719468;
+    return 1;
+}
+
+// This function detects type of single value, it is used for the first sampled value of column
+int detectType(const char *pData, int nLength)
+{
+    int64_t nValue;
+    double fValue;
+
+    if (parseInt(pData, nLength, &nValue)) return TYPE_INT;
+    if (parseDouble(pData, nLength, &fValue)) return TYPE_DOUBLE;
+    if (parseDate(pData, nLength, &nValue)) return TYPE_DATE;
+    return TYPE_TEXT;
+}
+
+// This function parses value for column of given type and returns type which holds the value,
+// fraction in INT column is DOUBLE. TYPE_TEXT is returned if value does not fit into column type
+int parseValue(int nColumnType, const char *pData, int nLength, TypedValue *pValue)
+{
+    pValue->nType = TYPE_TEXT;
+    pValue->nValue = 0;
+    pValue->fValue = 0;
+
+    if (nColumnType == TYPE_DATE)
+    {
+        if (parseDate(pData, nLength, &pValue->nValue)) pValue->nType = TYPE_DATE;
+    }
+    else if (nColumnType == TYPE_INT && parseInt(pData, nLength, &pValue->nValue))
+    {
+        pValue->fValue = (double)pValue->nValue;
+        pValue->nType = TYPE_INT;
+    }
+    else if (nColumnType != TYPE_TEXT && parseDouble(pData, nLength, &pValue->fValue))
+    {
+        pValue->nType = TYPE_DOUBLE;
+    }
+
+    return pValue->nType;
+}
+
+// This function returns next field of the row and moves row pointer behind it,
+// spaces around field are trimmed like in getField(). NULL is returned after the last field
+const char* nextField(const char **ppRow, int *pLen)
+{
+    const char *pRow = *ppRow;
+    if (pRow == NULL)
+    {
+        *pLen = 0;
+        return NULL;
+    }
+
+    while (*pRow == ' ') pRow++;
+    const char *pEnd = strchr(pRow, ',');
+    int nLen = pEnd != NULL ? (int)(pEnd - pRow) : (int)strlen(pRow);
+    while (nLen > 0 && pRow[nLen - 1] == ' ') nLen--;
+
+    *ppRow = pEnd != NULL ? pEnd + 1 : NULL;
+    *pLen = nLen;
+    return pRow;
+}
+
+// Source of schema epochs, every epoch is taken once so epochs of different tables never match
+static unsigned long g_nSchemaEpoch = 0;
+
+// This function returns new schema epoch
+unsigned long nextSchemaEpoch()
+{
+    return __atomic_add_fetch(&g_nSchemaEpoch, 1, __ATOMIC_RELAXED);
+}
+
+// This function widens column type, so values which did not fit can be stored. INT values are converted
+// into doubles in place, other types fall back to row text and lose packed values. New schema epoch
+// of table makes plans bound to the old column type compiled again
+void widenColumn(Database *pDB, Column *pCol, int nRows, int nType)
+{
+    if (pCol->nType == nType) return;
+    pDB->nSchemaEpoch = nextSchemaEpoch();
+
+    if (pCol->nType == TYPE_INT && nType == TYPE_DOUBLE)
+    {
+        int i;
+        for (i = 0; i < nRows; i++) pCol->pDoubles[i] = (double)pCol->pInts[i];
+
+        // Zones exist after table is loaded, their ranges are converted too
+        for (i = 0; pCol->pZones != NULL && i * ZONE_ROWS < nRows; i++)
+        {
+            pCol->pZones[i].fMin = (double)pCol->pZones[i].nMin;
+            pCol->pZones[i].fMax = (double)pCol->pZones[i].nMax;
+        }
+    }
+    else
+    {
+        free(pCol->pInts);
+        pCol->pInts = NULL;
+        nType = TYPE_TEXT;
+    }
+
+    pCol->nType = nType;
+}
+
+// This function saves parsed value into packed array of typed column
+void setColumnValue(Column *pCol, int nRow, TypedValue *pValue)
+{
+    if (pCol->nType == TYPE_DOUBLE) pCol->pDoubles[nRow] = pValue->fValue;
+    else if (pCol->nType != TYPE_TEXT) pCol->pInts[nRow] = pValue->nValue;
+}
+
+// This function widens column type so new value fits into it and saves value of the row
+void storeColumnValue(Database *pDB, Column *pCol, int nRows, int nRow, const char *pData, int nLength)
+{
+    if (pCol->nType == TYPE_TEXT) return;
+
+    TypedValue value;
+    int nType = parseValue(pCol->nType, pData, nLength, &value);
+    if (nType != pCol->nType) widenColumn(pDB, pCol, nRows, nType);
+    setColumnValue(pCol, nRow, &value);
+}
+
+// This function frees packed values of columns and the column array
+void destroyColumns(Column *pColumns, int nCount)
+{
+    if (pColumns == NULL) return;
+
+    int i;
+    for (i = 0; i < nCount; i++)
+    {
+        free(pColumns[i].pInts);
+        free(pColumns[i].pZones);
+        free(pColumns[i].pBloom);
+    }
+
+    free(pColumns);
+}
+
+// This function infers column types from the first rows of table and fills packed values of
+// typed columns. Later value which does not fit widens its column, so inferred type never lies
+int typeColumns(Database *pDB)
+{
+    pDB->pColumns = calloc(pDB->nColumnCount + 1, sizeof(Column));
+    if (pDB->pColumns == NULL)
+    {
+        logToFile(ERROR, "Can not alloc memory for columns of %s", pDB->sName);
+        return 0;
+    }
+
+    int nTypes[pDB->nColumnCount + 1];
+    int i, j, nLen = 0;
+    for (j = 0; j < pDB->nColumnCount; j++) nTypes[j] = -1; // Nothing sampled yet
+
+    // Every sampled value narrows candidate type of its column, missing value makes column text
+    for (i = 0; i < pDB->nRowCount && i < TYPE_SAMPLE_ROWS; i++)
+    {
+        const char *pRow = getRow(pDB, i)->sData;
+        for (j = 0; j < pDB->nColumnCount; j++)
+        {
+            TypedValue value;
+            const char *pField = nextField(&pRow, &nLen);
+            if (pField == NULL) nTypes[j] = TYPE_TEXT;
+            else if (nTypes[j] < 0) nTypes[j] = detectType(pField, nLen);
+            else nTypes[j] = parseValue(nTypes[j], pField, nLen, &value);
+        }
+    }
+
+    for (j = 0; j < pDB->nColumnCount; j++)
+    {
+        Column *pCol = &pDB->pColumns[j];
+        pCol->nType = nTypes[j] < 0 ? TYPE_TEXT : nTypes[j];
+        if (pCol->nType == TYPE_TEXT) continue;
+
+        pCol->pInts = malloc(sizeof(int64_t) * pDB->nChunkSize * ZONE_ROWS);
+        if (pCol->pInts == NULL)
+        {
+            logToFile(ERROR, "Can not alloc memory for column values of %s", pDB->sName);
+            return 0;
+        }
+    }
+
+    for (i = 0; i < pDB->nRowCount; i++)
+    {
+        const char *pRow = getRow(pDB, i)->sData;
+        for (j = 0; j < pDB->nColumnCount; j++)
+        {
+            const char *pField = nextField(&pRow, &nLen);
+            if (pField == NULL) widenColumn(pDB, &pDB->pColumns[j], i, TYPE_TEXT);
+            else storeColumnValue(pDB, &pDB->pColumns[j], i, i, pField, nLen);
+        }
+    }
+
+    // Log inferred schema of the table
+    char sSchema[DATA_MAX];
+    const char *pNames = pDB->sColumns;
+    int nUsed = 0;
+
+    for (j = 0; j < pDB->nColumnCount && nUsed < (int)sizeof(sSchema); j++)
+    {
+        const char *pName = nextField(&pNames, &nLen);
+        if (pName == NULL) break;
+
+        nUsed += snprintf(sSchema + nUsed, sizeof(sSchema) - nUsed, "%s%.*s %s", j ? ", " : "",
+                          nLen, pName, g_pTypeNames[pDB->pColumns[j].nType]);
+    }
+
+    logToFile(INFO, "Columns of %s: %s", pDB->sName, nUsed ? sSchema : "none");
+    return buildZones(pDB);
+}
+
+////////////////////////////////////////////////////////////////////////
+// ZONE MAPS
+////////////////////////////////////////////////////////////////////////
+
+// Filter of WHERE clause, column is compared with value by its type
+typedef struct {
+    char sValue[DATA_MAX];
+    int nColumnID;
+    int nOp;    // PRED_* bits
+} Predicate;
+
+// This function returns count of rows in zone
+int zoneRowCount(Database *pDB, int nZone)
+{
+    int nEnd = (nZone + 1) * ZONE_ROWS;
+    return (nEnd < pDB->nRowCount ? nEnd : pDB->nRowCount) - nZone * ZONE_ROWS;
+}
+
+// This function finalizes hash of key, so bits of both halves depend on all bits of key
+uint64_t mixHash(uint64_t nHash)
+{
+    nHash ^= nHash >> 33;
+    nHash *= 0xff51afd7ed558ccdULL;
+    nHash ^= nHash >> 33;
+    nHash *= 0xc4ceb9fe1a85ec53ULL;
+    nHash ^= nHash >> 33;
+    return nHash;
+}
+
+// This function returns key hash of value by column type, typed values are hashed
+// by their native value so equal values like "7" and "007" have the same key
+uint64_t keyHash(int nType, const char *pData, int nLength, int64_t nValue, double fValue)
+{
+    if (nType == TYPE_TEXT) return mixHash(((uint64_t)hashData(pData, nLength) << 32) | (uint32_t)nLength);
+    if (nType != TYPE_DOUBLE) return mixHash((uint64_t)nValue);
+
+    // Negative zero is equal to zero
+    uint64_t nBits = 0;
+    fValue += 0.0;
+    memcpy(&nBits, &fValue, sizeof(nBits));
+    return mixHash(nBits);
+}
+
+// This function sets or tests bits of key in Bloom filter, bit positions are derived from both halves of hash.
+// Returns 0 if key is not in filter when testing
+int bloomProbe(uint64_t *pBits, int nWords, int nHashes, uint64_t nHash, int isAdd)
+{
+    uint32_t nBitCount = (uint32_t)nWords * 64;
+    uint32_t nFirst = (uint32_t)nHash, nStep = (uint32_t)(nHash >> 32) | 1;
+    int i;
+
+    for (i = 0; i < nHashes; i++)
+    {
+        uint32_t nBit = (nFirst + i * nStep) % nBitCount;
+        if (isAdd) pBits[nBit >> 6] |= 1ULL << (nBit & 63);
+        else if (!(pBits[nBit >> 6] & (1ULL << (nBit & 63)))) return 0;
+    }
+
+    return 1;
+}
+
+// This function rebuilds Bloom filter of zone from its rows, NULL fields are never equal so they are not added
+void buildZoneBloom(Database *pDB, int nColumnID, int nZone)
+{
+    Column *pCol = &pDB->pColumns[nColumnID];
+    uint64_t *pBits = pCol->pBloom + (size_t)nZone * pCol->nBloomWords;
+    int i, nStart = nZone * ZONE_ROWS, nEnd = nStart + zoneRowCount(pDB, nZone);
+
+    memset(pBits, 0, sizeof(uint64_t) * pCol->nBloomWords);
+    for (i = nStart; i < nEnd; i++)
+    {
+        uint64_t nHash = 0;
+        if (pCol->nType == TYPE_TEXT)
+        {
+            int nLen = 0;
+            const char *pField = getField(getRow(pDB, i)->sData, nColumnID, &nLen);
+            if (pField == NULL || !nLen) continue;
+            nHash = keyHash(TYPE_TEXT, pField, nLen, 0, 0.0);
+        }
+        else if (pCol->nType == TYPE_DOUBLE) nHash = keyHash(TYPE_DOUBLE, NULL, 0, 0, pCol->pDoubles[i]);
+        else nHash = keyHash(pCol->nType, NULL, 0, pCol->pInts[i], 0.0);
+
+        bloomProbe(pBits, pCol->nBloomWords, pCol->nBloomHashes, nHash, 1);
+    }
+}
+
+// This function recomputes zone of column from its rows,
+// typed columns have no empty fields so only their range is computed
+void buildColumnZone(Database *pDB, int nColumnID, int nZone)
+{
+    Column *pCol = &pDB->pColumns[nColumnID];
+    Zone *pZone = &pCol->pZones[nZone];
+    int i, nStart = nZone * ZONE_ROWS, nEnd = nStart + zoneRowCount(pDB, nZone);
+
+    pZone->nMin = pZone->nMax = 0;
+    pZone->nNullCount = 0;
+
+    if (pCol->nType == TYPE_TEXT)
+    {
+        for (i = nStart; i < nEnd; i++)
+        {
+            int nLen = 0;
+            getField(getRow(pDB, i)->sData, nColumnID, &nLen);
+            pZone->nNullCount += !nLen;
+        }
+    }
+    else if (pCol->nType == TYPE_DOUBLE)
+    {
+        pZone->fMin = pZone->fMax = pCol->pDoubles[nStart];
+        for (i = nStart + 1; i < nEnd; i++)
+        {
+            if (pCol->pDoubles[i] < pZone->fMin) pZone->fMin = pCol->pDoubles[i];
+            if (pCol->pDoubles[i] > pZone->fMax) pZone->fMax = pCol->pDoubles[i];
+        }
+    }
+    else
+    {
+        pZone->nMin = pZone->nMax = pCol->pInts[nStart];
+        for (i = nStart + 1; i < nEnd; i++)
+        {
+            if (pCol->pInts[i] < pZone->nMin) pZone->nMin = pCol->pInts[i];
+            if (pCol->pInts[i] > pZone->nMax) pZone->nMax = pCol->pInts[i];
+        }
+    }
+
+    if (pCol->pBloom != NULL) buildZoneBloom(pDB, nColumnID, nZone);
+}
+
+// This function builds zone maps of all columns of loaded table
+int buildZones(Database *pDB)
+{
+    int i, j, nZones = (pDB->nRowCount + ZONE_ROWS - 1) / ZONE_ROWS;
+
+    for (j = 0; j < pDB->nColumnCount; j++)
+    {
+        pDB->pColumns[j].pZones = calloc(pDB->nChunkSize, sizeof(Zone));
+        if (pDB->pColumns[j].pZones == NULL)
+        {
+            logToFile(ERROR, "Can not alloc memory for zone maps of %s", pDB->sName);
+            return 0;
+        }
+
+        for (i = 0; i < nZones; i++) buildColumnZone(pDB, j, i);
+    }
+
+    return 1;
+}
+
+// This function adds values of new row into zones of all columns, zone of block is reset by its first row
+void addZoneRow(Database *pDB, int nRow)
+{
+    const char *pText = getRow(pDB, nRow)->sData;
+    int j, nLen = 0, nZone = nRow / ZONE_ROWS, isFirst = !(nRow % ZONE_ROWS);
+
+    for (j = 0; j < pDB->nColumnCount; j++)
+    {
+        Column *pCol = &pDB->pColumns[j];
+        Zone *pZone = &pCol->pZones[nZone];
+        uint64_t *pBits = pCol->pBloom != NULL ? pCol->pBloom + (size_t)nZone * pCol->nBloomWords : NULL;
+        const char *pField = nextField(&pText, &nLen);
+        uint64_t nHash = 0;
+
+        if (isFirst)
+        {
+            memset(pZone, 0, sizeof(Zone));
+            if (pBits != NULL) memset(pBits, 0, sizeof(uint64_t) * pCol->nBloomWords);
+        }
+
+        if (pCol->nType == TYPE_TEXT)
+        {
+            if (pField == NULL) nLen = 0;
+            pZone->nNullCount += !nLen;
+            if (!nLen) continue;
+            nHash = keyHash(TYPE_TEXT, pField, nLen, 0, 0.0);
+        }
+        else if (pCol->nType == TYPE_DOUBLE)
+        {
+            double fValue = pCol->pDoubles[nRow];
+            if (isFirst || fValue < pZone->fMin) pZone->fMin = fValue;
+            if (isFirst || fValue > pZone->fMax) pZone->fMax = fValue;
+            nHash = keyHash(TYPE_DOUBLE, NULL, 0, 0, fValue);
+        }
+        else
+        {
+            int64_t nValue = pCol->pInts[nRow];
+            if (isFirst || nValue < pZone->nMin) pZone->nMin = nValue;
+            if (isFirst || nValue > pZone->nMax) pZone->nMax = nValue;
+            nHash = keyHash(pCol->nType, NULL, 0, nValue, 0.0);
+        }
+
+        if (pBits != NULL) bloomProbe(pBits, pCol->nBloomWords, pCol->nBloomHashes, nHash, 1);
+    }
+}
+
+// This function adds Bloom filters to columns of table listed in catalog, about 0.7 hashes
+// per bit of key give the least false positives
+int addBlooms(Catalog *pCatalog, Database *pDB)
+{
+    const char *pName = pCatalog->pBloomColumns;
+    int i, nZones = (pDB->nRowCount + ZONE_ROWS - 1) / ZONE_ROWS;
+
+    while (pName != NULL && *pName != '\0')
+    {
+        const char *pColumn = pName;
+        int nLength = strcspn(pName, ",");
+        int nColumnID = findColumn(pDB, pColumn, nLength);
+        pName += nLength + (pName[nLength] == ',');
+        if (nColumnID < 0 || pDB->pColumns[nColumnID].pBloom != NULL) continue;
+
+        Column *pCol = &pDB->pColumns[nColumnID];
+        pCol->nBloomWords = (ZONE_ROWS * pCatalog->nBloomBits + 63) / 64;
+        pCol->nBloomHashes = (pCatalog->nBloomBits * 69 + 50) / 100;
+        if (pCol->nBloomHashes < 1) pCol->nBloomHashes = 1;
+
+        pCol->pBloom = calloc((size_t)pDB->nChunkSize * pCol->nBloomWords, sizeof(uint64_t));
+        if (pCol->pBloom == NULL)
+        {
+            logToFile(ERROR, "Can not alloc memory for Bloom filters of %s", pDB->sName);
+            return 0;
+        }
+
+        for (i = 0; i < nZones; i++) buildZoneBloom(pDB, nColumnID, i);
+        logToFile(INFO, "Column %.*s of %s has Bloom filters, %d bits per key and %d hashes.",
+                  nLength, pColumn, pDB->sName,
+                  pCatalog->nBloomBits, pCol->nBloomHashes);
+    }
+
+    return 1;
+}
+
+// This function returns comparison bit of two values, it is one of PRED_LESS, PRED_EQUAL and PRED_GREATER
+#define COMPARE_BIT(a, b) ((PRED_EQUAL << ((a) > (b))) >> ((a) < (b)))
+
+// This function returns comparison bits which rows of zone can give, values of zone
+// lie between min and max so every result between results of min and max is possible
+int zoneBits(Column *pCol, Zone *pZone, TypedValue *pValue, int isDouble)
+{
+    int nMinBit, nMaxBit;
+    if (pCol->nType == TYPE_DOUBLE)
+    {
+        nMinBit = COMPARE_BIT(pZone->fMin, pValue->fValue);
+        nMaxBit = COMPARE_BIT(pZone->fMax, pValue->fValue);
+    }
+    else if (isDouble)
+    {
+        nMinBit = COMPARE_BIT((double)pZone->nMin, pValue->fValue);
+        nMaxBit = COMPARE_BIT((double)pZone->nMax, pValue->fValue);
+    }
+    else
+    {
+        nMinBit = COMPARE_BIT(pZone->nMin, pValue->nValue);
+        nMaxBit = COMPARE_BIT(pZone->nMax, pValue->nValue);
+    }
+
+    return (nMaxBit << 1) - nMinBit;
+}
+
+// This function compares text field with value, empty field is NULL and matches only IS NULL
+int matchText(const char *pField, int nLen, Predicate *pPred, int nValueLength)
+{
+    if (pPred->nOp & (PRED_IS_NULL | PRED_NOT_NULL)) return !!(pPred->nOp & (nLen ? PRED_NOT_NULL : PRED_IS_NULL));
+    if (!nLen) return 0;
+
+    int nCmp = memcmp(pField, pPred->sValue, nLen < nValueLength ? nLen : nValueLength);
+    if (!nCmp) nCmp = nLen - nValueLength;
+    return !!(pPred->nOp & COMPARE_BIT(nCmp, 0));
+}
+
+// This function finds rows which satisfy predicate and saves their positions in pRows, at most nLimit
+// rows are found unless nLimit is negative. Blocks whose zone can not satisfy predicate are skipped,
+// blocks which satisfy it whole are taken without comparisons. Equality also skips blocks whose
+// Bloom filter does not have the value. Other blocks of typed columns are scanned in packed arrays
+// without branches. Zones still count deleted rows, so deleted rows are dropped from matches of block
+int filterRows(Database *pDB, Predicate *pPred, int *pRows, int nLimit)
+{
+    Column *pCol = &pDB->pColumns[pPred->nColumnID];
+    int nValueLength = strlen(pPred->sValue);
+    int i, nZone, nCount = 0, nScanned = 0, nSkipped = 0, nBloomSkipped = 0;
+
+    // Typed value is compared as double if column or value is double
+    TypedValue value;
+    int nValueType = pCol->nType != TYPE_TEXT ? parseValue(pCol->nType, pPred->sValue, nValueLength, &value) : TYPE_TEXT;
+    int isDouble = pCol->nType == TYPE_DOUBLE || nValueType == TYPE_DOUBLE;
+
+    // Filters have keys of column type, INT column compared with DOUBLE value can not use them
+    int isBloom = pCol->pBloom != NULL && pPred->nOp == PRED_EQUAL && nValueType == pCol->nType;
+    uint64_t nKeyHash = isBloom ? keyHash(nValueType, pPred->sValue, nValueLength, value.nValue, value.fValue) : 0;
+
+    for (nZone = 0; nZone * ZONE_ROWS < pDB->nRowCount; nZone++)
+    {
+        if (nLimit >= 0 && nCount >= nLimit) break;
+        if (isBlockCancelled()) break;
+
+        Zone *pZone = &pCol->pZones[nZone];
+        int nStart = nZone * ZONE_ROWS;
+        int nRows = zoneRowCount(pDB, nZone);
+        int nEnd = nStart + nRows;
+        int nFirst = nCount;
+
+        // Bits of results which rows of zone can give, NULL and NOT NULL are bits of their own
+        int nBits = 0;
+        if (pZone->nNullCount) nBits |= PRED_IS_NULL;
+        if (pZone->nNullCount < nRows) nBits |= PRED_NOT_NULL | PRED_LESS | PRED_EQUAL | PRED_GREATER;
+
+        // Typed column has no NULLs, value which does not fit into column type only differs from all values
+        if (pCol->nType != TYPE_TEXT)
+        {
+            if (pPred->nOp & (PRED_IS_NULL | PRED_NOT_NULL)) nBits = PRED_NOT_NULL;
+            else if (nValueType == TYPE_TEXT) nBits = pPred->nOp == (PRED_LESS | PRED_GREATER) ? pPred->nOp : 0;
+            else nBits = zoneBits(pCol, pZone, &value, isDouble);
+        }
+
+        if (!(nBits & pPred->nOp) || pDB->pChunkDeleted[nZone] == nRows)
+        {
+            nSkipped++;
+            continue;
+        }
+
+        if (isBloom && !bloomProbe(pCol->pBloom + (size_t)nZone * pCol->nBloomWords,
+                                   pCol->nBloomWords, pCol->nBloomHashes, nKeyHash, 0))
+        {
+            nBloomSkipped++;
+            continue;
+        }
+
+        nScanned++;
+        if (pCol->nType != TYPE_TEXT && !(nBits & ~pPred->nOp))
+        {
+            // Every row of zone satisfies predicate
+            for (i = nStart; i < nEnd; i++) pRows[nCount++] = i;
+        }
+        else if (pCol->nType == TYPE_TEXT)
+        {
+            for (i = nStart; i < nEnd; i++)
+            {
+                int nLen = 0;
+                const char *pField = getField(getRow(pDB, i)->sData, pPred->nColumnID, &nLen);
+                if (pField == NULL) nLen = 0;
+                if (matchText(pField, nLen, pPred, nValueLength)) pRows[nCount++] = i;
+            }
+        }
+        else if (pCol->nType == TYPE_DOUBLE)
+        {
+            for (i = nStart; i < nEnd; i++)
+            {
+                pRows[nCount] = i;
+                nCount += !!(pPred->nOp & COMPARE_BIT(pCol->pDoubles[i], value.fValue));
+            }
+        }
+        else if (isDouble)
+        {
+            for (i = nStart; i < nEnd; i++)
+            {
+                pRows[nCount] = i;
+                nCount += !!(pPred->nOp & COMPARE_BIT((double)pCol->pInts[i], value.fValue));
+            }
+        }
+        else
+        {
+            for (i = nStart; i < nEnd; i++)
+            {
+                pRows[nCount] = i;
+                nCount += !!(pPred->nOp & COMPARE_BIT(pCol->pInts[i], value.nValue));
+            }
+        }
+
+        if (pDB->pChunkDeleted[nZone])
+        {
+            int nKept = nFirst;
+            for (i = nFirst; i < nCount; i++)
+            {
+                pRows[nKept] = pRows[i];
+                nKept += !isRowDeleted(pDB, pRows[i]);
+            }
+
+            nCount = nKept;
+        }
+    }
+
+    __atomic_fetch_add(&g_stats.nZonesScanned, nScanned, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&g_stats.nZonesSkipped, nSkipped, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&g_stats.nBloomSkipped, nBloomSkipped, __ATOMIC_RELAXED);
+    return nLimit >= 0 && nCount > nLimit ? nLimit : nCount;
+}
+
+////////////////////////////////////////////////////////////////////////
+// CPU PLACEMENT
+////////////////////////////////////////////////////////////////////////
+
+// This function parses CPU list of sysfs (like 0-3,8-11) into CPU set
+void parseCpuList(const char *pList, cpu_set_t *pSet)
+{
+    CPU_ZERO(pSet);
+    while (*pList != '\0' && *pList != '\n')
+    {
+        char *pEnd = NULL;
+        long nFirst = strtol(pList, &pEnd, 10);
+        long nLast = nFirst;
+        if (pEnd == pList) break;
+
+        if (*pEnd == '-') nLast = strtol(pEnd + 1, &pEnd, 10);
+        for (; nFirst <= nLast && nFirst < CPU_SETSIZE; nFirst++) CPU_SET(nFirst, pSet);
+
+        pList = *pEnd == ',' ? pEnd + 1 : pEnd;
+    }
+}
+
+// This function detects CPUs allowed for server and their NUMA nodes from sysfs,
+// machine without sysfs node information is treated as single node
+void initTopology(Topology *pTopo, int nPinning, int nNuma)
+{
+    cpu_set_t allowed;
+    int i, nNode;
+
+    pTopo->nCpuCount = 0;
+    pTopo->nNodeCount = 0;
+    pTopo->nPinning = nPinning;
+    pTopo->nNuma = nNuma;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed))
+    {
+        CPU_ZERO(&allowed);
+        for (i = 0; i < getCpuCount() && i < CPU_SETSIZE; i++) CPU_SET(i, &allowed);
+    }
+
+    for (nNode = 0; nNode < NUMA_NODES_MAX; nNode++)
+    {
+        char sPath[PATH_MAX], sList[DATA_MAX];
+        snprintf(sPath, sizeof(sPath), "/sys/devices/system/node/node%d/cpulist", nNode);
+
+        FILE *fp = fopen(sPath, "r");
+        if (fp == NULL) continue;
+
+        cpu_set_t nodeCpus;
+        CPU_ZERO(&nodeCpus);
+        if (fgets(sList, sizeof(sList), fp) != NULL) parseCpuList(sList, &nodeCpus);
+        fclose(fp);
+
+        // Nodes without allowed CPUs are not used at all
+        pTopo->nNodeStart[pTopo->nNodeCount] = pTopo->nCpuCount;
+        for (i = 0; i < CPU_SETSIZE; i++)
+            if (CPU_ISSET(i, &nodeCpus) && CPU_ISSET(i, &allowed)) pTopo->nCpus[pTopo->nCpuCount++] = i;
+
+        if (pTopo->nCpuCount > pTopo->nNodeStart[pTopo->nNodeCount]) pTopo->nNodeCount++;
+    }
+
+    // No node information, all allowed CPUs are single node
+    if (!pTopo->nNodeCount)
+    {
+        pTopo->nNodeStart[0] = 0;
+        for (i = 0; i < CPU_SETSIZE; i++)
+            if (CPU_ISSET(i, &allowed)) pTopo->nCpus[pTopo->nCpuCount++] = i;
+
+        pTopo->nNodeCount = 1;
+    }
+
+    pTopo->nNodeStart[pTopo->nNodeCount] = pTopo->nCpuCount;
+    logToFile(INFO, "Topology: %d CPUs on %d NUMA nodes.", pTopo->nCpuCount, pTopo->nNodeCount);
+
+    if (pTopo->nNuma && pTopo->nNodeCount < 2)
+    {
+        logToFile(INFO, "Single NUMA node, rows and scans are not spread over nodes.");
+        pTopo->nNuma = 0;
+    }
+}
+
+// This function pins calling worker to single CPU, workers are spread over
+// nodes first so consecutive workers do not share the same node
+void pinWorker(Topology *pTopo, int nWorkerID)
+{
+    if (!pTopo->nPinning || !pTopo->nCpuCount) return;
+
+    int nNode = nWorkerID % pTopo->nNodeCount;
+    int nNodeCpus = pTopo->nNodeStart[nNode + 1] - pTopo->nNodeStart[nNode];
+    int nCpu = pTopo->nCpus[pTopo->nNodeStart[nNode] + (nWorkerID / pTopo->nNodeCount) % nNodeCpus];
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(nCpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+        logToFile(ERROR, "Thread #%d: can not pin thread to CPU %d", nWorkerID, nCpu);
+}
+
+// This function binds calling thread to all CPUs of NUMA node, memory
+// touched first by this thread is allocated from that node then
+void pinToNode(Topology *pTopo, int nNode)
+{
+    if (!pTopo->nNuma || nNode < 0 || nNode >= pTopo->nNodeCount) return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+
+    int i;
+    for (i = pTopo->nNodeStart[nNode]; i < pTopo->nNodeStart[nNode + 1]; i++)
+        CPU_SET(pTopo->nCpus[i], &set);
+
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// This function returns NUMA node of the row, -1 if rows are not spread over nodes
+int nodeOfRow(Database *pDB, int nRow)
+{
+    int i;
+    for (i = 0; i < pDB->nNodeCount; i++)
+        if (nRow < pDB->nNodeRows[i + 1]) return i;
+
+    return -1;
+}
+
+typedef struct {
+    Database *pDB;
+    Column *pColumns;
+    int nNode;
+} PlaceTask;
+
+// Placement thread copies chunks of its node, so their pages are allocated on that node
+void* placeThread(void *pArg)
+{
+    PlaceTask *pTask = (PlaceTask*)pArg;
+    Database *pDB = pTask->pDB;
+    int nStart = pDB->nNodeRows[pTask->nNode];
+    int nEnd = pDB->nNodeRows[pTask->nNode + 1];
+    int i;
+
+    pinToNode(&g_topology, pTask->nNode);
+    for (i = nStart / ZONE_ROWS; i * ZONE_ROWS < nEnd; i++)
+    {
+        // Chunk which can not be copied stays where it is
+        RowData *pChunk = malloc(sizeof(RowData) * ZONE_ROWS);
+        if (pChunk == NULL) continue;
+
+        memcpy(pChunk, pDB->pChunks[i], sizeof(RowData) * zoneRowCount(pDB, i));
+        free(pDB->pChunks[i]);
+        pDB->pChunks[i] = pChunk;
+    }
+
+    // Packed values of typed columns are 8 bytes wide whatever type they have
+    for (i = 0; i < pDB->nColumnCount; i++)
+        if (pTask->pColumns[i].nType != TYPE_TEXT)
+            memcpy(pTask->pColumns[i].pInts + nStart, pDB->pColumns[i].pInts + nStart, sizeof(int64_t) * (nEnd - nStart));
+
+    return NULL;
+}
+
+// This function spreads rows of loaded database over NUMA nodes in equal ranges of chunks,
+// rows are copied into fresh memory by threads bound to the node of every range
+void placeDatabase(Database *pDB)
+{
+    int nNodes = g_topology.nNodeCount;
+    if (!g_topology.nNuma || pDB->nRowCount < NUMA_PLACE_MIN) return;
+
+    // Fresh large allocations are not touched yet, pages are allocated by placement threads
+    Column *pColumns = calloc(pDB->nColumnCount + 1, sizeof(Column));
+    int i, nFailed = pColumns == NULL;
+
+    for (i = 0; i < pDB->nColumnCount && !nFailed; i++)
+    {
+        pColumns[i].nType = pDB->pColumns[i].nType;
+        if (pColumns[i].nType == TYPE_TEXT) continue;
+
+        pColumns[i].pInts = malloc(sizeof(int64_t) * pDB->nChunkSize * ZONE_ROWS);
+        if (pColumns[i].pInts == NULL) nFailed = 1;
+    }
+
+    if (nFailed)
+    {
+        logToFile(ERROR, "Can not alloc memory for rows of %s, rows are not spread over nodes", pDB->sName);
+        destroyColumns(pColumns, pDB->nColumnCount);
+        return;
+    }
+
+    for (i = 0; i <= nNodes; i++)
+    {
+        // Ranges are aligned to chunks, so every chunk is copied by single thread
+        long nRow = (long)pDB->nChunkCount * i / nNodes * ZONE_ROWS;
+        pDB->nNodeRows[i] = nRow < pDB->nRowCount ? (int)nRow : pDB->nRowCount;
+    }
+
+    PlaceTask tasks[NUMA_NODES_MAX];
+    pthread_t threads[NUMA_NODES_MAX];
+    int nStarted[NUMA_NODES_MAX];
+
+    for (i = 0; i < nNodes; i++)
+    {
+        tasks[i].pDB = pDB;
+        tasks[i].pColumns = pColumns;
+        tasks[i].nNode = i;
+        nStarted[i] = !pthread_create(&threads[i], NULL, placeThread, &tasks[i]);
+        if (!nStarted[i]) placeThread(&tasks[i]);
+    }
+
+    for (i = 0; i < nNodes; i++)
+        if (nStarted[i]) pthread_join(threads[i], NULL);
+
+    // Zone maps and Bloom filters are small and are read by every node, they are moved as they are
+    for (i = 0; i < pDB->nColumnCount; i++)
+    {
+        pColumns[i].pZones = pDB->pColumns[i].pZones;
+        pColumns[i].pBloom = pDB->pColumns[i].pBloom;
+        pColumns[i].nBloomWords = pDB->pColumns[i].nBloomWords;
+        pColumns[i].nBloomHashes = pDB->pColumns[i].nBloomHashes;
+        pDB->pColumns[i].pZones = NULL;
+        pDB->pColumns[i].pBloom = NULL;
+    }
+
+    destroyColumns(pDB->pColumns, pDB->nColumnCount);
+    pDB->pColumns = pColumns;
+    pDB->nNodeCount = nNodes;
+    logToFile(INFO, "Rows of %s are spread over %d NUMA nodes.", pDB->sName, nNodes);
+}
+
+////////////////////////////////////////////////////////////////////////
+// DATABASE
+////////////////////////////////////////////////////////////////////////
+
+// This function initializes database structure
+void initDatabase(Database *pDB)
+{
+    // Init read/write lock
+    if (pthread_rwlock_init(&pDB->rwLock, NULL))
+    {
+        logToFile(ERROR, "Can not init rw lock");
+        exitFailure(NULL);
+    }
+
+    // Initial values, catalog holds the first reference
+    pDB->sColumns[0] = '\0';
+    pDB->nRefCount = 1;
+    pDB->nColumnCount = 0;
+    pDB->nRowCount = 0;
+    pDB->nDeletedCount = 0;
+    pDB->nChunkCount = 0;
+    pDB->nChunkSize = 0;
+    pDB->nVersion = 0;
+    pDB->nSchemaEpoch = nextSchemaEpoch();
+    pDB->nNodeCount = 0;
+    pDB->pColumns = NULL;
+    pDB->pChunks = NULL;
+    pDB->pDeleted = NULL;
+    pDB->pChunkDeleted = NULL;
+    pDB->isInit = 1;
+
+    // Allocate chunk table, chunks are allocated as rows are appended
+    growTable(pDB);
+}
+
+// This function destroys database structure and all associated variables
+void destroyDatabase(Database *pDB)
+{
+    if (!pDB->isInit) return;
+
+    // Clear rows
+    int i;
+    for (i = 0; i < pDB->nChunkCount; i++) free(pDB->pChunks[i]);
+
+    free(pDB->pChunks);
+    free(pDB->pDeleted);
+    free(pDB->pChunkDeleted);
+    pDB->pChunks = NULL;
+    pDB->nChunkCount = 0;
+
+    destroyColumns(pDB->pColumns, pDB->nColumnCount);
+    pDB->pColumns = NULL;
+
+    // Destroy read/write lock
+    pthread_rwlock_destroy(&pDB->rwLock);
+}
+
+// This function appends the row data into the database, new chunk is allocated when the last one is full
+void appendDatabase(Database *pDB, const char *pRowData)
+{
+    if (pDB->nRowCount == pDB->nChunkCount * ZONE_ROWS)
+    {
+        if (pDB->nChunkCount == pDB->nChunkSize) growTable(pDB);
+
+        pDB->pChunks[pDB->nChunkCount] = (RowData*)malloc(sizeof(RowData) * ZONE_ROWS);
+        if (pDB->pChunks[pDB->nChunkCount] == NULL)
+        {
+            logToFile(ERROR, "Can not alloc memory for rows");
+            exitFailure(NULL);
+        }
+
+        pDB->nChunkCount++;
+    }
+
+    char sRow[DATA_MAX]; // Remove new line character
+    removeCharacter(sRow, sizeof(sRow), pRowData, '\n');
+
+    // Get new/unused row from column and set data
+    RowData *pRow = getRow(pDB, pDB->nRowCount++);
+    snprintf(pRow->sData, sizeof(pRow->sData), "%s", sRow);
+}
+
+// This function saves header line of table as its columns and counts them
+void parseColumns(Database *pDB, const char *pLine)
+{
+    // Save line into columns and remove new line character from back
+    removeCharacter(pDB->sColumns, sizeof(pDB->sColumns), pLine, '\n');
+
+    // Parse count of columnts by counting ','
+    char *pOffset = pDB->sColumns;
+    while ((pOffset = strstr(pOffset, ",")) != NULL)
+    {
+        pOffset++;
+        pDB->nColumnCount++;
+    }
+
+    // Last column after ','
+    if (pDB->nColumnCount) pDB->nColumnCount++;
+}
+
+// This function returns shard of key value. Numbers are hashed by value, so equal numbers like "7"
+// and "7.0" are on the same shard whatever type their column has and router needs no types
+int shardOfKey(const char *pData, int nLength, int nShardCount)
+{
+    double fValue;
+    if (parseDouble(pData, nLength, &fValue)) return (int)(keyHash(TYPE_DOUBLE, NULL, 0, 0, fValue) % nShardCount);
+    return (int)(keyHash(TYPE_TEXT, pData, nLength, 0, 0) % nShardCount);
+}
+
+// This function returns shard key column of table, -1 if server is not shard or table has no such column
+int shardKeyColumn(Catalog *pCatalog, Database *pDB)
+{
+    if (!pCatalog->nShardCount) return -1;
+    return findColumn(pDB, pCatalog->pShardKey, strlen(pCatalog->pShardKey));
+}
+
+// This function checks if row belongs to this shard, all rows of table without key column belong to shard 0
+int isShardRow(Catalog *pCatalog, int nKeyColumn, const char *pRow)
+{
+    if (!pCatalog->nShardCount) return 1;
+    if (nKeyColumn < 0) return pCatalog->nShard == 0;
+
+    int nLen = 0;
+    const char *pField = getField(pRow, nKeyColumn, &nLen);
+    if (pField == NULL) pField = "";
+
+    // Line read from file still has its new line
+    while (nLen > 0 && (pField[nLen - 1] == '\n' || pField[nLen - 1] == ' ')) nLen--;
+    return shardOfKey(pField, nLen, pCatalog->nShardCount) == pCatalog->nShard;
+}
+
+// This function opens database file, line-by-line reads it and saves recordings in the Database structure,
+// shard keeps only its own rows. It is called from loader threads so failure is returned to the caller instead of exiting
+int loadDatabase(Catalog *pCatalog, const char *pPath, Database *pDB)
+{
+    logToFile(INFO, "Loading dataset %s...", pDB->sName);
+    uint32_t nStartTime = timeStamp();
+
+    // Open input csv file read input csv file
+    FILE *fp = fopen(pPath, "r");
+    if (fp == NULL)
+    {
+        logToFile(ERROR, "Can not open dataset (%s)", pPath);
+        return 0;
+    }
+
+    char *pLine = NULL;
+    ssize_t nRead = 0;
+    size_t nLength = 0;
+    int nColumnsParsed = 0, nKeyColumn = -1;
+
+    // Line-by-line read input csv file
+    while ((nRead = getline(&pLine, &nLength, fp)) != -1) 
+    {
+        // Check if parsed line is valid
+        if (pLine != NULL && nLength > 1)
+        {
+            // If columns are not initialized, parse them first
+            if (!nColumnsParsed)
+            {
+                parseColumns(pDB, pLine);
+                nKeyColumn = shardKeyColumn(pCatalog, pDB);
+
+                // Mark columns as initialized
+                nColumnsParsed = 1;
+                continue;
+            }
+
+            // Append row into database
+            if (isShardRow(pCatalog, nKeyColumn, pLine)) appendDatabase(pDB, pLine);
+        }
+    }
+
+    // Log statistics into file
+    uint32_t nEndTime = timeStamp();
+    double fDiff = (double)(nEndTime - nStartTime) / (double)1000000;
+    logToFile(INFO, "Dataset %s loaded in %f seconds with %d records.", pDB->sName, fDiff, pDB->nRowCount);
+
+    // Clean line and close file
+    free(pLine); // this variable is allocated by getline() function
+    fclose(fp);
+
+    // Typed columns are built from loaded rows
+    return typeColumns(pDB);
+}
+
+// This function selects recordings from database with column id and appends those recordings in the pResponse variable
+int selectWithID(const char *pFrom, int nID, int nFound, String *pResponse, int nDistinct)
+{
+    char sData[DATA_MAX];
+    snprintf(sData, sizeof(sData), "%s", pFrom);
+
+    char *savePtr = NULL;
+    int nCurrentID = 0;
+
+    char *ptr = strtok_r(sData, ",", &savePtr);
+    while (ptr != NULL)
+    {
+        // Search current column in needed columns
+        if (nID == nCurrentID)
+        {
+            char sColumn[DATA_MAX];
+            while (*ptr == ' ') ptr++; // Remove spaces from front and back
+            removeCharacter(sColumn, sizeof(sColumn), ptr, ' ');
+
+            if (!nDistinct || strstr(pResponse->pData, sColumn) == NULL)
+            {
+                if (nFound) stringAppend(pResponse, ",", 1);
+                else nFound = 1;
+
+                // Append column name in response
+                stringAppend(pResponse, sColumn, strlen(sColumn));
+                break;
+            }
+        }
+
+        ptr = strtok_r(NULL, ",", &savePtr);
+        nCurrentID++;
+    }
+
+    return nFound;
+}
+
+// This function adds CSV file into catalog, table name is file name without directory and extension
+int addTable(Catalog *pCatalog, const char *pPath)
+{
+    if (pCatalog->nTableCount >= TABLES_MAX)
+    {
+        logToFile(ERROR, "Too many tables, at most %d datasets can be loaded", TABLES_MAX);
+        return 0;
+    }
+
+    Database *pDB = (Database*)calloc(1, sizeof(Database));
+    if (pDB == NULL)
+    {
+        logToFile(ERROR, "Can not alloc memory for table");
+        return 0;
+    }
+
+    snprintf(pDB->sPath, sizeof(pDB->sPath), "%s", pPath);
+
+    const char *pBase = strrchr(pPath, '/');
+    pBase = pBase != NULL ? pBase + 1 : pPath;
+    snprintf(pDB->sName, sizeof(pDB->sName), "%s", pBase);
+
+    char *pExt = strrchr(pDB->sName, '.');
+    if (pExt != NULL && pExt != pDB->sName) *pExt = '\0';
+
+    int i;
+    for (i = 0; i < pCatalog->nTableCount; i++)
+    {
+        if (!strcmp(pCatalog->pTables[i]->sName, pDB->sName))
+        {
+            logToFile(ERROR, "Duplicate table name %s (%s)", pDB->sName, pPath);
+            free(pDB);
+            return 0;
+        }
+    }
+
+    pCatalog->pTables[pCatalog->nTableCount++] = pDB;
+    return 1;
+}
+
+// This function compares table paths, directory entries are loaded in name order
+int compareTablePaths(const void *pA, const void *pB)
+{
+    return strcmp((*(Database* const*)pA)->sPath, (*(Database* const*)pB)->sPath);
+}
+
+// This function fills catalog from dataset argument, which is either directory of CSV files
+// or comma separated list of CSV files. Catalog of follower is empty, its tables come from primary
+int initCatalog(Catalog *pCatalog, const char *pDBPath)
+{
+    pCatalog->nTableCount = 0;
+    pCatalog->pBloomColumns = NULL;
+    pCatalog->nBloomBits = BLOOM_BITS_DEFAULT;
+    pCatalog->nCompactPercent = COMPACT_PERCENT_DEFAULT;
+    pCatalog->pShardKey = NULL;
+    pCatalog->nShard = 0;
+    pCatalog->nShardCount = 0;
+    pCatalog->isCompactInit = 0;
+    pCatalog->isReloading = 0;
+    pCatalog->isReloadInit = 0;
+    pCatalog->isSignalInit = 0;
+    pCatalog->pTables = (Database**)calloc(TABLES_MAX, sizeof(Database*));
+    if (pCatalog->pTables == NULL)
+    {
+        logToFile(ERROR, "Can not alloc memory for tables");
+        return 0;
+    }
+
+    initMutex(&pCatalog->mutex);
+    pCatalog->isInit = 1;
+    if (pDBPath == NULL) return 1;
+    struct stat st;
+
+    if (stat(pDBPath, &st) == 0 && S_ISDIR(st.st_mode))
+    {
+        DIR *pDir = opendir(pDBPath);
+        if (pDir == NULL)
+        {
+            logToFile(ERROR, "Can not open dataset directory (%s)", pDBPath);
+            return 0;
+        }
+
+        struct dirent *pEntry;
+        while ((pEntry = readdir(pDir)) != NULL)
+        {
+            // Only CSV files are loaded from directory
+            const char *pExt = strrchr(pEntry->d_name, '.');
+            if (pExt == NULL || strcmp(pExt, ".csv")) continue;
+
+            char sPath[PATH_MAX];
+            snprintf(sPath, sizeof(sPath), "%s/%s", pDBPath, pEntry->d_name);
+            if (!addTable(pCatalog, sPath))
+            {
+                closedir(pDir);
+                return 0;
+            }
+        }
+
+        closedir(pDir);
+        qsort(pCatalog->pTables, pCatalog->nTableCount, sizeof(Database*), compareTablePaths);
+    }
+    else
+    {
+        char sPaths[DATA_MAX];
+        snprintf(sPaths, sizeof(sPaths), "%s", pDBPath);
+
+        char *savePtr = NULL;
+        char *ptr = strtok_r(sPaths, ",", &savePtr);
+        while (ptr != NULL)
+        {
+            if (!addTable(pCatalog, ptr)) return 0;
+            ptr = strtok_r(NULL, ",", &savePtr);
+        }
+    }
+
+    if (!pCatalog->nTableCount)
+    {
+        logToFile(ERROR, "No datasets found in %s", pDBPath);
+        return 0;
+    }
+
+    int i;
+    for (i = 0; i < pCatalog->nTableCount; i++) pCatalog->pTables[i]->nSlot = i;
+    return 1;
+}
+
+// This is the loader thread function, every thread loads next unloaded table until all are loaded
+void* loaderThread(void *pArg)
+{
+    LoadTask *pTask = (LoadTask*)pArg;
+
+    while (!g_nInterrupted)
+    {
+        int nTable = __atomic_fetch_add(&pTask->nNextLoad, 1, __ATOMIC_RELAXED);
+        if (nTable >= pTask->nCount) break;
+
+        Database *pDB = pTask->pTables[nTable];
+        if (!loadDatabase(pTask->pCatalog, pDB->sPath, pDB) || !addBlooms(pTask->pCatalog, pDB)) continue;
+
+        placeDatabase(pDB);
+        pTask->nLoaded[nTable] = 1;
+    }
+
+    return NULL;
+}
+
+// This function loads tables of task in parallel, one thread per CPU at most.
+// Tables must be initialized, returns count of loaded tables
+int loadTables(LoadTask *pTask)
+{
+    int i, nThreads = getCpuCount();
+    if (nThreads > pTask->nCount) nThreads = pTask->nCount;
+    if (nThreads < 1) nThreads = 1;
+
+    pthread_t threads[nThreads];
+    int nStarted = 0, nLoaded = 0;
+
+    pTask->nNextLoad = 0;
+    for (i = 0; i < pTask->nCount; i++) pTask->nLoaded[i] = 0;
+
+    for (i = 1; i < nThreads; i++)
+    {
+        if (pthread_create(&threads[i], NULL, loaderThread, pTask)) break;
+        nStarted++;
+    }
+
+    // Current thread loads tables too
+    loaderThread(pTask);
+
+    for (i = 1; i <= nStarted; i++) pthread_join(threads[i], NULL);
+    for (i = 0; i < pTask->nCount; i++) nLoaded += pTask->nLoaded[i];
+    return nLoaded;
+}
+
+// This function loads all tables of catalog in parallel, one thread per CPU at most
+int loadCatalog(Catalog *pCatalog)
+{
+    logToFile(INFO, "Loading %d datasets...", pCatalog->nTableCount);
+    uint32_t nStartTime = timeStamp();
+    int i;
+
+    // Database structures are initialized before any thread starts, so cleanup is always safe
+    for (i = 0; i < pCatalog->nTableCount; i++) initDatabase(pCatalog->pTables[i]);
+
+    LoadTask task;
+    task.pCatalog = pCatalog;
+    task.pTables = pCatalog->pTables;
+    task.nCount = pCatalog->nTableCount;
+
+    if (loadTables(&task) < task.nCount || g_nInterrupted) return 0;
+
+    uint32_t nEndTime = timeStamp();
+    double fDiff = (double)(nEndTime - nStartTime) / (double)1000000;
+    logToFile(INFO, "All datasets loaded in %f seconds.", fDiff);
+    return 1;
+}
+
+// This function destroys all tables of catalog, it is called when no query uses them anymore
+void destroyCatalog(Catalog *pCatalog)
+{
+    if (!pCatalog->isInit) return;
+
+    int i;
+    for (i = 0; i < pCatalog->nTableCount; i++)
+    {
+        destroyDatabase(pCatalog->pTables[i]);
+        free(pCatalog->pTables[i]);
+    }
+
+    free(pCatalog->pTables);
+    pthread_mutex_destroy(&pCatalog->mutex);
+    pCatalog->pTables = NULL;
+    pCatalog->isInit = 0;
+}
+
+// This function returns position of table in catalog, TABLE is alias of the first table.
+// Catalog mutex must be locked, returns -1 if there is no such table
+int tableSlot(Catalog *pCatalog, const char *pName)
+{
+    int i;
+    for (i = 0; i < pCatalog->nTableCount; i++)
+        if (!strcmp(pCatalog->pTables[i]->sName, pName)) return i;
+
+    return strcmp(pName, TABLE_DEFAULT) ? -1 : 0;
+}
+
+// This function returns position of table in catalog, -1 if there is no such table
+int findTableSlot(Catalog *pCatalog, const char *pName)
+{
+    lockMutex(&pCatalog->mutex);
+    int nSlot = tableSlot(pCatalog, pName);
+    unlockMutex(&pCatalog->mutex);
+    return nSlot;
+}
+
+// This function returns current version of table in catalog position and takes its reference,
+// so the version is not freed by reload until releaseTable() is called
+Database* acquireTable(Catalog *pCatalog, int nSlot)
+{
+    if (nSlot < 0 || nSlot >= pCatalog->nTableCount) return NULL;
+
+    lockMutex(&pCatalog->mutex);
+    Database *pDB = pCatalog->pTables[nSlot];
+    __atomic_add_fetch(&pDB->nRefCount, 1, __ATOMIC_RELAXED);
+    unlockMutex(&pCatalog->mutex);
+    return pDB;
+}
+
+// This function drops reference of table, version replaced by reload is freed by its last user
+void releaseTable(Database *pDB)
+{
+    if (pDB == NULL || __atomic_sub_fetch(&pDB->nRefCount, 1, __ATOMIC_ACQ_REL)) return;
+
+    logToFile(INFO, "Old version of table %s is freed.", pDB->sName);
+    destroyDatabase(pDB);
+    free(pDB);
+}
+
+// This function searches table by name and takes its reference, TABLE is alias of the first table
+Database* findTable(Catalog *pCatalog, const char *pName)
+{
+    lockMutex(&pCatalog->mutex);
+    int nSlot = tableSlot(pCatalog, pName);
+    Database *pDB = nSlot >= 0 ? pCatalog->pTables[nSlot] : NULL;
+    if (pDB != NULL) __atomic_add_fetch(&pDB->nRefCount, 1, __ATOMIC_RELAXED);
+    unlockMutex(&pCatalog->mutex);
+    return pDB;
+}
+
+////////////////////////////////////////////////////////////////////////
+// ORDERING
+////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+    int nColumnID;
+    int nDesc;
+} OrderKey;
+
+typedef struct {
+    OrderKey keys[ORDER_MAX];
+    int nKeyCount;
+    long nLimit; // -1 means no limit
+    long nOffset;
+    Predicate where;
+    int nHasWhere;
+} SelectOptions;
+
+typedef struct {
+    const char *pData;
+    int64_t nValue; // INT and DATE values
+    double fValue;  // DOUBLE values
+    int nLength;
+    int nType;      // Numbers in text column are DOUBLE
+} SortKey;
+
+typedef struct {
+    SortKey *pKeys; // nKeyCount keys for each candidate row
+    OrderKey *pOrder;
+    Database *pDB;
+    QueryContext *pQuery;   // Query of sort, sort threads check its deadline
+    int nKeyCount;
+    int nCancelled;         // Comparisons stop mattering once query is cancelled
+} SortContext;
+
+// Comparisons made by sort thread since its last cancellation check
+static __thread unsigned t_nSortTicks = 0;
+
+typedef struct {
+    SortContext *pCtx;
+    int *pData;
+    int *pTemp;
+    int nStart;
+    int nMiddle;
+    int nEnd;
+    int nNode; // NUMA node of rows in chunk, -1 if rows are not spread
+} SortTask;
+
+// This function finds column with given ID in the row without copying it,
+// returns pointer to the first character and saves trimmed length in pLen
+const char* getField(const char *pRow, int nID, int *pLen)
+{
+    int nCurrentID = 0;
+    while (nCurrentID < nID)
+    {
+        pRow = strchr(pRow, ',');
+        if (pRow == NULL)
+        {
+            *pLen = 0;
+            return NULL;
+        }
+
+        pRow++;
+        nCurrentID++;
+    }
+
+    // Remove spaces from front and back
+    while (*pRow == ' ') pRow++;
+    const char *pEnd = strchr(pRow, ',');
+    int nLen = pEnd != NULL ? (int)(pEnd - pRow) : (int)strlen(pRow);
+    while (nLen > 0 && pRow[nLen - 1] == ' ') nLen--;
+
+    *pLen = nLen;
+    return pRow;
+}
+
+// This function extracts sort key of the row, typed columns give packed values and numbers
+// of text columns are detected here once, so comparisons are cheap while sorting
+void initSortKey(SortKey *pKey, Database *pDB, int nRow, int nColumnID)
+{
+    Column *pCol = &pDB->pColumns[nColumnID];
+    pKey->nType = pCol->nType;
+    pKey->nValue = 0;
+    pKey->fValue = 0;
+
+    if (pCol->nType != TYPE_TEXT)
+    {
+        if (pCol->nType == TYPE_DOUBLE) pKey->fValue = pCol->pDoubles[nRow];
+        else pKey->nValue = pCol->pInts[nRow];
+
+        pKey->pData = "";
+        pKey->nLength = 0;
+        return;
+    }
+
+    pKey->pData = getField(getRow(pDB, nRow)->sData, nColumnID, &pKey->nLength);
+
+    if (pKey->pData == NULL)
+    {
+        pKey->pData = "";
+        return;
+    }
+
+    if (pKey->nLength > 0)
+    {
+        char *pEnd = NULL;
+        pKey->fValue = strtod(pKey->pData, &pEnd);
+        if (pEnd == pKey->pData + pKey->nLength) pKey->nType = TYPE_DOUBLE;
+    }
+}
+
+// This function is called by every comparison of sort, worker checks its query every QUERY_CHECK_ROWS calls.
+// Sort threads have no query of their own, they check deadline of query of the sort and cancel it
+int isSortCancelled(SortContext *pCtx)
+{
+    if (__atomic_load_n(&pCtx->nCancelled, __ATOMIC_RELAXED)) return 1;
+
+    int isCancelled = 0;
+    if (t_pQuery != NULL) isCancelled = isQueryCancelled();
+    else if (pCtx->pQuery != NULL && !(++t_nSortTicks % QUERY_CHECK_ROWS))
+    {
+        isCancelled = __atomic_load_n(&pCtx->pQuery->nCancelled, __ATOMIC_RELAXED) ||
+                      (pCtx->pQuery->nDeadline && monotonicTime() > pCtx->pQuery->nDeadline);
+        if (isCancelled) __atomic_store_n(&pCtx->pQuery->nCancelled, 1, __ATOMIC_RELAXED);
+    }
+
+    if (isCancelled) __atomic_store_n(&pCtx->nCancelled, 1, __ATOMIC_RELAXED);
+    return isCancelled;
+}
+
+// This function compares two candidate rows by ORDER BY keys, numbers and dates are
+// compared by value and placed before text, ties are broken by load order. Keys of
+// one column have the same type, except numbers and words of text column. Cancelled
+// sort compares all rows as equal, so it ends without touching keys anymore
+int compareRows(const void *pA, const void *pB, void *pArg)
+{
+    SortContext *pCtx = (SortContext*)pArg;
+    int nA = *(const int*)pA;
+    int nB = *(const int*)pB;
+    int i;
+
+    if (isSortCancelled(pCtx)) return 0;
+
+    for (i = 0; i < pCtx->nKeyCount; i++)
+    {
+        SortKey *pKeyA = &pCtx->pKeys[nA * pCtx->nKeyCount + i];
+        SortKey *pKeyB = &pCtx->pKeys[nB * pCtx->nKeyCount + i];
+        int nCmp = 0;
+
+        if (pKeyA->nType != pKeyB->nType)
+            nCmp = pKeyA->nType == TYPE_TEXT ? 1 : -1;
+        else if (pKeyA->nType == TYPE_DOUBLE)
+            nCmp = (pKeyA->fValue > pKeyB->fValue) - (pKeyA->fValue < pKeyB->fValue);
+        else if (pKeyA->nType != TYPE_TEXT)
+            nCmp = (pKeyA->nValue > pKeyB->nValue) - (pKeyA->nValue < pKeyB->nValue);
+        else
+        {
+            int nLen = pKeyA->nLength < pKeyB->nLength ? pKeyA->nLength : pKeyB->nLength;
+            nCmp = memcmp(pKeyA->pData, pKeyB->pData, nLen);
+            if (!nCmp) nCmp = pKeyA->nLength - pKeyB->nLength;
+        }
+
+        if (nCmp) return pCtx->pOrder[i].nDesc ? -nCmp : nCmp;
+    }
+
+    return (nA > nB) - (nA < nB);
+}
+
+// Sort thread sorts its own chunk of the array
+void* sortThread(void *pArg)
+{
+    SortTask *pTask = (SortTask*)pArg;
+    pinToNode(&g_topology, pTask->nNode);
+    qsort_r(pTask->pData + pTask->nStart, pTask->nEnd - pTask->nStart, sizeof(int), compareRows, pTask->pCtx);
+    return NULL;
+}
+
+// Merge thread merges two sorted neighbour chunks into one
+void* mergeThread(void *pArg)
+{
+    SortTask *pTask = (SortTask*)pArg;
+    int i = pTask->nStart, j = pTask->nMiddle, k = pTask->nStart;
+
+    while (i < pTask->nMiddle && j < pTask->nEnd)
+    {
+        if (compareRows(&pTask->pData[j], &pTask->pData[i], pTask->pCtx) < 0) pTask->pTemp[k++] = pTask->pData[j++];
+        else pTask->pTemp[k++] = pTask->pData[i++];
+    }
+
+    while (i < pTask->nMiddle) pTask->pTemp[k++] = pTask->pData[i++];
+    while (j < pTask->nEnd) pTask->pTemp[k++] = pTask->pData[j++];
+
+    memcpy(pTask->pData + pTask->nStart, pTask->pTemp + pTask->nStart, sizeof(int) * (pTask->nEnd - pTask->nStart));
+    return NULL;
+}
+
+// This function runs sort tasks in separate threads, if thread
+// can not be created the task is simply executed by the caller
+void runSortTasks(SortTask *pTasks, int nCount, void*(*pFunc)(void*))
+{
+    pthread_t threads[SORT_THREADS_MAX];
+    int nStarted[SORT_THREADS_MAX];
+    int i;
+
+    for (i = 0; i < nCount; i++)
+    {
+        nStarted[i] = !pthread_create(&threads[i], NULL, pFunc, &pTasks[i]);
+        if (!nStarted[i]) pFunc(&pTasks[i]);
+    }
+
+    for (i = 0; i < nCount; i++)
+        if (nStarted[i]) pthread_join(threads[i], NULL);
+}
+
+// This function sorts candidate positions, large inputs are split into chunks
+// which are sorted in parallel and then merged pairwise, also in parallel
+void sortPositions(SortContext *pCtx, int *pData, int nCount)
+{
+    int nThreads = getCpuCount();
+    if (nThreads > SORT_THREADS_MAX) nThreads = SORT_THREADS_MAX;
+
+    if (nCount < PARALLEL_SORT_MIN || nThreads < 2)
+    {
+        qsort_r(pData, nCount, sizeof(int), compareRows, pCtx);
+        return;
+    }
+
+    int *pTemp = queryAlloc(sizeof(int) * nCount);
+
+    // Sort equal chunks
+    SortTask tasks[SORT_THREADS_MAX];
+    int nBounds[SORT_THREADS_MAX + 1];
+    int i;
+
+    for (i = 0; i <= nThreads; i++)
+        nBounds[i] = (int)((long)nCount * i / nThreads);
+
+    for (i = 0; i < nThreads; i++)
+    {
+        tasks[i].pCtx = pCtx;
+        tasks[i].pData = pData;
+        tasks[i].pTemp = pTemp;
+        tasks[i].nStart = nBounds[i];
+        tasks[i].nEnd = nBounds[i + 1];
+
+        // Positions are still in row order here, chunk is sorted on node of its rows
+        tasks[i].nNode = nodeOfRow(pCtx->pDB, (nBounds[i] + nBounds[i + 1]) / 2);
+    }
+
+    runSortTasks(tasks, nThreads, sortThread);
+
+    // Merge sorted chunks pairwise until one chunk is left
+    int nChunks = nThreads;
+    while (nChunks > 1)
+    {
+        int nTasks = 0, nNext = 0;
+        for (i = 0; i + 1 < nChunks; i += 2)
+        {
+            SortTask *pTask = &tasks[nTasks++];
+            pTask->nStart = nBounds[i];
+            pTask->nMiddle = nBounds[i + 1];
+            pTask->nEnd = nBounds[i + 2];
+            pTask->nNode = -1;
+            nBounds[nNext++] = nBounds[i];
+        }
+
+        // Odd chunk is moved to next round as it is
+        if (nChunks % 2) nBounds[nNext++] = nBounds[nChunks - 1];
+        nBounds[nNext] = nCount;
+
+        // Order of cancelled query is not used, so chunks are not merged anymore
+        if (__atomic_load_n(&pCtx->nCancelled, __ATOMIC_RELAXED)) break;
+
+        runSortTasks(tasks, nTasks, mergeThread);
+        nChunks = nNext;
+    }
+
+    queryFree(pTemp);
+}
+
+// This function moves heap element down until heap property is restored,
+// heap root is always the worst candidate which is kept in the heap
+void heapSiftDown(SortContext *pCtx, int *pHeap, int nSize, int nPos)
+{
+    while (1)
+    {
+        int nLeft = nPos * 2 + 1;
+        int nRight = nLeft + 1;
+        int nLargest = nPos;
+
+        if (nLeft < nSize && compareRows(&pHeap[nLeft], &pHeap[nLargest], pCtx) > 0) nLargest = nLeft;
+        if (nRight < nSize && compareRows(&pHeap[nRight], &pHeap[nLargest], pCtx) > 0) nLargest = nRight;
+        if (nLargest == nPos) break;
+
+        int nTemp = pHeap[nPos];
+        pHeap[nPos] = pHeap[nLargest];
+        pHeap[nLargest] = nTemp;
+        nPos = nLargest;
+    }
+}
+
+// This function selects first K candidates with bounded heap and sorts them,
+// so small LIMIT does not need to sort all rows of the database
+int selectTopK(SortContext *pCtx, int *pHeap, int nCount, int nK)
+{
+    int i, nSize = 0;
+    if (nK <= 0) return 0;
+
+    for (i = 0; i < nCount && !isSortCancelled(pCtx); i++)
+    {
+        if (nSize < nK)
+        {
+            pHeap[nSize++] = i;
+            if (nSize == nK)
+            {
+                // Heapify once heap is full
+                int j;
+                for (j = nSize / 2 - 1; j >= 0; j--)
+                    heapSiftDown(pCtx, pHeap, nSize, j);
+            }
+        }
+        else if (compareRows(&i, &pHeap[0], pCtx) < 0)
+        {
+            // Replace worst candidate
+            pHeap[0] = i;
+            heapSiftDown(pCtx, pHeap, nSize, 0);
+        }
+    }
+
+    qsort_r(pHeap, nSize, sizeof(int), compareRows, pCtx);
+    return nSize;
+}
+
+typedef struct {
+    Database *pDB;
+    SelectOptions *pOpts;
+    SortKey *pKeys;
+    int nNode;
+} ExtractTask;
+
+// This function extracts sort keys of positions in range, position is row itself unless candidate rows are given
+void extractSortKeys(Database *pDB, SelectOptions *pOpts, SortKey *pKeys, int *pRows, int nStart, int nEnd)
+{
+    int i, j;
+    for (i = nStart; i < nEnd; i++)
+    {
+        for (j = 0; j < pOpts->nKeyCount; j++)
+            initSortKey(&pKeys[i * pOpts->nKeyCount + j], pDB, pRows != NULL ? pRows[i] : i, pOpts->keys[j].nColumnID);
+    }
+}
+
+// Extract thread scans rows of single NUMA node on that node
+void* extractThread(void *pArg)
+{
+    ExtractTask *pTask = (ExtractTask*)pArg;
+    pinToNode(&g_topology, pTask->nNode);
+    extractSortKeys(pTask->pDB, pTask->pOpts, pTask->pKeys, NULL,
+                    pTask->pDB->nNodeRows[pTask->nNode], pTask->pDB->nNodeRows[pTask->nNode + 1]);
+    return NULL;
+}
+
+// This function extracts sort keys of rows spread over NUMA nodes, every node is scanned by its own thread
+void extractNodeSortKeys(Database *pDB, SelectOptions *pOpts, SortKey *pKeys)
+{
+    ExtractTask tasks[NUMA_NODES_MAX];
+    pthread_t threads[NUMA_NODES_MAX];
+    int nStarted[NUMA_NODES_MAX];
+    int i;
+
+    for (i = 0; i < pDB->nNodeCount; i++)
+    {
+        tasks[i].pDB = pDB;
+        tasks[i].pOpts = pOpts;
+        tasks[i].pKeys = pKeys;
+        tasks[i].nNode = i;
+        nStarted[i] = !pthread_create(&threads[i], NULL, extractThread, &tasks[i]);
+        if (!nStarted[i]) extractThread(&tasks[i]);
+    }
+
+    for (i = 0; i < pDB->nNodeCount; i++)
+        if (nStarted[i]) pthread_join(threads[i], NULL);
+
+    // Rows appended after placement do not belong to any node
+    int nPlaced = pDB->nNodeRows[pDB->nNodeCount];
+    if (nPlaced < pDB->nRowCount) extractSortKeys(pDB, pOpts, pKeys, NULL, nPlaced, pDB->nRowCount);
+}
+
+// This function orders candidate rows according to select options, all rows are ordered if pRows is NULL.
+// Returns ordered row IDs which must be freed by caller with queryFree() and count in pCount
+int* orderRows(Database *pDB, SelectOptions *pOpts, int nDistinct, int *pRows, int nRows, int *pCount)
+{
+    int *pOrder = queryAlloc(sizeof(int) * (nRows ? nRows : 1));
+    SortKey *pKeys = queryAlloc(sizeof(SortKey) * pOpts->nKeyCount * (nRows ? nRows : 1));
+
+    int i;
+    if (pDB->nNodeCount > 1 && pRows == NULL) extractNodeSortKeys(pDB, pOpts, pKeys);
+    else
+    {
+        for (i = 0; i < nRows && !isQueryCancelled(); i++)
+            extractSortKeys(pDB, pOpts, pKeys, pRows, i, i + 1);
+    }
+
+    // Keys are not sorted at all if query is cancelled
+    if (isQueryCancelled())
+    {
+        queryFree(pKeys);
+        *pCount = 0;
+        return pOrder;
+    }
+
+    SortContext ctx;
+    ctx.pKeys = pKeys;
+    ctx.pOrder = pOpts->keys;
+    ctx.pDB = pDB;
+    ctx.pQuery = t_pQuery;
+    ctx.nKeyCount = pOpts->nKeyCount;
+    ctx.nCancelled = 0;
+
+    // Top-K can not be used with DISTINCT, duplicates would take the heap slots
+    long nWanted = pOpts->nLimit < 0 ? -1 : pOpts->nOffset + pOpts->nLimit;
+    if (!nDistinct && nWanted >= 0 && nWanted <= TOPK_MAX && nWanted < nRows)
+    {
+        *pCount = selectTopK(&ctx, pOrder, nRows, (int)nWanted);
+    }
+    else
+    {
+        for (i = 0; i < nRows; i++) pOrder[i] = i;
+        sortPositions(&ctx, pOrder, nRows);
+        *pCount = nRows;
+    }
+
+    // Order of cancelled sort is not valid, no row is returned
+    if (ctx.nCancelled) *pCount = 0;
+
+    // Ordered positions are translated back into rows
+    for (i = 0; pRows != NULL && i < *pCount; i++) pOrder[i] = pRows[pOrder[i]];
+
+    queryFree(pKeys);
+    return pOrder;
+}
+
+////////////////////////////////////////////////////////////////////////
+// EXPRESSION VM
+////////////////////////////////////////////////////////////////////////
+
+// Instruction of expression VM, registers hold values of all rows of batch
+typedef struct {
+    int nOp;    // VM_* opcode
+    int nArg;   // PRED_* bits of comparison or symbol of arithmetic
+    int nDst;   // Register of result
+    int nA;     // Register, column of load and column opcodes
+    int nB;     // Register, constant of constant opcodes
+} Instruction;
+
+// Constant of program, text constants point into query text kept by plan
+typedef struct {
+    TypedValue value;   // Boolean constant is 0 or 1 in nValue
+    const char *pText;
+    int nLength;
+} VmConstant;
+
+// Compiled expression, its value for every row of batch is in register nResult
+typedef struct {
+    Instruction *pCode;
+    int nCodeCount;
+    int nResult;
+    int nType;  // TYPE_* type of result
+} Program;
+
+// Register of VM, values are either read in place from column or written into buffer of register
+typedef struct {
+    void *pValues;      // int64_t, double, const char* or uint8_t values by type of register
+    int *pLengths;      // Lengths of text values
+    void *pBuffer;      // Room for VM_BATCH_ROWS values of 8 bytes
+    int *pLengthBuffer;
+} Register;
+
+// State of VM which evaluates programs of plan over batches of rows
+typedef struct {
+    Database *pDB;
+    VmConstant *pConsts;
+    Register *pRegs;
+    int64_t *pScratch;  // Values of column gathered by column opcodes
+    const int *pRows;   // Rows of batch, NULL if batch is rows nStart .. nStart + nCount - 1
+    int nStart;
+    int nCount;
+    int nBatches;       // Batches evaluated, they are added to statistics when VM is freed
+} Vm;
+
+// This function allocates registers of VM from temporaries of query, VM must be freed by freeVm()
+void initVm(Vm *pVm, Database *pDB, VmConstant *pConsts, int nRegisterCount)
+{
+    size_t nValues = sizeof(int64_t) * VM_BATCH_ROWS;
+    size_t nLengths = sizeof(int) * VM_BATCH_ROWS;
+    char *pMemory = queryAlloc(sizeof(Register) * nRegisterCount + (nValues + nLengths) * nRegisterCount + nValues);
+    int i;
+
+    pVm->pDB = pDB;
+    pVm->pConsts = pConsts;
+    pVm->pRegs = (Register*)pMemory;
+    pMemory += sizeof(Register) * nRegisterCount;
+
+    for (i = 0; i < nRegisterCount; i++)
+    {
+        Register *pReg = &pVm->pRegs[i];
+        pReg->pValues = pReg->pBuffer = pMemory;
+        pReg->pLengths = pReg->pLengthBuffer = (int*)(pMemory + nValues);
+        pMemory += nValues + nLengths;
+    }
+
+    pVm->pScratch = (int64_t*)pMemory;
+    pVm->pRows = NULL;
+    pVm->nStart = 0;
+    pVm->nCount = 0;
+    pVm->nBatches = 0;
+}
+
+// This function frees registers of VM, its batches are counted in statistics at once
+void freeVm(Vm *pVm)
+{
+    if (pVm->nBatches) __atomic_fetch_add(&g_stats.nVmBatches, pVm->nBatches, __ATOMIC_RELAXED);
+    queryFree(pVm->pRegs);
+}
+
+// This function sets rows which the next programs are evaluated for, at most VM_BATCH_ROWS rows.
+// Rows are taken from pRows, or they are nCount rows from nStart if pRows is NULL
+void setVmBatch(Vm *pVm, const int *pRows, int nStart, int nCount)
+{
+    pVm->pRows = pRows;
+    pVm->nStart = nStart;
+    pVm->nCount = nCount;
+    pVm->nBatches++;
+}
+
+// This function returns packed values of typed column for rows of batch. Consecutive rows are read
+// in place, other rows are gathered into buffer. DOUBLE values are copied by their bits too
+int64_t* batchColumn(Vm *pVm, Column *pCol, int64_t *pBuffer)
+{
+    if (pVm->pRows == NULL) return pCol->pInts + pVm->nStart;
+
+    int i;
+    for (i = 0; i < pVm->nCount; i++) pBuffer[i] = pCol->pInts[pVm->pRows[i]];
+    return pBuffer;
+}
+
+// This function returns comparison bit of two texts, it is one of PRED_LESS, PRED_EQUAL and PRED_GREATER
+int compareTextBit(const char *pA, int nA, const char *pB, int nB)
+{
+    int nCmp = memcmp(pA, pB, nA < nB ? nA : nB);
+    if (!nCmp) nCmp = nA - nB;
+    return COMPARE_BIT(nCmp, 0);
+}
+
+// This function runs program for rows of batch. Every instruction loops over whole batch, so opcode is
+// dispatched once per batch. Results are written over registers of operands, value of row is read before
+// result of the row is written and boolean results never reach values of following rows
+void runProgram(Vm *pVm, Program *pProg)
+{
+    Database *pDB = pVm->pDB;
+    int i, k, n = pVm->nCount;
+
+    for (k = 0; k < pProg->nCodeCount; k++)
+    {
+        Instruction *pIns = &pProg->pCode[k];
+        Register *pDst = &pVm->pRegs[pIns->nDst];
+        int nArg = pIns->nArg;
+
+        int64_t *pInts = pDst->pBuffer;
+        double *pDoubles = pDst->pBuffer;
+        uint8_t *pBools = pDst->pBuffer;
+        const char **pTexts = pDst->pBuffer;
+
+        switch (pIns->nOp)
+        {
+        case VM_LOAD_PACKED:
+            pDst->pValues = batchColumn(pVm, &pDB->pColumns[pIns->nA], pDst->pBuffer);
+            continue;
+
+        case VM_LOAD_TEXT:
+            for (i = 0; i < n; i++)
+            {
+                int nRow = pVm->pRows != NULL ? pVm->pRows[i] : pVm->nStart + i;
+                pTexts[i] = getField(getRow(pDB, nRow)->sData, pIns->nA, &pDst->pLengthBuffer[i]);
+                if (pTexts[i] == NULL) pDst->pLengthBuffer[i] = 0;
+            }
+            break;
+
+        case VM_CONST_INT:
+            for (i = 0; i < n; i++) pInts[i] = pVm->pConsts[pIns->nB].value.nValue;
+            break;
+
+        case VM_CONST_DOUBLE:
+            for (i = 0; i < n; i++) pDoubles[i] = pVm->pConsts[pIns->nB].value.fValue;
+            break;
+
+        case VM_CONST_TEXT:
+            for (i = 0; i < n; i++)
+            {
+                pTexts[i] = pVm->pConsts[pIns->nB].pText;
+                pDst->pLengthBuffer[i] = pVm->pConsts[pIns->nB].nLength;
+            }
+            break;
+
+        case VM_CONST_BOOL:
+            memset(pBools, (int)pVm->pConsts[pIns->nB].value.nValue, n);
+            break;
+
+        case VM_TO_DOUBLE:
+        {
+            const int64_t *pA = pVm->pRegs[pIns->nA].pValues;
+            for (i = 0; i < n; i++) pDoubles[i] = (double)pA[i];
+            break;
+        }
+
+        case VM_ARITH_INT:
+        {
+            // Overflow wraps around, division by zero gives zero
+            const int64_t *pA = pVm->pRegs[pIns->nA].pValues;
+            const int64_t *pB = pVm->pRegs[pIns->nB].pValues;
+            if (nArg == '+') for (i = 0; i < n; i++) pInts[i] = (int64_t)((uint64_t)pA[i] + (uint64_t)pB[i]);
+            else if (nArg == '-') for (i = 0; i < n; i++) pInts[i] = (int64_t)((uint64_t)pA[i] - (uint64_t)pB[i]);
+            else if (nArg == '*') for (i = 0; i < n; i++) pInts[i] = (int64_t)((uint64_t)pA[i] * (uint64_t)pB[i]);
+            else for (i = 0; i < n; i++) pInts[i] = pB[i] == 0 ? 0 : pB[i] == -1 ? (int64_t)(0 - (uint64_t)pA[i]) : pA[i] / pB[i];
+            break;
+        }
+
+        case VM_ARITH_DOUBLE:
+        {
+            const double *pA = pVm->pRegs[pIns->nA].pValues;
+            const double *pB = pVm->pRegs[pIns->nB].pValues;
+            if (nArg == '+') for (i = 0; i < n; i++) pDoubles[i] = pA[i] + pB[i];
+            else if (nArg == '-') for (i = 0; i < n; i++) pDoubles[i] = pA[i] - pB[i];
+            else if (nArg == '*') for (i = 0; i < n; i++) pDoubles[i] = pA[i] * pB[i];
+            else for (i = 0; i < n; i++) pDoubles[i] = pB[i] != 0 ? pA[i] / pB[i] : 0;
+            break;
+        }
+
+        case VM_CMP_INT:
+        {
+            const int64_t *pA = pVm->pRegs[pIns->nA].pValues;
+            const int64_t *pB = pVm->pRegs[pIns->nB].pValues;
+            for (i = 0; i < n; i++) pBools[i] = !!(nArg & COMPARE_BIT(pA[i], pB[i]));
+            break;
+        }
+
+        case VM_CMP_DOUBLE:
+        {
+            const double *pA = pVm->pRegs[pIns->nA].pValues;
+            const double *pB = pVm->pRegs[pIns->nB].pValues;
+            for (i = 0; i < n; i++) pBools[i] = !!(nArg & COMPARE_BIT(pA[i], pB[i]));
+            break;
+        }
+
+        case VM_CMP_TEXT:
+        {
+            // NULL is not comparable
+            Register *pA = &pVm->pRegs[pIns->nA], *pB = &pVm->pRegs[pIns->nB];
+            const char **pTextsA = pA->pValues, **pTextsB = pB->pValues;
+            for (i = 0; i < n; i++)
+            {
+                int nA = pA->pLengths[i], nB = pB->pLengths[i];
+                pBools[i] = nA && nB && (nArg & compareTextBit(pTextsA[i], nA, pTextsB[i], nB));
+            }
+            break;
+        }
+
+        case VM_CMP_INT_CONST:
+        case VM_CMP_COLUMN_INT:
+        {
+            const int64_t *pA = pIns->nOp == VM_CMP_INT_CONST ? pVm->pRegs[pIns->nA].pValues :
+                                batchColumn(pVm, &pDB->pColumns[pIns->nA], pVm->pScratch);
+            int64_t nValue = pVm->pConsts[pIns->nB].value.nValue;
+            for (i = 0; i < n; i++) pBools[i] = !!(nArg & COMPARE_BIT(pA[i], nValue));
+            break;
+        }
+
+        case VM_CMP_DOUBLE_CONST:
+        case VM_CMP_COLUMN_DOUBLE:
+        {
+            const double *pA = pIns->nOp == VM_CMP_DOUBLE_CONST ? pVm->pRegs[pIns->nA].pValues :
+                               (double*)batchColumn(pVm, &pDB->pColumns[pIns->nA], pVm->pScratch);
+            double fValue = pVm->pConsts[pIns->nB].value.fValue;
+            for (i = 0; i < n; i++) pBools[i] = !!(nArg & COMPARE_BIT(pA[i], fValue));
+            break;
+        }
+
+        case VM_CMP_TEXT_CONST:
+        {
+            // Empty constant is less than every value, like in matchText()
+            Register *pA = &pVm->pRegs[pIns->nA];
+            const char **pTextsA = pA->pValues;
+            VmConstant *pConst = &pVm->pConsts[pIns->nB];
+            for (i = 0; i < n; i++)
+            {
+                int nA = pA->pLengths[i];
+                pBools[i] = nA && (nArg & compareTextBit(pTextsA[i], nA, pConst->pText, pConst->nLength));
+            }
+            break;
+        }
+
+        case VM_CMP_COLUMN_TEXT:
+        {
+            VmConstant *pConst = &pVm->pConsts[pIns->nB];
+            for (i = 0; i < n; i++)
+            {
+                int nRow = pVm->pRows != NULL ? pVm->pRows[i] : pVm->nStart + i;
+                int nLen = 0;
+                const char *pField = getField(getRow(pDB, nRow)->sData, pIns->nA, &nLen);
+                if (pField == NULL) nLen = 0;
+                pBools[i] = nLen && (nArg & compareTextBit(pField, nLen, pConst->pText, pConst->nLength));
+            }
+            break;
+        }
+
+        case VM_IS_NULL:
+        {
+            const int *pLengths = pVm->pRegs[pIns->nA].pLengths;
+            for (i = 0; i < n; i++) pBools[i] = !!(nArg & (pLengths[i] ? PRED_NOT_NULL : PRED_IS_NULL));
+            break;
+        }
+
+        case VM_AND:
+        case VM_OR:
+        {
+            const uint8_t *pA = pVm->pRegs[pIns->nA].pValues;
+            const uint8_t *pB = pVm->pRegs[pIns->nB].pValues;
+            if (pIns->nOp == VM_AND) for (i = 0; i < n; i++) pBools[i] = pA[i] & pB[i];
+            else for (i = 0; i < n; i++) pBools[i] = pA[i] | pB[i];
+            break;
+        }
+
+        case VM_NOT:
+        {
+            const uint8_t *pA = pVm->pRegs[pIns->nA].pValues;
+            for (i = 0; i < n; i++) pBools[i] = !pA[i];
+            break;
+        }
+        }
+
+        pDst->pValues = pDst->pBuffer;
+        pDst->pLengths = pDst->pLengthBuffer;
+    }
+}
+
+// This function formats INT or DOUBLE value for CSV row, doubles keep 15 digits so decimal values do not get noise digits
+void formatNumber(char *pDst, int nSize, int nType, int64_t nValue, double fValue)
+{
+    if (nType == TYPE_DOUBLE) snprintf(pDst, nSize, "%.15g", fValue);
+    else snprintf(pDst, nSize, "%lld", (long long)nValue);
+}
+
+// This function formats value which program computed for row i of batch, it is written into CSV row
+void formatResult(Vm *pVm, Program *pProg, int i, char *pDst, int nSize)
+{
+    Register *pReg = &pVm->pRegs[pProg->nResult];
+    if (pProg->nType == TYPE_TEXT) snprintf(pDst, nSize, "%.*s", pReg->pLengths[i], ((const char**)pReg->pValues)[i]);
+    else formatNumber(pDst, nSize, pProg->nType, ((int64_t*)pReg->pValues)[i], ((double*)pReg->pValues)[i]);
+}
+
+// This function finds rows which satisfy WHERE program and saves their positions in pRows, at most nLimit
+// rows are found unless nLimit is negative. Program is evaluated for VM_BATCH_ROWS consecutive rows at once,
+// blocks whose rows are all deleted are skipped
+int filterProgram(Database *pDB, Program *pProg, VmConstant *pConsts, int nRegisterCount, int *pRows, int nLimit)
+{
+    Vm vm;
+    initVm(&vm, pDB, pConsts, nRegisterCount);
+    int i, nStart, nCount = 0, nScanned = 0, nSkipped = 0;
+
+    for (nStart = 0; nStart < pDB->nRowCount; nStart += VM_BATCH_ROWS)
+    {
+        if (nLimit >= 0 && nCount >= nLimit) break;
+
+        int nZone = nStart / ZONE_ROWS;
+        int nDeleted = pDB->pChunkDeleted[nZone];
+        if (nStart % ZONE_ROWS == 0)
+        {
+            if (isBlockCancelled()) break;
+            if (nDeleted == zoneRowCount(pDB, nZone))
+            {
+                nSkipped++;
+                nStart += ZONE_ROWS - VM_BATCH_ROWS;
+                continue;
+            }
+
+            nScanned++;
+        }
+
+        int nRows = pDB->nRowCount - nStart < VM_BATCH_ROWS ? pDB->nRowCount - nStart : VM_BATCH_ROWS;
+        setVmBatch(&vm, NULL, nStart, nRows);
+        runProgram(&vm, pProg);
+
+        const uint8_t *pMatches = vm.pRegs[pProg->nResult].pValues;
+        for (i = 0; i < nRows; i++)
+        {
+            pRows[nCount] = nStart + i;
+            nCount += pMatches[i] && (!nDeleted || !isRowDeleted(pDB, nStart + i));
+        }
+    }
+
+    freeVm(&vm);
+    __atomic_fetch_add(&g_stats.nZonesScanned, nScanned, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&g_stats.nZonesSkipped, nSkipped, __ATOMIC_RELAXED);
+    return nLimit >= 0 && nCount > nLimit ? nLimit : nCount;
+}
+
+////////////////////////////////////////////////////////////////////////
+// QUERY PLANS
+////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+    char sValue[DATA_MAX];
+    int nColumnID;
+    Program expr;   // Value computed for every row, code is empty if sValue is value of all rows
+} UpdateSet;
+
+// Token of query, its text points into query which is not modified by parser
+typedef struct {
+    const char *pText;
+    int nLength;
+    int nType;  // TOKEN_* type
+    int nOp;    // PRED_* bits of operator token
+} Token;
+
+// Node of expression, leaf is column or value and other nodes are operators of their operands.
+// Right operand of IS NULL and NOT is NULL
+typedef struct AstExpr {
+    int nKind;      // EXPR_* kind
+    int nOp;        // PRED_* bits of comparison or symbol of arithmetic
+    Token *pToken;  // Column or value of leaf
+    struct AstExpr *pLeft;
+    struct AstExpr *pRight;
+} AstExpr;
+
+// Assignment "column = expression" of UPDATE query
+typedef struct {
+    Token *pColumn;
+    AstExpr *pValue;
+} AstAssignment;
+
+typedef struct {
+    Token *pColumn;
+    int nDesc;
+} AstOrderKey;
+
+// Syntax tree of SELECT, UPDATE or DELETE query, names are resolved when it is lowered into plan
+typedef struct {
+    int nType;              // STATEMENT_* type
+    int isDistinct;
+    int isStar;             // Whole rows are selected
+    Token *pTable;          // Table of query, NULL if SELECT has no FROM clause and reads the first table
+    Token **pColumns;       // Selected columns, array has room for every token
+    int nColumnCount;
+    AstAssignment *pSets;   // Assignments of UPDATE, array has room for every token
+    int nSetCount;
+    AstExpr *pNodes;        // Nodes of expressions, array has room for every token
+    int nNodeCount;
+    AstExpr *pWhere;
+    int hasWhere;
+    AstOrderKey order[ORDER_MAX];
+    int nOrderCount;
+    long nLimit;            // -1 means no limit
+    long nOffset;
+    int nFromPos;           // Token behind select list
+    int nTailPos;           // Token behind FROM and WHERE clauses of SELECT, ORDER BY, LIMIT and OFFSET follow it
+} AstQuery;
+
+// State of recursive descent parser, position of the next token. Every node of expression takes
+// its own token, so node array with room for every token can not overflow
+typedef struct {
+    Token *pTokens;
+    int nPos;
+    AstExpr *pNodes;
+    int nNodeCount;
+    int nDepth;     // Nesting of parentheses
+} Parser;
+
+// Physical plan of query, it is bound to columns of its table. Operators run in order of nOps,
+// their parameters are kept in plan so it can be executed again without parsing
+typedef struct {
+    int nType;              // STATEMENT_* type
+    int nOps[PLAN_OPS_MAX]; // PLAN_* operators
+    int nOpCount;
+    SelectOptions options;  // Parameters of filter, sort and limit
+    long nScanLimit;        // Rows after which scan and filter stop, -1 if all rows are needed
+    int *pColumnIDs;        // Projected columns, NULL projects whole rows
+    int nColumnCount;
+    int isDistinct;
+    UpdateSet *pSets;       // New values of UPDATE
+    int nSetCount;
+    int nSetPrograms;       // Sets whose values are computed for every row
+    Program filter;         // WHERE program, its code is empty if options.where is the filter
+    VmConstant *pConsts;    // Constants of programs
+    int nRegisterCount;     // Registers of VM used by programs
+    char *pQuery;           // Text of query, it is the key of cached plan
+    char *pHeader;          // Columns of table which plan is bound to
+    int *pColumnTypes;      // Types of columns which opcodes of programs are specialized to
+    int nTypeCount;
+    unsigned long nSchemaEpoch; // Schema epoch of table when plan was compiled
+    uint32_t nHash;         // Hash of query text
+    int isCached;
+    int isHeap;             // Plan is allocated from heap, otherwise from arena of query
+} Plan;
+
+// Plans cached by worker thread, slot of plan is chosen by hash of query text
+typedef struct {
+    Plan *pPlans[PLAN_CACHE_SIZE];
+} PlanCache;
+
+// Plan cache of worker thread, other threads compile every query
+static __thread PlanCache *t_pPlans = NULL;
+
+// This function splits query into tokens in single pass, token array must have room for length of query plus one
+// tokens. Whitespace separates tokens, quoted value keeps everything up to the closing quote. Arithmetic + - and /
+// are symbols only if they stand alone, so bare values like -1.5 or 2019-01-01 stay whole. Last token is
+// TOKEN_END. Returns count of tokens before it, -1 if quote is not closed or operator is unknown
+int tokenizeQuery(const char *pQuery, Token *pTokens)
+{
+    static const struct { const char *pName; int nOp; } ops[] = {
+        { "<=", PRED_LESS | PRED_EQUAL }, { ">=", PRED_GREATER | PRED_EQUAL },
+        { "<>", PRED_LESS | PRED_GREATER }, { "!=", PRED_LESS | PRED_GREATER },
+        { "<", PRED_LESS }, { ">", PRED_GREATER }, { "=", PRED_EQUAL } };
+    int i, nOpCount = sizeof(ops) / sizeof(ops[0]);
+    int nCount = 0;
+    const char *ptr = pQuery;
+
+    while (1)
+    {
+        while (*ptr == ' ' || *ptr == '\t' || *ptr == '\r' || *ptr == '\n') ptr++;
+
+        Token *pTok = &pTokens[nCount];
+        pTok->pText = ptr;
+        pTok->nLength = 0;
+        pTok->nOp = 0;
+
+        if (*ptr == '\0')
+        {
+            pTok->nType = TOKEN_END;
+            return nCount;
+        }
+
+        if (*ptr == '\'')
+        {
+            const char *pEnd = strchr(ptr + 1, '\'');
+            if (pEnd == NULL) return -1;
+
+            pTok->nType = TOKEN_STRING;
+            pTok->pText = ptr + 1;
+            pTok->nLength = pEnd - ptr - 1;
+            ptr = pEnd + 1;
+        }
+        else if (strchr("<>=!", *ptr) != NULL)
+        {
+            for (i = 0; i < nOpCount; i++)
+                if (!strncmp(ptr, ops[i].pName, strlen(ops[i].pName))) break;
+
+            if (i == nOpCount) return -1;
+            pTok->nType = TOKEN_OPERATOR;
+            pTok->nLength = strlen(ops[i].pName);
+            pTok->nOp = ops[i].nOp;
+            ptr += pTok->nLength;
+        }
+        else if (strchr(",;()*", *ptr) != NULL || (strchr("+-/", *ptr) != NULL && strchr(" \t\r\n('", ptr[1]) != NULL))
+        {
+            pTok->nType = TOKEN_SYMBOL;
+            pTok->nLength = 1;
+            ptr++;
+        }
+        else
+        {
+            // Names, keywords and bare values like 2019-01-01 or -1.5 end at separator
+            pTok->nType = TOKEN_WORD;
+            pTok->nLength = strcspn(ptr, " \t\r\n',;()*<>=!");
+            ptr += pTok->nLength;
+        }
+
+        nCount++;
+    }
+}
+
+// This function returns 1 if token is the keyword, keywords are upper case
+int isKeyword(Token *pTok, const char *pWord)
+{
+    int nLength = strlen(pWord);
+    return pTok->nType == TOKEN_WORD && pTok->nLength == nLength && !strncmp(pTok->pText, pWord, nLength);
+}
+
+// This function moves parser behind the keyword, 0 is returned if the next token is not the keyword
+int acceptKeyword(Parser *pParser, const char *pWord)
+{
+    if (!isKeyword(&pParser->pTokens[pParser->nPos], pWord)) return 0;
+    pParser->nPos++;
+    return 1;
+}
+
+// This function moves parser behind the symbol, 0 is returned if the next token is not the symbol
+int acceptSymbol(Parser *pParser, char nSymbol)
+{
+    Token *pTok = &pParser->pTokens[pParser->nPos];
+    if (pTok->nType != TOKEN_SYMBOL || *pTok->pText != nSymbol) return 0;
+    pParser->nPos++;
+    return 1;
+}
+
+// This function takes name of table or column, NULL is returned if the next token is not a word
+Token* acceptName(Parser *pParser)
+{
+    Token *pTok = &pParser->pTokens[pParser->nPos];
+    if (pTok->nType != TOKEN_WORD) return NULL;
+    pParser->nPos++;
+    return pTok;
+}
+
+// This function takes quoted or bare value, NULL is returned if the next token is not a value
+Token* acceptValue(Parser *pParser)
+{
+    Token *pTok = &pParser->pTokens[pParser->nPos];
+    if (pTok->nType != TOKEN_WORD && pTok->nType != TOKEN_STRING) return NULL;
+    pParser->nPos++;
+    return pTok;
+}
+
+// This function parses non-negative count of LIMIT or OFFSET clause
+int parseCount(Parser *pParser, long *pCount)
+{
+    Token *pTok = acceptName(pParser);
+    char sNumber[32];
+    if (pTok == NULL || pTok->nLength >= (int)sizeof(sNumber)) return 0;
+
+    memcpy(sNumber, pTok->pText, pTok->nLength);
+    sNumber[pTok->nLength] = '\0';
+
+    char *pEnd = NULL;
+    *pCount = strtol(sNumber, &pEnd, 10);
+    return *pEnd == '\0' && *pCount >= 0;
+}
+
+// This function returns new node of expression
+AstExpr* newExpr(Parser *pParser, int nKind, int nOp, Token *pToken, AstExpr *pLeft, AstExpr *pRight)
+{
+    AstExpr *pExpr = &pParser->pNodes[pParser->nNodeCount++];
+    pExpr->nKind = nKind;
+    pExpr->nOp = nOp;
+    pExpr->pToken = pToken;
+    pExpr->pLeft = pLeft;
+    pExpr->pRight = pRight;
+    return pExpr;
+}
+
+AstExpr* parseExpression(Parser *pParser);
+
+// This function parses column, value or expression in parentheses
+AstExpr* parseAtom(Parser *pParser)
+{
+    if (acceptSymbol(pParser, '('))
+    {
+        if (++pParser->nDepth > EXPR_DEPTH_MAX) return NULL;
+
+        AstExpr *pExpr = parseExpression(pParser);
+        pParser->nDepth--;
+        return pExpr != NULL && acceptSymbol(pParser, ')') ? pExpr : NULL;
+    }
+
+    Token *pTok = acceptValue(pParser);
+    return pTok != NULL ? newExpr(pParser, EXPR_VALUE, 0, pTok, NULL, NULL) : NULL;
+}
+
+// This function parses products and quotients, operators of the same level are applied from left to right
+AstExpr* parseProduct(Parser *pParser)
+{
+    AstExpr *pExpr = parseAtom(pParser);
+    while (pExpr != NULL)
+    {
+        Token *pTok = &pParser->pTokens[pParser->nPos];
+        if (!acceptSymbol(pParser, '*') && !acceptSymbol(pParser, '/')) break;
+
+        AstExpr *pRight = parseAtom(pParser);
+        pExpr = pRight != NULL ? newExpr(pParser, EXPR_ARITHMETIC, *pTok->pText, pTok, pExpr, pRight) : NULL;
+    }
+
+    return pExpr;
+}
+
+// This function parses sums and differences
+AstExpr* parseSum(Parser *pParser)
+{
+    AstExpr *pExpr = parseProduct(pParser);
+    while (pExpr != NULL)
+    {
+        Token *pTok = &pParser->pTokens[pParser->nPos];
+        if (!acceptSymbol(pParser, '+') && !acceptSymbol(pParser, '-')) break;
+
+        AstExpr *pRight = parseProduct(pParser);
+        pExpr = pRight != NULL ? newExpr(pParser, EXPR_ARITHMETIC, *pTok->pText, pTok, pExpr, pRight) : NULL;
+    }
+
+    return pExpr;
+}
+
+// This function parses comparison like "price >= '100'", "qty * 2 < stock" or "name IS NOT NULL".
+// Operators are =, !=, <>, <, <=, > and >=, operand without operator is returned as it is
+AstExpr* parseComparison(Parser *pParser)
+{
+    AstExpr *pLeft = parseSum(pParser);
+    if (pLeft == NULL) return NULL;
+
+    Token *pTok = &pParser->pTokens[pParser->nPos];
+    if (acceptKeyword(pParser, "IS"))
+    {
+        int nOp = acceptKeyword(pParser, "NOT") ? PRED_NOT_NULL : PRED_IS_NULL;
+        return acceptKeyword(pParser, "NULL") ? newExpr(pParser, EXPR_IS_NULL, nOp, pTok, pLeft, NULL) : NULL;
+    }
+
+    if (pTok->nType != TOKEN_OPERATOR) return pLeft;
+    pParser->nPos++;
+
+    AstExpr *pRight = parseSum(pParser);
+    return pRight != NULL ? newExpr(pParser, EXPR_COMPARE, pTok->nOp, pTok, pLeft, pRight) : NULL;
+}
+
+AstExpr* parseNot(Parser *pParser)
+{
+    Token *pTok = &pParser->pTokens[pParser->nPos];
+    if (!acceptKeyword(pParser, "NOT")) return parseComparison(pParser);
+
+    AstExpr *pExpr = parseNot(pParser);
+    return pExpr != NULL ? newExpr(pParser, EXPR_NOT, 0, pTok, pExpr, NULL) : NULL;
+}
+
+AstExpr* parseAnd(Parser *pParser)
+{
+    AstExpr *pExpr = parseNot(pParser);
+    while (pExpr != NULL)
+    {
+        Token *pTok = &pParser->pTokens[pParser->nPos];
+        if (!acceptKeyword(pParser, "AND")) break;
+
+        AstExpr *pRight = parseNot(pParser);
+        pExpr = pRight != NULL ? newExpr(pParser, EXPR_AND, 0, pTok, pExpr, pRight) : NULL;
+    }
+
+    return pExpr;
+}
+
+// This function parses expression, precedence goes from OR, AND and NOT through comparison to arithmetic.
+// Types of operands are checked when expression is compiled. Returns NULL if expression is invalid
+AstExpr* parseExpression(Parser *pParser)
+{
+    AstExpr *pExpr = parseAnd(pParser);
+    while (pExpr != NULL)
+    {
+        Token *pTok = &pParser->pTokens[pParser->nPos];
+        if (!acceptKeyword(pParser, "OR")) break;
+
+        AstExpr *pRight = parseAnd(pParser);
+        pExpr = pRight != NULL ? newExpr(pParser, EXPR_OR, 0, pTok, pExpr, pRight) : NULL;
+    }
+
+    return pExpr;
+}
+
+// This function parses select list, it is * or columns separated by commas
+int parseColumnList(Parser *pParser, AstQuery *pAst)
+{
+    pAst->isStar = acceptSymbol(pParser, '*');
+    if (pAst->isStar) return 1;
+
+    do
+    {
+        Token *pColumn = acceptName(pParser);
+        if (pColumn == NULL) return 0;
+        pAst->pColumns[pAst->nColumnCount++] = pColumn;
+    } while (acceptSymbol(pParser, ','));
+
+    return 1;
+}
+
+// This function parses keys of ORDER BY clause, every key is column with optional ASC or DESC
+int parseOrderBy(Parser *pParser, AstQuery *pAst)
+{
+    do
+    {
+        if (pAst->nOrderCount >= ORDER_MAX) return 0;
+        AstOrderKey *pKey = &pAst->order[pAst->nOrderCount++];
+
+        pKey->pColumn = acceptName(pParser);
+        if (pKey->pColumn == NULL) return 0;
+
+        pKey->nDesc = acceptKeyword(pParser, "DESC");
+        if (!pKey->nDesc) acceptKeyword(pParser, "ASC");
+    } while (acceptSymbol(pParser, ','));
+
+    return 1;
+}
+
+// This function parses rest of query "SELECT [DISTINCT] columns [FROM table] [WHERE condition]
+// [ORDER BY keys] [LIMIT count] [OFFSET count]", LIMIT and OFFSET may come in any order
+int parseSelect(Parser *pParser, AstQuery *pAst)
+{
+    pAst->isDistinct = acceptKeyword(pParser, "DISTINCT");
+    if (!parseColumnList(pParser, pAst)) return 0;
+    pAst->nFromPos = pParser->nPos;
+
+    // Query without FROM clause reads the first table
+    if (acceptKeyword(pParser, "FROM") && (pAst->pTable = acceptName(pParser)) == NULL) return 0;
+
+    pAst->hasWhere = acceptKeyword(pParser, "WHERE");
+    if (pAst->hasWhere && (pAst->pWhere = parseExpression(pParser)) == NULL) return 0;
+    pAst->nTailPos = pParser->nPos;
+
+    if (acceptKeyword(pParser, "ORDER") && (!acceptKeyword(pParser, "BY") || !parseOrderBy(pParser, pAst))) return 0;
+
+    int hasLimit = 0, hasOffset = 0;
+    while (1)
+    {
+        if (!hasLimit && acceptKeyword(pParser, "LIMIT"))
+        {
+            hasLimit = 1;
+            if (!parseCount(pParser, &pAst->nLimit)) return 0;
+        }
+        else if (!hasOffset && acceptKeyword(pParser, "OFFSET"))
+        {
+            hasOffset = 1;
+            if (!parseCount(pParser, &pAst->nOffset)) return 0;
+        }
+        else return 1;
+    }
+}
+
+// This function parses rest of query "UPDATE table SET column = expression [, column = expression] WHERE condition"
+int parseUpdate(Parser *pParser, AstQuery *pAst)
+{
+    if ((pAst->pTable = acceptName(pParser)) == NULL || !acceptKeyword(pParser, "SET")) return 0;
+
+    do
+    {
+        AstAssignment *pSet = &pAst->pSets[pAst->nSetCount++];
+        pSet->pColumn = acceptName(pParser);
+
+        Token *pTok = &pParser->pTokens[pParser->nPos];
+        if (pSet->pColumn == NULL || pTok->nType != TOKEN_OPERATOR || pTok->nOp != PRED_EQUAL) return 0;
+        pParser->nPos++;
+
+        pSet->pValue = parseSum(pParser);
+        if (pSet->pValue == NULL) return 0;
+    } while (acceptSymbol(pParser, ','));
+
+    pAst->hasWhere = acceptKeyword(pParser, "WHERE");
+    return pAst->hasWhere && (pAst->pWhere = parseExpression(pParser)) != NULL;
+}
+
+// This function parses rest of query "DELETE FROM table WHERE condition"
+int parseDelete(Parser *pParser, AstQuery *pAst)
+{
+    if (!acceptKeyword(pParser, "FROM") || (pAst->pTable = acceptName(pParser)) == NULL) return 0;
+
+    pAst->hasWhere = acceptKeyword(pParser, "WHERE");
+    return pAst->hasWhere && (pAst->pWhere = parseExpression(pParser)) != NULL;
+}
+
+// This function parses tokens of query into syntax tree by recursive descent, statement may end with semicolons.
+// Column, assignment and node arrays of tree must be allocated by caller. Returns 0 if query is invalid
+int parseQuery(Token *pTokens, AstQuery *pAst)
+{
+    Parser parser;
+    parser.pTokens = pTokens;
+    parser.nPos = 0;
+    parser.pNodes = pAst->pNodes;
+    parser.nNodeCount = 0;
+    parser.nDepth = 0;
+
+    pAst->isDistinct = 0;
+    pAst->isStar = 0;
+    pAst->pTable = NULL;
+    pAst->nColumnCount = 0;
+    pAst->nSetCount = 0;
+    pAst->hasWhere = 0;
+    pAst->pWhere = NULL;
+    pAst->nOrderCount = 0;
+    pAst->nLimit = -1;
+    pAst->nOffset = 0;
+    pAst->nFromPos = 0;
+    pAst->nTailPos = 0;
+
+    int isValid = 0;
+    if (acceptKeyword(&parser, "SELECT"))
+    {
+        pAst->nType = STATEMENT_SELECT;
+        isValid = parseSelect(&parser, pAst);
+    }
+    else if (acceptKeyword(&parser, "UPDATE"))
+    {
+        pAst->nType = STATEMENT_UPDATE;
+        isValid = parseUpdate(&parser, pAst);
+    }
+    else if (acceptKeyword(&parser, "DELETE"))
+    {
+        pAst->nType = STATEMENT_DELETE;
+        isValid = parseDelete(&parser, pAst);
+    }
+
+    while (isValid && acceptSymbol(&parser, ';'));
+    pAst->nNodeCount = parser.nNodeCount;
+    return isValid && pTokens[parser.nPos].nType == TOKEN_END;
+}
+
+// This function finds names of table and joined table in head of query "SELECT [DISTINCT] columns [FROM table
+// [JOIN table]]", "UPDATE table", "DELETE FROM table" or "INSERT INTO table", so table is known before plan or
+// cached response is looked up. Names are tokens of query, table is NULL if SELECT reads the first table and join
+// is NULL if query does not join. Returns 0 if statement is unknown or its table name is missing
+int parseQueryTables(Token *pTokens, Token **ppTable, Token **ppJoin)
+{
+    Parser parser;
+    parser.pTokens = pTokens;
+    parser.nPos = 0;
+
+    *ppTable = NULL;
+    *ppJoin = NULL;
+
+    if (acceptKeyword(&parser, "UPDATE")) *ppTable = acceptName(&parser);
+    else if (acceptKeyword(&parser, "DELETE")) *ppTable = acceptKeyword(&parser, "FROM") ? acceptName(&parser) : NULL;
+    else if (acceptKeyword(&parser, "INSERT")) *ppTable = acceptKeyword(&parser, "INTO") ? acceptName(&parser) : NULL;
+    else if (acceptKeyword(&parser, "SELECT"))
+    {
+        // Select list is * or names separated by commas, joined columns are qualified by table
+        acceptKeyword(&parser, "DISTINCT");
+        while (!isKeyword(&pTokens[parser.nPos], "FROM") &&
+               (acceptSymbol(&parser, '*') || acceptSymbol(&parser, ',') || acceptName(&parser) != NULL));
+
+        if (!acceptKeyword(&parser, "FROM")) return 1;
+        *ppTable = acceptName(&parser);
+        if (*ppTable != NULL && acceptKeyword(&parser, "JOIN")) return (*ppJoin = acceptName(&parser)) != NULL;
+    }
+
+    return *ppTable != NULL;
+}
+
+// This function copies text of token into buffer, 0 is returned if it does not fit
+int copyToken(char *pDst, int nSize, Token *pTok)
+{
+    if (pTok->nLength >= nSize) return 0;
+
+    memcpy(pDst, pTok->pText, pTok->nLength);
+    pDst[pTok->nLength] = '\0';
+    return 1;
+}
+
+// This function searches table named by token and takes its reference, NULL token is the first table
+Database* findTokenTable(Catalog *pCatalog, Token *pName)
+{
+    char sName[TABLE_NAME_MAX];
+    if (pName == NULL) return acquireTable(pCatalog, 0);
+    return copyToken(sName, sizeof(sName), pName) ? findTable(pCatalog, sName) : NULL;
+}
+
+// This function finds table of SELECT, UPDATE, INSERT or DELETE query and takes its reference, SELECT without
+// FROM clause reads the first table. Table named by JOIN clause is taken into ppJoin, it is NULL if query does
+// not join. NULL is returned if query does not name its tables or any of them does not exist
+Database* findQueryTable(Catalog *pCatalog, const char *pQuery, Database **ppJoin)
+{
+    Token *pTokens = queryAlloc(sizeof(Token) * (strlen(pQuery) + 1));
+    Token *pTable = NULL, *pJoinName = NULL;
+    Database *pDB = NULL, *pJoin = NULL;
+
+    if (tokenizeQuery(pQuery, pTokens) >= 0 && parseQueryTables(pTokens, &pTable, &pJoinName))
+    {
+        pDB = findTokenTable(pCatalog, pTable);
+        if (pJoinName != NULL) pJoin = findTokenTable(pCatalog, pJoinName);
+
+        if (pDB == NULL || (pJoinName != NULL && pJoin == NULL))
+        {
+            releaseTable(pDB);
+            releaseTable(pJoin);
+            pDB = pJoin = NULL;
+        }
+    }
+
+    queryFree(pTokens);
+    if (ppJoin != NULL) *ppJoin = pJoin;
+    else releaseTable(pJoin);
+    return pDB;
+}
+
+// This function returns 1 if token of query names the table, query without table reads the first table
+int isQueryTable(Database *pDB, Token *pName)
+{
+    char sName[TABLE_NAME_MAX];
+    if (pName == NULL) return pDB->nSlot == 0;
+    if (!copyToken(sName, sizeof(sName), pName)) return 0;
+    return !strcmp(sName, pDB->sName) || (pDB->nSlot == 0 && !strcmp(sName, TABLE_DEFAULT));
+}
+
+void freePlan(Plan *pPlan)
+{
+    if (pPlan->isHeap) free(pPlan);
+    else queryFree(pPlan);
+}
+
+// Operand of expression compiler, columns and constants are loaded into registers only if instruction needs it
+typedef struct {
+    int nKind;          // OPERAND_* kind
+    int nType;          // TYPE_* type or TYPE_BOOL
+    int nColumnID;
+    int nRegister;
+    TypedValue value;   // Value of constant, boolean constant is 0 or 1 in nValue
+    Token *pToken;      // Text of literal
+} Operand;
+
+// State of expression compiler, instructions and constants are appended into arrays of plan
+typedef struct {
+    Database *pDB;
+    const char *pSource;    // Query text which tokens point into
+    const char *pText;      // Copy of query text kept by plan
+    Instruction *pCode;
+    int nCodeCount;
+    int nCodeMax;
+    VmConstant *pConsts;
+    int nConstCount;
+    int nConstMax;
+    int nRegisterCount;
+} Compiler;
+
+#define IS_CONSTANT(pOperand) ((pOperand)->nKind == OPERAND_LITERAL || (pOperand)->nKind == OPERAND_CONSTANT)
+
+// This function swaps less and greater bits of comparison, so operands can be swapped
+int mirrorOp(int nOp)
+{
+    return (nOp & ~(PRED_LESS | PRED_GREATER)) | (nOp & PRED_LESS ? PRED_GREATER : 0) | (nOp & PRED_GREATER ? PRED_LESS : 0);
+}
+
+void setBoolean(Operand *pOperand, int isTrue)
+{
+    memset(pOperand, 0, sizeof(Operand));
+    pOperand->nKind = OPERAND_CONSTANT;
+    pOperand->nType = TYPE_BOOL;
+    pOperand->value.nValue = isTrue;
+}
+
+void setRegister(Operand *pOperand, int nType, int nRegister)
+{
+    memset(pOperand, 0, sizeof(Operand));
+    pOperand->nKind = OPERAND_REGISTER;
+    pOperand->nType = nType;
+    pOperand->nRegister = nRegister;
+}
+
+// This function appends constant of program, text of literal is kept in query text of plan.
+// Returns -1 if there is no room
+int addConstant(Compiler *pComp, Operand *pOperand)
+{
+    if (pComp->nConstCount >= pComp->nConstMax) return -1;
+
+    VmConstant *pConst = &pComp->pConsts[pComp->nConstCount];
+    pConst->value = pOperand->value;
+    pConst->pText = pOperand->pToken != NULL ? pComp->pText + (pOperand->pToken->pText - pComp->pSource) : "";
+    pConst->nLength = pOperand->pToken != NULL ? pOperand->pToken->nLength : 0;
+    return pComp->nConstCount++;
+}
+
+// This function appends instruction, 0 is returned if program or its registers do not fit
+int emitInstruction(Compiler *pComp, int nOp, int nArg, int nDst, int nA, int nB)
+{
+    if (pComp->nCodeCount >= pComp->nCodeMax || nDst >= VM_REGISTERS_MAX || nA < 0 || nB < 0) return 0;
+
+    Instruction *pIns = &pComp->pCode[pComp->nCodeCount++];
+    pIns->nOp = nOp;
+    pIns->nArg = nArg;
+    pIns->nDst = nDst;
+    pIns->nA = nA;
+    pIns->nB = nB;
+
+    if (nDst >= pComp->nRegisterCount) pComp->nRegisterCount = nDst + 1;
+    return 1;
+}
+
+// This function loads column or constant into register
+int loadOperand(Compiler *pComp, Operand *pOperand, int nRegister)
+{
+    int isValid = 1;
+    if (pOperand->nKind == OPERAND_REGISTER) return 1;
+
+    if (pOperand->nKind == OPERAND_COLUMN)
+    {
+        int nOp = pOperand->nType == TYPE_TEXT ? VM_LOAD_TEXT : VM_LOAD_PACKED;
+        isValid = emitInstruction(pComp, nOp, 0, nRegister, pOperand->nColumnID, 0);
+    }
+    else
+    {
+        int nOp = pOperand->nType == TYPE_DOUBLE ? VM_CONST_DOUBLE : pOperand->nType == TYPE_TEXT ? VM_CONST_TEXT :
+                  pOperand->nType == TYPE_BOOL ? VM_CONST_BOOL : VM_CONST_INT;
+        isValid = emitInstruction(pComp, nOp, 0, nRegister, 0, addConstant(pComp, pOperand));
+    }
+
+    pOperand->nKind = OPERAND_REGISTER;
+    pOperand->nRegister = nRegister;
+    return isValid;
+}
+
+// This function loads both operands of instruction, operand which is in register keeps it
+// and the other one takes the free register of nDepth and nDepth + 1
+int loadOperands(Compiler *pComp, Operand *pA, Operand *pB, int nDepth)
+{
+    int nFree = pB->nKind == OPERAND_REGISTER && pB->nRegister == nDepth ? nDepth + 1 : nDepth;
+    if (!loadOperand(pComp, pA, nFree)) return 0;
+    return loadOperand(pComp, pB, pA->nRegister == nDepth ? nDepth + 1 : nDepth);
+}
+
+// This function gives literal type of the other operand, 0 is returned if literal does not fit into the type
+int typeLiteral(Operand *pOperand, int nType)
+{
+    TypedValue value;
+    if (parseValue(nType, pOperand->pToken->pText, pOperand->pToken->nLength, &value) == TYPE_TEXT) return 0;
+
+    pOperand->nKind = OPERAND_CONSTANT;
+    pOperand->nType = value.nType;
+    pOperand->value = value;
+    return 1;
+}
+
+// This function compares constants. Two literals are compared as numbers if both are numbers and as texts
+// otherwise, literal compared with number gets its type. Returns 1 if comparison is true
+int foldComparison(Operand *pA, Operand *pB, int nOp)
+{
+    if (pA->nKind == OPERAND_LITERAL && pB->nKind == OPERAND_LITERAL)
+    {
+        Operand a = *pA, b = *pB;
+        if (!typeLiteral(&a, TYPE_DOUBLE) || !typeLiteral(&b, TYPE_DOUBLE))
+        {
+            // NULL is not comparable, like in matchText()
+            Token *pTokA = pA->pToken, *pTokB = pB->pToken;
+            return pTokA->nLength && (nOp & compareTextBit(pTokA->pText, pTokA->nLength, pTokB->pText, pTokB->nLength));
+        }
+
+        *pA = a;
+        *pB = b;
+    }
+
+    // Value which does not fit into type of the other one differs from it
+    if (pA->nKind == OPERAND_LITERAL && !typeLiteral(pA, pB->nType)) return nOp == (PRED_LESS | PRED_GREATER);
+    if (pB->nKind == OPERAND_LITERAL && !typeLiteral(pB, pA->nType)) return nOp == (PRED_LESS | PRED_GREATER);
+
+    if (pA->nType == TYPE_DOUBLE || pB->nType == TYPE_DOUBLE)
+        return !!(nOp & COMPARE_BIT(pA->value.fValue, pB->value.fValue));
+    return !!(nOp & COMPARE_BIT(pA->value.nValue, pB->value.nValue));
+}
+
+// This function computes arithmetic of constants like VM does, integers wrap around and division by zero gives zero
+void foldArithmetic(int nSymbol, Operand *pA, Operand *pB, Operand *pOut)
+{
+    memset(pOut, 0, sizeof(Operand));
+    pOut->nKind = OPERAND_CONSTANT;
+
+    if (pA->nType == TYPE_DOUBLE || pB->nType == TYPE_DOUBLE)
+    {
+        double fA = pA->value.fValue, fB = pB->value.fValue;
+        pOut->nType = TYPE_DOUBLE;
+        pOut->value.fValue = nSymbol == '+' ? fA + fB : nSymbol == '-' ? fA - fB : nSymbol == '*' ? fA * fB :
+                             fB != 0 ? fA / fB : 0;
+    }
+    else
+    {
+        uint64_t nA = (uint64_t)pA->value.nValue, nB = (uint64_t)pB->value.nValue;
+        int64_t nDivisor = pB->value.nValue;
+        pOut->nType = TYPE_INT;
+        pOut->value.nValue = nSymbol == '+' ? (int64_t)(nA + nB) : nSymbol == '-' ? (int64_t)(nA - nB) :
+                             nSymbol == '*' ? (int64_t)(nA * nB) : nDivisor == 0 ? 0 :
+                             nDivisor == -1 ? (int64_t)(0 - nA) : pA->value.nValue / nDivisor;
+        pOut->value.fValue = (double)pOut->value.nValue;
+    }
+
+    pOut->value.nType = pOut->nType;
+}
+
+int compileExpr(Compiler *pComp, AstExpr *pExpr, int nDepth, Operand *pOut);
+
+// This function compiles operands of binary node, right operand takes the next register only if left one holds a register
+int compileOperands(Compiler *pComp, AstExpr *pExpr, int nDepth, Operand *pA, Operand *pB)
+{
+    if (!compileExpr(pComp, pExpr->pLeft, nDepth, pA)) return 0;
+    return compileExpr(pComp, pExpr->pRight, pA->nKind == OPERAND_REGISTER ? nDepth + 1 : nDepth, pB);
+}
+
+// This function compiles comparison. Column compared with constant gets specialized opcode which reads packed
+// values of column in place, constants are compared at compile time. Texts are compared only with texts
+// and dates only with dates, numbers are compared as doubles if one of them is double
+int compileComparison(Compiler *pComp, AstExpr *pExpr, int nDepth, Operand *pOut)
+{
+    int nStart = pComp->nCodeCount, nOp = pExpr->nOp, isValid = 1;
+    Operand a, b;
+    if (!compileOperands(pComp, pExpr, nDepth, &a, &b) || a.nType == TYPE_BOOL || b.nType == TYPE_BOOL) return 0;
+
+    // Constant is moved to the right
+    if (IS_CONSTANT(&a) && !IS_CONSTANT(&b))
+    {
+        Operand tmp = a;
+        a = b;
+        b = tmp;
+        nOp = mirrorOp(nOp);
+    }
+
+    if (IS_CONSTANT(&a) || (b.nKind == OPERAND_LITERAL && a.nType != TYPE_TEXT && !typeLiteral(&b, a.nType)))
+    {
+        // Value which does not fit into type of column differs from all its values
+        int isTrue = IS_CONSTANT(&a) ? foldComparison(&a, &b, nOp) : nOp == (PRED_LESS | PRED_GREATER);
+        pComp->nCodeCount = nStart;
+        setBoolean(pOut, isTrue);
+        return 1;
+    }
+
+    int nA = a.nKind == OPERAND_COLUMN ? a.nColumnID : a.nRegister;
+    if (b.nKind == OPERAND_LITERAL)
+    {
+        // Only text operand keeps literal
+        isValid = emitInstruction(pComp, a.nKind == OPERAND_COLUMN ? VM_CMP_COLUMN_TEXT : VM_CMP_TEXT_CONST,
+                                  nOp, nDepth, nA, addConstant(pComp, &b));
+    }
+    else if (b.nKind == OPERAND_CONSTANT)
+    {
+        if (a.nType == TYPE_TEXT || (a.nType == TYPE_DATE) != (b.nType == TYPE_DATE)) return 0;
+
+        if (a.nType == TYPE_DOUBLE || b.nType != TYPE_DOUBLE)
+        {
+            int isDouble = a.nType == TYPE_DOUBLE;
+            int nColumnOp = isDouble ? VM_CMP_COLUMN_DOUBLE : VM_CMP_COLUMN_INT;
+            int nRegisterOp = isDouble ? VM_CMP_DOUBLE_CONST : VM_CMP_INT_CONST;
+            isValid = emitInstruction(pComp, a.nKind == OPERAND_COLUMN ? nColumnOp : nRegisterOp,
+                                      nOp, nDepth, nA, addConstant(pComp, &b));
+        }
+        else
+        {
+            // INT operand is compared with DOUBLE constant as double
+            isValid = loadOperand(pComp, &a, nDepth) &&
+                      emitInstruction(pComp, VM_TO_DOUBLE, 0, nDepth, nDepth, 0) &&
+                      emitInstruction(pComp, VM_CMP_DOUBLE_CONST, nOp, nDepth, nDepth, addConstant(pComp, &b));
+        }
+    }
+    else
+    {
+        if ((a.nType == TYPE_TEXT) != (b.nType == TYPE_TEXT) || (a.nType == TYPE_DATE) != (b.nType == TYPE_DATE)) return 0;
+
+        int isDouble = a.nType == TYPE_DOUBLE || b.nType == TYPE_DOUBLE;
+        int nCmpOp = a.nType == TYPE_TEXT ? VM_CMP_TEXT : isDouble ? VM_CMP_DOUBLE : VM_CMP_INT;
+        isValid = loadOperands(pComp, &a, &b, nDepth);
+
+        if (isValid && isDouble && a.nType == TYPE_INT) isValid = emitInstruction(pComp, VM_TO_DOUBLE, 0, a.nRegister, a.nRegister, 0);
+        if (isValid && isDouble && b.nType == TYPE_INT) isValid = emitInstruction(pComp, VM_TO_DOUBLE, 0, b.nRegister, b.nRegister, 0);
+        isValid = isValid && emitInstruction(pComp, nCmpOp, nOp, nDepth, a.nRegister, b.nRegister);
+    }
+
+    setRegister(pOut, TYPE_BOOL, nDepth);
+    return isValid;
+}
+
+// This function compiles IS NULL and IS NOT NULL, only empty text is NULL
+int compileIsNull(Compiler *pComp, AstExpr *pExpr, int nDepth, Operand *pOut)
+{
+    int nStart = pComp->nCodeCount;
+    Operand a;
+    if (!compileExpr(pComp, pExpr->pLeft, nDepth, &a) || a.nType == TYPE_BOOL) return 0;
+
+    if (a.nType == TYPE_TEXT && a.nKind != OPERAND_LITERAL)
+    {
+        setRegister(pOut, TYPE_BOOL, nDepth);
+        return loadOperand(pComp, &a, nDepth) && emitInstruction(pComp, VM_IS_NULL, pExpr->nOp, nDepth, nDepth, 0);
+    }
+
+    // Typed columns and numbers are never NULL
+    int isNull = a.nKind == OPERAND_LITERAL && !a.pToken->nLength;
+    pComp->nCodeCount = nStart;
+    setBoolean(pOut, !!(pExpr->nOp & (isNull ? PRED_IS_NULL : PRED_NOT_NULL)));
+    return 1;
+}
+
+// This function compiles arithmetic of INT and DOUBLE operands, literals are numbers. Result is DOUBLE
+// if one of operands is DOUBLE
+int compileArithmetic(Compiler *pComp, AstExpr *pExpr, int nDepth, Operand *pOut)
+{
+    Operand a, b;
+    if (!compileOperands(pComp, pExpr, nDepth, &a, &b)) return 0;
+
+    Operand *pOperands[2] = { &a, &b };
+    int i, isDouble = 0;
+    for (i = 0; i < 2; i++)
+    {
+        Operand *pOperand = pOperands[i];
+        if (pOperand->nKind == OPERAND_LITERAL && !typeLiteral(pOperand, TYPE_INT)) return 0;
+        if (pOperand->nType != TYPE_INT && pOperand->nType != TYPE_DOUBLE) return 0;
+        isDouble |= pOperand->nType == TYPE_DOUBLE;
+    }
+
+    if (a.nKind == OPERAND_CONSTANT && b.nKind == OPERAND_CONSTANT)
+    {
+        foldArithmetic(pExpr->nOp, &a, &b, pOut);
+        return 1;
+    }
+
+    // Constants are converted now, registers by instruction
+    for (i = 0; i < 2 && isDouble; i++)
+        if (pOperands[i]->nKind == OPERAND_CONSTANT) pOperands[i]->nType = TYPE_DOUBLE;
+
+    if (!loadOperands(pComp, &a, &b, nDepth)) return 0;
+
+    for (i = 0; i < 2 && isDouble; i++)
+    {
+        Operand *pOperand = pOperands[i];
+        if (pOperand->nType == TYPE_INT &&
+            !emitInstruction(pComp, VM_TO_DOUBLE, 0, pOperand->nRegister, pOperand->nRegister, 0)) return 0;
+    }
+
+    setRegister(pOut, isDouble ? TYPE_DOUBLE : TYPE_INT, nDepth);
+    return emitInstruction(pComp, isDouble ? VM_ARITH_DOUBLE : VM_ARITH_INT, pExpr->nOp, nDepth, a.nRegister, b.nRegister);
+}
+
+// This function compiles AND and OR. Constant FALSE of AND and TRUE of OR decide result, the other constant drops out
+int compileLogic(Compiler *pComp, AstExpr *pExpr, int nDepth, Operand *pOut)
+{
+    int nStart = pComp->nCodeCount, isAnd = pExpr->nKind == EXPR_AND;
+    Operand a, b;
+    if (!compileOperands(pComp, pExpr, nDepth, &a, &b) || a.nType != TYPE_BOOL || b.nType != TYPE_BOOL) return 0;
+
+    Operand *pConst = a.nKind == OPERAND_CONSTANT ? &a : b.nKind == OPERAND_CONSTANT ? &b : NULL;
+    if (pConst != NULL)
+    {
+        // Operand which is left takes nDepth, because constant does not hold a register
+        if (pConst->value.nValue != isAnd)
+        {
+            pComp->nCodeCount = nStart;
+            setBoolean(pOut, !isAnd);
+        }
+        else *pOut = pConst == &a ? b : a;
+        return 1;
+    }
+
+    setRegister(pOut, TYPE_BOOL, nDepth);
+    return emitInstruction(pComp, isAnd ? VM_AND : VM_OR, 0, nDepth, a.nRegister, b.nRegister);
+}
+
+// This function returns column of leaf which is bare name of column, -1 for other expressions
+int exprColumn(Database *pDB, AstExpr *pExpr)
+{
+    if (pExpr == NULL || pExpr->nKind != EXPR_VALUE || pExpr->pToken->nType != TOKEN_WORD) return -1;
+    return findColumn(pDB, pExpr->pToken->pText, pExpr->pToken->nLength);
+}
+
+// This function compiles expression into instructions whose result is in register nDepth, registers above it
+// are temporaries. Columns and constants are left unloaded in pOut, so their consumer picks opcode for them.
+// Returns 0 if types of operands do not match their operators or program is too large
+int compileExpr(Compiler *pComp, AstExpr *pExpr, int nDepth, Operand *pOut)
+{
+    if (pExpr->nKind == EXPR_COMPARE) return compileComparison(pComp, pExpr, nDepth, pOut);
+    if (pExpr->nKind == EXPR_IS_NULL) return compileIsNull(pComp, pExpr, nDepth, pOut);
+    if (pExpr->nKind == EXPR_ARITHMETIC) return compileArithmetic(pComp, pExpr, nDepth, pOut);
+    if (pExpr->nKind == EXPR_AND || pExpr->nKind == EXPR_OR) return compileLogic(pComp, pExpr, nDepth, pOut);
+
+    if (pExpr->nKind == EXPR_NOT)
+    {
+        Operand a;
+        if (!compileExpr(pComp, pExpr->pLeft, nDepth, &a) || a.nType != TYPE_BOOL) return 0;
+
+        if (a.nKind == OPERAND_CONSTANT)
+        {
+            setBoolean(pOut, !a.value.nValue);
+            return 1;
+        }
+
+        setRegister(pOut, TYPE_BOOL, nDepth);
+        return emitInstruction(pComp, VM_NOT, 0, nDepth, a.nRegister, 0);
+    }
+
+    // Bare word is column if table has such column, otherwise it is value like quoted text
+    memset(pOut, 0, sizeof(Operand));
+    pOut->nColumnID = exprColumn(pComp->pDB, pExpr);
+    pOut->nKind = pOut->nColumnID >= 0 ? OPERAND_COLUMN : OPERAND_LITERAL;
+    pOut->nType = pOut->nColumnID >= 0 ? pComp->pDB->pColumns[pOut->nColumnID].nType : TYPE_TEXT;
+    pOut->pToken = pOut->nColumnID >= 0 ? NULL : pExpr->pToken;
+    return 1;
+}
+
+// This function lowers condition "column operator value" or "column IS [NOT] NULL" into predicate which is
+// scanned with zone maps and Bloom filters. Returns 0 if condition has other shape
+int lowerPredicate(Database *pDB, AstExpr *pExpr, Predicate *pPred)
+{
+    if (pExpr->nKind != EXPR_COMPARE && pExpr->nKind != EXPR_IS_NULL) return 0;
+
+    AstExpr *pColumn = pExpr->pLeft, *pValue = pExpr->pRight;
+    int nOp = pExpr->nOp;
+    if (pExpr->nKind == EXPR_COMPARE && exprColumn(pDB, pValue) >= 0)
+    {
+        pColumn = pExpr->pRight;
+        pValue = pExpr->pLeft;
+        nOp = mirrorOp(nOp);
+    }
+
+    pPred->nColumnID = exprColumn(pDB, pColumn);
+    pPred->nOp = nOp;
+    pPred->sValue[0] = '\0';
+    if (pPred->nColumnID < 0) return 0;
+    if (pExpr->nKind == EXPR_IS_NULL) return 1;
+
+    return pValue->nKind == EXPR_VALUE && exprColumn(pDB, pValue) < 0 &&
+           copyToken(pPred->sValue, sizeof(pPred->sValue), pValue->pToken);
+}
+
+// This function lowers new value of UPDATE. Value and constant expression are saved as text for every row,
+// other expressions are compiled into program whose result is in register nRegister of the set, so programs
+// of all sets are evaluated for batch of rows before these rows are changed
+int lowerSet(Compiler *pComp, AstExpr *pExpr, int nRegister, UpdateSet *pSet)
+{
+    int nStart = pComp->nCodeCount;
+    Operand value;
+
+    pSet->sValue[0] = '\0';
+    memset(&pSet->expr, 0, sizeof(Program));
+    if (!compileExpr(pComp, pExpr, nRegister, &value) || value.nType == TYPE_BOOL) return 0;
+
+    // New values are written into CSV rows, so they can not contain separators
+    if (value.nKind == OPERAND_LITERAL)
+    {
+        Token *pTok = value.pToken;
+        return memchr(pTok->pText, ',', pTok->nLength) == NULL && memchr(pTok->pText, '\n', pTok->nLength) == NULL &&
+               copyToken(pSet->sValue, sizeof(pSet->sValue), pTok);
+    }
+
+    if (value.nKind == OPERAND_CONSTANT)
+    {
+        formatNumber(pSet->sValue, sizeof(pSet->sValue), value.nType, value.value.nValue, value.value.fValue);
+        return 1;
+    }
+
+    // Column is copied as text of its field, so value keeps its form
+    int isValid = value.nKind != OPERAND_COLUMN || emitInstruction(pComp, VM_LOAD_TEXT, 0, nRegister, value.nColumnID, 0);
+    pSet->expr.pCode = pComp->pCode + nStart;
+    pSet->expr.nCodeCount = pComp->nCodeCount - nStart;
+    pSet->expr.nResult = nRegister;
+    pSet->expr.nType = value.nKind == OPERAND_COLUMN ? TYPE_TEXT : value.nType;
+    return isValid;
+}
+
+// This function lowers syntax tree into plan, names are resolved to columns of table. Expressions are compiled into
+// programs of VM, except single comparison of column with value which filter scans with zone maps. Plan, its
+// arrays, programs and texts are allocated in one block. Every node adds at most three instructions and two
+// constants. Returns NULL if table has no such column, types do not match or value can not be stored
+Plan* lowerQuery(Database *pDB, AstQuery *pAst, const char *pQuery, int isHeap)
+{
+    int nQueryLength = strlen(pQuery);
+    int nHeaderLength = strlen(pDB->sColumns);
+    int nCodeMax = 3 * pAst->nNodeCount + pAst->nSetCount + 2;
+    int nConstMax = 2 * pAst->nNodeCount + 2;
+    size_t nSize = sizeof(Plan) + sizeof(VmConstant) * nConstMax + sizeof(UpdateSet) * pAst->nSetCount +
+                   sizeof(Instruction) * nCodeMax + sizeof(int) * (pAst->nColumnCount + pDB->nColumnCount) +
+                   nQueryLength + nHeaderLength + 2;
+
+    Plan *pPlan = isHeap ? malloc(nSize) : queryAlloc(nSize);
+    if (pPlan == NULL)
+    {
+        logToFile(ERROR, "Can not alloc memory for query plan");
+        exitFailure(NULL);
+    }
+
+    memset(pPlan, 0, sizeof(Plan));
+    pPlan->pConsts = (VmConstant*)(pPlan + 1);
+    pPlan->pSets = (UpdateSet*)(pPlan->pConsts + nConstMax);
+    Instruction *pCode = (Instruction*)(pPlan->pSets + pAst->nSetCount);
+    pPlan->pColumnIDs = (int*)(pCode + nCodeMax);
+    pPlan->pColumnTypes = pPlan->pColumnIDs + pAst->nColumnCount;
+    pPlan->pQuery = (char*)(pPlan->pColumnTypes + pDB->nColumnCount);
+    pPlan->pHeader = pPlan->pQuery + nQueryLength + 1;
+    memcpy(pPlan->pQuery, pQuery, nQueryLength + 1);
+    memcpy(pPlan->pHeader, pDB->sColumns, nHeaderLength + 1);
+
+    pPlan->nType = pAst->nType;
+    pPlan->isDistinct = pAst->isDistinct;
+    pPlan->isHeap = isHeap;
+
+    // Plan is bound to column types of table
+    int i, j, isValid = 1, hasFilter = pAst->hasWhere;
+    pPlan->nSchemaEpoch = pDB->nSchemaEpoch;
+    pPlan->nTypeCount = pDB->nColumnCount;
+    for (i = 0; i < pDB->nColumnCount; i++) pPlan->pColumnTypes[i] = pDB->pColumns[i].nType;
+
+    SelectOptions *pOpts = &pPlan->options;
+    pOpts->nLimit = pAst->nLimit;
+    pOpts->nOffset = pAst->nOffset;
+
+    Compiler comp;
+    comp.pDB = pDB;
+    comp.pSource = pQuery;
+    comp.pText = pPlan->pQuery;
+    comp.pCode = pCode;
+    comp.nCodeCount = 0;
+    comp.nCodeMax = nCodeMax;
+    comp.pConsts = pPlan->pConsts;
+    comp.nConstCount = 0;
+    comp.nConstMax = nConstMax;
+    comp.nRegisterCount = 0;
+
+    if (pAst->hasWhere && lowerPredicate(pDB, pAst->pWhere, &pOpts->where)) pOpts->nHasWhere = 1;
+    else if (pAst->hasWhere)
+    {
+        Operand result;
+        isValid = compileExpr(&comp, pAst->pWhere, 0, &result) && result.nType == TYPE_BOOL;
+
+        // Condition which is always true needs no filter
+        if (isValid && result.nKind == OPERAND_CONSTANT && result.value.nValue) hasFilter = 0;
+        else if (isValid) isValid = loadOperand(&comp, &result, 0);
+
+        pPlan->filter.pCode = pCode;
+        pPlan->filter.nCodeCount = hasFilter ? comp.nCodeCount : 0;
+        pPlan->filter.nType = TYPE_BOOL;
+    }
+
+    for (i = 0; i < pAst->nOrderCount && isValid; i++)
+    {
+        OrderKey *pKey = &pOpts->keys[pOpts->nKeyCount++];
+        pKey->nColumnID = findColumn(pDB, pAst->order[i].pColumn->pText, pAst->order[i].pColumn->nLength);
+        pKey->nDesc = pAst->order[i].nDesc;
+        isValid = pKey->nColumnID >= 0;
+    }
+
+    // Column selected twice is projected once
+    for (i = 0; i < pAst->nColumnCount && isValid; i++)
+    {
+        int nColumnID = findColumn(pDB, pAst->pColumns[i]->pText, pAst->pColumns[i]->nLength);
+        isValid = nColumnID >= 0;
+
+        for (j = 0; j < pPlan->nColumnCount; j++)
+            if (pPlan->pColumnIDs[j] == nColumnID) break;
+        if (j == pPlan->nColumnCount) pPlan->pColumnIDs[pPlan->nColumnCount++] = nColumnID;
+    }
+
+    if (pAst->isStar) pPlan->pColumnIDs = NULL;
+
+    // Column can be set once and row with changed shard key would belong to other shard
+    int nKeyColumn = shardKeyColumn(&g_catalog, pDB);
+    for (i = 0; i < pAst->nSetCount && isValid; i++)
+    {
+        UpdateSet *pSet = &pPlan->pSets[pPlan->nSetCount++];
+        pSet->nColumnID = findColumn(pDB, pAst->pSets[i].pColumn->pText, pAst->pSets[i].pColumn->nLength);
+
+        isValid = pSet->nColumnID >= 0 && pSet->nColumnID != nKeyColumn && lowerSet(&comp, pAst->pSets[i].pValue, i, pSet);
+        if (isValid && pSet->expr.nCodeCount) pPlan->nSetPrograms++;
+
+        for (j = 0; j < i && isValid; j++) isValid = pPlan->pSets[j].nColumnID != pSet->nColumnID;
+    }
+
+    pPlan->nRegisterCount = comp.nRegisterCount;
+
+    if (!isValid)
+    {
+        freePlan(pPlan);
+        return NULL;
+    }
+
+    pPlan->nOps[pPlan->nOpCount++] = PLAN_SCAN;
+    if (hasFilter) pPlan->nOps[pPlan->nOpCount++] = PLAN_FILTER;
+    pPlan->nScanLimit = -1;
+
+    if (pPlan->nType == STATEMENT_SELECT)
+    {
+        if (pOpts->nKeyCount) pPlan->nOps[pPlan->nOpCount++] = PLAN_SORT;
+        pPlan->nOps[pPlan->nOpCount++] = PLAN_PROJECT;
+        if (pPlan->isDistinct) pPlan->nOps[pPlan->nOpCount++] = PLAN_DISTINCT;
+        if (pOpts->nLimit >= 0 || pOpts->nOffset) pPlan->nOps[pPlan->nOpCount++] = PLAN_LIMIT;
+
+        // Without sort and DISTINCT scan stops as soon as limit is reached
+        long nWanted = pOpts->nLimit < 0 || pOpts->nKeyCount || pPlan->isDistinct ? -1 : pOpts->nOffset + pOpts->nLimit;
+        if (nWanted <= INT_MAX) pPlan->nScanLimit = nWanted;
+    }
+    else pPlan->nOps[pPlan->nOpCount++] = pPlan->nType == STATEMENT_UPDATE ? PLAN_UPDATE : PLAN_DELETE;
+
+    return pPlan;
+}
+
+// This function compiles query of given statement type into plan bound to columns of table, tokens and syntax tree
+// are temporaries of query. Plan is allocated from heap if it is cached. Returns NULL if query is invalid
+Plan* compilePlan(Database *pDB, const char *pQuery, int nType, int isHeap)
+{
+    int nLength = strlen(pQuery);
+    Token *pTokens = queryAlloc(sizeof(Token) * (nLength + 1));
+    int nCount = tokenizeQuery(pQuery, pTokens);
+
+    AstQuery ast;
+    ast.pColumns = queryAlloc(sizeof(Token*) * (nCount + 1));
+    ast.pSets = queryAlloc(sizeof(AstAssignment) * (nCount + 1));
+    ast.pNodes = queryAlloc(sizeof(AstExpr) * (nCount + 1));
+
+    Plan *pPlan = NULL;
+    if (nCount >= 0 && parseQuery(pTokens, &ast) && ast.nType == nType && isQueryTable(pDB, ast.pTable))
+        pPlan = lowerQuery(pDB, &ast, pQuery, isHeap);
+
+    queryFree(ast.pNodes);
+    queryFree(ast.pSets);
+    queryFree(ast.pColumns);
+    queryFree(pTokens);
+    return pPlan;
+}
+
+void initPlanCache(PlanCache *pCache)
+{
+    memset(pCache, 0, sizeof(PlanCache));
+}
+
+void destroyPlanCache(PlanCache *pCache)
+{
+    int i;
+    for (i = 0; i < PLAN_CACHE_SIZE; i++)
+        if (pCache->pPlans[i] != NULL) freePlan(pCache->pPlans[i]);
+}
+
+// This function returns 1 if plan is bound to current column types of table, table must be locked by caller.
+// Widened column or reloaded table changes schema epoch, so opcodes specialized to old types are not run
+int isPlanCurrent(Database *pDB, Plan *pPlan)
+{
+    if (pPlan->nSchemaEpoch != pDB->nSchemaEpoch || pPlan->nTypeCount != pDB->nColumnCount) return 0;
+
+    int i;
+    for (i = 0; i < pDB->nColumnCount; i++)
+        if (pPlan->pColumnTypes[i] != pDB->pColumns[i].nType) return 0;
+
+    return 1;
+}
+
+// This function returns plan of query for table locked by caller, plan cached by worker is reused if it was
+// compiled from the same text for the same columns and their types, so widened or reloaded table gets a new
+// plan. Worker runs one query at a time, so replaced plan is not used anymore. Plan must be released by
+// releasePlan(), NULL is returned if query is invalid
+Plan* acquirePlan(Database *pDB, const char *pQuery, int nType)
+{
+    PlanCache *pCache = t_pPlans;
+    if (pCache == NULL) return compilePlan(pDB, pQuery, nType, 0);
+
+    uint64_t nStartTime = traceTime();
+    uint32_t nHash = hashData(pQuery, strlen(pQuery));
+    Plan **ppSlot = &pCache->pPlans[nHash % PLAN_CACHE_SIZE];
+    Plan *pPlan = *ppSlot;
+
+    if (pPlan != NULL && pPlan->nHash == nHash && pPlan->nType == nType &&
+        !strcmp(pPlan->pQuery, pQuery) && !strcmp(pPlan->pHeader, pDB->sColumns) && isPlanCurrent(pDB, pPlan))
+    {
+        __atomic_fetch_add(&g_stats.nPlanHits, 1, __ATOMIC_RELAXED);
+        traceSpan("plan cached", nStartTime);
+        return pPlan;
+    }
+
+    __atomic_fetch_add(&g_stats.nPlanMisses, 1, __ATOMIC_RELAXED);
+    Plan *pNew = compilePlan(pDB, pQuery, nType, 1);
+    traceSpan("parse", nStartTime);
+    if (pNew == NULL) return NULL;
+
+    if (pPlan != NULL) freePlan(pPlan);
+    pNew->nHash = nHash;
+    pNew->isCached = 1;
+    *ppSlot = pNew;
+    return pNew;
+}
+
+// This function releases plan after query, cached plan is kept for the next query
+void releasePlan(Plan *pPlan)
+{
+    if (!pPlan->isCached) freePlan(pPlan);
+}
+
+// This function runs scan, filter and sort operators of plan over table locked by caller, following operators
+// consume returned row IDs. NULL is returned if rows are taken in load order, count of rows is saved in pCount.
+// Returned array must be freed by queryFree()
+int* runPlanRows(Database *pDB, Plan *pPlan, int *pCount)
+{
+    int *pRows = NULL;
+    int i, nRows = pDB->nRowCount;
+    uint64_t nStartTime = traceTime();
+
+    for (i = 0; i < pPlan->nOpCount; i++)
+    {
+        int nOp = pPlan->nOps[i];
+        if (nOp == PLAN_SCAN)
+        {
+            // Filter scans table by itself, otherwise scan only drops deleted rows
+            if ((i + 1 < pPlan->nOpCount && pPlan->nOps[i + 1] == PLAN_FILTER) || !pDB->nDeletedCount) continue;
+
+            pRows = queryAlloc(sizeof(int) * (pDB->nRowCount + 1));
+            nRows = liveRows(pDB, pRows, (int)pPlan->nScanLimit);
+        }
+        else if (nOp == PLAN_FILTER)
+        {
+            pRows = queryAlloc(sizeof(int) * (pDB->nRowCount + 1));
+            if (pPlan->filter.nCodeCount)
+                nRows = filterProgram(pDB, &pPlan->filter, pPlan->pConsts, pPlan->nRegisterCount, pRows, (int)pPlan->nScanLimit);
+            else nRows = filterRows(pDB, &pPlan->options.where, pRows, (int)pPlan->nScanLimit);
+        }
+        else if (nOp == PLAN_SORT)
+        {
+            int *pOrder = orderRows(pDB, &pPlan->options, pPlan->isDistinct, pRows, nRows, &nRows);
+            queryFree(pRows);
+            pRows = pOrder;
+        }
+    }
+
+    *pCount = nRows;
+    traceSpan("scan", nStartTime);
+    return pRows;
+}
+
+////////////////////////////////////////////////////////////////////////
+// SELECT
+////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+    uint32_t nHash;
+    int nOffset;
+    int nLength;
+} RowSetEntry;
+
+// Hash set of already selected rows, used by DISTINCT queries
+typedef struct {
+    RowSetEntry *pEntries;
+    String keys;
+    int nSize;
+    int nUsed;
+} RowSet;
+
+// FNV-1a hash function
+uint32_t hashData(const char *pData, int nLength)
+{
+    uint32_t nHash = 2166136261u;
+    int i;
+
+    for (i = 0; i < nLength; i++)
+    {
+        nHash ^= (unsigned char)pData[i];
+        nHash *= 16777619u;
+    }
+
+    return nHash;
+}
+
+void rowSetInit(RowSet *pSet)
+{
+    pSet->nSize = 1024;
+    pSet->nUsed = 0;
+    pSet->pEntries = queryCalloc(pSet->nSize, sizeof(RowSetEntry));
+    stringInit(&pSet->keys, DATA_MAX);
+}
+
+void rowSetClear(RowSet *pSet)
+{
+    queryFree(pSet->pEntries);
+    pSet->pEntries = NULL;
+    stringClear(&pSet->keys);
+}
+
+// This function inserts row in the set, returns 0 if the same row is already there
+int rowSetInsert(RowSet *pSet, const char *pData, int nLength)
+{
+    uint32_t nHash = hashData(pData, nLength);
+    uint32_t nMask = pSet->nSize - 1;
+    uint32_t nPos = nHash & nMask;
+
+    while (pSet->pEntries[nPos].nLength)
+    {
+        RowSetEntry *pEntry = &pSet->pEntries[nPos];
+        if (pEntry->nHash == nHash && pEntry->nLength == nLength + 1 &&
+            !memcmp(pSet->keys.pData + pEntry->nOffset, pData, nLength)) return 0;
+
+        nPos = (nPos + 1) & nMask;
+    }
+
+    // Length is saved with one extra byte so empty rows are not confused with free slots
+    pSet->pEntries[nPos].nHash = nHash;
+    pSet->pEntries[nPos].nOffset = pSet->keys.nUsed;
+    pSet->pEntries[nPos].nLength = nLength + 1;
+    stringAppend(&pSet->keys, (char*)pData, nLength);
+
+    // Grow table when it is half full
+    if (++pSet->nUsed * 2 > pSet->nSize)
+    {
+        RowSetEntry *pOld = pSet->pEntries;
+        int i, nOldSize = pSet->nSize;
+
+        pSet->nSize *= 2;
+        pSet->pEntries = queryCalloc(pSet->nSize, sizeof(RowSetEntry));
+
+        nMask = pSet->nSize - 1;
+        for (i = 0; i < nOldSize; i++)
+        {
+            if (!pOld[i].nLength) continue;
+            nPos = pOld[i].nHash & nMask;
+            while (pSet->pEntries[nPos].nLength) nPos = (nPos + 1) & nMask;
+            pSet->pEntries[nPos] = pOld[i];
+        }
+
+        queryFree(pOld);
+    }
+
+    return 1;
+}
+
+// This function appends requested columns of the row into the response,
+// whole row is appended as it is if column ID array is NULL
+void appendProjection(String *pStr, const char *pRow, int *pIDS, int nCount)
+{
+    if (pIDS == NULL)
+    {
+        stringAppend(pStr, (char*)pRow, strlen(pRow));
+        return;
+    }
+
+    int i;
+    for (i = 0; i < nCount; i++)
+    {
+        int nLen = 0;
+        const char *pField = getField(pRow, pIDS[i], &nLen);
+
+        if (i) stringAppend(pStr, ",", 1);
+        if (pField != NULL) stringAppend(pStr, (char*)pField, nLen);
+    }
+}
+
+// This function runs projection of plan with its DISTINCT and LIMIT operators. They are pipelined, so rows are
+// appended into response one by one and the loop stops as soon as limit is reached. All rows are projected in load
+// order if pRows is NULL
+int projectRows(Database *pDB, Plan *pPlan, int *pRows, int nRows, String *pResponse)
+{
+    SelectOptions *pOpts = &pPlan->options;
+    RowSet seen;
+    if (pPlan->isDistinct) rowSetInit(&seen);
+
+    long nSkipped = 0;
+    int i, nRecordings = 0;
+
+    for (i = 0; i < nRows; i++)
+    {
+        // Stop scanning as soon as limit is reached or query is cancelled
+        if (pOpts->nLimit >= 0 && nRecordings >= pOpts->nLimit) break;
+        if (isQueryCancelled()) break;
+
+        RowData *pRow = getRow(pDB, pRows != NULL ? pRows[i] : i);
+        int nMark = pResponse->nUsed;
+
+        // Columns are appended before first recording
+        if (!nRecordings)
+        {
+            appendProjection(pResponse, pDB->sColumns, pPlan->pColumnIDs, pPlan->nColumnCount);
+            stringAppend(pResponse, "\n", 1);
+        }
+
+        int nStart = pResponse->nUsed;
+        appendProjection(pResponse, pRow->sData, pPlan->pColumnIDs, pPlan->nColumnCount);
+
+        // Rollback row if it is already selected or skipped by offset
+        if ((pPlan->isDistinct && !rowSetInsert(&seen, pResponse->pData + nStart, pResponse->nUsed - nStart)) ||
+            nSkipped++ < pOpts->nOffset)
+        {
+            pResponse->nUsed = nMark;
+            pResponse->pData[nMark] = '\0';
+            continue;
+        }
+
+        stringAppend(pResponse, "\n", 1);
+        nRecordings += 1;
+    }
+
+    if (pPlan->isDistinct) rowSetClear(&seen);
+    return nRecordings;
+}
+
+// This function executes SELECT query by its plan, plan is compiled once and reused by later queries
+int executeSelectQuery(Database *pDB, char *pQuery, String *pResponse)
+{
+    // Lock database for reading, plan is bound to column types which writers may widen
+    lockRead(&pDB->rwLock);
+
+    Plan *pPlan = acquirePlan(pDB, pQuery, STATEMENT_SELECT);
+    if (pPlan == NULL)
+    {
+        unlockRW(&pDB->rwLock);
+        return -1; // return -1 means unsupported query
+    }
+
+    int nRows = 0;
+    int *pRows = runPlanRows(pDB, pPlan, &nRows);
+    uint64_t nSerializeTime = traceTime();
+    int nRecordCount = projectRows(pDB, pPlan, pRows, nRows, pResponse);
+    traceSpan("serialize", nSerializeTime);
+    queryFree(pRows);
+
+    // Unlock database rwlock
+    unlockRW(&pDB->rwLock);
+    releasePlan(pPlan);
+    return nRecordCount;
+}
+
+// Columns and zones touched by update, zone maps are refreshed once after all rows are updated
+typedef struct {
+    char *pColumns; // 1 if column is updated, 2 if all its zones must be rebuilt
+    char *pZones;   // 1 if zone has updated rows
+} UpdateMarks;
+
+void initUpdateMarks(Database *pDB, UpdateMarks *pMarks)
+{
+    pMarks->pColumns = queryCalloc(pDB->nColumnCount + 1, 1);
+    pMarks->pZones = queryCalloc(pDB->nChunkSize + 1, 1);
+}
+
+// This function widens columns of update sets, so every row can store new values. Values computed
+// for every row widen their columns in updateRow(). Keys of Bloom filters change with column type,
+// so all zones of such column are rebuilt
+void widenUpdateColumns(Database *pDB, UpdateSet *pSet, int nCount, UpdateMarks *pMarks)
+{
+    int j;
+    for (j = 0; j < nCount; j++)
+    {
+        if (pSet[j].nColumnID < 0 || pSet[j].nColumnID >= pDB->nColumnCount || pSet[j].expr.nCodeCount) continue;
+
+        TypedValue value;
+        Column *pCol = &pDB->pColumns[pSet[j].nColumnID];
+        int nType = parseValue(pCol->nType, pSet[j].sValue, strlen(pSet[j].sValue), &value);
+        if (nType == pCol->nType) continue;
+
+        widenColumn(pDB, pCol, pDB->nRowCount, nType);
+        if (pCol->pBloom != NULL) pMarks->pColumns[pSet[j].nColumnID] = 2;
+    }
+}
+
+// This function replaces fields of row with values of update sets, packed values of typed
+// columns follow row text. Returns count of replaced fields
+int updateRow(Database *pDB, int nRow, UpdateSet *pSet, int nCount, UpdateMarks *pMarks)
+{
+    RowData *pRow = getRow(pDB, nRow);
+    int j, nUpdatedCount = 0;
+
+    // Row is built on stack, it is cut to row size anyway
+    char sRow[sizeof(pRow->sData)];
+    int nUsed = 0;
+    sRow[0] = '\0';
+
+    // Empty fields are kept, so following columns stay in their positions
+    const char *pText = pRow->sData;
+    int nCurrID = 0;
+
+    do
+    {
+        int nLen = 0;
+        const char *pField = nextField(&pText, &nLen);
+        if (nCurrID) nUsed = appendBounded(sRow, sizeof(sRow), nUsed, ",", 1);
+
+        int nSetDone = 0;
+        for (j = 0; j < nCount; j++)
+        {
+            UpdateSet *pCurr = &pSet[j];
+            if (nCurrID == pCurr->nColumnID)
+            {
+                // Update value with a new one in row
+                nUsed = appendBounded(sRow, sizeof(sRow), nUsed, pCurr->sValue, strlen(pCurr->sValue));
+                nSetDone = 1;
+            }
+        }
+
+        // Append old value if this row is row updated
+        if (!nSetDone) nUsed = appendBounded(sRow, sizeof(sRow), nUsed, pField, nLen);
+        else nUpdatedCount++;
+
+        nCurrID++;
+    } while (pText != NULL);
+
+    // Update row and packed values of its typed columns
+    memcpy(pRow->sData, sRow, nUsed + 1);
+
+    for (j = 0; j < nCount; j++)
+    {
+        if (pSet[j].nColumnID < 0 || pSet[j].nColumnID >= pDB->nColumnCount) continue;
+
+        Column *pCol = &pDB->pColumns[pSet[j].nColumnID];
+        int nType = pCol->nType;
+        storeColumnValue(pDB, pCol, pDB->nRowCount, nRow, pSet[j].sValue, strlen(pSet[j].sValue));
+
+        if (pCol->nType != nType && pCol->pBloom != NULL) pMarks->pColumns[pSet[j].nColumnID] = 2;
+        else if (!pMarks->pColumns[pSet[j].nColumnID]) pMarks->pColumns[pSet[j].nColumnID] = 1;
+    }
+
+    pMarks->pZones[nRow / ZONE_ROWS] = 1;
+    return nUpdatedCount;
+}
+
+// This function recomputes zones of updated columns and frees marks, widened columns
+// with Bloom filters are rebuilt whole and other columns only in zones of updated rows
+void refreshZones(Database *pDB, UpdateMarks *pMarks)
+{
+    int i, j;
+    for (j = 0; j < pDB->nColumnCount; j++)
+    {
+        if (!pMarks->pColumns[j]) continue;
+
+        for (i = 0; i * ZONE_ROWS < pDB->nRowCount; i++)
+            if (pMarks->pColumns[j] == 2 || pMarks->pZones[i]) buildColumnZone(pDB, j, i);
+    }
+
+    queryFree(pMarks->pColumns);
+    queryFree(pMarks->pZones);
+}
+
+// This function computes values of set programs for matched rows, VM_BATCH_ROWS rows at once. Value of set j
+// of row k is NUL terminated text at pOffsets[k * nSetCount + j] in pValues. Matched rows are consecutive rows
+// from the first one if pMatches is NULL. Returns count of rows evaluated before query was cancelled
+int evaluateSets(Database *pDB, Plan *pPlan, int *pMatches, int nMatched, String *pValues, int *pOffsets)
+{
+    UpdateSet *pSets = pPlan->pSets;
+    int j, k, nStart;
+
+    Vm vm;
+    initVm(&vm, pDB, pPlan->pConsts, pPlan->nRegisterCount);
+
+    for (nStart = 0; nStart < nMatched; nStart += VM_BATCH_ROWS)
+    {
+        if (isBlockCancelled()) break;
+
+        int nCount = nMatched - nStart < VM_BATCH_ROWS ? nMatched - nStart : VM_BATCH_ROWS;
+        setVmBatch(&vm, pMatches != NULL ? pMatches + nStart : NULL, nStart, nCount);
+        for (j = 0; j < pPlan->nSetCount; j++)
+            if (pSets[j].expr.nCodeCount) runProgram(&vm, &pSets[j].expr);
+
+        for (k = 0; k < nCount; k++)
+        {
+            for (j = 0; j < pPlan->nSetCount; j++)
+            {
+                if (!pSets[j].expr.nCodeCount) continue;
+
+                char sValue[sizeof(pSets[j].sValue)];
+                formatResult(&vm, &pSets[j].expr, k, sValue, sizeof(sValue));
+                pOffsets[(size_t)(nStart + k) * pPlan->nSetCount + j] = pValues->nUsed;
+                stringAppend(pValues, sValue, strlen(sValue) + 1);
+            }
+        }
+    }
+
+    freeVm(&vm);
+    return nStart < nMatched ? nStart : nMatched;
+}
+
+// This function updates rows matched by scan and filter of plan with its new values. Programs of sets are
+// evaluated for all matched rows before the first row is changed, so all sets read old values of rows and
+// column widened by new value does not change types which programs were compiled for. Computed values
+// are copied into copy of sets for every row
+int updateDatabase(Database *pDB, Plan *pPlan)
+{
+    int nMatched = 0, j, k, nUpdatedCount = 0;
+    int *pMatches = runPlanRows(pDB, pPlan, &nMatched);
+
+    UpdateSet *pSets = pPlan->pSets;
+    String values;
+    int *pOffsets = NULL;
+
+    if (pPlan->nSetPrograms && nMatched)
+    {
+        pSets = queryAlloc(sizeof(UpdateSet) * pPlan->nSetCount);
+        memcpy(pSets, pPlan->pSets, sizeof(UpdateSet) * pPlan->nSetCount);
+
+        stringInit(&values, DATA_MAX);
+        pOffsets = queryAlloc(sizeof(int) * (size_t)nMatched * pPlan->nSetCount);
+        nMatched = evaluateSets(pDB, pPlan, pMatches, nMatched, &values, pOffsets);
+    }
+
+    // New values widen their columns first, so every matched row can store them
+    UpdateMarks marks;
+    initUpdateMarks(pDB, &marks);
+    if (nMatched) widenUpdateColumns(pDB, pPlan->pSets, pPlan->nSetCount, &marks);
+
+    for (k = 0; k < nMatched; k++)
+    {
+        // Rows updated before cancellation stay updated
+        if (isQueryCancelled()) break;
+
+        for (j = 0; j < pPlan->nSetCount && pOffsets != NULL; j++)
+            if (pSets[j].expr.nCodeCount)
+                strcpy(pSets[j].sValue, values.pData + pOffsets[(size_t)k * pPlan->nSetCount + j]);
+
+        nUpdatedCount += updateRow(pDB, pMatches != NULL ? pMatches[k] : k, pSets, pPlan->nSetCount, &marks);
+    }
+
+    if (pOffsets != NULL)
+    {
+        stringClear(&values);
+        queryFree(pOffsets);
+        queryFree(pSets);
+    }
+
+    refreshZones(pDB, &marks);
+    queryFree(pMatches);
+    return nUpdatedCount;
+}
+
+// This function executes UPDATE query and appends response in the string
+int executeUpdateQuery(Database *pDB, char *pQuery, String *pResponse)
+{
+    // Lock database for writing, plan is bound to column types which writers may widen
+    lockWrite(&pDB->rwLock);
+
+    Plan *pPlan = acquirePlan(pDB, pQuery, STATEMENT_UPDATE);
+    if (pPlan == NULL)
+    {
+        unlockRW(&pDB->rwLock);
+        return -1; // return -1 means unsupported query
+    }
+
+    int nRecordCount = updateDatabase(pDB, pPlan);
+
+    // New version invalidates cached responses of this database, parser does not modify query
+    // so followers get its original text
+    if (nRecordCount) __atomic_add_fetch(&pDB->nVersion, 1, __ATOMIC_RELEASE);
+    if (nRecordCount) replicateWrite(pDB, pQuery);
+
+    char sResponse[DATA_MAX]; // Create response
+    int nLen = snprintf(sResponse, sizeof(sResponse), "Updated %d recordings", nRecordCount);
+    if (nRecordCount) stringAppend(pResponse, sResponse, nLen);
+
+    // Unlock database for writing
+    unlockRW(&pDB->rwLock);
+    releasePlan(pPlan);
+    return nRecordCount;
+}
+
+////////////////////////////////////////////////////////////////////////
+// INSERT AND DELETE
+////////////////////////////////////////////////////////////////////////
+
+// This function parses tuple of INSERT query like "(1, 'Ankara', 2.5)" into CSV row. Values are quoted or bare,
+// CSV text can not keep commas inside values. Returns pointer behind the tuple, NULL if tuple is invalid
+// or count of its values differs from count of columns
+const char* parseTuple(Database *pDB, const char *pText, char *pRow, int nSize)
+{
+    while (*pText == ' ') pText++;
+    if (*pText++ != '(') return NULL;
+
+    int nUsed = 0, nValues = 0;
+    for (;;)
+    {
+        while (*pText == ' ') pText++;
+
+        const char *pValue = pText, *pEnd = NULL;
+        if (*pText == '\'')
+        {
+            pEnd = strchr(++pValue, '\'');
+            if (pEnd == NULL) return NULL;
+            pText = pEnd + 1;
+        }
+        else
+        {
+            pText += strcspn(pText, ",)");
+            pEnd = pText;
+            while (pEnd > pValue && pEnd[-1] == ' ') pEnd--;
+        }
+
+        int nLen = (int)(pEnd - pValue);
+        if (memchr(pValue, ',', nLen) != NULL || memchr(pValue, '\n', nLen) != NULL) return NULL;
+        if (nUsed + nLen + 2 > nSize) return NULL;
+
+        if (nValues++) pRow[nUsed++] = ',';
+        memcpy(pRow + nUsed, pValue, nLen);
+        nUsed += nLen;
+
+        while (*pText == ' ') pText++;
+        if (*pText == ')') break;
+        if (*pText++ != ',') return NULL;
+    }
+
+    pRow[nUsed] = '\0';
+    return nValues == pDB->nColumnCount ? pText + 1 : NULL;
+}
+
+// This function appends CSV row into table, packed values of typed columns and zones follow it.
+// Value which does not fit widens its column, keys of Bloom filters change then so all zones are rebuilt
+void insertRow(Database *pDB, const char *pText, UpdateMarks *pMarks)
+{
+    appendDatabase(pDB, pText);
+
+    int j, nLen = 0, nRow = pDB->nRowCount - 1;
+    const char *pRow = getRow(pDB, nRow)->sData;
+
+    for (j = 0; j < pDB->nColumnCount; j++)
+    {
+        Column *pCol = &pDB->pColumns[j];
+        int nType = pCol->nType;
+
+        const char *pField = nextField(&pRow, &nLen);
+        if (pField == NULL) widenColumn(pDB, pCol, nRow, TYPE_TEXT);
+        else storeColumnValue(pDB, pCol, nRow, nRow, pField, nLen);
+
+        if (pCol->nType != nType && pCol->pBloom != NULL) pMarks->pColumns[j] = 2;
+    }
+
+    addZoneRow(pDB, nRow);
+}
+
+// This function returns start of tuples of INSERT query "INSERT INTO table VALUES (...)", head of query is
+// tokenized so any whitespace may separate its words. NULL is returned if query has no such head
+const char* findInsertValues(const char *pQuery)
+{
+    Token *pTokens = queryAlloc(sizeof(Token) * (strlen(pQuery) + 1));
+    const char *pText = NULL;
+
+    if (tokenizeQuery(pQuery, pTokens) >= 4 && isKeyword(&pTokens[0], "INSERT") && isKeyword(&pTokens[1], "INTO") &&
+        pTokens[2].nType == TOKEN_WORD && isKeyword(&pTokens[3], "VALUES")) pText = pTokens[4].pText;
+
+    queryFree(pTokens);
+    return pText;
+}
+
+// This function executes INSERT query "INSERT INTO table VALUES (...), (...)", every tuple has value
+// of every column. All tuples are parsed before table is locked, rows are appended at the end of table.
+// Router sends INSERT to every shard and shard inserts only tuples of its own keys
+int executeInsertQuery(Database *pDB, char *pQuery, String *pResponse)
+{
+    const char *pText = findInsertValues(pQuery);
+    if (pText == NULL) return -1;
+
+    // Parsed rows follow each other with their terminators, followers of shard get only kept tuples
+    String rows, kept;
+    stringInit(&rows, DATA_MAX);
+    stringInit(&kept, DATA_MAX);
+    stringAppend(&kept, pQuery, (int)(pText - pQuery));
+    int i, nCount = 0, nSkipped = 0;
+    int nKeyColumn = shardKeyColumn(&g_catalog, pDB);
+
+    while (pText != NULL)
+    {
+        char sRow[DATA_MAX];
+        const char *pTuple = pText;
+        pText = parseTuple(pDB, pText, sRow, sizeof(sRow));
+        if (pText == NULL) break;
+
+        if (!isShardRow(&g_catalog, nKeyColumn, sRow))
+        {
+            nSkipped++;
+        }
+        else
+        {
+            if (nCount) stringAppend(&kept, ",", 1);
+            stringAppend(&kept, (char*)pTuple, (int)(pText - pTuple));
+            stringAppend(&rows, sRow, strlen(sRow) + 1);
+            nCount++;
+        }
+
+        while (*pText == ' ') pText++;
+        if (*pText != ',') break;
+        pText++;
+    }
+
+    // Nothing but terminator may follow the last tuple
+    while (pText != NULL && (*pText == ' ' || *pText == ';')) pText++;
+    if (pText == NULL || *pText != '\0' || !nCount)
+    {
+        stringClear(&rows);
+        stringClear(&kept);
+        if (pText == NULL || *pText != '\0') return -1;
+
+        // Every tuple belongs to other shards
+        stringAppend(pResponse, "Inserted 0 recordings", 21);
+        return 0;
+    }
+
+    // Lock database for writing
+    lockWrite(&pDB->rwLock);
+
+    UpdateMarks marks;
+    initUpdateMarks(pDB, &marks);
+
+    const char *pRow = rows.pData;
+    for (i = 0; i < nCount; i++)
+    {
+        insertRow(pDB, pRow, &marks);
+        pRow += strlen(pRow) + 1;
+    }
+
+    refreshZones(pDB, &marks);
+    __atomic_add_fetch(&pDB->nVersion, 1, __ATOMIC_RELEASE);
+    replicateWrite(pDB, nSkipped ? kept.pData : pQuery);
+
+    // Unlock database for writing
+    unlockRW(&pDB->rwLock);
+    stringClear(&rows);
+    stringClear(&kept);
+
+    char sResponse[DATA_MAX];
+    int nLen = snprintf(sResponse, sizeof(sResponse), "Inserted %d recordings", nCount);
+    stringAppend(pResponse, sResponse, nLen);
+    return nCount;
+}
+
+// This function executes DELETE query "DELETE FROM table WHERE predicate". Deleted rows get tombstones
+// and are skipped by scans, compaction thread removes them when enough rows of their partition are deleted
+int executeDeleteQuery(Database *pDB, char *pQuery, String *pResponse)
+{
+    // Lock database for writing, plan is bound to column types which writers may widen
+    lockWrite(&pDB->rwLock);
+
+    Plan *pPlan = acquirePlan(pDB, pQuery, STATEMENT_DELETE);
+    if (pPlan == NULL)
+    {
+        unlockRW(&pDB->rwLock);
+        return -1;
+    }
+
+    // Rows found before cancellation are deleted
+    int i, nDeleted = 0;
+    int *pMatches = runPlanRows(pDB, pPlan, &nDeleted);
+    for (i = 0; i < nDeleted; i++)
+    {
+        int nRow = pMatches != NULL ? pMatches[i] : i;
+        pDB->pDeleted[nRow >> 6] |= 1ULL << (nRow & 63);
+        pDB->pChunkDeleted[nRow / ZONE_ROWS]++;
+    }
+
+    // Compaction thread checks count of deleted rows without lock
+    __atomic_add_fetch(&pDB->nDeletedCount, nDeleted, __ATOMIC_RELAXED);
+    if (nDeleted) __atomic_add_fetch(&pDB->nVersion, 1, __ATOMIC_RELEASE);
+    if (nDeleted) replicateWrite(pDB, pQuery);
+
+    // Unlock database for writing
+    unlockRW(&pDB->rwLock);
+    queryFree(pMatches);
+    releasePlan(pPlan);
+
+    char sResponse[DATA_MAX];
+    int nLen = snprintf(sResponse, sizeof(sResponse), "Deleted %d recordings", nDeleted);
+    if (nDeleted) stringAppend(pResponse, sResponse, nLen);
+    return nDeleted;
+}
+
+////////////////////////////////////////////////////////////////////////
+// COMPACTION
+////////////////////////////////////////////////////////////////////////
+
+// This function exchanges rows, columns and tombstones of tables
+void swapTableData(Database *pA, Database *pB)
+{
+    Database temp;
+    temp.pChunks = pA->pChunks;
+    temp.pColumns = pA->pColumns;
+    temp.pDeleted = pA->pDeleted;
+    temp.pChunkDeleted = pA->pChunkDeleted;
+    temp.nRowCount = pA->nRowCount;
+    temp.nDeletedCount = pA->nDeletedCount;
+    temp.nChunkCount = pA->nChunkCount;
+
+    pA->pChunks = pB->pChunks;
+    pA->pColumns = pB->pColumns;
+    pA->pDeleted = pB->pDeleted;
+    pA->pChunkDeleted = pB->pChunkDeleted;
+    pA->nRowCount = pB->nRowCount;
+    pA->nDeletedCount = pB->nDeletedCount;
+    pA->nChunkCount = pB->nChunkCount;
+
+    pB->pChunks = temp.pChunks;
+    pB->pColumns = temp.pColumns;
+    pB->pDeleted = temp.pDeleted;
+    pB->pChunkDeleted = temp.pChunkDeleted;
+    pB->nRowCount = temp.nRowCount;
+    pB->nDeletedCount = temp.nDeletedCount;
+    pB->nChunkCount = temp.nChunkCount;
+}
+
+// This function builds compacted copy of table from the first partition nFirst, which is rewritten without
+// deleted rows together with all following partitions. Earlier chunks are shared and their values are copied
+void buildCompacted(Database *pDB, Database *pCopy, int nFirst)
+{
+    int i, j, nStart = nFirst * ZONE_ROWS;
+    size_t nCapacity = (size_t)pDB->nChunkSize * ZONE_ROWS;
+
+    memset(pCopy, 0, sizeof(Database));
+    pCopy->nColumnCount = pDB->nColumnCount;
+    pCopy->nChunkSize = pDB->nChunkSize;
+    pCopy->pChunks = calloc(pDB->nChunkSize, sizeof(RowData*));
+    pCopy->pColumns = calloc(pDB->nColumnCount + 1, sizeof(Column));
+    pCopy->pDeleted = calloc(nCapacity / 64, sizeof(uint64_t));
+    pCopy->pChunkDeleted = calloc(pDB->nChunkSize, sizeof(int));
+    if (pCopy->pChunks == NULL || pCopy->pColumns == NULL || pCopy->pDeleted == NULL || pCopy->pChunkDeleted == NULL)
+    {
+        logToFile(ERROR, "Can not alloc memory for compaction");
+        exitFailure(NULL);
+    }
+
+    memcpy(pCopy->pChunks, pDB->pChunks, sizeof(RowData*) * nFirst);
+    memcpy(pCopy->pDeleted, pDB->pDeleted, nStart / 8);
+    memcpy(pCopy->pChunkDeleted, pDB->pChunkDeleted, sizeof(int) * nFirst);
+    for (i = 0; i < nFirst; i++) pCopy->nDeletedCount += pDB->pChunkDeleted[i];
+    pCopy->nChunkCount = nFirst;
+    pCopy->nRowCount = nStart;
+
+    for (j = 0; j < pDB->nColumnCount; j++)
+    {
+        Column *pSrc = &pDB->pColumns[j], *pDst = &pCopy->pColumns[j];
+        pDst->nType = pSrc->nType;
+        pDst->nBloomWords = pSrc->nBloomWords;
+        pDst->nBloomHashes = pSrc->nBloomHashes;
+        pDst->pZones = malloc(sizeof(Zone) * pDB->nChunkSize);
+        if (pDst->nType != TYPE_TEXT) pDst->pInts = malloc(sizeof(int64_t) * nCapacity);
+        if (pSrc->pBloom != NULL) pDst->pBloom = malloc(sizeof(uint64_t) * pSrc->nBloomWords * pDB->nChunkSize);
+
+        if (pDst->pZones == NULL || (pDst->nType != TYPE_TEXT && pDst->pInts == NULL) ||
+            (pSrc->pBloom != NULL && pDst->pBloom == NULL))
+        {
+            logToFile(ERROR, "Can not alloc memory for compaction");
+            exitFailure(NULL);
+        }
+
+        memcpy(pDst->pZones, pSrc->pZones, sizeof(Zone) * nFirst);
+        if (pDst->pInts != NULL) memcpy(pDst->pInts, pSrc->pInts, sizeof(int64_t) * nStart);
+        if (pDst->pBloom != NULL) memcpy(pDst->pBloom, pSrc->pBloom, sizeof(uint64_t) * pSrc->nBloomWords * nFirst);
+    }
+
+    // Live rows are appended into fresh chunks with their packed values, so order of rows is kept
+    for (i = nStart; i < pDB->nRowCount; i++)
+    {
+        if (isRowDeleted(pDB, i)) continue;
+
+        int nRow = pCopy->nRowCount;
+        appendDatabase(pCopy, getRow(pDB, i)->sData);
+        for (j = 0; j < pDB->nColumnCount; j++)
+            if (pDB->pColumns[j].nType != TYPE_TEXT) pCopy->pColumns[j].pInts[nRow] = pDB->pColumns[j].pInts[i];
+    }
+
+    for (j = 0; j < pCopy->nColumnCount; j++)
+        for (i = nFirst; i < pCopy->nChunkCount; i++) buildColumnZone(pCopy, j, i);
+}
+
+// This function compacts table if deleted rows of any partition reach compaction percent. Compacted
+// partitions are built under read lock, so only writers wait for them, and replace the old ones under
+// short write lock unless table was changed meanwhile. Returns count of removed rows
+int compactTable(Catalog *pCatalog, Database *pDB)
+{
+    if (!__atomic_load_n(&pDB->nDeletedCount, __ATOMIC_RELAXED)) return 0;
+
+    lockRead(&pDB->rwLock);
+
+    int i, nFirst;
+    for (nFirst = 0; nFirst < pDB->nChunkCount; nFirst++)
+    {
+        int nDeleted = pDB->pChunkDeleted[nFirst];
+        if (nDeleted && nDeleted * 100 >= zoneRowCount(pDB, nFirst) * pCatalog->nCompactPercent) break;
+    }
+
+    if (nFirst == pDB->nChunkCount)
+    {
+        unlockRW(&pDB->rwLock);
+        return 0;
+    }
+
+    uint64_t nStartTime = monotonicTime();
+    unsigned long nVersion = pDB->nVersion;
+    Database compacted;
+    buildCompacted(pDB, &compacted, nFirst);
+    unlockRW(&pDB->rwLock);
+
+    // Every write changes version, then compacted copy is stale and is dropped
+    lockWrite(&pDB->rwLock);
+    uint64_t nLockTime = monotonicTime();
+    int nRemoved = pDB->nRowCount - compacted.nRowCount;
+    int isSwapped = pDB->nVersion == nVersion;
+
+    if (isSwapped)
+    {
+        swapTableData(pDB, &compacted);
+
+        // Rows of compacted partitions moved to lower positions, node ranges must not pass the end
+        for (i = 0; i <= pDB->nNodeCount; i++)
+            if (pDB->nNodeRows[i] > pDB->nRowCount) pDB->nNodeRows[i] = pDB->nRowCount;
+    }
+
+    nLockTime = monotonicTime() - nLockTime;
+    unlockRW(&pDB->rwLock);
+
+    // Shared chunks belong to both copies, only rewritten or replaced ones are freed
+    for (i = nFirst; i < compacted.nChunkCount; i++) free(compacted.pChunks[i]);
+    free(compacted.pChunks);
+    free(compacted.pDeleted);
+    free(compacted.pChunkDeleted);
+    destroyColumns(compacted.pColumns, compacted.nColumnCount);
+
+    if (!isSwapped) return 0;
+
+    __atomic_fetch_add(&g_stats.nCompactions, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&g_stats.nCompactedRows, nRemoved, __ATOMIC_RELAXED);
+    logToFile(INFO, "Table %s compacted from partition %d in %lu usecs (%lu usecs locked), %d deleted rows removed.",
+              pDB->sName, nFirst, (unsigned long)(monotonicTime() - nStartTime), (unsigned long)nLockTime, nRemoved);
+    return nRemoved;
+}
+
+// Compaction thread periodically rewrites partitions of tables with many deleted rows
+void* compactThread(void *pArg)
+{
+    Catalog *pCatalog = (Catalog*)pArg;
+    uint64_t nLastCheck = monotonicTime();
+
+    while (pCatalog->isCompactInit && !g_nInterrupted)
+    {
+        usleep(100000);
+        if (monotonicTime() - nLastCheck < (uint64_t)COMPACT_INTERVAL * 1000) continue;
+        nLastCheck = monotonicTime();
+
+        int i;
+        for (i = 0; i < pCatalog->nTableCount && !g_nInterrupted; i++)
+        {
+            Database *pDB = acquireTable(pCatalog, i);
+            compactTable(pCatalog, pDB);
+            releaseTable(pDB);
+        }
+    }
+
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////
+// REPLICATION
+////////////////////////////////////////////////////////////////////////
+
+// This function initializes replication state, pPrimary is NULL unless server follows a primary
+void initReplication(Replication *pRepl, const char *pPrimary)
+{
+    initMutex(&pRepl->mutex);
+    if (pthread_cond_init(&pRepl->cond, NULL))
+    {
+        logToFile(ERROR, "Can not init condition variable");
+        exitFailure(NULL);
+    }
+
+    pRepl->pFollowers = NULL;
+    pRepl->nSeq = 0;
+    pRepl->nFollowerCount = 0;
+    pRepl->pPrimary = pPrimary;
+    pRepl->nAppliedSeq = 0;
+    pRepl->nPrimaryTime = 0;
+    pRepl->nPrimarySocket = -1;
+    pRepl->isSynced = 0;
+    pRepl->isThreadInit = 0;
+    pRepl->isInit = 1;
+}
+
+// This function writes value into nBytes bytes of buffer, the most significant byte first
+void encodeBigEndian(unsigned char *pBuffer, uint64_t nValue, int nBytes)
+{
+    int i;
+    for (i = nBytes - 1; i >= 0; i--)
+    {
+        pBuffer[i] = nValue & 0xff;
+        nValue >>= 8;
+    }
+}
+
+// This function reads value of nBytes bytes written by encodeBigEndian
+uint64_t decodeBigEndian(const unsigned char *pBuffer, int nBytes)
+{
+    uint64_t nValue = 0;
+    int i;
+    for (i = 0; i < nBytes; i++) nValue = (nValue << 8) | pBuffer[i];
+    return nValue;
+}
+
+// This function serializes header of replication message, so primary and follower
+// do not depend on struct layout or byte order of each other
+void encodeReplicaHeader(const ReplicaHeader *pHeader, unsigned char *pBuffer)
+{
+    encodeBigEndian(pBuffer, (uint32_t)pHeader->nType, 4);
+    encodeBigEndian(pBuffer + 4, (uint32_t)pHeader->nSlot, 4);
+    encodeBigEndian(pBuffer + 8, (uint32_t)pHeader->nLength, 4);
+    encodeBigEndian(pBuffer + 12, (uint32_t)pHeader->nReserved, 4);
+    encodeBigEndian(pBuffer + 16, pHeader->nSeq, 8);
+    encodeBigEndian(pBuffer + 24, pHeader->nTime, 8);
+}
+
+// This function parses header serialized by encodeReplicaHeader
+void decodeReplicaHeader(const unsigned char *pBuffer, ReplicaHeader *pHeader)
+{
+    pHeader->nType = (int32_t)decodeBigEndian(pBuffer, 4);
+    pHeader->nSlot = (int32_t)decodeBigEndian(pBuffer + 4, 4);
+    pHeader->nLength = (int32_t)decodeBigEndian(pBuffer + 8, 4);
+    pHeader->nReserved = (int32_t)decodeBigEndian(pBuffer + 12, 4);
+    pHeader->nSeq = decodeBigEndian(pBuffer + 16, 8);
+    pHeader->nTime = decodeBigEndian(pBuffer + 24, 8);
+}
+
+// This function appends message with its header to the log of follower
+void appendMessage(String *pLog, int nType, int nSlot, uint64_t nSeq, const char *pData, int nLength)
+{
+    ReplicaHeader header;
+    memset(&header, 0, sizeof(header));
+    header.nType = nType;
+    header.nSlot = nSlot;
+    header.nLength = nLength;
+    header.nSeq = nSeq;
+    header.nTime = wallTime();
+
+    unsigned char sHeader[REPLICA_HEADER_SIZE];
+    encodeReplicaHeader(&header, sHeader);
+    stringAppend(pLog, (char*)sHeader, sizeof(sHeader));
+    if (nLength) stringAppend(pLog, (char*)pData, nLength);
+}
+
+// This function writes table name, columns, column types and live rows into snapshot, one per line.
+// Table must be locked, snapshot string is initialized here
+void buildSnapshot(Database *pDB, String *pSnapshot)
+{
+    int i, nLength = 0;
+    char sTypes[DATA_MAX];
+    for (i = 0; i < pDB->nColumnCount && nLength < (int)sizeof(sTypes) - 2; i++)
+        nLength += snprintf(sTypes + nLength, sizeof(sTypes) - nLength, "%s%d", i ? "," : "", pDB->pColumns[i].nType);
+
+    // Size is counted first, rows are appended without reallocation
+    size_t nSize = strlen(pDB->sName) + strlen(pDB->sColumns) + nLength + 3;
+    for (i = 0; i < pDB->nRowCount; i++)
+        if (!isRowDeleted(pDB, i)) nSize += strlen(getRow(pDB, i)->sData) + 1;
+
+    stringInit(pSnapshot, nSize);
+    stringAppend(pSnapshot, pDB->sName, strlen(pDB->sName));
+    stringAppend(pSnapshot, "\n", 1);
+    stringAppend(pSnapshot, pDB->sColumns, strlen(pDB->sColumns));
+    stringAppend(pSnapshot, "\n", 1);
+    stringAppend(pSnapshot, sTypes, nLength);
+    stringAppend(pSnapshot, "\n", 1);
+
+    for (i = 0; i < pDB->nRowCount; i++)
+    {
+        if (isRowDeleted(pDB, i)) continue;
+
+        char *pRow = getRow(pDB, i)->sData;
+        stringAppend(pSnapshot, pRow, strlen(pRow));
+        stringAppend(pSnapshot, "\n", 1);
+    }
+}
+
+// This function queues message to every follower which has snapshot of the table, follower
+// which can not keep up with writes is disconnected and gets new snapshots when it reconnects.
+// Replication mutex must be locked
+void shipMessage(Replication *pRepl, int nType, int nSlot, const char *pData, int nLength)
+{
+    Follower *pFollower;
+    for (pFollower = pRepl->pFollowers; pFollower != NULL; pFollower = pFollower->pNext)
+    {
+        if (pFollower->isClosed || !((pFollower->nTables >> nSlot) & 1)) continue;
+
+        if (nType == REPLICA_MSG_WRITE && pFollower->log.nUsed > REPLICA_LOG_MAX)
+        {
+            logToFile(INFO, "Follower is too far behind, it is disconnected.");
+            pFollower->isClosed = 1;
+            shutdown(pFollower->nSocket, SHUT_RDWR);
+            continue;
+        }
+
+        appendMessage(&pFollower->log, nType, nSlot, pRepl->nSeq, pData, nLength);
+    }
+
+    pthread_cond_broadcast(&pRepl->cond);
+}
+
+// This function returns 1 if table is the current version in its catalog position
+int isCurrentTable(Catalog *pCatalog, Database *pDB)
+{
+    lockMutex(&pCatalog->mutex);
+    int isCurrent = pDB->nSlot < pCatalog->nTableCount && pCatalog->pTables[pDB->nSlot] == pDB;
+    unlockMutex(&pCatalog->mutex);
+    return isCurrent;
+}
+
+// This function ships applied write to followers. It is called while table is locked for writing, so
+// followers apply writes of every table in the same order. Write which was cancelled halfway can not
+// be repeated by followers, snapshot of the table is shipped instead. Snapshot is built before
+// replication mutex is locked, so writes of other tables are not shipped meanwhile
+void replicateWrite(Database *pDB, const char *pQuery)
+{
+    Replication *pRepl = &g_replica;
+
+    // Follower which registers later gets this write in snapshot, it waits for the table lock
+    if (!__atomic_load_n(&pRepl->nFollowerCount, __ATOMIC_RELAXED)) return;
+
+    int isCancelled = t_pQuery != NULL && t_pQuery->nCancelled;
+    String snapshot;
+    if (isCancelled) buildSnapshot(pDB, &snapshot);
+
+    lockMutex(&pRepl->mutex);
+
+    // Write to version replaced by reload is lost, followers already have the new version
+    if (isCurrentTable(&g_catalog, pDB))
+    {
+        pRepl->nSeq++;
+        if (isCancelled) shipMessage(pRepl, REPLICA_MSG_TABLE, pDB->nSlot, snapshot.pData, snapshot.nUsed);
+        else shipMessage(pRepl, REPLICA_MSG_WRITE, pDB->nSlot, pQuery, strlen(pQuery));
+    }
+
+    unlockMutex(&pRepl->mutex);
+    if (isCancelled) stringClear(&snapshot);
+}
+
+// This function makes new version of table current, old version is freed after its last query.
+// New table of follower may take the next free position. Followers get snapshot of the new version,
+// it is built before any lock is taken because nobody can write to the version which is not installed
+void installTable(Catalog *pCatalog, Database *pNew)
+{
+    Replication *pRepl = &g_replica;
+
+    String snapshot;
+    int isSnapshot = __atomic_load_n(&pRepl->nFollowerCount, __ATOMIC_RELAXED) > 0;
+    if (isSnapshot) buildSnapshot(pNew, &snapshot);
+
+    // Writes to new version are shipped after its snapshot
+    lockRead(&pNew->rwLock);
+    lockMutex(&pRepl->mutex);
+
+    lockMutex(&pCatalog->mutex);
+    Database *pOld = pNew->nSlot < pCatalog->nTableCount ? pCatalog->pTables[pNew->nSlot] : NULL;
+
+    // New version is far above old one, so responses cached from old data never match
+    if (pOld != NULL) pNew->nVersion = __atomic_load_n(&pOld->nVersion, __ATOMIC_ACQUIRE) + RELOAD_VERSION_STEP;
+
+    // Plans of old version are not reused, even if columns of new version have the same names and types
+    pNew->nSchemaEpoch = nextSchemaEpoch();
+    pCatalog->pTables[pNew->nSlot] = pNew;
+    if (pNew->nSlot >= pCatalog->nTableCount) pCatalog->nTableCount = pNew->nSlot + 1;
+    unlockMutex(&pCatalog->mutex);
+
+    // Follower registered meanwhile is rare, its snapshot is built under the lock
+    if (pRepl->pFollowers != NULL)
+    {
+        if (!isSnapshot) buildSnapshot(pNew, &snapshot);
+        isSnapshot = 1;
+        shipMessage(pRepl, REPLICA_MSG_TABLE, pNew->nSlot, snapshot.pData, snapshot.nUsed);
+    }
+
+    unlockMutex(&pRepl->mutex);
+    unlockRW(&pNew->rwLock);
+    if (isSnapshot) stringClear(&snapshot);
+
+    // Queries which use old version finish on it, the last one frees it
+    releaseTable(pOld);
+}
+
+// This function sends whole buffer, returns 0 if connection failed
+int sendAll(int nSocket, const char *pData, int nLength)
+{
+    while (nLength > 0)
+    {
+        ssize_t nSent = send(nSocket, pData, nLength, MSG_NOSIGNAL);
+        statsSyscalls(1);
+        if (nSent <= 0) return 0;
+
+        pData += nSent;
+        nLength -= nSent;
+    }
+
+    return 1;
+}
+
+// This function receives exactly nLength bytes, returns 0 if connection failed or was closed
+int recvAll(int nSocket, void *pData, int nLength)
+{
+    char *ptr = (char*)pData;
+    while (nLength > 0)
+    {
+        ssize_t nRead = recv(nSocket, ptr, nLength, 0);
+        if (nRead <= 0) return 0;
+
+        ptr += nRead;
+        nLength -= nRead;
+    }
+
+    return 1;
+}
+
+// Sender thread writes queued messages of its follower, idle stream gets heartbeats
+void* senderThread(void *pArg)
+{
+    Follower *pFollower = (Follower*)pArg;
+    Replication *pRepl = &g_replica;
+    lockMutex(&pRepl->mutex);
+
+    while (!pFollower->isClosed && pRepl->isInit)
+    {
+        if (!pFollower->log.nUsed && !waitConditionTimed(&pRepl->cond, &pRepl->mutex, REPLICA_HEARTBEAT))
+            appendMessage(&pFollower->log, REPLICA_MSG_PING, -1, pRepl->nSeq, NULL, 0);
+        if (!pFollower->log.nUsed || pFollower->isClosed || !pRepl->isInit) continue;
+
+        // Queued messages are sent without lock, writers append to the new log meanwhile
+        String log = pFollower->log;
+        stringInit(&pFollower->log, DATA_MAX);
+        unlockMutex(&pRepl->mutex);
+
+        int isSent = sendAll(pFollower->nSocket, log.pData, log.nUsed);
+        stringClear(&log);
+
+        lockMutex(&pRepl->mutex);
+        if (!isSent) pFollower->isClosed = 1;
+    }
+
+    pFollower->isDone = 1;
+    pRepl->nFollowerCount--;
+    unlockMutex(&pRepl->mutex);
+    logToFile(INFO, "Follower disconnected.");
+    return NULL;
+}
+
+// This function joins sender threads which have stopped and frees their followers,
+// replication mutex must be locked
+void reapFollowers(Replication *pRepl)
+{
+    Follower **ppFollower = &pRepl->pFollowers;
+    while (*ppFollower != NULL)
+    {
+        Follower *pFollower = *ppFollower;
+        if (!pFollower->isDone)
+        {
+            ppFollower = &pFollower->pNext;
+            continue;
+        }
+
+        *ppFollower = pFollower->pNext;
+        pthread_join(pFollower->thread, NULL);
+        close(pFollower->nSocket);
+        stringClear(&pFollower->log);
+        free(pFollower);
+    }
+}
+
+// This function executes REPLICATE request, its connection becomes replication stream of new follower.
+// Snapshot of every table is queued under its read lock, so follower gets every later write of the table
+// after the snapshot. Connection is kept by sender thread, nothing is replied here
+int executeReplicateQuery(Catalog *pCatalog, Request *pReq, String *pResponse)
+{
+    Replication *pRepl = &g_replica;
+    Follower *pFollower = calloc(1, sizeof(Follower));
+    if (pFollower == NULL)
+    {
+        logToFile(ERROR, "Can not alloc memory for follower");
+        exitFailure(NULL);
+    }
+
+    stringInit(&pFollower->log, DATA_MAX);
+    pFollower->nSocket = pReq->nClientFD;
+
+    lockMutex(&pRepl->mutex);
+    reapFollowers(pRepl);
+
+    if (pthread_create(&pFollower->thread, NULL, senderThread, pFollower))
+    {
+        unlockMutex(&pRepl->mutex);
+        logToFile(ERROR, "Can not create sender thread");
+        stringClear(&pFollower->log);
+        free(pFollower);
+
+        char *pMessage = "Can not start replication";
+        stringAppend(pResponse, pMessage, strlen(pMessage));
+        return STATUS_BUSY;
+    }
+
+    pFollower->pNext = pRepl->pFollowers;
+    pRepl->pFollowers = pFollower;
+    pRepl->nFollowerCount++;
+    unlockMutex(&pRepl->mutex);
+
+    // Connection belongs to sender thread now
+    pReq->nClientFD = -1;
+
+    int i;
+    for (i = 0; i < pCatalog->nTableCount; i++)
+    {
+        Database *pDB = acquireTable(pCatalog, i);
+        lockRead(&pDB->rwLock);
+
+        String snapshot;
+        buildSnapshot(pDB, &snapshot);
+
+        lockMutex(&pRepl->mutex);
+        int isCurrent = isCurrentTable(pCatalog, pDB);
+        if (isCurrent)
+        {
+            appendMessage(&pFollower->log, REPLICA_MSG_TABLE, i, pRepl->nSeq, snapshot.pData, snapshot.nUsed);
+            pFollower->nTables |= 1ULL << i;
+            pthread_cond_broadcast(&pRepl->cond);
+        }
+
+        unlockMutex(&pRepl->mutex);
+        unlockRW(&pDB->rwLock);
+        releaseTable(pDB);
+        stringClear(&snapshot);
+
+        // Table was reloaded meanwhile, snapshot of its new version is taken
+        if (!isCurrent) i--;
+    }
+
+    lockMutex(&pRepl->mutex);
+    appendMessage(&pFollower->log, REPLICA_MSG_READY, -1, pRepl->nSeq, NULL, 0);
+    pthread_cond_broadcast(&pRepl->cond);
+    unlockMutex(&pRepl->mutex);
+
+    logToFile(INFO, "Follower registered, snapshots of %d tables are queued.", pCatalog->nTableCount);
+    return pCatalog->nTableCount;
+}
+
+// This function connects socket in nTimeout msecs. Connect does not block, so unreachable server holds
+// the caller only until timeout. Socket is blocking again when connected, returns 0 on failure
+int connectTimed(int nSocket, const struct sockaddr *pAddr, socklen_t nAddrLength, int nTimeout)
+{
+    int nFlags = fcntl(nSocket, F_GETFL);
+    if (nFlags < 0 || fcntl(nSocket, F_SETFL, nFlags | O_NONBLOCK) < 0) return 0;
+
+    int nError = 0;
+    if (connect(nSocket, pAddr, nAddrLength))
+    {
+        if (errno != EINPROGRESS) return 0;
+
+        struct pollfd pfd;
+        pfd.fd = nSocket;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+
+        int nReady = poll(&pfd, 1, nTimeout);
+        socklen_t nLength = sizeof(nError);
+        if (nReady <= 0 || getsockopt(nSocket, SOL_SOCKET, SO_ERROR, &nError, &nLength) < 0) return 0;
+    }
+
+    return !nError && fcntl(nSocket, F_SETFL, nFlags) == 0;
+}
+
+// This function connects to server given as host:port in nTimeout msecs, returns socket or -1
+int connectServer(const char *pAddress, int nTimeout)
+{
+    char sHost[DATA_MAX];
+    snprintf(sHost, sizeof(sHost), "%s", pAddress);
+
+    char *pPort = strrchr(sHost, ':');
+    if (pPort == NULL) return -1;
+    *pPort++ = '\0';
+
+    struct addrinfo hints, *pInfo = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(sHost, pPort, &hints, &pInfo) || pInfo == NULL) return -1;
+
+    int nSocket = socket(pInfo->ai_family, pInfo->ai_socktype, pInfo->ai_protocol);
+    if (nSocket >= 0 && !connectTimed(nSocket, pInfo->ai_addr, pInfo->ai_addrlen, nTimeout))
+    {
+        close(nSocket);
+        nSocket = -1;
+    }
+
+    freeaddrinfo(pInfo);
+    return nSocket;
+}
+
+// This function connects to primary given as host:port and sends REPLICATE request, returns socket or -1
+int connectPrimary(const char *pPrimary)
+{
+    int nSocket = connectServer(pPrimary, CONNECT_TIMEOUT);
+    if (nSocket >= 0 && !sendAll(nSocket, "REPLICATE", 9))
+    {
+        close(nSocket);
+        nSocket = -1;
+    }
+
+    return nSocket;
+}
+
+// This function loads table from snapshot of primary. Column types of primary are kept,
+// so follower compares values the same way. Returns NULL if snapshot is invalid
+Database* loadSnapshot(Catalog *pCatalog, int nSlot, char *pData)
+{
+    char *pName = strsep(&pData, "\n");
+    char *pColumns = strsep(&pData, "\n");
+    char *pTypes = strsep(&pData, "\n");
+    if (pData == NULL || nSlot < 0 || nSlot >= TABLES_MAX || nSlot > pCatalog->nTableCount) return NULL;
+
+    Database *pDB = (Database*)calloc(1, sizeof(Database));
+    if (pDB == NULL)
+    {
+        logToFile(ERROR, "Can not alloc memory for table");
+        exitFailure(NULL);
+    }
+
+    snprintf(pDB->sName, sizeof(pDB->sName), "%s", pName);
+    snprintf(pDB->sPath, sizeof(pDB->sPath), "%s", g_replica.pPrimary);
+    pDB->nSlot = nSlot;
+    initDatabase(pDB);
+    parseColumns(pDB, pColumns);
+
+    // Every line is a row, the last one ends with new line too
+    char *pRow;
+    while (pData != NULL && *pData != '\0' && (pRow = strsep(&pData, "\n")) != NULL) appendDatabase(pDB, pRow);
+
+    if (!typeColumns(pDB))
+    {
+        destroyDatabase(pDB);
+        free(pDB);
+        return NULL;
+    }
+
+    // Column is wider on primary if it was widened by writes
+    int i;
+    for (i = 0; i < pDB->nColumnCount && pTypes != NULL; i++)
+    {
+        int nType = atoi(strsep(&pTypes, ","));
+        Column *pCol = &pDB->pColumns[i];
+        if (nType == TYPE_TEXT || (pCol->nType == TYPE_INT && nType == TYPE_DOUBLE))
+            widenColumn(pDB, pCol, pDB->nRowCount, nType);
+    }
+
+    if (!addBlooms(pCatalog, pDB))
+    {
+        destroyDatabase(pDB);
+        free(pDB);
+        return NULL;
+    }
+
+    placeDatabase(pDB);
+    return pDB;
+}
+
+// This function applies message of primary, returns 0 if stream is invalid
+int applyMessage(Catalog *pCatalog, ReplicaHeader *pHeader, char *pData)
+{
+    Replication *pRepl = &g_replica;
+    Database *pDB = NULL;
+
+    if (pHeader->nType == REPLICA_MSG_TABLE)
+    {
+        pDB = loadSnapshot(pCatalog, pHeader->nSlot, pData);
+        if (pDB == NULL) return 0;
+
+        logToFile(INFO, "Snapshot of table %s received with %d records.", pDB->sName, pDB->nRowCount);
+        installTable(pCatalog, pDB);
+    }
+    else if (pHeader->nType == REPLICA_MSG_WRITE)
+    {
+        pDB = acquireTable(pCatalog, pHeader->nSlot);
+        if (pDB == NULL) return 0;
+
+        String response;
+        stringInit(&response, DATA_MAX);
+        if (!strncmp(pData, "UPDATE ", 7)) executeUpdateQuery(pDB, pData, &response);
+        else if (!strncmp(pData, "INSERT ", 7)) executeInsertQuery(pDB, pData, &response);
+        else if (!strncmp(pData, "DELETE ", 7)) executeDeleteQuery(pDB, pData, &response);
+
+        stringClear(&response);
+        releaseTable(pDB);
+    }
+    else if (pHeader->nType == REPLICA_MSG_READY && !pRepl->isSynced)
+    {
+        logToFile(INFO, "Snapshots of %d tables received from primary %s.", pCatalog->nTableCount, pRepl->pPrimary);
+        __atomic_store_n(&pRepl->isSynced, 1, __ATOMIC_RELEASE);
+    }
+
+    // Heartbeat only tells that primary is alive
+    if (pHeader->nType != REPLICA_MSG_PING) __atomic_store_n(&pRepl->nAppliedSeq, pHeader->nSeq, __ATOMIC_RELAXED);
+    __atomic_store_n(&pRepl->nPrimaryTime, pHeader->nTime, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// Follower thread receives snapshots and writes of primary and applies them,
+// lost connection is reconnected and tables are replaced by new snapshots
+void* followerThread(void *pArg)
+{
+    Catalog *pCatalog = (Catalog*)pArg;
+    Replication *pRepl = &g_replica;
+
+    while (pRepl->isThreadInit && !g_nInterrupted)
+    {
+        int nSocket = connectPrimary(pRepl->pPrimary);
+        if (nSocket < 0)
+        {
+            int i;
+            for (i = 0; i < REPLICA_RETRY / 100 && pRepl->isThreadInit && !g_nInterrupted; i++) usleep(100000);
+            continue;
+        }
+
+        lockMutex(&pRepl->mutex);
+        pRepl->nPrimarySocket = nSocket;
+        unlockMutex(&pRepl->mutex);
+        logToFile(INFO, "Connected to primary %s.", pRepl->pPrimary);
+
+        ReplicaHeader header;
+        unsigned char sHeader[REPLICA_HEADER_SIZE];
+        while (pRepl->isThreadInit && recvAll(nSocket, sHeader, sizeof(sHeader)))
+        {
+            // Length is checked before payload is allocated, invalid one breaks the stream
+            decodeReplicaHeader(sHeader, &header);
+            if (header.nLength < 0 || header.nLength > REPLICA_MESSAGE_MAX)
+            {
+                errno = EBADMSG;
+                logToFile(ERROR, "Replication message of %d bytes is not valid", header.nLength);
+                break;
+            }
+
+            char *pData = malloc(header.nLength + 1);
+            if (pData == NULL)
+            {
+                logToFile(ERROR, "Can not alloc memory for replication message");
+                exitFailure(NULL);
+            }
+
+            int isValid = recvAll(nSocket, pData, header.nLength);
+            if (isValid)
+            {
+                pData[header.nLength] = '\0';
+                isValid = applyMessage(pCatalog, &header, pData);
+            }
+
+            free(pData);
+            if (!isValid) break;
+        }
+
+        lockMutex(&pRepl->mutex);
+        pRepl->nPrimarySocket = -1;
+        unlockMutex(&pRepl->mutex);
+
+        close(nSocket);
+        logToFile(INFO, "Connection to primary %s is lost.", pRepl->pPrimary);
+    }
+
+    return NULL;
+}
+
+// This function stops follower thread and sender threads of followers and frees replication state
+void destroyReplication(Replication *pRepl)
+{
+    if (!pRepl->isInit) return;
+
+    // Blocked receive of follower thread is woken by shutdown
+    if (pRepl->isThreadInit)
+    {
+        lockMutex(&pRepl->mutex);
+        pRepl->isThreadInit = 0;
+        if (pRepl->nPrimarySocket >= 0) shutdown(pRepl->nPrimarySocket, SHUT_RDWR);
+        unlockMutex(&pRepl->mutex);
+        pthread_join(pRepl->thread, NULL);
+    }
+
+    lockMutex(&pRepl->mutex);
+    pRepl->isInit = 0;
+    pthread_cond_broadcast(&pRepl->cond);
+
+    Follower *pFollower;
+    for (pFollower = pRepl->pFollowers; pFollower != NULL; pFollower = pFollower->pNext)
+        shutdown(pFollower->nSocket, SHUT_RDWR);
+
+    unlockMutex(&pRepl->mutex);
+
+    // Sender threads stop when their send fails or they wake up
+    while (pRepl->pFollowers != NULL)
+    {
+        pFollower = pRepl->pFollowers;
+        pRepl->pFollowers = pFollower->pNext;
+        pthread_join(pFollower->thread, NULL);
+        close(pFollower->nSocket);
+        stringClear(&pFollower->log);
+        free(pFollower);
+    }
+
+    pthread_mutex_destroy(&pRepl->mutex);
+    pthread_cond_destroy(&pRepl->cond);
+}
+
+////////////////////////////////////////////////////////////////////////
+// RELOAD
+////////////////////////////////////////////////////////////////////////
+
+// Reload thread loads new versions of tables from their files and swaps them into catalog
+void* reloadThread(void *pArg)
+{
+    Catalog *pCatalog = (Catalog*)pArg;
+    uint64_t nStartTime = monotonicTime();
+    int i, nReloaded = 0;
+
+    int nFirst = pCatalog->nReloadSlot < 0 ? 0 : pCatalog->nReloadSlot;
+    int nLast = pCatalog->nReloadSlot < 0 ? pCatalog->nTableCount : nFirst + 1;
+
+    Database *pTables[TABLES_MAX];
+    LoadTask task;
+    task.pCatalog = pCatalog;
+    task.pTables = pTables;
+    task.nCount = 0;
+
+    for (i = nFirst; i < nLast; i++)
+    {
+        Database *pDB = (Database*)calloc(1, sizeof(Database));
+        if (pDB == NULL)
+        {
+            logToFile(ERROR, "Can not alloc memory for table");
+            exitFailure(NULL);
+        }
+
+        // Only reload thread replaces tables, so current version can be read without lock
+        memcpy(pDB->sName, pCatalog->pTables[i]->sName, sizeof(pDB->sName));
+        memcpy(pDB->sPath, pCatalog->pTables[i]->sPath, sizeof(pDB->sPath));
+        pDB->nSlot = i;
+        initDatabase(pDB);
+        pTables[task.nCount++] = pDB;
+    }
+
+    logToFile(INFO, "Reloading %d datasets...", task.nCount);
+    loadTables(&task);
+
+    for (i = 0; i < task.nCount; i++)
+    {
+        Database *pNew = pTables[i];
+        if (!task.nLoaded[i])
+        {
+            logToFile(ERROR, "Can not reload table %s, old version is kept", pNew->sName);
+            destroyDatabase(pNew);
+            free(pNew);
+            continue;
+        }
+
+        installTable(pCatalog, pNew);
+        nReloaded++;
+    }
+
+    __atomic_fetch_add(&g_stats.nReloads, nReloaded, __ATOMIC_RELAXED);
+    logToFile(INFO, "%d of %d datasets reloaded in %lu usecs.", nReloaded, task.nCount,
+              (unsigned long)(monotonicTime() - nStartTime));
+
+    lockMutex(&pCatalog->mutex);
+    pCatalog->isReloading = 0;
+    unlockMutex(&pCatalog->mutex);
+    return NULL;
+}
+
+// This function starts reload of table in catalog position, -1 reloads all tables. Returns count
+// of tables being reloaded, 0 if reload is already in progress and -1 if it can not be started
+int startReload(Catalog *pCatalog, int nSlot)
+{
+    lockMutex(&pCatalog->mutex);
+    if (pCatalog->isReloading)
+    {
+        unlockMutex(&pCatalog->mutex);
+        return 0;
+    }
+
+    // Previous reload thread has finished already, it only has to be joined
+    if (pCatalog->isReloadInit) pthread_join(pCatalog->reloadThread, NULL);
+
+    pCatalog->nReloadSlot = nSlot;
+    pCatalog->isReloading = 1;
+    pCatalog->isReloadInit = 1;
+
+    if (pthread_create(&pCatalog->reloadThread, NULL, reloadThread, pCatalog))
+    {
+        logToFile(ERROR, "Can not create reload thread");
+        pCatalog->isReloading = 0;
+        pCatalog->isReloadInit = 0;
+        unlockMutex(&pCatalog->mutex);
+        return -1;
+    }
+
+    unlockMutex(&pCatalog->mutex);
+    return nSlot < 0 ? pCatalog->nTableCount : 1;
+}
+
+// This function executes RELOAD query, "RELOAD" reloads all tables and "RELOAD <table>" one of them.
+// Tables are loaded in background, so response only tells that reload has started
+int executeReloadQuery(Catalog *pCatalog, const char *pQuery, String *pResponse)
+{
+    int nSlot = -1;
+    if (pQuery[6] == ' ')
+    {
+        nSlot = findTableSlot(pCatalog, pQuery + 7);
+        if (nSlot < 0)
+        {
+            stringAppend(pResponse, "Unknown table: ", 15);
+            return STATUS_INVALID;
+        }
+    }
+
+    int nCount = startReload(pCatalog, nSlot);
+    if (nCount <= 0)
+    {
+        char *pMessage = nCount < 0 ? "Can not start reload" : "Reload is already in progress";
+        stringAppend(pResponse, pMessage, strlen(pMessage));
+        return STATUS_BUSY;
+    }
+
+    char sMessage[64];
+    int nLen = snprintf(sMessage, sizeof(sMessage), "Reload of %d tables started", nCount);
+    stringAppend(pResponse, sMessage, nLen);
+    return nCount;
+}
+
+// Signal thread waits SIGHUP, which reloads all tables like RELOAD query
+void* signalThread(void *pArg)
+{
+    Catalog *pCatalog = (Catalog*)pArg;
+    sigset_t sigSet;
+    sigemptyset(&sigSet);
+    sigaddset(&sigSet, SIGHUP);
+
+    while (pCatalog->isSignalInit && !g_nInterrupted)
+    {
+        int nSignal = 0;
+        if (sigwait(&sigSet, &nSignal) || !pCatalog->isSignalInit) break;
+
+        // Tables of follower are replaced by snapshots of primary only
+        if (g_replica.pPrimary != NULL)
+        {
+            logToFile(INFO, "SIGHUP received, follower does not reload datasets.");
+            continue;
+        }
+
+        logToFile(INFO, "SIGHUP received, reloading all datasets.");
+        if (!startReload(pCatalog, -1)) logToFile(INFO, "Reload is already in progress.");
+    }
+
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////
+// BATCH
+////////////////////////////////////////////////////////////////////////
+
+// UPDATE statement of BATCH request
+typedef struct {
+    Database *pDB;
+    Plan *pPlan;
+    UpdateSet *pSets;   // New values and condition of plan
+    Predicate *pWhere;
+    char *pText;        // Statement text, it is shipped to followers
+    TypedValue key;     // WHERE value of statement executed by grouped scan
+    uint64_t nKeyHash;
+    int nSetCount;
+    int nUpdated;
+    int nWidened;       // Columns of sets are widened when the first row matches
+} BatchStatement;
+
+// This function compiles plan of statement again if earlier statement of batch changed type of column, because
+// programs of plan are specialised to column types. Returns 0 and leaves plan NULL if statement is not valid
+// for new types anymore
+int rebindStatement(BatchStatement *pStmt)
+{
+    if (pStmt->pPlan == NULL) return 0;
+    if (isPlanCurrent(pStmt->pDB, pStmt->pPlan)) return 1;
+
+    freePlan(pStmt->pPlan);
+    pStmt->pPlan = compilePlan(pStmt->pDB, pStmt->pText, STATEMENT_UPDATE, 0);
+    if (pStmt->pPlan == NULL) return 0;
+
+    pStmt->pSets = pStmt->pPlan->pSets;
+    pStmt->pWhere = &pStmt->pPlan->options.where;
+    pStmt->nSetCount = pStmt->pPlan->nSetCount;
+    return 1;
+}
+
+// This function reads rest of request body which did not fit into the first read, query deadline
+// is checked between reads. Whole body must arrive in REQUEST_BODY_TIMEOUT msecs, so client which
+// trickles bytes does not hold the worker. Returns 0 if body is not complete
+int readRequestBody(Request *pReq, char *pBody, int nLength, int nReceived)
+{
+    uint64_t nEnd = monotonicTime() + (uint64_t)REQUEST_BODY_TIMEOUT * 1000;
+
+    while (nReceived < nLength)
+    {
+        if (isBlockCancelled()) return 0;
+
+        uint64_t nNow = monotonicTime();
+        if (nNow >= nEnd)
+        {
+            errno = ETIMEDOUT;
+            return 0;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = pReq->nClientFD;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        int nWait = (nEnd - nNow + 999) / 1000;
+        int nReady = poll(&pfd, 1, nWait < REQUEST_READ_TIMEOUT ? nWait : REQUEST_READ_TIMEOUT);
+        ssize_t nRead = nReady > 0 ? recv(pReq->nClientFD, pBody + nReceived, nLength - nReceived, 0) : -1;
+        statsSyscalls(nReady > 0 ? 2 : 1);
+        if (nRead <= 0) return 0;
+
+        nReceived += nRead;
+    }
+
+    pBody[nLength] = '\0';
+    return 1;
+}
+
+// This function splits batch body into statements separated by ';' or new line,
+// separators in quoted values are kept. Returns count of statements saved in pStarts
+int splitStatements(char *pBody, char **pStarts)
+{
+    int nCount = 0, isQuoted = 0;
+    char *pStart = pBody, *ptr;
+
+    for (ptr = pBody; ; ptr++)
+    {
+        if (*ptr == '\'') isQuoted = !isQuoted;
+        if (*ptr != '\0' && (isQuoted || (*ptr != ';' && *ptr != '\n'))) continue;
+
+        int isEnd = *ptr == '\0';
+        *ptr = '\0';
+
+        // Spaces around statement are removed, empty statements are skipped
+        while (*pStart == ' ' || *pStart == '\r') pStart++;
+        char *pLast = ptr;
+        while (pLast > pStart && (pLast[-1] == ' ' || pLast[-1] == '\r')) *--pLast = '\0';
+        if (*pStart != '\0') pStarts[nCount++] = pStart;
+
+        if (isEnd) break;
+        pStart = ptr + 1;
+    }
+
+    return nCount;
+}
+
+// This function returns end of group of statements beginning at nFirst which are executed by single scan.
+// Statements of group update the same table with equality on the same column, their values have column
+// type and no statement updates that column, so conditions do not depend on order of statements.
+// Statements whose values are computed for every row are executed alone. Group is formed after previous
+// groups were executed, so plans are rebound to column types which previous groups left
+int batchGroupEnd(BatchStatement *pStmts, int nFirst, int nCount)
+{
+    int i, j;
+    for (i = nFirst; i < nCount; i++)
+    {
+        BatchStatement *pStmt = &pStmts[i];
+        if (!rebindStatement(pStmt) || pStmt->pDB != pStmts[nFirst].pDB || !pStmt->pPlan->options.nHasWhere || pStmt->pPlan->nSetPrograms ||
+            pStmt->pWhere->nOp != PRED_EQUAL ||
+            pStmt->pWhere->nColumnID != pStmts[nFirst].pWhere->nColumnID) break;
+
+        Column *pCol = &pStmt->pDB->pColumns[pStmt->pWhere->nColumnID];
+        int nLength = strlen(pStmt->pWhere->sValue);
+        if (!nLength || parseValue(pCol->nType, pStmt->pWhere->sValue, nLength, &pStmt->key) != pCol->nType) break;
+
+        for (j = 0; j < pStmt->nSetCount; j++)
+            if (pStmt->pSets[j].nColumnID == pStmt->pWhere->nColumnID) break;
+        if (j < pStmt->nSetCount) break;
+
+        pStmt->nKeyHash = keyHash(pCol->nType, pStmt->pWhere->sValue, nLength, pStmt->key.nValue, pStmt->key.fValue);
+    }
+
+    return i > nFirst ? i : nFirst + 1;
+}
+
+// This function returns 1 if row has WHERE value of statement
+int isBatchKey(Column *pCol, BatchStatement *pStmt, int nRow, const char *pField, int nLen)
+{
+    if (pCol->nType == TYPE_TEXT)
+        return nLen == (int)strlen(pStmt->pWhere->sValue) && !memcmp(pField, pStmt->pWhere->sValue, nLen);
+    if (pCol->nType == TYPE_DOUBLE) return pCol->pDoubles[nRow] == pStmt->key.fValue;
+    return pCol->pInts[nRow] == pStmt->key.nValue;
+}
+
+// This function executes group of statements by single scan. Rows are looked up in hash table of WHERE values
+// and matched statements are applied in their order, as if every statement was executed separately.
+// Zones of typed column which do not overlap range of group values are skipped
+void updateGroup(BatchStatement *pStmts, int nCount)
+{
+    Database *pDB = pStmts[0].pDB;
+    int nColumnID = pStmts[0].pWhere->nColumnID;
+    Column *pCol = &pDB->pColumns[nColumnID];
+
+    int i, k, nSize = 1;
+    while (nSize < nCount * 2) nSize <<= 1;
+    uint32_t nMask = nSize - 1;
+
+    int *pSlots = queryAlloc(sizeof(int) * nSize);
+    int *pMatched = queryAlloc(sizeof(int) * nCount);
+
+    // Range of group values, DATE values are kept as integers too
+    double fMin = pStmts[0].key.fValue, fMax = fMin;
+    int64_t nMin = pStmts[0].key.nValue, nMax = nMin;
+
+    for (i = 0; i < nSize; i++) pSlots[i] = -1;
+    for (k = 0; k < nCount; k++)
+    {
+        uint32_t nPos = (uint32_t)pStmts[k].nKeyHash & nMask;
+        while (pSlots[nPos] >= 0) nPos = (nPos + 1) & nMask;
+        pSlots[nPos] = k;
+
+        if (pStmts[k].key.fValue < fMin) fMin = pStmts[k].key.fValue;
+        if (pStmts[k].key.fValue > fMax) fMax = pStmts[k].key.fValue;
+        if (pStmts[k].key.nValue < nMin) nMin = pStmts[k].key.nValue;
+        if (pStmts[k].key.nValue > nMax) nMax = pStmts[k].key.nValue;
+    }
+
+    UpdateMarks marks;
+    initUpdateMarks(pDB, &marks);
+
+    for (i = 0; i < pDB->nRowCount; i++)
+    {
+        if (!(i % ZONE_ROWS))
+        {
+            // Rows updated before cancellation stay updated
+            if (isBlockCancelled()) break;
+
+            Zone *pZone = &pCol->pZones[i / ZONE_ROWS];
+            if ((pCol->nType == TYPE_DOUBLE && (pZone->fMax < fMin || pZone->fMin > fMax)) ||
+                (pCol->nType != TYPE_DOUBLE && pCol->nType != TYPE_TEXT && (pZone->nMax < nMin || pZone->nMin > nMax)))
+            {
+                i += zoneRowCount(pDB, i / ZONE_ROWS) - 1;
+                continue;
+            }
+        }
+
+        if (isRowDeleted(pDB, i)) continue;
+
+        const char *pField = NULL;
+        int nLen = 0;
+        uint64_t nHash = 0;
+
+        if (pCol->nType == TYPE_TEXT)
+        {
+            pField = getField(getRow(pDB, i)->sData, nColumnID, &nLen);
+            if (pField == NULL || !nLen) continue;
+            nHash = keyHash(TYPE_TEXT, pField, nLen, 0, 0.0);
+        }
+        else if (pCol->nType == TYPE_DOUBLE) nHash = keyHash(TYPE_DOUBLE, NULL, 0, 0, pCol->pDoubles[i]);
+        else nHash = keyHash(pCol->nType, NULL, 0, pCol->pInts[i], 0.0);
+
+        // Matched statements are kept in their order
+        int nMatched = 0;
+        uint32_t nPos;
+        for (nPos = (uint32_t)nHash & nMask; pSlots[nPos] >= 0; nPos = (nPos + 1) & nMask)
+        {
+            k = pSlots[nPos];
+            if (pStmts[k].nKeyHash != nHash || !isBatchKey(pCol, &pStmts[k], i, pField, nLen)) continue;
+
+            int j = nMatched++;
+            while (j > 0 && pMatched[j - 1] > k)
+            {
+                pMatched[j] = pMatched[j - 1];
+                j--;
+            }
+
+            pMatched[j] = k;
+        }
+
+        for (k = 0; k < nMatched; k++)
+        {
+            BatchStatement *pStmt = &pStmts[pMatched[k]];
+            if (!pStmt->nWidened) widenUpdateColumns(pDB, pStmt->pSets, pStmt->nSetCount, &marks);
+            pStmt->nWidened = 1;
+            pStmt->nUpdated += updateRow(pDB, i, pStmt->pSets, pStmt->nSetCount, &marks);
+        }
+    }
+
+    refreshZones(pDB, &marks);
+    queryFree(pSlots);
+    queryFree(pMatched);
+}
+
+// This function compares tables by address, tables are locked in this order
+int compareTables(const void *pA, const void *pB)
+{
+    uintptr_t nA = (uintptr_t)*(Database* const*)pA;
+    uintptr_t nB = (uintptr_t)*(Database* const*)pB;
+    return (nA > nB) - (nA < nB);
+}
+
+// This function executes BATCH request "BATCH <bytes>\n<statements>", statements are UPDATE queries
+// separated by ';' or new line. Part of body which did not fit into request is read from the client.
+// All statements are parsed before anything is updated, every table of batch is locked once and
+// consecutive statements with equality on the same column are executed by single scan. Statement which
+// is not valid for column types changed by earlier statements is skipped and reported as invalid.
+// Updated count of every statement is appended in the response, returns total count
+int executeBatchQuery(Catalog *pCatalog, Request *pReq, String *pResponse)
+{
+    char *pEnd = NULL;
+    long nLength = strtol(pReq->sData + 6, &pEnd, 10);
+    if (pEnd == pReq->sData + 6 || *pEnd != '\n' || nLength <= 0 || nLength > BATCH_MAX) return -1;
+
+    char *pBody = queryAlloc(nLength + 1);
+
+    int nReceived = pReq->nLength - (int)(pEnd + 1 - pReq->sData);
+    if (nReceived > nLength) nReceived = nLength;
+    memcpy(pBody, pEnd + 1, nReceived);
+
+    if (!readRequestBody(pReq, pBody, nLength, nReceived))
+    {
+        logToFile(ERROR, "Can not read batch from client");
+        queryFree(pBody);
+        return -1;
+    }
+
+    // Every separator may end a statement
+    int i, nMax = 1;
+    for (i = 0; i < nLength; i++) nMax += pBody[i] == ';' || pBody[i] == '\n';
+
+    char **pStarts = queryAlloc(sizeof(char*) * nMax);
+    BatchStatement *pStmts = queryCalloc(nMax, sizeof(BatchStatement));
+    Database **pTables = queryAlloc(sizeof(Database*) * nMax);
+
+    int nCount = splitStatements(pBody, pStarts);
+    int nTables = 0, nTotal = 0, nParsed = 0, nValid = nCount > 0;
+
+    for (i = 0; i < nCount && nValid; i++, nParsed++)
+    {
+        BatchStatement *pStmt = &pStmts[i];
+        pStmt->pDB = findQueryTable(pCatalog, pStarts[i], NULL);
+        nValid = pStmt->pDB != NULL;
+        if (!nValid) break;
+
+        // Statements of batch differ by values, so their plans are not cached
+        pStmt->pPlan = compilePlan(pStmt->pDB, pStarts[i], STATEMENT_UPDATE, 0);
+        nValid = pStmt->pPlan != NULL;
+        if (!nValid) break;
+
+        pStmt->pText = pStarts[i];
+        pStmt->pSets = pStmt->pPlan->pSets;
+        pStmt->pWhere = &pStmt->pPlan->options.where;
+        pStmt->nSetCount = pStmt->pPlan->nSetCount;
+        pTables[nTables++] = pStmt->pDB;
+    }
+
+    if (nValid)
+    {
+        // Tables are locked in address order, so batches and joins can not deadlock
+        qsort(pTables, nTables, sizeof(Database*), compareTables);
+        int nUnique = 0;
+        for (i = 0; i < nTables; i++)
+            if (!nUnique || pTables[nUnique - 1] != pTables[i]) pTables[nUnique++] = pTables[i];
+        nTables = nUnique;
+
+        for (i = 0; i < nTables; i++) lockWrite(&pTables[i]->rwLock);
+
+        for (i = 0; i < nCount && !isBlockCancelled(); )
+        {
+            int nGroupEnd = batchGroupEnd(pStmts, i, nCount);
+            if (pStmts[i].pPlan == NULL) logToFile(INFO, "Batch statement %d is invalid after earlier statements", i + 1);
+            else if (nGroupEnd - i > 1) updateGroup(&pStmts[i], nGroupEnd - i);
+            else pStmts[i].nUpdated = updateDatabase(pStmts[i].pDB, pStmts[i].pPlan);
+            i = nGroupEnd;
+        }
+
+        // New version invalidates cached responses of updated tables
+        for (i = 0; i < nCount; i++)
+        {
+            if (pStmts[i].nUpdated) __atomic_add_fetch(&pStmts[i].pDB->nVersion, 1, __ATOMIC_RELEASE);
+            if (pStmts[i].nUpdated) replicateWrite(pStmts[i].pDB, pStmts[i].pText);
+            nTotal += pStmts[i].nUpdated;
+        }
+
+        for (i = nTables - 1; i >= 0; i--) unlockRW(&pTables[i]->rwLock);
+
+        stringAppend(pResponse, "statement,updated\n", 18);
+        for (i = 0; i < nCount; i++)
+        {
+            char sLine[64];
+            int nLen = pStmts[i].pPlan != NULL ? snprintf(sLine, sizeof(sLine), "%d,%d\n", i + 1, pStmts[i].nUpdated) :
+                snprintf(sLine, sizeof(sLine), "%d,invalid\n", i + 1);
+            stringAppend(pResponse, sLine, nLen);
+        }
+    }
+    else
+    {
+        char sMessage[64];
+        int nLen = snprintf(sMessage, sizeof(sMessage), "Statement %d of batch: ", nParsed + 1);
+        stringAppend(pResponse, sMessage, nLen);
+    }
+
+    for (i = 0; i < nCount; i++)
+    {
+        if (pStmts[i].pPlan != NULL) freePlan(pStmts[i].pPlan);
+        releaseTable(pStmts[i].pDB);
+    }
+
+    queryFree(pStmts);
+    queryFree(pStarts);
+    queryFree(pTables);
+    queryFree(pBody);
+    return nValid ? nTotal : -1;
+}
+
+////////////////////////////////////////////////////////////////////////
+// JOIN
+////////////////////////////////////////////////////////////////////////
+
+// Join key of single row, text key points into row storage so nothing is copied
+typedef struct {
+    const char *pKey;
+    int64_t nValue; // Integer or bits of double key of typed columns
+    uint32_t nHash;
+    int nLength;
+    int nRow;
+} JoinKey;
+
+// Output column of joined row
+typedef struct {
+    int nSide; // 0 is left table, 1 is right table
+    int nColumnID;
+} JoinColumn;
+
+// Joined rows are appended into response through this structure
+typedef struct {
+    Database *pTables[2];
+    JoinColumn *pColumns;
+    SelectOptions *pOpts;
+    String *pResponse;
+    RowSet seen;
+    long nSkipped;
+    int nColumnCount;
+    int nDistinct;
+    int nBuildSide; // Side of hash table, other side is probed
+    int nKeyType;   // Type which keys of both sides are compared as
+    int nRecordings;
+    int nDone;      // Limit is reached or query is cancelled
+} JoinOutput;
+
+// This function searches column by exact name, -1 is returned if there is no such column
+int findColumn(Database *pDB, const char *pName, int nLength)
+{
+    int i, nLen = 0;
+    for (i = 0; i < pDB->nColumnCount; i++)
+    {
+        const char *pField = getField(pDB->sColumns, i, &nLen);
+        if (pField != NULL && nLen == nLength && !strncmp(pField, pName, nLength)) return i;
+    }
+
+    return -1;
+}
+
+// This function resolves column reference of join query, reference is either table.column or column,
+// column is searched in preferred side first so self join can tell its sides apart
+int resolveJoinColumn(Database **pTables, char *pRef, int nPreferSide, JoinColumn *pColumn)
+{
+    while (*pRef == ' ') pRef++;
+    int nLength = strlen(pRef);
+    while (nLength > 0 && pRef[nLength - 1] == ' ') nLength--;
+
+    char *pDot = memchr(pRef, '.', nLength);
+    int i;
+
+    for (i = 0; i < 2; i++)
+    {
+        int nSide = i ? !nPreferSide : nPreferSide;
+        const char *pName = pRef;
+        int nLen = nLength;
+
+        if (pDot != NULL)
+        {
+            char sTable[TABLE_NAME_MAX];
+            snprintf(sTable, sizeof(sTable), "%.*s", (int)(pDot - pRef), pRef);
+            if (findTableSlot(&g_catalog, sTable) != pTables[nSide]->nSlot) continue;
+
+            pName = pDot + 1;
+            nLen = nLength - (int)(pDot + 1 - pRef);
+        }
+
+        int nID = findColumn(pTables[nSide], pName, nLen);
+        if (nID >= 0)
+        {
+            pColumn->nSide = nSide;
+            pColumn->nColumnID = nID;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// This function appends header of join result, columns are qualified with table names
+void appendJoinHeader(JoinOutput *pOut)
+{
+    int i;
+    for (i = 0; i < pOut->nColumnCount; i++)
+    {
+        JoinColumn *pCol = &pOut->pColumns[i];
+        Database *pDB = pOut->pTables[pCol->nSide];
+
+        int nLen = 0;
+        const char *pField = getField(pDB->sColumns, pCol->nColumnID, &nLen);
+
+        if (i) stringAppend(pOut->pResponse, ",", 1);
+        stringAppend(pOut->pResponse, pDB->sName, strlen(pDB->sName));
+        stringAppend(pOut->pResponse, ".", 1);
+        if (pField != NULL) stringAppend(pOut->pResponse, (char*)pField, nLen);
+    }
+
+    stringAppend(pOut->pResponse, "\n", 1);
+}
+
+// This function appends single joined row into response,
+// zero is returned when limit is reached and join must stop
+int emitJoinRow(JoinOutput *pOut, int nBuildRow, int nProbeRow)
+{
+    if (pOut->pOpts->nLimit >= 0 && pOut->nRecordings >= pOut->pOpts->nLimit)
+    {
+        pOut->nDone = 1;
+        return 0;
+    }
+
+    const char *pRows[2];
+    pRows[pOut->nBuildSide] = getRow(pOut->pTables[pOut->nBuildSide], nBuildRow)->sData;
+    pRows[!pOut->nBuildSide] = getRow(pOut->pTables[!pOut->nBuildSide], nProbeRow)->sData;
+
+    String *pResponse = pOut->pResponse;
+    int nMark = pResponse->nUsed;
+
+    // Columns are appended before first recording
+    if (!pOut->nRecordings) appendJoinHeader(pOut);
+    int i, nStart = pResponse->nUsed;
+
+    for (i = 0; i < pOut->nColumnCount; i++)
+    {
+        JoinColumn *pCol = &pOut->pColumns[i];
+        int nLen = 0;
+        const char *pField = getField(pRows[pCol->nSide], pCol->nColumnID, &nLen);
+
+        if (i) stringAppend(pResponse, ",", 1);
+        if (pField != NULL) stringAppend(pResponse, (char*)pField, nLen);
+    }
+
+    // Rollback row if it is already selected or skipped by offset
+    if ((pOut->nDistinct && !rowSetInsert(&pOut->seen, pResponse->pData + nStart, pResponse->nUsed - nStart)) ||
+        pOut->nSkipped++ < pOut->pOpts->nOffset)
+    {
+        pResponse->nUsed = nMark;
+        pResponse->pData[nMark] = '\0';
+        return 1;
+    }
+
+    stringAppend(pResponse, "\n", 1);
+    pOut->nRecordings++;
+    return 1;
+}
+
+// This function returns type which join keys of two columns are compared as,
+// INT and DOUBLE columns are joined by double values, other mixed types by text
+int joinKeyType(int nTypeA, int nTypeB)
+{
+    if (nTypeA == nTypeB) return nTypeA;
+    if ((nTypeA == TYPE_INT && nTypeB == TYPE_DOUBLE) || (nTypeA == TYPE_DOUBLE && nTypeB == TYPE_INT)) return TYPE_DOUBLE;
+    return TYPE_TEXT;
+}
+
+// This function extracts join keys of all rows, deleted rows and rows without key column are skipped.
+// Typed keys are hashed and compared as packed values, so 7 joins 7.0 of DOUBLE column
+int extractJoinKeys(Database *pDB, int nColumnID, int nKeyType, JoinKey *pKeys)
+{
+    Column *pCol = &pDB->pColumns[nColumnID];
+    int i, nCount = 0;
+
+    for (i = 0; i < pDB->nRowCount; i++)
+    {
+        if (isQueryCancelled()) break;
+        if (isRowDeleted(pDB, i)) continue;
+
+        JoinKey *pKey = &pKeys[nCount];
+        pKey->nRow = i;
+
+        if (nKeyType == TYPE_TEXT)
+        {
+            pKey->pKey = getField(getRow(pDB, i)->sData, nColumnID, &pKey->nLength);
+            if (pKey->pKey == NULL) continue;
+
+            pKey->nHash = hashData(pKey->pKey, pKey->nLength);
+            pKey->nValue = 0;
+            nCount++;
+            continue;
+        }
+
+        if (nKeyType == TYPE_DOUBLE)
+        {
+            double fValue = pCol->nType == TYPE_DOUBLE ? pCol->pDoubles[i] : (double)pCol->pInts[i];
+            if (fValue == 0) fValue = 0; // Negative zero has other bits
+            memcpy(&pKey->nValue, &fValue, sizeof(fValue));
+        }
+        else pKey->nValue = pCol->pInts[i];
+
+        pKey->pKey = NULL;
+        pKey->nLength = 0;
+        pKey->nHash = hashData((const char*)&pKey->nValue, sizeof(pKey->nValue));
+        nCount++;
+    }
+
+    return nCount;
+}
+
+// This function scatters keys into partitions by high bits of hash, so hash table
+// of every partition fits into cache. Order of keys is kept inside partition
+void partitionJoinKeys(JoinKey *pSrc, int nCount, JoinKey *pDst, int *pOffsets)
+{
+    int i, nPos[JOIN_PARTITIONS];
+    memset(pOffsets, 0, sizeof(int) * (JOIN_PARTITIONS + 1));
+
+    for (i = 0; i < nCount; i++) pOffsets[(pSrc[i].nHash >> (32 - JOIN_RADIX_BITS)) + 1]++;
+    for (i = 0; i < JOIN_PARTITIONS; i++) pOffsets[i + 1] += pOffsets[i];
+
+    memcpy(nPos, pOffsets, sizeof(nPos));
+    for (i = 0; i < nCount; i++) pDst[nPos[pSrc[i].nHash >> (32 - JOIN_RADIX_BITS)]++] = pSrc[i];
+}
+
+// This function builds hash table from build keys and probes it with probe keys,
+// low bits of hash select bucket since high bits are the same inside partition
+void joinPartition(JoinOutput *pOut, JoinKey *pBuild, int nBuild, JoinKey *pProbe, int nProbe, int *pHeads, int *pNext)
+{
+    int nBuckets = 1;
+    while (nBuckets < nBuild * 2) nBuckets <<= 1;
+
+    uint32_t nMask = nBuckets - 1;
+    int i, j;
+
+    // Chains are built backwards, so matches are found in build order
+    memset(pHeads, -1, sizeof(int) * nBuckets);
+    for (i = nBuild - 1; i >= 0; i--)
+    {
+        uint32_t nPos = pBuild[i].nHash & nMask;
+        pNext[i] = pHeads[nPos];
+        pHeads[nPos] = i;
+    }
+
+    for (i = 0; i < nProbe && !pOut->nDone; i++)
+    {
+        if (isQueryCancelled())
+        {
+            pOut->nDone = 1;
+            break;
+        }
+
+        JoinKey *pKey = &pProbe[i];
+        for (j = pHeads[pKey->nHash & nMask]; j >= 0; j = pNext[j])
+        {
+            JoinKey *pMatch = &pBuild[j];
+            if (pMatch->nHash != pKey->nHash || pMatch->nValue != pKey->nValue) continue;
+            if (pOut->nKeyType == TYPE_TEXT && (pMatch->nLength != pKey->nLength ||
+                memcmp(pMatch->pKey, pKey->pKey, pKey->nLength))) continue;
+
+            if (!emitJoinRow(pOut, pMatch->nRow, pKey->nRow)) break;
+        }
+    }
+}
+
+// This function joins tables with hash join, smaller table is the build side.
+// Large build sides are radix partitioned first, then every partition is joined separately
+void hashJoin(JoinOutput *pOut, int *pKeyColumns)
+{
+    int nBuildSide = pOut->nBuildSide;
+    Database *pBuildDB = pOut->pTables[nBuildSide];
+    Database *pProbeDB = pOut->pTables[!nBuildSide];
+
+    JoinKey *pBuild = queryAlloc(sizeof(JoinKey) * (pBuildDB->nRowCount + 1));
+    JoinKey *pProbe = queryAlloc(sizeof(JoinKey) * (pProbeDB->nRowCount + 1));
+
+    pOut->nKeyType = joinKeyType(pBuildDB->pColumns[pKeyColumns[nBuildSide]].nType,
+                                 pProbeDB->pColumns[pKeyColumns[!nBuildSide]].nType);
+
+    int nBuild = extractJoinKeys(pBuildDB, pKeyColumns[nBuildSide], pOut->nKeyType, pBuild);
+    int nProbe = extractJoinKeys(pProbeDB, pKeyColumns[!nBuildSide], pOut->nKeyType, pProbe);
+    int i, nMaxBuild = nBuild;
+
+    int nPartitions = 1;
+    int nBuildOffsets[JOIN_PARTITIONS + 1] = { 0, nBuild };
+    int nProbeOffsets[JOIN_PARTITIONS + 1] = { 0, nProbe };
+
+    if (nBuild >= JOIN_RADIX_MIN && !isQueryCancelled())
+    {
+        JoinKey *pBuildParts = queryAlloc(sizeof(JoinKey) * (nBuild + 1));
+        JoinKey *pProbeParts = queryAlloc(sizeof(JoinKey) * (nProbe + 1));
+
+        partitionJoinKeys(pBuild, nBuild, pBuildParts, nBuildOffsets);
+        partitionJoinKeys(pProbe, nProbe, pProbeParts, nProbeOffsets);
+
+        queryFree(pBuild);
+        queryFree(pProbe);
+        pBuild = pBuildParts;
+        pProbe = pProbeParts;
+        nPartitions = JOIN_PARTITIONS;
+
+        // Hash table is allocated once for the largest partition
+        for (i = 0, nMaxBuild = 0; i < nPartitions; i++)
+            if (nBuildOffsets[i + 1] - nBuildOffsets[i] > nMaxBuild) nMaxBuild = nBuildOffsets[i + 1] - nBuildOffsets[i];
+    }
+
+    int nBuckets = 1;
+    while (nBuckets < nMaxBuild * 2) nBuckets <<= 1;
+
+    int *pHeads = queryAlloc(sizeof(int) * nBuckets);
+    int *pNext = queryAlloc(sizeof(int) * (nMaxBuild + 1));
+
+    for (i = 0; i < nPartitions && !pOut->nDone; i++)
+    {
+        joinPartition(pOut, pBuild + nBuildOffsets[i], nBuildOffsets[i + 1] - nBuildOffsets[i],
+                      pProbe + nProbeOffsets[i], nProbeOffsets[i + 1] - nProbeOffsets[i], pHeads, pNext);
+    }
+
+    queryFree(pHeads);
+    queryFree(pNext);
+    queryFree(pBuild);
+    queryFree(pProbe);
+}
+
+// This function parses LIMIT and OFFSET clauses of join query and cuts them from the query
+int parseJoinLimits(char *pQuery, SelectOptions *pOpts)
+{
+    pOpts->nKeyCount = 0;
+    pOpts->nLimit = -1;
+    pOpts->nOffset = 0;
+    pOpts->nHasWhere = 0;
+
+    char *pLimit = strstr(pQuery, " LIMIT ");
+    char *pOffset = strstr(pQuery, " OFFSET ");
+
+    if (pLimit != NULL)
+    {
+        char *pEnd = NULL;
+        pOpts->nLimit = strtol(pLimit + 7, &pEnd, 10);
+        if (pEnd == pLimit + 7 || pOpts->nLimit < 0) return 0;
+    }
+
+    if (pOffset != NULL)
+    {
+        char *pEnd = NULL;
+        pOpts->nOffset = strtol(pOffset + 8, &pEnd, 10);
+        if (pEnd == pOffset + 8 || pOpts->nOffset < 0) return 0;
+    }
+
+    if (pLimit != NULL) *pLimit = '\0';
+    if (pOffset != NULL) *pOffset = '\0';
+    return 1;
+}
+
+// This function parses and executes SELECT ... FROM a JOIN b ON a.x = b.y query.
+// Order of joined rows is not defined, so ORDER BY is not supported yet
+int executeJoinQuery(Database *pLeft, Database *pRight, char *pQuery, String *pResponse)
+{
+    SelectOptions options;
+    JoinOutput output;
+    int nDistinct = 0;
+    pQuery += 7; // Skip "SELECT" and space
+
+    if (!strncmp(pQuery, "DISTINCT", 8))
+    {
+        pQuery += 9; // Skip "DISTINCT" and space
+        nDistinct = 1;
+    }
+
+    if (strstr(pQuery, " ORDER BY ") != NULL || strstr(pQuery, " WHERE ") != NULL) return -1;
+    if (!parseJoinLimits(pQuery, &options)) return -1;
+
+    char *pFrom = strstr(pQuery, " FROM ");
+    char *pOn = strstr(pQuery, " ON ");
+    if (pFrom == NULL || pOn == NULL) return -1;
+
+    char *pEqual = strchr(pOn, '=');
+    if (pEqual == NULL) return -1;
+    *pFrom = '\0';
+    *pEqual = '\0';
+
+    // Lock both tables for reading in address order like batches do, self join is locked only once
+    Database *pFirst = pLeft < pRight ? pLeft : pRight;
+    Database *pSecond = pLeft < pRight ? pRight : pLeft;
+    lockRead(&pFirst->rwLock);
+    if (pSecond != pFirst) lockRead(&pSecond->rwLock);
+
+    output.pTables[0] = pLeft;
+    output.pTables[1] = pRight;
+    output.pOpts = &options;
+    output.pResponse = pResponse;
+    output.nSkipped = 0;
+    output.nDistinct = nDistinct;
+    output.nRecordings = 0;
+    output.nDone = 0;
+    output.nColumnCount = 0;
+
+    // Build side is the smaller table, so hash table is as small as possible
+    output.nBuildSide = pLeft->nRowCount < pRight->nRowCount ? 0 : 1;
+
+    JoinColumn columns[pLeft->nColumnCount + pRight->nColumnCount + 1];
+    JoinColumn keys[2];
+    output.pColumns = columns;
+    int i, nValid = 1;
+
+    // Key columns, first reference belongs to left table unless it is qualified otherwise
+    if (!resolveJoinColumn(output.pTables, pOn + 4, 0, &keys[0]) ||
+        !resolveJoinColumn(output.pTables, pEqual + 1, 1, &keys[1]) ||
+        keys[0].nSide == keys[1].nSide) nValid = 0;
+
+    if (nValid && !strncmp(pQuery, "*", 1))
+    {
+        for (i = 0; i < pLeft->nColumnCount + pRight->nColumnCount; i++)
+        {
+            columns[i].nSide = i >= pLeft->nColumnCount;
+            columns[i].nColumnID = i < pLeft->nColumnCount ? i : i - pLeft->nColumnCount;
+        }
+
+        output.nColumnCount = i;
+    }
+    else if (nValid)
+    {
+        char *savePtr = NULL;
+        char *ptr = strtok_r(pQuery, ",", &savePtr);
+
+        while (ptr != NULL && output.nColumnCount < pLeft->nColumnCount + pRight->nColumnCount)
+        {
+            if (!resolveJoinColumn(output.pTables, ptr, 0, &columns[output.nColumnCount++]))
+            {
+                nValid = 0;
+                break;
+            }
+
+            ptr = strtok_r(NULL, ",", &savePtr);
+        }
+
+        if (!output.nColumnCount) nValid = 0;
+    }
+
+    if (nValid)
+    {
+        int nKeyColumns[2];
+        nKeyColumns[keys[0].nSide] = keys[0].nColumnID;
+        nKeyColumns[keys[1].nSide] = keys[1].nColumnID;
+
+        if (nDistinct) rowSetInit(&output.seen);
+        hashJoin(&output, nKeyColumns);
+        if (nDistinct) rowSetClear(&output.seen);
+    }
+
+    if (pSecond != pFirst) unlockRW(&pSecond->rwLock);
+    unlockRW(&pFirst->rwLock);
+    return nValid ? output.nRecordings : -1;
+}
+
+////////////////////////////////////////////////////////////////////////
+// CLUSTER ROUTER
+////////////////////////////////////////////////////////////////////////
+
+// This function initializes router of comma separated shards, position in the list is shard number
+void initRouter(Router *pRouter, const char *pShards, const char *pKey)
+{
+    pRouter->nCount = 0;
+    pRouter->pKey = pKey;
+    pRouter->pList = NULL;
+    if (pShards == NULL) return;
+
+    pRouter->pList = strdup(pShards);
+    if (pRouter->pList == NULL)
+    {
+        logToFile(ERROR, "Can not alloc memory for shards");
+        exitFailure(NULL);
+    }
+
+    char *savePtr = NULL;
+    char *ptr = strtok_r(pRouter->pList, ",", &savePtr);
+    while (ptr != NULL && pRouter->nCount < SHARDS_MAX)
+    {
+        pRouter->pHosts[pRouter->nCount++] = ptr;
+        ptr = strtok_r(NULL, ",", &savePtr);
+    }
+
+    logToFile(INFO, "Router of %d shards, rows are sharded by %s.", pRouter->nCount, pKey);
+}
+
+// This function returns shard of condition "key = value", -1 if condition does not fix shard key
+// and query must be sent to all shards. Router does not know columns, so bare value is taken
+// only if it is a number and can not name other column
+int routeCondition(Router *pRouter, AstExpr *pCond)
+{
+    if (pCond == NULL || pCond->nKind != EXPR_COMPARE || pCond->nOp != PRED_EQUAL ||
+        pCond->pLeft->nKind != EXPR_VALUE || pCond->pRight->nKind != EXPR_VALUE) return -1;
+
+    Token *pKey = pCond->pLeft->pToken, *pValue = pCond->pRight->pToken;
+    int isValue = pValue->nType == TOKEN_STRING || strchr("+-.0123456789", *pValue->pText) != NULL;
+
+    if (pKey->nType != TOKEN_WORD || !isValue || pKey->nLength != (int)strlen(pRouter->pKey) ||
+        strncmp(pKey->pText, pRouter->pKey, pKey->nLength)) return -1;
+    return shardOfKey(pValue->pText, pValue->nLength, pRouter->nCount);
+}
+
+// This function returns shard of SELECT, UPDATE or DELETE query by its WHERE clause, -1 if query is sent
+// to all shards. Query is parsed by the same parser as shards use, so they agree on its condition
+int routeQuery(Router *pRouter, const char *pQuery)
+{
+    Token *pTokens = queryAlloc(sizeof(Token) * (strlen(pQuery) + 1));
+    int nCount = tokenizeQuery(pQuery, pTokens);
+
+    AstQuery ast;
+    ast.pColumns = queryAlloc(sizeof(Token*) * (nCount + 1));
+    ast.pSets = queryAlloc(sizeof(AstAssignment) * (nCount + 1));
+    ast.pNodes = queryAlloc(sizeof(AstExpr) * (nCount + 1));
+
+    int nShard = nCount >= 0 && parseQuery(pTokens, &ast) ? routeCondition(pRouter, ast.pWhere) : -1;
+
+    queryFree(ast.pNodes);
+    queryFree(ast.pSets);
+    queryFree(ast.pColumns);
+    queryFree(pTokens);
+    return nShard;
+}
+
+// This function reads whole response of shard, shard closes connection after it.
+// Cancellation of routed query is checked while waiting. Returns 0 if response is not complete
+int recvShardReply(ShardReply *pReply)
+{
+    char sBuffer[DATA_MAX];
+    for (;;)
+    {
+        if (isBlockCancelled()) return 0;
+
+        struct pollfd pfd;
+        pfd.fd = pReply->nSocket;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        int nReady = poll(&pfd, 1, REQUEST_READ_TIMEOUT);
+        if (nReady == 0) continue;
+
+        ssize_t nRead = nReady > 0 ? recv(pReply->nSocket, sBuffer, sizeof(sBuffer), 0) : -1;
+        statsSyscalls(2);
+        if (nRead < 0) return 0;
+        if (nRead == 0) break;
+
+        stringAppend(&pReply->data, sBuffer, nRead);
+    }
+
+    // Status is followed by response text
+    if (pReply->data.nUsed < (int)sizeof(int)) return 0;
+    memcpy(&pReply->nStatus, pReply->data.pData, sizeof(int));
+    pReply->data.nUsed -= sizeof(int);
+    memmove(pReply->data.pData, pReply->data.pData + sizeof(int), pReply->data.nUsed + 1);
+    return 1;
+}
+
+// This function sends query to shard nTarget or to all shards if it is -1 and reads their responses.
+// Query is sent to every shard before any response is read, so shards execute it in parallel.
+// Header passes client ID and remaining time, so shards queue it fairly and cancel it at the same deadline.
+// Returns 0 and message in pResponse if any shard failed
+int scatterQuery(Router *pRouter, Request *pReq, int nTarget, const char *pQuery, int nLength,
+                 ShardReply *pReplies, String *pResponse)
+{
+    int nTimeout = 0;
+    if (t_pQuery != NULL && t_pQuery->nDeadline)
+    {
+        uint64_t nNow = monotonicTime();
+        nTimeout = t_pQuery->nDeadline > nNow ? (int)((t_pQuery->nDeadline - nNow) / 1000) + 1 : 1;
+    }
+
+    // Shard which does not accept is failed, connect waits at most until deadline
+    int nConnectTimeout = nTimeout && nTimeout < CONNECT_TIMEOUT ? nTimeout : CONNECT_TIMEOUT;
+
+    String request;
+    stringInit(&request, nLength + 64);
+    char sHeader[128];
+    int nHeader = snprintf(sHeader, sizeof(sHeader), "@client=%lu timeout=%d\n", (unsigned long)pReq->nClientKey, nTimeout);
+    stringAppend(&request, sHeader, nHeader);
+    stringAppend(&request, (char*)pQuery, nLength);
+
+    int i, nFailed = -1;
+    for (i = 0; i < pRouter->nCount; i++)
+    {
+        stringInit(&pReplies[i].data, DATA_MAX);
+        pReplies[i].nStatus = 0;
+        pReplies[i].nSocket = -1;
+        if ((nTarget >= 0 && i != nTarget) || nFailed >= 0) continue;
+
+        pReplies[i].nSocket = connectServer(pRouter->pHosts[i], nConnectTimeout);
+        if (pReplies[i].nSocket < 0 || !sendAll(pReplies[i].nSocket, request.pData, request.nUsed)) nFailed = i;
+    }
+
+    for (i = 0; i < pRouter->nCount; i++)
+    {
+        if (pReplies[i].nSocket < 0) continue;
+        if (nFailed < 0 && !recvShardReply(&pReplies[i])) nFailed = i;
+
+        close(pReplies[i].nSocket);
+        pReplies[i].nSocket = -1;
+    }
+
+    stringClear(&request);
+    if (nTarget >= 0) __atomic_fetch_add(&g_stats.nRoutedSingle, 1, __ATOMIC_RELAXED);
+    else __atomic_fetch_add(&g_stats.nRoutedScatter, 1, __ATOMIC_RELAXED);
+
+    // Cancelled query is answered by caller
+    if (nFailed < 0 || isBlockCancelled()) return nFailed < 0;
+
+    __atomic_fetch_add(&g_stats.nShardErrors, 1, __ATOMIC_RELAXED);
+    logToFile(ERROR, "Shard %s did not answer routed query", pRouter->pHosts[nFailed]);
+
+    char sMessage[DATA_MAX];
+    int nLen = snprintf(sMessage, sizeof(sMessage), "Shard %s is unavailable", pRouter->pHosts[nFailed]);
+    stringAppend(pResponse, sMessage, nLen);
+    return 0;
+}
+
+// This function frees responses of shards
+void clearShardReplies(Router *pRouter, ShardReply *pReplies)
+{
+    int i;
+    for (i = 0; i < pRouter->nCount; i++) stringClear(&pReplies[i].data);
+}
+
+// This function returns the first failed response of shards, its message is passed to the client.
+// Returns -1 if all shards succeeded
+int failedShard(Router *pRouter, ShardReply *pReplies, String *pResponse)
+{
+    int i;
+    for (i = 0; i < pRouter->nCount; i++)
+    {
+        if (pReplies[i].nStatus >= 0) continue;
+
+        stringAppend(pResponse, pReplies[i].data.pData, pReplies[i].data.nUsed);
+        return i;
+    }
+
+    return -1;
+}
+
+// This function returns length of the first nCount fields of row, hidden ORDER BY columns follow them
+int visibleLength(const char *pRow, int nCount)
+{
+    const char *ptr = pRow;
+    while (nCount-- > 0)
+    {
+        ptr = strchr(ptr, ',');
+        if (ptr == NULL) return strlen(pRow);
+        ptr++;
+    }
+
+    return (int)(ptr - pRow) - 1;
+}
+
+// This function extracts sort key of row merged by router. Types of columns are not known here,
+// numbers are compared by value and everything else as text, dates compare the same as text
+void initRoutedSortKey(SortKey *pKey, const char *pRow, int nColumnID)
+{
+    pKey->nType = TYPE_TEXT;
+    pKey->nValue = 0;
+    pKey->fValue = 0;
+    pKey->pData = getField(pRow, nColumnID, &pKey->nLength);
+
+    if (pKey->pData == NULL)
+    {
+        pKey->pData = "";
+        return;
+    }
+
+    if (pKey->nLength > 0)
+    {
+        char *pEnd = NULL;
+        pKey->fValue = strtod(pKey->pData, &pEnd);
+        if (pEnd == pKey->pData + pKey->nLength) pKey->nType = TYPE_DOUBLE;
+    }
+}
+
+// This function executes SELECT on shards and merges their rows. Shards return at most OFFSET + LIMIT rows,
+// which are merged by ORDER BY keys, made DISTINCT again and limited here. ORDER BY columns which are not
+// selected are added to the shard query and cut from merged rows. Ties of keys are ordered by shard
+int executeRoutedSelect(Router *pRouter, Request *pReq, String *pResponse)
+{
+    const char *pQuery = pReq->sData;
+    char sShardQuery[DATA_MAX];
+
+    // Query is parsed by the same parser as shards use, so clauses are found by tokens and never inside values
+    Token *pTokens = queryAlloc(sizeof(Token) * (strlen(pQuery) + 1));
+    int nCount = tokenizeQuery(pQuery, pTokens);
+
+    Token *pTable = NULL, *pJoin = NULL;
+    if (nCount >= 0 && parseQueryTables(pTokens, &pTable, &pJoin) && pJoin != NULL)
+    {
+        queryFree(pTokens);
+        char *pMessage = "JOIN is not supported by router because rows of joined tables may be on different shards";
+        stringAppend(pResponse, pMessage, strlen(pMessage));
+        return STATUS_INVALID;
+    }
+
+    AstQuery ast;
+    ast.pColumns = queryAlloc(sizeof(Token*) * (nCount + 1));
+    ast.pSets = queryAlloc(sizeof(AstAssignment) * (nCount + 1));
+    ast.pNodes = queryAlloc(sizeof(AstExpr) * (nCount + 1));
+
+    int isValid = nCount >= 0 && parseQuery(pTokens, &ast) && ast.nType == STATEMENT_SELECT;
+    int nDistinct = isValid && ast.isDistinct;
+    long nLimit = isValid ? ast.nLimit : -1, nOffset = isValid ? ast.nOffset : 0;
+    int nShard = isValid ? routeCondition(pRouter, ast.pWhere) : -1;
+
+    // Names of ORDER BY keys, columns which are not selected are added as hidden ones
+    char sKeys[ORDER_MAX][DATA_MAX];
+    OrderKey keys[ORDER_MAX];
+    int i, j, nKeyCount = 0, nHidden = 0;
+    char sHidden[DATA_MAX] = "";
+    int nHiddenLength = 0, nLength = -1;
+
+    for (i = 0; isValid && i < ast.nOrderCount; i++)
+    {
+        Token *pKey = ast.order[i].pColumn;
+        isValid = copyToken(sKeys[i], DATA_MAX, pKey);
+        keys[i].nDesc = ast.order[i].nDesc;
+        nKeyCount++;
+
+        int isSelected = ast.isStar;
+        for (j = 0; j < ast.nColumnCount && !isSelected; j++)
+            isSelected = ast.pColumns[j]->nLength == pKey->nLength && !strncmp(ast.pColumns[j]->pText, pKey->pText, pKey->nLength);
+
+        if (!isSelected)
+        {
+            nHiddenLength += snprintf(sHidden + nHiddenLength, sizeof(sHidden) - nHiddenLength, ", %s", sKeys[i]);
+            if (nHiddenLength >= (int)sizeof(sHidden)) isValid = 0;
+            nHidden++;
+        }
+    }
+
+    // Select list and FROM and WHERE clauses are passed as they are, their tokens end with a word, symbol or quote
+    if (isValid)
+    {
+        Token *pList = &pTokens[nDistinct ? 2 : 1], *pFrom = &pTokens[ast.nFromPos], *pTail = &pTokens[ast.nTailPos];
+        int nListLength = pFrom->pText - pList->pText, nFromLength = pTail->pText - pFrom->pText;
+        while (nListLength > 0 && strchr(" \t\r\n", pList->pText[nListLength - 1]) != NULL) nListLength--;
+        while (nFromLength > 0 && strchr(" \t\r\n", pFrom->pText[nFromLength - 1]) != NULL) nFromLength--;
+
+        // Top rows of every shard contain top rows of the cluster, unless hidden keys make more rows distinct
+        nLength = snprintf(sShardQuery, sizeof(sShardQuery), "SELECT %s%.*s%s %.*s", nDistinct ? "DISTINCT " : "",
+                           nListLength, pList->pText, sHidden, nFromLength, pFrom->pText);
+        for (i = 0; i < nKeyCount && nLength < (int)sizeof(sShardQuery); i++)
+            nLength += snprintf(sShardQuery + nLength, sizeof(sShardQuery) - nLength, "%s %s%s", i ? "," : " ORDER BY",
+                                sKeys[i], keys[i].nDesc ? " DESC" : "");
+        if (nLimit >= 0 && !(nDistinct && nHidden) && nLength < (int)sizeof(sShardQuery))
+            nLength += snprintf(sShardQuery + nLength, sizeof(sShardQuery) - nLength, " LIMIT %ld", nOffset + nLimit);
+        if (nLength >= (int)sizeof(sShardQuery)) nLength = -1;
+    }
+
+    queryFree(ast.pNodes);
+    queryFree(ast.pSets);
+    queryFree(ast.pColumns);
+    queryFree(pTokens);
+    if (nLength < 0) return STATUS_INVALID;
+
+    ShardReply replies[SHARDS_MAX];
+    if (!scatterQuery(pRouter, pReq, nShard, sShardQuery, nLength, replies, pResponse))
+    {
+        clearShardReplies(pRouter, replies);
+        return STATUS_BUSY;
+    }
+
+    int nFailed = failedShard(pRouter, replies, pResponse);
+    if (nFailed >= 0)
+    {
+        int nStatus = replies[nFailed].nStatus;
+        clearShardReplies(pRouter, replies);
+        return nStatus;
+    }
+
+    // Lines of responses become rows, the first line of every response is header
+    const char *pHeader = NULL;
+    int nRowCount = 0;
+    for (i = 0; i < pRouter->nCount; i++)
+        if (replies[i].nStatus > 0) nRowCount += replies[i].nStatus;
+
+    const char **pRows = queryAlloc(sizeof(char*) * (nRowCount + 1));
+    int *pOrderRows = queryAlloc(sizeof(int) * (nRowCount + 1));
+    SortKey *pKeys = queryAlloc(sizeof(SortKey) * ((size_t)nRowCount * nKeyCount + 1));
+
+    int nRows = 0;
+    for (i = 0; i < pRouter->nCount; i++)
+    {
+        if (replies[i].nStatus <= 0) continue;
+
+        char *ptr = replies[i].data.pData;
+        for (j = 0; j <= replies[i].nStatus && *ptr != '\0'; j++)
+        {
+            char *pLine = ptr;
+            ptr += strcspn(ptr, "\n");
+            if (*ptr != '\0') *ptr++ = '\0';
+
+            if (!j) pHeader = pLine;
+            else if (nRows < nRowCount) pRows[nRows++] = pLine;
+        }
+    }
+
+    int nResult = 0;
+    if (pHeader != NULL)
+    {
+        // Key columns are found in header of response
+        int nFields = 1;
+        for (i = 0; pHeader[i] != '\0'; i++) nFields += pHeader[i] == ',';
+
+        for (i = 0; i < nKeyCount; i++)
+        {
+            keys[i].nColumnID = -1;
+            for (j = 0; j < nFields && keys[i].nColumnID < 0; j++)
+            {
+                int nLen = 0;
+                const char *pName = getField(pHeader, j, &nLen);
+                if (pName != NULL && nLen == (int)strlen(sKeys[i]) && !strncmp(pName, sKeys[i], nLen)) keys[i].nColumnID = j;
+            }
+        }
+
+        for (i = 0; i < nRows; i++)
+        {
+            pOrderRows[i] = i;
+            for (j = 0; j < nKeyCount; j++)
+                if (keys[j].nColumnID >= 0) initRoutedSortKey(&pKeys[i * nKeyCount + j], pRows[i], keys[j].nColumnID);
+                else initRoutedSortKey(&pKeys[i * nKeyCount + j], "", 0);
+        }
+
+        // Rows of every shard are already ordered, ties are kept in order of shards
+        if (nKeyCount)
+        {
+            SortContext ctx;
+            ctx.pKeys = pKeys;
+            ctx.pOrder = keys;
+            ctx.pDB = NULL;
+            ctx.pQuery = t_pQuery;
+            ctx.nKeyCount = nKeyCount;
+            ctx.nCancelled = 0;
+            qsort_r(pOrderRows, nRows, sizeof(int), compareRows, &ctx);
+        }
+
+        RowSet seen;
+        if (nDistinct) rowSetInit(&seen);
+        int nVisible = nFields - nHidden;
+        long nSkipped = 0;
+
+        stringAppend(pResponse, (char*)pHeader, visibleLength(pHeader, nVisible));
+        stringAppend(pResponse, "\n", 1);
+
+        for (i = 0; i < nRows && (nLimit < 0 || nResult < nLimit); i++)
+        {
+            const char *pRow = pRows[pOrderRows[i]];
+            int nLen = visibleLength(pRow, nVisible);
+
+            if (nDistinct && !rowSetInsert(&seen, pRow, nLen)) continue;
+            if (nSkipped++ < nOffset) continue;
+
+            stringAppend(pResponse, (char*)pRow, nLen);
+            stringAppend(pResponse, "\n", 1);
+            nResult++;
+        }
+
+        if (nDistinct) rowSetClear(&seen);
+
+        // Header alone is not a response
+        if (!nResult) pResponse->nUsed = 0;
+        pResponse->pData[pResponse->nUsed] = '\0';
+    }
+
+    queryFree(pRows);
+    queryFree(pOrderRows);
+    queryFree(pKeys);
+    clearShardReplies(pRouter, replies);
+    return nResult;
+}
+
+// This function executes UPDATE, INSERT, DELETE or RELOAD on shards. UPDATE and DELETE with equality
+// on shard key go to one shard, INSERT goes to every shard and each of them keeps tuples of its own keys
+int executeRoutedWrite(Router *pRouter, Request *pReq, String *pResponse)
+{
+    const char *pQuery = pReq->sData;
+    int isInsert = !strncmp(pQuery, "INSERT ", 7);
+    int isReload = !strncmp(pQuery, "RELOAD", 6);
+    int nTarget = isInsert || isReload ? -1 : routeQuery(pRouter, pQuery);
 
-    // Create listener socket file descriptor
-    int fd = socket(AF_INET, SOCK_STREAM | FD_CLOEXEC, IPPROTO_TCP);
-    if (fd < 0)
+    ShardReply replies[SHARDS_MAX];
+    if (!scatterQuery(pRouter, pReq, nTarget, pQuery, strlen(pQuery), replies, pResponse))
     {
-        logToFile(ERROR, "Can not create server socket");
+        clearShardReplies(pRouter, replies);
+        return STATUS_BUSY;
+    }
+
+    int i, nTotal = 0, nFailed = failedShard(pRouter, replies, pResponse);
+    if (nFailed >= 0)
+    {
+        int nStatus = replies[nFailed].nStatus;
+        clearShardReplies(pRouter, replies);
+        return nStatus;
+    }
+
+    for (i = 0; i < pRouter->nCount; i++) nTotal += replies[i].nStatus;
+    clearShardReplies(pRouter, replies);
+
+    char sResponse[DATA_MAX];
+    int nLen = 0;
+    if (isReload) nLen = snprintf(sResponse, sizeof(sResponse), "Reload of %d tables started on %d shards", nTotal, pRouter->nCount);
+    else if (isInsert) nLen = snprintf(sResponse, sizeof(sResponse), "Inserted %d recordings", nTotal);
+    else if (nTotal) nLen = snprintf(sResponse, sizeof(sResponse), "%s %d recordings",
+                                     !strncmp(pQuery, "UPDATE", 6) ? "Updated" : "Deleted", nTotal);
+
+    stringAppend(pResponse, sResponse, nLen);
+    return nTotal;
+}
+
+// This function sends BATCH to every shard and sums updated rows of every statement. Statements
+// are not split by shards, so every shard validates the whole batch and rejects it the same way
+int executeRoutedBatch(Router *pRouter, Request *pReq, String *pResponse)
+{
+    char *pEnd = NULL;
+    long nLength = strtol(pReq->sData + 6, &pEnd, 10);
+    if (pEnd == pReq->sData + 6 || *pEnd != '\n' || nLength <= 0 || nLength > BATCH_MAX) return STATUS_INVALID;
+
+    int nHeader = (int)(pEnd + 1 - pReq->sData);
+    char *pBatch = queryAlloc(nHeader + nLength + 1);
+
+    // Batch is forwarded with its length line
+    memcpy(pBatch, pReq->sData, nHeader);
+    int nReceived = pReq->nLength - nHeader;
+    if (nReceived > nLength) nReceived = nLength;
+    memcpy(pBatch + nHeader, pEnd + 1, nReceived);
+
+    if (!readRequestBody(pReq, pBatch + nHeader, nLength, nReceived))
+    {
+        logToFile(ERROR, "Can not read batch from client");
+        queryFree(pBatch);
+        return STATUS_INVALID;
+    }
+
+    ShardReply replies[SHARDS_MAX];
+    int nSent = scatterQuery(pRouter, pReq, -1, pBatch, nHeader + nLength, replies, pResponse);
+    queryFree(pBatch);
+
+    if (!nSent)
+    {
+        clearShardReplies(pRouter, replies);
+        return STATUS_BUSY;
+    }
+
+    int i, nFailed = failedShard(pRouter, replies, pResponse);
+    if (nFailed >= 0)
+    {
+        int nStatus = replies[nFailed].nStatus;
+        clearShardReplies(pRouter, replies);
+        return nStatus;
+    }
+
+    // Every response has line "statement,updated" of every statement after header
+    int nCount = -1;
+    for (i = 0; i < replies[0].data.nUsed; i++) nCount += replies[0].data.pData[i] == '\n';
+
+    int *pUpdated = queryCalloc(nCount + 1, sizeof(int));
+
+    for (i = 0; i < pRouter->nCount; i++)
+    {
+        char *ptr = strchr(replies[i].data.pData, '\n');
+        while (ptr != NULL && ptr[1] != '\0')
+        {
+            int nStatement = 0, nUpdated = 0;
+            if (sscanf(ptr + 1, "%d,%d", &nStatement, &nUpdated) == 2 && nStatement > 0 && nStatement <= nCount)
+                pUpdated[nStatement - 1] += nUpdated;
+
+            ptr = strchr(ptr + 1, '\n');
+        }
+    }
+
+    int nTotal = 0;
+    stringAppend(pResponse, "statement,updated\n", 18);
+    for (i = 0; i < nCount; i++)
+    {
+        char sLine[64];
+        int nLen = snprintf(sLine, sizeof(sLine), "%d,%d\n", i + 1, pUpdated[i]);
+        stringAppend(pResponse, sLine, nLen);
+        nTotal += pUpdated[i];
+    }
+
+    queryFree(pUpdated);
+    clearShardReplies(pRouter, replies);
+    return nTotal;
+}
+
+// This function routes query of client to shards, router has no tables itself
+int executeRouterQuery(Router *pRouter, Request *pReq, String *pResponse)
+{
+    const char *pQuery = pReq->sData;
+    int nStatus = STATUS_INVALID;
+
+    if (!strncmp(pQuery, "SELECT", 6)) nStatus = executeRoutedSelect(pRouter, pReq, pResponse);
+    else if (!strncmp(pQuery, "BATCH ", 6)) nStatus = executeRoutedBatch(pRouter, pReq, pResponse);
+    else if (!strncmp(pQuery, "UPDATE", 6) || !strncmp(pQuery, "INSERT ", 7) || !strncmp(pQuery, "DELETE ", 7) ||
+             !strcmp(pQuery, "RELOAD") || !strncmp(pQuery, "RELOAD ", 7))
+        nStatus = executeRoutedWrite(pRouter, pReq, pResponse);
+    else if (!strcmp(pQuery, "REPLICATE"))
+    {
+        char *pMessage = "Router has no tables, followers replicate shards";
+        stringAppend(pResponse, pMessage, strlen(pMessage));
+    }
+
+    // Messages of shards are passed as they are
+    if (nStatus == STATUS_INVALID && !pResponse->nUsed) stringAppend(pResponse, "Invalid or unsupported query", 28);
+    return nStatus;
+}
+
+////////////////////////////////////////////////////////////////////////
+// RESULT CACHE
+////////////////////////////////////////////////////////////////////////
+
+// This function normalizes query text for cache key, whitespace runs outside quoted values are
+// collapsed to single space and trailing spaces and semicolons are removed. Quoted values are
+// copied as they are, so values which differ only by their spaces get different keys
+void normalizeQuery(char *pDst, int nSize, const char *pQuery)
+{
+    int nLen = 0, nSpace = 0, isQuoted = 0;
+
+    while (*pQuery == ' ' || *pQuery == '\t' || *pQuery == '\r' || *pQuery == '\n') pQuery++;
+    while (*pQuery != '\0' && nLen < nSize - 1)
+    {
+        char c = *pQuery++;
+        if (c == '\'') isQuoted = !isQuoted;
+        if (!isQuoted && (c == ' ' || c == '\t' || c == '\r' || c == '\n'))
+        {
+            nSpace = 1;
+            continue;
+        }
+
+        if (nSpace && nLen < nSize - 2) pDst[nLen++] = ' ';
+        pDst[nLen++] = c;
+        nSpace = 0;
+    }
+
+    while (nLen > 0 && (pDst[nLen - 1] == ';' || pDst[nLen - 1] == ' ')) nLen--;
+    pDst[nLen] = '\0';
+}
+
+// This function initializes result cache with given capacity of entries
+void initCache(ResultCache *pCache, int nCapacity)
+{
+    pCache->pHead = pCache->pTail = NULL;
+    pCache->nHits = pCache->nMisses = 0;
+    pCache->nCapacity = nCapacity;
+    pCache->nBytes = 0;
+    pCache->nCount = 0;
+    pCache->isInit = 0;
+    if (nCapacity <= 0) return;
+
+    // Keep buckets at least twice more than entries
+    pCache->nBucketCount = 16;
+    while (pCache->nBucketCount < nCapacity * 2) pCache->nBucketCount *= 2;
+
+    pCache->pBuckets = calloc(pCache->nBucketCount, sizeof(CacheEntry*));
+    if (pCache->pBuckets == NULL)
+    {
+        logToFile(ERROR, "Can not alloc memory for result cache");
         exitFailure(NULL);
     }
 
-    // Bind socket
-    if (bind(fd, (struct sockaddr*)&inaddr, sizeof(inaddr)) < 0)
+    initMutex(&pCache->mutex);
+    pCache->isInit = 1;
+}
+
+// This function unlinks entry from LRU list and hash bucket and frees it
+void cacheRemove(ResultCache *pCache, CacheEntry *pEntry)
+{
+    CacheEntry **ppSlot = &pCache->pBuckets[pEntry->nHash & (pCache->nBucketCount - 1)];
+    while (*ppSlot != pEntry) ppSlot = &(*ppSlot)->pHashNext;
+    *ppSlot = pEntry->pHashNext;
+
+    if (pEntry->pPrev != NULL) pEntry->pPrev->pNext = pEntry->pNext;
+    else pCache->pHead = pEntry->pNext;
+    if (pEntry->pNext != NULL) pEntry->pNext->pPrev = pEntry->pPrev;
+    else pCache->pTail = pEntry->pPrev;
+
+    pCache->nBytes -= pEntry->nLength;
+    pCache->nCount--;
+
+    free(pEntry->pKey);
+    free(pEntry->pData);
+    free(pEntry);
+}
+
+// This function destroys cache and frees all entries
+void destroyCache(ResultCache *pCache)
+{
+    if (!pCache->isInit) return;
+
+    while (pCache->pHead != NULL)
+        cacheRemove(pCache, pCache->pHead);
+
+    free(pCache->pBuckets);
+    pCache->pBuckets = NULL;
+    pthread_mutex_destroy(&pCache->mutex);
+    pCache->isInit = 0;
+}
+
+// This function returns cache hit ratio in percents, counters are read without cache lock
+double cacheHitRatio(ResultCache *pCache)
+{
+    unsigned long nHits = __atomic_load_n(&pCache->nHits, __ATOMIC_RELAXED);
+    unsigned long nTotal = nHits + __atomic_load_n(&pCache->nMisses, __ATOMIC_RELAXED);
+    return nTotal ? (double)nHits * 100.0 / (double)nTotal : 0.0;
+}
+
+// This function searches response of the query in cache, entries created with older database
+// version are dropped here. On hit response is copied into pResponse and 1 is returned
+int cacheLookup(ResultCache *pCache, const char *pKey, unsigned long nVersion, String *pResponse, int *pStatus)
+{
+    if (!pCache->isInit) return 0;
+
+    uint32_t nHash = hashData(pKey, strlen(pKey));
+    lockMutex(&pCache->mutex);
+
+    CacheEntry *pEntry = pCache->pBuckets[nHash & (pCache->nBucketCount - 1)];
+    while (pEntry != NULL && (pEntry->nHash != nHash || strcmp(pEntry->pKey, pKey)))
+        pEntry = pEntry->pHashNext;
+
+    // Stale entry, database was updated after the response was cached
+    if (pEntry != NULL && pEntry->nVersion != nVersion)
     {
-        logToFile(ERROR, "Failed to bind socket");
-        close(fd);
+        cacheRemove(pCache, pEntry);
+        pEntry = NULL;
+    }
+
+    if (pEntry == NULL)
+    {
+        __atomic_fetch_add(&pCache->nMisses, 1, __ATOMIC_RELAXED);
+        unlockMutex(&pCache->mutex);
+        return 0;
+    }
+
+    // Move entry to the head of LRU list
+    if (pEntry != pCache->pHead)
+    {
+        pEntry->pPrev->pNext = pEntry->pNext;
+        if (pEntry->pNext != NULL) pEntry->pNext->pPrev = pEntry->pPrev;
+        else pCache->pTail = pEntry->pPrev;
+
+        pEntry->pPrev = NULL;
+        pEntry->pNext = pCache->pHead;
+        pCache->pHead->pPrev = pEntry;
+        pCache->pHead = pEntry;
+    }
+
+    stringAppend(pResponse, pEntry->pData, pEntry->nLength);
+    *pStatus = pEntry->nStatus;
+    __atomic_fetch_add(&pCache->nHits, 1, __ATOMIC_RELAXED);
+
+    unlockMutex(&pCache->mutex);
+    return 1;
+}
+
+// This function saves response of the query in cache, least recently
+// used entries are evicted when count or memory bound is reached
+void cacheStore(ResultCache *pCache, const char *pKey, unsigned long nVersion, String *pResponse, int nStatus)
+{
+    if (!pCache->isInit || pResponse->nUsed > CACHE_BYTES_MAX / 4) return;
+
+    CacheEntry *pEntry = malloc(sizeof(CacheEntry));
+    if (pEntry == NULL) return;
+
+    pEntry->pKey = strdup(pKey);
+    pEntry->pData = malloc(pResponse->nUsed + 1);
+    if (pEntry->pKey == NULL || pEntry->pData == NULL)
+    {
+        free(pEntry->pKey);
+        free(pEntry->pData);
+        free(pEntry);
+        return;
+    }
+
+    memcpy(pEntry->pData, pResponse->pData, pResponse->nUsed);
+    pEntry->nHash = hashData(pKey, strlen(pKey));
+    pEntry->nLength = pResponse->nUsed;
+    pEntry->nVersion = nVersion;
+    pEntry->nStatus = nStatus;
+
+    lockMutex(&pCache->mutex);
+
+    // Replace existing entry of the same query
+    CacheEntry *pOld = pCache->pBuckets[pEntry->nHash & (pCache->nBucketCount - 1)];
+    while (pOld != NULL && (pOld->nHash != pEntry->nHash || strcmp(pOld->pKey, pKey)))
+        pOld = pOld->pHashNext;
+    if (pOld != NULL) cacheRemove(pCache, pOld);
+
+    // Evict least recently used entries
+    while (pCache->pTail != NULL && (pCache->nCount >= pCache->nCapacity ||
+           pCache->nBytes + pEntry->nLength > CACHE_BYTES_MAX))
+        cacheRemove(pCache, pCache->pTail);
+
+    CacheEntry **ppSlot = &pCache->pBuckets[pEntry->nHash & (pCache->nBucketCount - 1)];
+    pEntry->pHashNext = *ppSlot;
+    *ppSlot = pEntry;
+
+    pEntry->pPrev = NULL;
+    pEntry->pNext = pCache->pHead;
+    if (pCache->pHead != NULL) pCache->pHead->pPrev = pEntry;
+    else pCache->pTail = pEntry;
+    pCache->pHead = pEntry;
+
+    pCache->nBytes += pEntry->nLength;
+    pCache->nCount++;
+
+    unlockMutex(&pCache->mutex);
+}
+
+////////////////////////////////////////////////////////////////////////
+// STATS QUERY
+////////////////////////////////////////////////////////////////////////
+
+static const char *g_pQueryTypes[QUERY_TYPE_COUNT] = { "SELECT", "UPDATE", "STATS", "INVALID" };
+
+// This function appends one histogram line in stats response
+void appendHistogram(String *pStr, const char *pName, Histogram *pHist)
+{
+    char sLine[DATA_MAX];
+    int nLen = snprintf(sLine, sizeof(sLine), "%s,%lu,%lu,%lu,%lu,%lu,%lu\n", pName,
+                        (unsigned long)pHist->nTotal,
+                        (unsigned long)(pHist->nTotal ? pHist->nSum / pHist->nTotal : 0),
+                        (unsigned long)histogramPercentile(pHist, 50.0),
+                        (unsigned long)histogramPercentile(pHist, 99.0),
+                        (unsigned long)histogramPercentile(pHist, 99.9),
+                        (unsigned long)pHist->nMax);
+
+    stringAppend(pStr, sLine, nLen);
+}
+
+// This function merges statistics of all worker threads and appends them into response,
+// latencies are in usecs and are measured from accepting connection until response is sent
+int buildStats(String *pResponse)
+{
+    WorkerStats *pTotal = queryCalloc(1, sizeof(WorkerStats));
+
+    int i, j, nLines = 0;
+    uint64_t nNow = monotonicTime();
+    uint64_t nLiveTime = 0; // Usecs lived by all workers
+
+    // Slots are not freed before workers are stopped, so they can be read under pool mutex
+    lockMutex(&g_workers.mutex);
+    for (i = 0; i < g_workers.nSlotCount; i++)
+    {
+        WorkerContext *pWorker = g_workers.pWorkers[i];
+        WorkerStats *pStats = pWorker->pStats;
+        if (pStats == NULL) continue;
+
+        nLiveTime += pWorker->nLiveTime;
+        if (pWorker->nState == WORKER_RUNNING) nLiveTime += nNow - pWorker->nSpawnTime;
+
+        for (j = 0; j < QUERY_TYPE_COUNT; j++)
+            histogramMerge(&pTotal->latency[j], &pStats->latency[j]);
+
+        histogramMerge(&pTotal->queueWait, &pStats->queueWait);
+        histogramMerge(&pTotal->lockWait, &pStats->lockWait);
+        pTotal->nBusyTime += __atomic_load_n(&pStats->nBusyTime, __ATOMIC_RELAXED);
+        pTotal->nBytesSent += __atomic_load_n(&pStats->nBytesSent, __ATOMIC_RELAXED);
+    }
+
+    int nWorkers = g_workers.nWorkerCount;
+    unsigned long nSpawned = g_workers.nSpawned;
+    unsigned long nRetired = g_workers.nRetired;
+    unlockMutex(&g_workers.mutex);
+
+    // Lag of follower is age of the last message of primary, heartbeats keep it low while primary is idle
+    uint64_t nLag = 0, nPrimaryTime = __atomic_load_n(&g_replica.nPrimaryTime, __ATOMIC_RELAXED);
+    if (g_replica.pPrimary != NULL && wallTime() > nPrimaryTime) nLag = wallTime() - nPrimaryTime;
+
+    // Process CPU time, so CPU per query can be compared between engines
+    struct rusage usage;
+    memset(&usage, 0, sizeof(usage));
+    getrusage(RUSAGE_SELF, &usage);
+
+    uint64_t nUptime = nNow - g_stats.nStartTime;
+    double fUtilization = nLiveTime ? (double)pTotal->nBusyTime * 100.0 / (double)nLiveTime : 0.0;
+
+    char sLine[DATA_MAX];
+    int nLen = snprintf(sLine, sizeof(sLine),
+        "uptime_us,%lu\n"
+        "connections,%lu\n"
+        "queue_depth,%d\n"
+        "queue_depth_max,%d\n"
+        "worker_waits,%lu\n"
+        "rejected,%lu\n"
+        "cancelled,%lu\n"
+        "workers,%d\n"
+        "workers_spawned,%lu\n"
+        "workers_retired,%lu\n"
+        "worker_busy_us,%lu\n"
+        "worker_utilization_pct,%.2f\n"
+        "bytes_sent,%lu\n"
+        "shm_responses,%lu\n"
+        "zones_scanned,%lu\n"
+        "zones_skipped,%lu\n"
+        "bloom_skipped,%lu\n"
+        "compactions,%lu\n"
+        "compacted_rows,%lu\n"
+        "reloads,%lu\n"
+        "followers,%d\n"
+        "replicated_writes,%lu\n"
+        "replica_lag_us,%lu\n"
+        "shards,%d\n"
+        "routed_single,%lu\n"
+        "routed_scatter,%lu\n"
+        "shard_errors,%lu\n"
+        "plan_cache_hits,%lu\n"
+        "plan_cache_misses,%lu\n"
+        "vm_batches,%lu\n"
+        "io_syscalls,%lu\n"
+        "cpu_user_us,%lu\n"
+        "cpu_system_us,%lu\n"
+        "cache_hit_ratio_pct,%.2f\n",
+        (unsigned long)nUptime,
+        (unsigned long)__atomic_load_n(&g_stats.nAccepted, __ATOMIC_RELAXED),
+        __atomic_load_n(&g_stats.nQueueDepth, __ATOMIC_RELAXED),
+        __atomic_load_n(&g_stats.nMaxQueueDepth, __ATOMIC_RELAXED),
+        (unsigned long)__atomic_load_n(&g_stats.nWaits, __ATOMIC_RELAXED),
+        (unsigned long)__atomic_load_n(&g_stats.nRejected, __ATOMIC_RELAXED),
+        (unsigned long)__atomic_load_n(&g_stats.nCancelled, __ATOMIC_RELAXED),
+        nWorkers, nSpawned, nRetired,
+        (unsigned long)pTotal->nBusyTime, fUtilization,
+        (unsigned long)pTotal->nBytesSent,
+        (unsigned long)__atomic_load_n(&g_stats.nShmResponses, __ATOMIC_RELAXED),
+        (unsigned long)__atomic_load_n(&g_stats.nZonesScanned, __ATOMIC_RELAXED),
+        (unsigned long)__atomic_load_n(&g_stats.nZonesSkipped, __ATOMIC_RELAXED),
+        (unsigned long)__atomic_load_n(&g_stats.nBloomSkipped, __ATOMIC_RELAXED),
+        (unsigned long)__atomic_load_n(&g_stats.nCompactions, __ATOMIC_RELAXED),
+        (unsigned long)__atomic_load_n(&g_stats.nCompactedRows, __ATOMIC_RELAXED),
+        (unsigned long)__atomic_load_n(&g_stats.nReloads, __ATOMIC_RELAXED),
+        __atomic_load_n(&g_replica.nFollowerCount, __ATOMIC_RELAXED),
+        (unsigned long)__atomic_load_n(&g_replica.nSeq, __ATOMIC_RELAXED),
+        (unsigned long)nLag,
+        g_router.nCount ? g_router.nCount : g_catalog.nShardCount,
+        (unsigned long)__atomic_load_n(&g_stats.nRoutedSingle, __ATOMIC_RELAXED),
+        (unsigned long)__atomic_load_n(&g_stats.nRoutedScatter, __ATOMIC_RELAXED),
+        (unsigned long)__atomic_load_n(&g_stats.nShardErrors, __ATOMIC_RELAXED),
+        (unsigned long)__atomic_load_n(&g_stats.nPlanHits, __ATOMIC_RELAXED),
+        (unsigned long)__atomic_load_n(&g_stats.nPlanMisses, __ATOMIC_RELAXED),
+        (unsigned long)__atomic_load_n(&g_stats.nVmBatches, __ATOMIC_RELAXED),
+        (unsigned long)__atomic_load_n(&g_stats.nSyscalls, __ATOMIC_RELAXED),
+        (unsigned long)usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec,
+        (unsigned long)usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec,
+        cacheHitRatio(&g_cache));
+
+    stringAppend(pResponse, sLine, nLen);
+    nLines += 34;
+
+    // Histograms of query latencies and waits
+    stringAppend(pResponse, "histogram,count,mean_us,p50_us,p99_us,p999_us,max_us\n", 53);
+    for (j = 0; j < QUERY_TYPE_COUNT; j++, nLines++)
+        appendHistogram(pResponse, g_pQueryTypes[j], &pTotal->latency[j]);
+
+    appendHistogram(pResponse, "queue_wait", &pTotal->queueWait);
+    appendHistogram(pResponse, "lock_wait", &pTotal->lockWait);
+    nLines += 2;
+
+    queryFree(pTotal);
+    return nLines;
+}
+
+// This function executes STATS query and appends statistics in the response
+int executeStatsQuery(String *pResponse)
+{
+    return buildStats(pResponse);
+}
+
+#ifdef LOCK_PROFILE
+
+// This function orders call sites by total wait, then by hold time
+int compareLockSites(const void *pA, const void *pB)
+{
+    const LockSite *pSiteA = (const LockSite*)pA, *pSiteB = (const LockSite*)pB;
+    if (pSiteA->nWaitTime != pSiteB->nWaitTime) return pSiteA->nWaitTime < pSiteB->nWaitTime ? 1 : -1;
+    if (pSiteA->nHoldTime != pSiteB->nHoldTime) return pSiteA->nHoldTime < pSiteB->nHoldTime ? 1 : -1;
+    return 0;
+}
+
+// This function merges lock counters of all threads by call site and appends them into response,
+// sites which waited most go first. Times are in usecs, returns count of sites
+int buildLockStats(String *pResponse)
+{
+    static const char *pKinds[] = { "mutex", "read", "write" };
+    LockSite *pSites = queryCalloc(LOCK_SITES_MAX, sizeof(LockSite));
+    int i, j, nCount = 0;
+
+    // Profiles are only added to registry, sites of running threads are read with relaxed atomics
+    pthread_mutex_lock(&g_locks.mutex);
+    LockProfile *pProfile;
+    for (pProfile = g_locks.pProfiles; pProfile != NULL; pProfile = pProfile->pNext)
+    {
+        for (i = 0; i < LOCK_SITES_MAX; i++)
+        {
+            LockSite *pSrc = &pProfile->sites[i];
+            const char *pFunction = __atomic_load_n(&pSrc->pFunction, __ATOMIC_ACQUIRE);
+            if (pFunction == NULL) continue;
+
+            for (j = 0; j < nCount; j++)
+                if (pSites[j].pFunction == pFunction && pSites[j].nLine == pSrc->nLine && pSites[j].nKind == pSrc->nKind) break;
+
+            LockSite *pDst = &pSites[j];
+            if (j == nCount)
+            {
+                if (nCount == LOCK_SITES_MAX) continue;
+                pDst->pFunction = pFunction;
+                pDst->nLine = pSrc->nLine;
+                pDst->nKind = pSrc->nKind;
+                nCount++;
+            }
+
+            uint64_t nMaxWait = __atomic_load_n(&pSrc->nMaxWait, __ATOMIC_RELAXED);
+            uint64_t nMaxHold = __atomic_load_n(&pSrc->nMaxHold, __ATOMIC_RELAXED);
+            pDst->nAcquired += __atomic_load_n(&pSrc->nAcquired, __ATOMIC_RELAXED);
+            pDst->nContended += __atomic_load_n(&pSrc->nContended, __ATOMIC_RELAXED);
+            pDst->nWaitTime += __atomic_load_n(&pSrc->nWaitTime, __ATOMIC_RELAXED);
+            pDst->nHoldTime += __atomic_load_n(&pSrc->nHoldTime, __ATOMIC_RELAXED);
+            if (nMaxWait > pDst->nMaxWait) pDst->nMaxWait = nMaxWait;
+            if (nMaxHold > pDst->nMaxHold) pDst->nMaxHold = nMaxHold;
+        }
+    }
+
+    pthread_mutex_unlock(&g_locks.mutex);
+    qsort(pSites, nCount, sizeof(LockSite), compareLockSites);
+
+    char *pHeader = "lock_site,kind,acquired,contended,contended_pct,wait_us,max_wait_us,hold_us,max_hold_us\n";
+    stringAppend(pResponse, pHeader, strlen(pHeader));
+
+    for (i = 0; i < nCount; i++)
+    {
+        LockSite *pSite = &pSites[i];
+        char sLine[DATA_MAX];
+        int nLen = snprintf(sLine, sizeof(sLine), "%s:%d,%s,%lu,%lu,%.2f,%lu,%lu,%lu,%lu\n",
+                            pSite->pFunction, pSite->nLine, pKinds[pSite->nKind],
+                            (unsigned long)pSite->nAcquired, (unsigned long)pSite->nContended,
+                            pSite->nAcquired ? (double)pSite->nContended * 100.0 / (double)pSite->nAcquired : 0.0,
+                            (unsigned long)pSite->nWaitTime, (unsigned long)pSite->nMaxWait,
+                            (unsigned long)pSite->nHoldTime, (unsigned long)pSite->nMaxHold);
+
+        stringAppend(pResponse, sLine, nLen);
+    }
+
+    queryFree(pSites);
+    return nCount;
+}
+
+// This function executes LOCKS query and appends lock contention of call sites in the response
+int executeLocksQuery(String *pResponse)
+{
+    return buildLockStats(pResponse);
+}
+
+// This function writes lock contention into log file at shutdown
+void logLockStats()
+{
+    if (!g_locks.isInit) return;
+
+    String stats;
+    stringInit(&stats, DATA_MAX);
+    buildLockStats(&stats);
+
+    // Log every line of stats separately
+    char *savePtr = NULL;
+    char *ptr = strtok_r(stats.pData, "\n", &savePtr);
+    while (ptr != NULL)
+    {
+        logToFile(INFO, "Locks: %s", ptr);
+        ptr = strtok_r(NULL, "\n", &savePtr);
+    }
+
+    stringClear(&stats);
+}
+
+#endif
+
+// Stats thread periodically writes statistics into log file
+void* statsThread(void *pArg)
+{
+    int nInterval = *(int*)pArg;
+    uint64_t nLastDump = monotonicTime();
+
+    while (g_stats.isInit && !g_nInterrupted)
+    {
+        usleep(100000);
+        if (monotonicTime() - nLastDump < (uint64_t)nInterval * 1000000) continue;
+        nLastDump = monotonicTime();
+
+        String stats;
+        stringInit(&stats, DATA_MAX);
+        buildStats(&stats);
+
+        // Log every line of stats separately
+        char *savePtr = NULL;
+        char *ptr = strtok_r(stats.pData, "\n", &savePtr);
+        while (ptr != NULL)
+        {
+            logToFile(INFO, "Stats: %s", ptr);
+            ptr = strtok_r(NULL, "\n", &savePtr);
+        }
+
+        stringClear(&stats);
+    }
+
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////
+// REQUEST QUEUE
+////////////////////////////////////////////////////////////////////////
+
+// This function initializes bounded queue of pending requests
+void initQueue(RequestQueue *pQueue, int nLimit)
+{
+    if (pthread_mutex_init(&pQueue->mutex, NULL))
+    {
+        logToFile(ERROR, "Failed to init queue mutex");
+        exitFailure(NULL);
+    }
+
+    if (pthread_cond_init(&pQueue->cond, NULL))
+    {
+        logToFile(ERROR, "Failed to init queue condition variable");
+        pthread_mutex_destroy(&pQueue->mutex);
+        exitFailure(NULL);
+    }
+
+    memset(pQueue->pBuckets, 0, sizeof(pQueue->pBuckets));
+    pQueue->pActiveHead = NULL;
+    pQueue->pActiveTail = NULL;
+    pQueue->nLimit = nLimit;
+    pQueue->nCount = 0;
+    pQueue->nIdleWorkers = 0;
+    pQueue->nShutdown = 0;
+    pQueue->isInit = 1;
+}
+
+// This function wakes up all workers waiting for requests, dequeueRequest()
+// returns NULL to them after this and workers can exit
+void shutdownQueue(RequestQueue *pQueue)
+{
+    if (!pQueue->isInit) return;
+
+    lockMutex(&pQueue->mutex);
+    pQueue->nShutdown = 1;
+    pthread_cond_broadcast(&pQueue->cond);
+    unlockMutex(&pQueue->mutex);
+}
+
+// This function finds queue of the client, new queue is created if bCreate is set
+ClientQueue* findClientQueue(RequestQueue *pQueue, uint64_t nKey, int bCreate)
+{
+    ClientQueue **ppSlot = &pQueue->pBuckets[nKey % QUEUE_BUCKETS];
+    while (*ppSlot != NULL && (*ppSlot)->nKey != nKey) ppSlot = &(*ppSlot)->pHashNext;
+    if (*ppSlot != NULL || !bCreate) return *ppSlot;
+
+    ClientQueue *pClient = calloc(1, sizeof(ClientQueue));
+    if (pClient == NULL)
+    {
+        logToFile(ERROR, "Can not alloc memory for client queue");
         exitFailure(NULL);
     }
 
-    // Listen to socket
-    if (listen(fd, 120000) < 0) 
+    // New client is appended at the end of round-robin ring
+    pClient->nKey = nKey;
+    *ppSlot = pClient;
+
+    if (pQueue->pActiveTail != NULL) pQueue->pActiveTail->pNextActive = pClient;
+    else pQueue->pActiveHead = pClient;
+    pQueue->pActiveTail = pClient;
+
+    return pClient;
+}
+
+// This function removes empty client queue from hash table, client
+// must be already unlinked from round-robin ring by the caller
+void removeClientQueue(RequestQueue *pQueue, ClientQueue *pClient)
+{
+    ClientQueue **ppSlot = &pQueue->pBuckets[pClient->nKey % QUEUE_BUCKETS];
+    while (*ppSlot != pClient) ppSlot = &(*ppSlot)->pHashNext;
+    *ppSlot = pClient->pHashNext;
+    free(pClient);
+}
+
+// This function appends request into queue of its client. When queue is full the newest request of the client
+// with the longest queue is pushed out for the new one, so noisy client can not take all slots of the queue.
+// Returns 0 if request is rejected, pushed out request is saved in ppDropped and must be answered by caller
+int enqueueRequest(RequestQueue *pQueue, Request *pReq, Request **ppDropped)
+{
+    *ppDropped = NULL;
+    pReq->pNext = NULL;
+
+    lockMutex(&pQueue->mutex);
+    if (pQueue->nShutdown)
+    {
+        unlockMutex(&pQueue->mutex);
+        return 0;
+    }
+
+    if (pQueue->nCount >= pQueue->nLimit)
+    {
+        ClientQueue *pOwn = findClientQueue(pQueue, pReq->nClientKey, 0);
+        ClientQueue *pLongest = pQueue->pActiveHead;
+        ClientQueue *pClient;
+
+        for (pClient = pQueue->pActiveHead; pClient != NULL; pClient = pClient->pNextActive)
+            if (pClient->nCount > pLongest->nCount) pLongest = pClient;
+
+        // Reject if this client already has the longest queue
+        if (pLongest == NULL || pLongest->nCount <= (pOwn != NULL ? pOwn->nCount + 1 : 1))
+        {
+            unlockMutex(&pQueue->mutex);
+            return 0;
+        }
+
+        // Push out the newest request of the longest queue
+        Request **ppLast = &pLongest->pHead;
+        while ((*ppLast)->pNext != NULL) ppLast = &(*ppLast)->pNext;
+
+        *ppDropped = *ppLast;
+        *ppLast = NULL;
+        pLongest->pTail = pLongest->pHead;
+        while (pLongest->pTail->pNext != NULL) pLongest->pTail = pLongest->pTail->pNext;
+        pLongest->nCount--;
+        pQueue->nCount--;
+    }
+
+    ClientQueue *pClient = findClientQueue(pQueue, pReq->nClientKey, 1);
+    if (pClient->pTail != NULL) pClient->pTail->pNext = pReq;
+    else pClient->pHead = pReq;
+    pClient->pTail = pReq;
+    pClient->nCount++;
+
+    // Update queue statistics
+    pQueue->nCount++;
+    __atomic_store_n(&g_stats.nQueueDepth, pQueue->nCount, __ATOMIC_RELAXED);
+    if (pQueue->nCount > g_stats.nMaxQueueDepth) __atomic_store_n(&g_stats.nMaxQueueDepth, pQueue->nCount, __ATOMIC_RELAXED);
+    if (!pQueue->nIdleWorkers)
+    {
+        logToFile(INFO, "No thread is available! Request is queued, %d requests are waiting.", pQueue->nCount);
+        __atomic_fetch_add(&g_stats.nWaits, 1, __ATOMIC_RELAXED);
+    }
+
+    signalCondition(&pQueue->cond);
+    unlockMutex(&pQueue->mutex);
+    return 1;
+}
+
+// This function waits for pending request and takes it from the queue. Clients are served
+// in round-robin order, one request of every client in turn. Trace events of waiting worker
+// are flushed when they are buffered for TRACE_FLUSH_INTERVAL. Returns NULL on shutdown
+Request* dequeueRequest(RequestQueue *pQueue, int nIdleTimeout, int *pRetired)
+{
+    *pRetired = 0;
+    lockMutex(&pQueue->mutex);
+    pQueue->nIdleWorkers++;
+    uint64_t nIdleEnd = monotonicTime() + (uint64_t)nIdleTimeout * 1000;
+
+    while (pQueue->pActiveHead == NULL && !pQueue->nShutdown)
+    {
+        int nFlushWait = traceFlushWait();
+        if (!nFlushWait)
+        {
+            unlockMutex(&pQueue->mutex);
+            flushTraceBuffer(t_pTrace);
+            lockMutex(&pQueue->mutex);
+            continue;
+        }
+
+        if (nIdleTimeout <= 0 && nFlushWait < 0)
+        {
+            waitCondition(&pQueue->cond, &pQueue->mutex);
+            continue;
+        }
+
+        // Wait ends at idle timeout or when trace events must be flushed, whichever comes first
+        int nWait = nFlushWait, isIdleWait = 0;
+        if (nIdleTimeout > 0)
+        {
+            uint64_t nNow = monotonicTime();
+            int nIdleLeft = nIdleEnd > nNow ? (int)((nIdleEnd - nNow + 999) / 1000) : 0;
+            isIdleWait = nWait < 0 || nIdleLeft <= nWait;
+            if (isIdleWait) nWait = nIdleLeft;
+        }
+
+        if (waitConditionTimed(&pQueue->cond, &pQueue->mutex, nWait) || !isIdleWait || pQueue->pActiveHead != NULL) continue;
+
+        // Worker which stays idle for whole timeout is retired if pool is above its minimum
+        if (shrinkPool(&g_workers))
+        {
+            *pRetired = 1;
+            break;
+        }
+
+        nIdleEnd = monotonicTime() + (uint64_t)nIdleTimeout * 1000;
+    }
+
+    pQueue->nIdleWorkers--;
+    if (pQueue->nShutdown || *pRetired)
     {
-        logToFile(ERROR, "Failed to listen socket");
-        close(fd);
-        exitFailure(NULL);
+        unlockMutex(&pQueue->mutex);
+        return NULL;
     }
 
-    return fd;
-}
+    // Take the first request of the client at the head of ring
+    ClientQueue *pClient = pQueue->pActiveHead;
+    Request *pReq = pClient->pHead;
+    pClient->pHead = pReq->pNext;
+    if (pClient->pHead == NULL) pClient->pTail = NULL;
+    pClient->nCount--;
 
-////////////////////////////////////////////////////////////////////////
-// DATABASE
-////////////////////////////////////////////////////////////////////////
+    // Move client to the end of ring or remove it if it has nothing more
+    pQueue->pActiveHead = pClient->pNextActive;
+    if (pQueue->pActiveHead == NULL) pQueue->pActiveTail = NULL;
+    pClient->pNextActive = NULL;
 
-// This function initializes database structure
-void initDatabase(Database *pDB)
-{
-    // Init read/write lock
-    if (pthread_rwlock_init(&pDB->rwLock, NULL))
+    if (pClient->nCount)
     {
-        logToFile(ERROR, "Can not init rw lock");
-        exitFailure(NULL);
+        if (pQueue->pActiveTail != NULL) pQueue->pActiveTail->pNextActive = pClient;
+        else pQueue->pActiveHead = pClient;
+        pQueue->pActiveTail = pClient;
     }
+    else removeClientQueue(pQueue, pClient);
 
-    // Initial values
-    pDB->sColumns[0] = '\0';
-    pDB->nColumnCount = 0;
-    pDB->nRowCount = 0;
-    pDB->nRowSize = 10;
+    pQueue->nCount--;
+    __atomic_store_n(&g_stats.nQueueDepth, pQueue->nCount, __ATOMIC_RELAXED);
+
+    unlockMutex(&pQueue->mutex);
+    return pReq;
+}
+
+// This function returns usecs waited by the oldest pending request,
+// zero is returned if some worker is idle and takes it anyway
+uint64_t queueWaitTime(RequestQueue *pQueue, uint64_t nNow)
+{
+    uint64_t nOldest = nNow;
+    ClientQueue *pClient;
 
-    // Allocate memory for rows
-    pDB->pRows = (RowData*)malloc((sizeof(RowData) + DATA_MAX) * pDB->nRowSize);
-    if (pDB->pRows == NULL)
+    lockMutex(&pQueue->mutex);
+    if (!pQueue->nIdleWorkers)
     {
-        // Destroy rw lock and free database
-        logToFile(ERROR, "Can not alloc memory for database");
-        pthread_rwlock_destroy(&pDB->rwLock);
-        exitFailure(NULL);
+        for (pClient = pQueue->pActiveHead; pClient != NULL; pClient = pClient->pNextActive)
+            if (pClient->pHead->nAcceptTime < nOldest) nOldest = pClient->pHead->nAcceptTime;
     }
 
-    pDB->isInit = 1;
+    unlockMutex(&pQueue->mutex);
+    return nNow - nOldest;
 }
 
-// This function destroys database structure and all associated variables
-void destroyDatabase(Database *pDB)
+// This function closes connections of all pending requests and destroys the queue
+void destroyQueue(RequestQueue *pQueue)
 {
-    if (!pDB->isInit) return;
+    if (!pQueue->isInit) return;
 
-    // Clear columns
-    if (pDB->pRows != NULL)
+    while (pQueue->pActiveHead != NULL)
     {
-        free(pDB->pRows);
-        pDB->pRows = NULL;
+        ClientQueue *pClient = pQueue->pActiveHead;
+        pQueue->pActiveHead = pClient->pNextActive;
+
+        while (pClient->pHead != NULL)
+        {
+            Request *pReq = pClient->pHead;
+            pClient->pHead = pReq->pNext;
+            close(pReq->nClientFD);
+            freeRequest(pReq);
+        }
+
+        removeClientQueue(pQueue, pClient);
     }
 
-    // Destroy read/write lock
-    pthread_rwlock_destroy(&pDB->rwLock);
+    pthread_mutex_destroy(&pQueue->mutex);
+    pthread_cond_destroy(&pQueue->cond);
+    pQueue->isInit = 0;
 }
 
-// This function appends the row data into the database
-void appendDatabase(Database *pDB, const char *pRowData)
+// This function sends status and response to the client of request and closes connection.
+// Large response of shared memory client is written into its memfd, so socket carries only
+// its length. Returns count of delivered bytes or -1
+ssize_t replyRequest(Request *pReq, int nStatus, const char *pData, int nLength)
 {
-    // Reallocate rows array if upper bound is reached
-    if (pDB->nRowCount + 1 > pDB->nRowSize)
+    struct iovec iov[3];
+    int nShmLength = -1, nCount = 0;
+    iov[nCount].iov_base = &nStatus;
+    iov[nCount++].iov_len = sizeof(nStatus);
+
+    // Shared memory client reads length of response in memfd, -1 means response follows inline
+    if (pReq->nShmFD >= 0)
     {
-        pDB->nRowSize = pDB->nRowSize * 2;
-        pDB->pRows = realloc(pDB->pRows, (sizeof(RowData) + DATA_MAX) * pDB->nRowSize);
-        if (pDB->pRows == NULL)
+        if (nLength > SHM_INLINE_MAX)
         {
-            logToFile(ERROR, "Can not realloc memory for columns");
-            exitFailure(NULL);
+            if (pwrite(pReq->nShmFD, pData, nLength, 0) == nLength) nShmLength = nLength;
+            statsSyscalls(1);
         }
+
+        iov[nCount].iov_base = &nShmLength;
+        iov[nCount++].iov_len = sizeof(nShmLength);
     }
 
-    char sRow[DATA_MAX]; // Remove new line character
-    removeCharacter(sRow, sizeof(sRow), pRowData, '\n');
+    if (nShmLength < 0)
+    {
+        iov[nCount].iov_base = (void*)pData;
+        iov[nCount++].iov_len = nLength;
+    }
 
-    // Get new/unused row from column and set data
-    RowData *pRow = &pDB->pRows[pDB->nRowCount++];
-    snprintf(pRow->sData, sizeof(pRow->sData), "%s", sRow);
+    ssize_t nSent = sendAndClose(pReq->nClientFD, iov, nCount);
+    if (nSent >= 0 && nShmLength >= 0)
+    {
+        __atomic_fetch_add(&g_stats.nShmResponses, 1, __ATOMIC_RELAXED);
+        nSent += nShmLength;
+    }
+
+    return nSent;
 }
 
-// This function opens database file, line-by-line reads it and saves recordings in the Database structure
-void loadDatabase(const char *pPath, Database *pDB)
+// This function frees request, connection must be closed by caller
+void freeRequest(Request *pReq)
 {
-    logToFile(INFO, "Loading dataset...");
-    uint32_t nStartTime = timeStamp();
+    if (pReq->nShmFD >= 0) close(pReq->nShmFD);
+    free(pReq);
+}
 
-    // Open input csv file read input csv file
-    FILE *fp = fopen(pPath, "r");
-    if (fp == NULL)
+// This function answers request with "server busy" status and closes its connection
+void rejectRequest(Request *pReq)
+{
+    const char *pMessage = "Server busy, try again later";
+    replyRequest(pReq, STATUS_BUSY, pMessage, strlen(pMessage));
+    __atomic_fetch_add(&g_stats.nRejected, 1, __ATOMIC_RELAXED);
+    freeRequest(pReq);
+}
+
+// This function parses optional request header. Header is the first line of the request,
+// starts with '@' and contains space separated options, e.g. "@client=3 timeout=500". Query after
+// header is moved to the beginning of request data
+void parseRequestHeader(Request *pReq)
+{
+    if (pReq->sData[0] != '@') return;
+
+    char *pEnd = strchr(pReq->sData, '\n');
+    if (pEnd == NULL) return;
+    *pEnd = '\0';
+
+    char *savePtr = NULL;
+    char *ptr = strtok_r(pReq->sData + 1, " ", &savePtr);
+    while (ptr != NULL)
     {
-        logToFile(ERROR, "Can not open dataset (%s)", pPath);
-        exitFailure(NULL);
+        if (!strncmp(ptr, "client=", 7)) pReq->nClientKey = strtoul(ptr + 7, NULL, 10);
+        else if (!strncmp(ptr, "timeout=", 8)) pReq->nTimeout = atoi(ptr + 8);
+        ptr = strtok_r(NULL, " ", &savePtr);
     }
 
-    char *pLine = NULL;
-    ssize_t nRead = 0;
-    size_t nLength = 0;
-    int nColumnsParsed = 0;
+    pReq->nLength -= (pEnd + 1 - pReq->sData);
+    memmove(pReq->sData, pEnd + 1, pReq->nLength + 1);
+}
 
-    // Line-by-line read input csv file
-    while ((nRead = getline(&pLine, &nLength, fp)) != -1) 
-    {
-        // Check if parsed line is valid
-        if (pLine != NULL && nLength > 1)
-        {
-            // If columns are not initialized, parse them first
-            if (!nColumnsParsed)
-            {
-                // Save line into columns and remove new line character from back
-                removeCharacter(pDB->sColumns, sizeof(pDB->sColumns), pLine, '\n');
+// This function checks that descriptor passed by client is writable memfd. Only memfd has seals, so server
+// never writes into other files of client, and memfd whose seals forbid writing or growing is refused
+int isShmUsable(int nFD)
+{
+    int nSeals = fcntl(nFD, F_GET_SEALS);
+    int nFlags = fcntl(nFD, F_GETFL);
+    statsSyscalls(2);
+    if (nSeals < 0 || nFlags < 0 || (nFlags & O_ACCMODE) != O_RDWR) return 0;
+
+    int nForbidden = F_SEAL_WRITE | F_SEAL_GROW;
+#ifdef F_SEAL_FUTURE_WRITE
+    nForbidden |= F_SEAL_FUTURE_WRITE;
+#endif
+    if (nSeals & nForbidden) return 0;
 
-                // Parse count of columnts by counting ','
-                char *pOffset = pDB->sColumns;
-                while ((pOffset = strstr(pOffset, ",")) != NULL)
-                {
-                    pOffset++;
-                    pDB->nColumnCount++;
-                }
+    struct stat st;
+    statsSyscalls(1);
+    return fstat(nFD, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// This function receives memfd passed by shared memory client along with its query,
+// descriptors which are not usable memfd are closed. Returns memfd or -1
+int receiveShmFD(struct msghdr *pMsg)
+{
+    int nShmFD = -1;
+    struct cmsghdr *pCmsg;
 
-                // Last column after ','
-                if (pDB->nColumnCount) pDB->nColumnCount++;
+    for (pCmsg = CMSG_FIRSTHDR(pMsg); pCmsg != NULL; pCmsg = CMSG_NXTHDR(pMsg, pCmsg))
+    {
+        if (pCmsg->cmsg_level != SOL_SOCKET || pCmsg->cmsg_type != SCM_RIGHTS) continue;
 
-                // Mark columns as initialized
-                nColumnsParsed = 1;
-                continue;
-            }
+        int i, nCount = (pCmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0; i < nCount; i++)
+        {
+            int nFD;
+            memcpy(&nFD, CMSG_DATA(pCmsg) + i * sizeof(int), sizeof(int));
 
-            // Append row into database
-            appendDatabase(pDB, pLine);
+            if (nShmFD < 0 && isShmUsable(nFD)) nShmFD = nFD;
+            else close(nFD);
         }
     }
 
-    // Log statistics into file
-    uint32_t nEndTime = timeStamp();
-    double fDiff = (double)(nEndTime - nStartTime) / (double)1000000;
-    logToFile(INFO, "Dataset loaded in %f seconds with %d records.", fDiff, pDB->nRowCount);
-
-    // Clean line and close file
-    free(pLine); // this variable is allocated by getline() function
-    fclose(fp);
+    return nShmFD;
 }
 
-// This function searches column id with column name from database
-int selectColumnID(Database *pDB, char *pColumnName, int *pIDS, int nCount)
+// This function allocates request of newly accepted connection, query is read when it arrives
+Request* newRequest(int nClientFD, uint64_t nClientKey, uint64_t nAcceptTime, int nTimeout)
 {
-    char sColumns[DATA_MAX];
-    snprintf(sColumns, sizeof(sColumns), "%s", pDB->sColumns);
-
-    char *savePtr = NULL;
-    int nCurrentID = 0;
-    int i, nFound = 0;
-
-    char *ptr = strtok_r(sColumns, ",", &savePtr);
-    while (ptr != NULL)
+    Request *pReq = malloc(sizeof(Request));
+    if (pReq == NULL)
     {
-        // Check if column matches our search criteria
-        if (strstr(ptr, pColumnName) != NULL) break;
-        ptr = strtok_r(NULL, ",", &savePtr);
-        nCurrentID++;
+        logToFile(ERROR, "Can not alloc memory for request");
+        return NULL;
     }
 
-    // Check if this column is already selected
-    for (i = 0; i < nCount; i++)
+    pReq->nClientKey = nClientKey;
+    pReq->nAcceptTime = nAcceptTime;
+    pReq->nClientFD = nClientFD;
+    pReq->nTimeout = nTimeout;
+    pReq->nShmFD = -1;
+    pReq->nLength = 0;
+    return pReq;
+}
+
+// This function reads query of connection which became readable and puts it in the request queue,
+// read does not wait. Connections without header are queued by nClientKey of peer instead of client ID
+void admitConnection(RequestQueue *pQueue, Request *pReq)
+{
+    // Local client may pass memfd for its responses
+    char sControl[CMSG_SPACE(sizeof(int) * 4)];
+    struct iovec iov;
+    iov.iov_base = pReq->sData;
+    iov.iov_len = sizeof(pReq->sData) - 1;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = sControl;
+    msg.msg_controllen = sizeof(sControl);
+
+    pReq->nLength = recvmsg(pReq->nClientFD, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+    pReq->nShmFD = pReq->nLength >= 0 ? receiveShmFD(&msg) : -1;
+    statsSyscalls(1);
+    if (pReq->nLength <= 0)
     {
-        if (pIDS[i] == nCurrentID)
-        {
-            nFound = 1;
-            break;
-        }
+        logToFile(ERROR, "Can not read query from client");
+        close(pReq->nClientFD);
+        freeRequest(pReq);
+        return;
     }
 
-    // Save selected column ID into array
-    if (!nFound) pIDS[nCount++] = nCurrentID;
-    return nCount;
+    pReq->sData[pReq->nLength] = '\0';
+    queueRequest(pQueue, pReq);
 }
 
-// This function selects recordings from database with column id and appends those recordings in the pResponse variable
-int selectWithID(const char *pFrom, int nID, int nFound, String *pResponse, int nDistinct)
+// This is the acceptor loop of blocking engine and local listener. Listener and accepted connections
+// whose query did not arrive yet are polled together, so slow client does not block the acceptor
+// and its connection is closed after REQUEST_READ_TIMEOUT msecs. Loop ends on interrupt, on error
+// of listener or when pRunning becomes zero
+void acceptLoop(RequestQueue *pQueue, int nListenSock, int isLocal, int nTimeout, int *pRunning)
 {
-    char sData[DATA_MAX];
-    snprintf(sData, sizeof(sData), "%s", pFrom);
+    struct pollfd fds[PENDING_READS_MAX + 1];
+    Request *pPending[PENDING_READS_MAX + 1];
+    int i, nCount = 1; // Listener is the first entry
 
-    char *savePtr = NULL;
-    int nCurrentID = 0;
+    fds[0].fd = nListenSock;
+    fds[0].events = POLLIN;
+    fcntl(nListenSock, F_SETFL, fcntl(nListenSock, F_GETFL) | O_NONBLOCK);
 
-    char *ptr = strtok_r(sData, ",", &savePtr);
-    while (ptr != NULL)
+    while (!g_nInterrupted && __atomic_load_n(pRunning, __ATOMIC_RELAXED))
     {
-        // Search current column in needed columns
-        if (nID == nCurrentID)
+        // Full table pauses accepts, kernel backlog keeps new connections meanwhile
+        fds[0].events = nCount <= PENDING_READS_MAX ? POLLIN : 0;
+        for (i = 0; i < nCount; i++) fds[i].revents = 0;
+
+        int nReady = poll(fds, nCount, nCount > 1 ? REQUEST_READ_TIMEOUT / 4 : -1);
+        statsSyscalls(1);
+        if (nReady < 0 && errno != EINTR) break;
+
+        // Ready and expired connections are removed, last entry takes their place
+        uint64_t nNow = monotonicTime();
+        for (i = nCount - 1; i > 0; i--)
         {
-            char sColumn[DATA_MAX];
-            while (*ptr == ' ') ptr++; // Remove spaces from front and back
-            removeCharacter(sColumn, sizeof(sColumn), ptr, ' ');
+            if (!fds[i].revents && nNow - pPending[i]->nAcceptTime < (uint64_t)REQUEST_READ_TIMEOUT * 1000) continue;
 
-            if (!nDistinct || strstr(pResponse->pData, sColumn) == NULL)
+            if (fds[i].revents) admitConnection(pQueue, pPending[i]);
+            else
             {
-                if (nFound) stringAppend(pResponse, ",", 1);
-                else nFound = 1;
-
-                // Append column name in response
-                stringAppend(pResponse, sColumn, strlen(sColumn));
-                break;
+                logToFile(ERROR, "Query did not arrive in %d msecs, connection is closed", REQUEST_READ_TIMEOUT);
+                close(pPending[i]->nClientFD);
+                freeRequest(pPending[i]);
             }
+
+            nCount--;
+            fds[i] = fds[nCount];
+            pPending[i] = pPending[nCount];
         }
 
-        ptr = strtok_r(NULL, ",", &savePtr);
-        nCurrentID++;
-    }
+        if (nReady <= 0 || !fds[0].revents || nCount > PENDING_READS_MAX) continue;
 
-    return nFound;
-}
+        struct sockaddr_in inAddr;
+        socklen_t len = sizeof(inAddr);
+        int nClientFD = accept4(nListenSock, isLocal ? NULL : (struct sockaddr*)&inAddr, isLocal ? NULL : &len, SOCK_CLOEXEC);
+        statsSyscalls(1);
+        if (nClientFD < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN || errno == ECONNABORTED) continue;
+            if (!g_nInterrupted && __atomic_load_n(pRunning, __ATOMIC_RELAXED))
+                logToFile(ERROR, isLocal ? "Can not accept to the local socket" : "Can not accept to the socket");
+            break;
+        }
 
-// This function selects recordings from database with column id array and appends those recordings in the pResponse variable
-int selectFromIDS(Database *pDB, int *pIDS, int nCount, String *pResponse, int nDistinct)
-{
-    if (!nCount) return 0;
-    int i, nFound = 0;
+        __atomic_fetch_add(&g_stats.nAccepted, 1, __ATOMIC_RELAXED);
+        uint64_t nKey = isLocal ? localPeerKey(nClientFD) : ((uint64_t)1 << 32) | inAddr.sin_addr.s_addr;
+        Request *pReq = newRequest(nClientFD, nKey, monotonicTime(), nTimeout);
+        if (pReq == NULL)
+        {
+            close(nClientFD);
+            continue;
+        }
 
-    for (i = 0; i < nCount; i++) // Search current column in needed columns
-        nFound = selectWithID(pDB->sColumns, pIDS[i], nFound, pResponse, nDistinct);
+        fds[nCount].fd = nClientFD;
+        fds[nCount].events = POLLIN;
+        pPending[nCount++] = pReq;
 
-    if (nFound) stringAppend(pResponse, "\n", 1);
-    int j, nRecordings = 0;
+        // Grow worker pool if requests wait too long
+        growPool(&g_workers, pQueue);
+    }
 
-    for (i = 0; i < pDB->nRowCount; i++)
+    for (i = 1; i < nCount; i++)
     {
-        RowData *pRow = &pDB->pRows[i];
-        nFound = 0;
-
-        for (j = 0; j < nCount; j++) // Search current column in needed columns
-            nFound = selectWithID(pRow->sData, pIDS[j], nFound, pResponse, nDistinct);
-
-        if (nFound)
-        {
-            stringAppend(pResponse, "\n", 1);
-            nRecordings += 1;
-        }
+        close(pPending[i]->nClientFD);
+        freeRequest(pPending[i]);
     }
-
-    return nRecordings;
 }
 
-
-// This function parses SQL queries and executing them according the query type
-int executeSelectQuery(Database *pDB, char *pQuery, String *pResponse)
+// This function parses header of received request and queues it,
+// request is rejected if queue is full
+void queueRequest(RequestQueue *pQueue, Request *pReq)
 {
-    // Get query length and validate
-    int nLength = strlen(pQuery);
-    if (!nLength) return -1; // return -1 means unsupported query
+    parseRequestHeader(pReq);
 
-    int nRecordCount = 0;
-    int nDistinct = 0;
-    pQuery += 7; // Skip "SELECT" and space
+    // Client without ID is identified by its address
+    if (pReq->nClientKey == UINT64_MAX)
+    {
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        memset(&addr, 0, sizeof(addr));
+        getpeername(pReq->nClientFD, (struct sockaddr*)&addr, &len);
+        statsSyscalls(1);
+        pReq->nClientKey = ((uint64_t)1 << 32) | addr.sin_addr.s_addr;
+    }
 
-    if (!strncmp(pQuery, "DISTINCT", 8))
+    Request *pDropped = NULL;
+    if (!enqueueRequest(pQueue, pReq, &pDropped))
     {
-        pQuery += 9; // Skip "DISTINCT" and space
-        nDistinct = 1;
+        logToFile(INFO, "Request queue is full, query '%s' is rejected.", pReq->sData);
+        rejectRequest(pReq);
     }
 
-    // Select everything from database
-    if (!strncmp(pQuery, "*", 1))
+    if (pDropped != NULL)
     {
-        // Lock database for reading
-        lockRead(&pDB->rwLock);
+        logToFile(INFO, "Request queue is full, query '%s' is pushed out.", pDropped->sData);
+        rejectRequest(pDropped);
+    }
+}
 
-        int i, nColumnsDone = 0; // Iterate all comuns
-        for (i = 0; i < pDB->nRowCount; i++)
-        {
-            if (!nColumnsDone) // Select columns first
-            {
-                stringAppend(pResponse, pDB->sColumns, strlen(pDB->sColumns));
-                stringAppend(pResponse, "\n", 1);
-                nColumnsDone = 1;
-            }
+////////////////////////////////////////////////////////////////////////
+// IO_URING
+////////////////////////////////////////////////////////////////////////
 
-            // Get next row
-            RowData *pRow = &pDB->pRows[i];
+// Ring of worker thread, NULL if worker uses blocking I/O
+static __thread Ring *t_pRing = NULL;
 
-            // Dont append row data if query is distinct and we have already similar data in response
-            if (!nDistinct || strstr(pResponse->pData, pRow->sData) == NULL)
-            {
-                // Append recording into response
-                stringAppend(pResponse, pRow->sData, strlen(pRow->sData));
-                stringAppend(pResponse, "\n", 1);
-                nRecordCount++;
-            }
-        }
+// Provided receive buffers of acceptor ring, kernel picks one for every read
+typedef struct {
+    struct io_uring_buf_ring *pRing;
+    char *pData;
+    unsigned short nTail;
+} RingBuffers;
 
-        // Unlock database rwlock
-        unlockRW(&pDB->rwLock);
-        return nRecordCount;
+// This function creates io_uring instance and maps its queues, zero is returned on failure
+int ringInit(Ring *pRing, unsigned nEntries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(pRing, 0, sizeof(Ring));
+
+    pRing->nRingFD = syscall(__NR_io_uring_setup, nEntries, &params);
+    if (pRing->nRingFD < 0) return 0;
+
+    pRing->nSqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    pRing->nCqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // Both queues are in the same mapping on newer kernels
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (pRing->nCqMapSize > pRing->nSqMapSize) pRing->nSqMapSize = pRing->nCqMapSize;
+        pRing->nCqMapSize = 0;
     }
-    else
+
+    pRing->pSqMap = mmap(NULL, pRing->nSqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         pRing->nRingFD, IORING_OFF_SQ_RING);
+    pRing->pCqMap = pRing->nCqMapSize ? mmap(NULL, pRing->nCqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                             pRing->nRingFD, IORING_OFF_CQ_RING) : pRing->pSqMap;
+    pRing->pSqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, pRing->nRingFD, IORING_OFF_SQES);
+
+    if (pRing->pSqMap == MAP_FAILED || pRing->pCqMap == MAP_FAILED || pRing->pSqes == MAP_FAILED)
     {
-        if (strstr(pQuery, ",") != NULL)
-        {
-            char *savePtr = NULL;
-            char *ptr = strtok_r(pQuery, ",", &savePtr);
-            if (ptr == NULL) return -1;
+        if (pRing->pSqMap != MAP_FAILED) munmap(pRing->pSqMap, pRing->nSqMapSize);
+        if (pRing->nCqMapSize && pRing->pCqMap != MAP_FAILED) munmap(pRing->pCqMap, pRing->nCqMapSize);
+        if (pRing->pSqes != MAP_FAILED) munmap(pRing->pSqes, params.sq_entries * sizeof(struct io_uring_sqe));
+        close(pRing->nRingFD);
+        return 0;
+    }
 
-            // Lock database for reading
-            lockRead(&pDB->rwLock);
+    char *pSq = (char*)pRing->pSqMap;
+    char *pCq = (char*)pRing->pCqMap;
+    pRing->pSqHead = (unsigned*)(pSq + params.sq_off.head);
+    pRing->pSqTail = (unsigned*)(pSq + params.sq_off.tail);
+    pRing->pCqHead = (unsigned*)(pCq + params.cq_off.head);
+    pRing->pCqTail = (unsigned*)(pCq + params.cq_off.tail);
+    pRing->pCqes = (struct io_uring_cqe*)(pCq + params.cq_off.cqes);
+    pRing->nSqMask = *(unsigned*)(pSq + params.sq_off.ring_mask);
+    pRing->nCqMask = *(unsigned*)(pCq + params.cq_off.ring_mask);
+    pRing->nSqEntries = params.sq_entries;
+    pRing->nSqeTail = *pRing->pSqTail;
+
+    // Submission entries are always used in ring order
+    unsigned i, *pArray = (unsigned*)(pSq + params.sq_off.array);
+    for (i = 0; i < params.sq_entries; i++) pArray[i] = i;
 
-            // Column IDs which we want to select
-            int nColumnIDs[pDB->nColumnCount];
-            int nColumnCount = 0;
+    return 1;
+}
 
-            while (ptr != NULL)
-            {
-                char sColumn[DATA_MAX];
+// This function unmaps queues and closes io_uring instance, pending operations are cancelled by kernel
+void ringDestroy(Ring *pRing)
+{
+    if (pRing->nRingFD < 0) return;
 
-                while (*ptr == ' ') ptr++; // Remove spaces from front and back
-                removeCharacter(sColumn, sizeof(sColumn), ptr, ' ');
+    munmap(pRing->pSqes, pRing->nSqEntries * sizeof(struct io_uring_sqe));
+    munmap(pRing->pSqMap, pRing->nSqMapSize);
+    if (pRing->nCqMapSize) munmap(pRing->pCqMap, pRing->nCqMapSize);
+    close(pRing->nRingFD);
+    pRing->nRingFD = -1;
+}
 
-                // Select IDS from requested column;
-                nColumnCount = selectColumnID(pDB, sColumn, nColumnIDs, nColumnCount);
-                ptr = strtok_r(NULL, ",", &savePtr);
-            }
+// This function returns next free submission entry, NULL if submission queue is full
+struct io_uring_sqe* ringGetSqe(Ring *pRing)
+{
+    unsigned nHead = __atomic_load_n(pRing->pSqHead, __ATOMIC_ACQUIRE);
+    if (pRing->nSqeTail - nHead >= pRing->nSqEntries) return NULL;
 
-            // Select recordings from column IDs
-            nRecordCount = selectFromIDS(pDB, nColumnIDs, nColumnCount, pResponse, nDistinct);
+    struct io_uring_sqe *pSqe = &pRing->pSqes[pRing->nSqeTail & pRing->nSqMask];
+    memset(pSqe, 0, sizeof(struct io_uring_sqe));
+    pRing->nSqeTail++;
+    return pSqe;
+}
 
-            // Unlock database rwlock
-            unlockRW(&pDB->rwLock);
-            return nRecordCount;
-        }
-        else
-        {
-            char *savePtr = NULL;
-            char *ptr = strtok_r(pQuery, " ", &savePtr);
-            if (ptr == NULL) return -1;
+// This function submits prepared entries and waits at least nWait completions, entries which kernel did not
+// take by earlier partial submission are submitted again. Negative errno is returned on failure
+int ringSubmit(Ring *pRing, unsigned nWait)
+{
+    __atomic_store_n(pRing->pSqTail, pRing->nSqeTail, __ATOMIC_RELEASE);
+    unsigned nPending = pRing->nSqeTail - __atomic_load_n(pRing->pSqHead, __ATOMIC_ACQUIRE);
+
+    int nResult = syscall(__NR_io_uring_enter, pRing->nRingFD, nPending, nWait,
+                          nWait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    statsSyscalls(1);
+    return nResult < 0 ? -errno : nResult;
+}
 
-            // Remove spaces from front
-            while (*ptr == ' ') ptr++;
+// This function withdraws published entries which kernel did not take, so they are never submitted later.
+// Kernel takes entries only inside io_uring_enter, so nothing is taken meanwhile. Returns count of entries
+// taken by kernel since tail nTail
+unsigned ringWithdraw(Ring *pRing, unsigned nTail)
+{
+    unsigned nHead = __atomic_load_n(pRing->pSqHead, __ATOMIC_ACQUIRE);
+    __atomic_store_n(pRing->pSqTail, nHead, __ATOMIC_RELEASE);
+    pRing->nSqeTail = nHead;
+    return nHead - nTail;
+}
+
+// This function returns next completion or NULL if there is nothing completed
+struct io_uring_cqe* ringPeekCqe(Ring *pRing)
+{
+    unsigned nHead = *pRing->pCqHead;
+    if (nHead == __atomic_load_n(pRing->pCqTail, __ATOMIC_ACQUIRE)) return NULL;
+    return &pRing->pCqes[nHead & pRing->nCqMask];
+}
 
-            int nColumnCount = 0;
-            int nColumnIDs[1];
+// This function marks completion as consumed, so kernel can reuse its slot
+void ringSeenCqe(Ring *pRing)
+{
+    __atomic_store_n(pRing->pCqHead, *pRing->pCqHead + 1, __ATOMIC_RELEASE);
+}
 
-            // Lock database for reading
-            lockRead(&pDB->rwLock);
+// This function checks if kernel supports everything used by io_uring engine,
+// socket opcode came with multishot accept and provided buffer rings, so it marks new enough kernel
+int uringSupported()
+{
+    Ring ring;
+    if (!ringInit(&ring, 4)) return 0;
 
-            // Select IDS from requested column;
-            nColumnCount = selectColumnID(pDB, ptr, nColumnIDs, 0);
+    size_t nSize = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *pProbe = calloc(1, nSize);
+    int nSupported = 0;
 
-            // Select recordings from column IDs
-            nRecordCount = selectFromIDS(pDB, nColumnIDs, nColumnCount, pResponse, nDistinct);
+    if (pProbe != NULL && syscall(__NR_io_uring_register, ring.nRingFD, IORING_REGISTER_PROBE, pProbe, 256) == 0)
+    {
+        int nOps[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_CLOSE, IORING_OP_LINK_TIMEOUT,
+                       IORING_OP_ASYNC_CANCEL };
+        int i;
 
-            // Unlock database rwlock
-            unlockRW(&pDB->rwLock);
-            return nRecordCount;
-        }
+        nSupported = pProbe->last_op >= IORING_OP_SOCKET;
+        for (i = 0; i < (int)(sizeof(nOps) / sizeof(nOps[0])); i++)
+            if (nOps[i] > pProbe->last_op || !(pProbe->ops[nOps[i]].flags & IO_URING_OP_SUPPORTED)) nSupported = 0;
     }
 
-    return -1;
+    free(pProbe);
+    ringDestroy(&ring);
+    return nSupported;
 }
 
-typedef struct {
-    char sColumn[DATA_MAX];
-    char sValue[DATA_MAX];
-    int nColumnID;
-} UpdateSet;
-
-// This function parses equality from the UPDATE sql query and saves parsed values into UpdateSet variable
-int parseEquality(Database *pDB, UpdateSet *pSet, char *pData)
+// This function gives receive buffer back to the kernel
+void ringRecycleBuffer(RingBuffers *pBufs, int nID)
 {
-    char *savePtr, *savePtr2;
-    char sData[DATA_MAX];
+    struct io_uring_buf *pBuf = &pBufs->pRing->bufs[pBufs->nTail & (URING_BUFFERS - 1)];
+    pBuf->addr = (uint64_t)(uintptr_t)(pBufs->pData + (size_t)nID * DATA_MAX);
+    pBuf->len = DATA_MAX - 1;
+    pBuf->bid = nID;
+
+    pBufs->nTail++;
+    __atomic_store_n(&pBufs->pRing->tail, pBufs->nTail, __ATOMIC_RELEASE);
+}
 
-    while (*pData == ' ') pData++;
-    removeCharacter(sData, sizeof(sData), pData, ' ');
+// This function registers provided buffer ring of receive buffers, zero is returned on failure
+int ringInitBuffers(Ring *pRing, RingBuffers *pBufs)
+{
+    size_t nRingSize = sizeof(struct io_uring_buf) * URING_BUFFERS;
+    pBufs->pRing = mmap(NULL, nRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    pBufs->pData = malloc((size_t)URING_BUFFERS * DATA_MAX);
+    pBufs->nTail = 0;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)pBufs->pRing;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BUF_GROUP;
+
+    if (pBufs->pRing == MAP_FAILED || pBufs->pData == NULL ||
+        syscall(__NR_io_uring_register, pRing->nRingFD, IORING_REGISTER_PBUF_RING, &reg, 1))
+    {
+        if (pBufs->pRing != MAP_FAILED) munmap(pBufs->pRing, nRingSize);
+        free(pBufs->pData);
+        return 0;
+    }
 
-    char *ptr = strtok_r(sData, "=", &savePtr);
-    if (ptr == NULL) return 0;
-    while (*ptr == ' ') ptr++;
+    int i;
+    for (i = 0; i < URING_BUFFERS; i++) ringRecycleBuffer(pBufs, i);
+    return 1;
+}
 
-    // Parse column name and remove spaces from back
-    removeCharacter(pSet->sColumn, sizeof(pSet->sColumn), ptr, ' ');
+// This function returns free submission entry, prepared entries are submitted if queue is full
+struct io_uring_sqe* ringNextSqe(Ring *pRing)
+{
+    struct io_uring_sqe *pSqe = ringGetSqe(pRing);
+    if (pSqe != NULL) return pSqe;
 
-    // Lock database for reading
-    lockRead(&pDB->rwLock);
+    ringSubmit(pRing, 0);
+    return ringGetSqe(pRing);
+}
 
-    // Mark colun IDS which we want to update
-    int nColumnCount = 0;
-    int nColumnIDs[1];
+// This function arms multishot accept, single submission accepts connections until it fails
+void uringArmAccept(Ring *pRing)
+{
+    struct io_uring_sqe *pSqe = ringNextSqe(pRing);
+    pSqe->opcode = IORING_OP_ACCEPT;
+    pSqe->fd = g_nListenerSock;
+    pSqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    pSqe->user_data = URING_TAG_ACCEPT;
+}
 
-    // Select IDS from requested column;
-    nColumnCount = selectColumnID(pDB, pSet->sColumn, nColumnIDs, 0);
-    if (nColumnCount) pSet->nColumnID = nColumnIDs[0];
+// This function reads query of accepted connection into provided buffer,
+// read is cancelled by linked timeout so slow client does not hold request forever
+void uringReadRequest(Ring *pRing, Request *pReq)
+{
+    static struct __kernel_timespec ts = { 0, REQUEST_READ_TIMEOUT * 1000000L };
+
+    struct io_uring_sqe *pSqe = ringNextSqe(pRing);
+    pSqe->opcode = IORING_OP_RECV;
+    pSqe->fd = pReq->nClientFD;
+    pSqe->len = DATA_MAX - 1;
+    pSqe->flags = IOSQE_BUFFER_SELECT | IOSQE_IO_LINK;
+    pSqe->buf_group = URING_BUF_GROUP;
+    pSqe->user_data = (uint64_t)(uintptr_t)pReq;
+
+    // Linked entry must follow in the same submission, so queue is flushed before if needed
+    struct io_uring_sqe *pTimeout = ringGetSqe(pRing);
+    if (pTimeout == NULL)
+    {
+        pSqe->flags &= ~IOSQE_IO_LINK;
+        return;
+    }
 
-    // Unlock database rwlock
-    unlockRW(&pDB->rwLock);
+    pTimeout->opcode = IORING_OP_LINK_TIMEOUT;
+    pTimeout->addr = (uint64_t)(uintptr_t)&ts;
+    pTimeout->len = 1;
+    pTimeout->user_data = URING_TAG_TIMEOUT;
+}
 
-    ptr = strtok_r(NULL, "=", &savePtr);
-    if (ptr == NULL) return 0;
-    while (*ptr == ' ') ptr++;
-    if (*ptr != '\'') return 0;
+// This function handles completed read of request and queues request for workers
+void uringRequestRead(RequestQueue *pQueue, RingBuffers *pBufs, Request *pReq, int nResult, unsigned nFlags)
+{
+    if (nFlags & IORING_CQE_F_BUFFER)
+    {
+        int nID = nFlags >> IORING_CQE_BUFFER_SHIFT;
+        if (nResult > 0) memcpy(pReq->sData, pBufs->pData + (size_t)nID * DATA_MAX, nResult);
+        ringRecycleBuffer(pBufs, nID);
+    }
 
-    ptr = strtok_r(ptr + 1, "'", &savePtr2);
-    if (ptr == NULL) return 0;
+    if (nResult <= 0)
+    {
+        errno = nResult ? -nResult : ECONNRESET;
+        logToFile(ERROR, "Can not read query from client");
+        close(pReq->nClientFD);
+        statsSyscalls(1);
+        free(pReq);
+        return;
+    }
 
-    // Parse new value and remove whitespace 
-    removeCharacter(pSet->sValue, sizeof(pSet->sValue), ptr, ' ');
-    return 1;
+    pReq->sData[nResult] = '\0';
+    pReq->nLength = nResult;
+    queueRequest(pQueue, pReq);
 }
 
-// This function updates database recordings according to UpdateSet and UpdateSet condition
-int updateDatabase(Database *pDB, UpdateSet *pSet, int nCount, UpdateSet *pCond)
+// This is the acceptor loop of io_uring engine, connections are accepted and read
+// without blocking the acceptor and many completions are handled by single syscall.
+// Zero is returned if engine can not run, caller falls back to blocking accept then
+int uringAcceptLoop(RequestQueue *pQueue, int nTimeout)
 {
-    int i, nFound, nUpdatedCount = 0;
-    for (i = 0; i < pDB->nRowCount; i++)
+    Ring ring;
+    RingBuffers bufs;
+
+    if (!ringInit(&ring, URING_ENTRIES)) return 0;
+    if (!ringInitBuffers(&ring, &bufs))
     {
-        // Get next row
-        RowData *pRow = &pDB->pRows[i];
+        ringDestroy(&ring);
+        return 0;
+    }
 
-        String data;
-        stringInit(&data, DATA_MAX);
+    logToFile(INFO, "Accepting connections with io_uring engine.");
+    uringArmAccept(&ring);
 
-        // Get value from row wich we want to update
-        nFound = selectWithID(pRow->sData, pCond->nColumnID, 0, &data, 0);
+    int nInFlight = 0, nAccepted = 0, nRunning = 1;
+    while (nRunning && !g_nInterrupted)
+    {
+        int nResult = ringSubmit(&ring, 1);
+        if (nResult < 0 && nResult != -EINTR && nResult != -EAGAIN && nResult != -EBUSY)
+        {
+            errno = -nResult;
+            logToFile(ERROR, "Can not wait io_uring completions");
+            break;
+        }
 
-        // Check if row meets our condition
-        if (nFound && !strncmp(data.pData, pCond->sValue, data.nUsed))
+        struct io_uring_cqe *pCqe;
+        while ((pCqe = ringPeekCqe(&ring)) != NULL)
         {
-            String rowData;
-            stringInit(&rowData, DATA_MAX);
+            uint64_t nTag = pCqe->user_data;
+            int nRes = pCqe->res;
+            unsigned nFlags = pCqe->flags;
+            ringSeenCqe(&ring);
 
-            char *savePtr;
-            int nStarted = 0, nCurrID = 0;
+            if (nTag == URING_TAG_TIMEOUT || nTag == URING_TAG_CANCEL) continue;
+            if (nTag != URING_TAG_ACCEPT)
+            {
+                nInFlight--;
+                uringRequestRead(pQueue, &bufs, (Request*)(uintptr_t)nTag, nRes, nFlags);
+                continue;
+            }
 
-            char *ptr = strtok_r(pRow->sData, ",", &savePtr);
-            if (ptr == NULL) return 0;
+            if (nRes < 0)
+            {
+                // Multishot accept is not supported at all, blocking accept takes over
+                if (!nAccepted && nRes == -EINVAL)
+                {
+                    nRunning = 0;
+                    break;
+                }
 
-            while (ptr != NULL)
+                errno = -nRes;
+                logToFile(ERROR, "Can not accept to the socket");
+            }
+            else
             {
-                if (nStarted) stringAppend(&rowData, ",", 1);
-                else nStarted = 1;
+                nAccepted++;
+                __atomic_fetch_add(&g_stats.nAccepted, 1, __ATOMIC_RELAXED);
 
-                int j, nSetDone = 0;
-                for (j = 0; j < nCount; j++)
+                Request *pReq = malloc(sizeof(Request));
+                if (pReq == NULL)
                 {
-                    UpdateSet *pCurr = &pSet[j];
-                    if (nCurrID == pCurr->nColumnID)
-                    {
-                        // Update value with a new one in row
-                        stringAppend(&rowData, pCurr->sValue, strlen(pCurr->sValue));
-                        nSetDone = 1;
-                    }
-
+                    logToFile(ERROR, "Can not alloc memory for request");
+                    close(nRes);
+                }
+                else
+                {
+                    // Peer address is read only if client does not send its ID
+                    pReq->nClientKey = UINT64_MAX;
+                    pReq->nAcceptTime = monotonicTime();
+                    pReq->nClientFD = nRes;
+                    pReq->nShmFD = -1;
+                    pReq->nTimeout = nTimeout;
+                    uringReadRequest(&ring, pReq);
+                    nInFlight++;
                 }
+            }
 
-                // Append old value if this row is row updated
-                if (!nSetDone) stringAppend(&rowData, ptr, strlen(ptr));
-                else nUpdatedCount++;
+            // Accept is rearmed when kernel stops multishot
+            if (!(nFlags & IORING_CQE_F_MORE) && !g_nInterrupted) uringArmAccept(&ring);
+        }
 
-                ptr = strtok_r(NULL, ",", &savePtr);
-                nCurrID++;
-            }
+        // Grow worker pool if requests wait too long
+        growPool(&g_workers, pQueue);
+    }
+
+    // Cancel pending reads and wait them, so their requests are freed
+    struct io_uring_sqe *pSqe = ringNextSqe(&ring);
+    pSqe->opcode = IORING_OP_ASYNC_CANCEL;
+    pSqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    pSqe->user_data = URING_TAG_CANCEL;
+
+    while (nInFlight > 0)
+    {
+        int nResult = ringSubmit(&ring, 1);
+        if (nResult < 0 && nResult != -EINTR) break;
+
+        struct io_uring_cqe *pCqe;
+        while ((pCqe = ringPeekCqe(&ring)) != NULL)
+        {
+            uint64_t nTag = pCqe->user_data;
+            int nRes = pCqe->res;
+            unsigned nFlags = pCqe->flags;
+            ringSeenCqe(&ring);
 
-            // Update row
-            snprintf(pRow->sData, sizeof(pRow->sData), "%s", rowData.pData);
-            stringClear(&rowData); // Clear allocated string
+            if (nTag > URING_TAG_CANCEL)
+            {
+                nInFlight--;
+                uringRequestRead(pQueue, &bufs, (Request*)(uintptr_t)nTag, nRes, nFlags);
+            }
         }
-        
-        // Clear allocated string
-        stringClear(&data);
     }
 
-    return nUpdatedCount;
+    ringDestroy(&ring);
+    munmap(bufs.pRing, sizeof(struct io_uring_buf) * URING_BUFFERS);
+    free(bufs.pData);
+    return nRunning;
 }
 
-// This function executes UPDATE query and appends response in the string
-int executeUpdateQuery(Database *pDB, char *pQuery, String *pResponse)
+// This function sends response by blocking writev and closes connection
+ssize_t writeAndClose(int nClientFD, struct iovec *pIov, int nCount)
 {
-    // Get query length and validate
-    int nLength = strlen(pQuery);
-    if (!nLength) return -1; // return -1 means unsupported query
+    ssize_t nSent = writev(nClientFD, pIov, nCount);
+    close(nClientFD);
+    statsSyscalls(2);
+    return nSent;
+}
 
-    int nRecordCount = 0;
-    pQuery += 7; // Skip "UPDATE" and space
+// This function sends response with single write and closes connection. Worker with io_uring
+// submits linked send and close with single syscall, otherwise writev and close are used.
+// Entries which kernel did not take are withdrawn before returning, so next submission never
+// sends message of this stack frame or closes descriptor which was closed here
+ssize_t sendAndClose(int nClientFD, struct iovec *pIov, int nCount)
+{
+    Ring *pRing = t_pRing;
+    if (pRing == NULL) return writeAndClose(nClientFD, pIov, nCount);
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = pIov;
+    msg.msg_iovlen = nCount;
+
+    // Worker ring is used only here and every call completes its entries, so queue is empty. Entries
+    // are not published until they are submitted, so full queue just falls back to blocking I/O
+    unsigned nTail = pRing->nSqeTail;
+    struct io_uring_sqe *pSend = ringGetSqe(pRing);
+    struct io_uring_sqe *pClose = pSend != NULL ? ringGetSqe(pRing) : NULL;
+    if (pClose == NULL)
+    {
+        pRing->nSqeTail = nTail;
+        return writeAndClose(nClientFD, pIov, nCount);
+    }
 
-    // We are supporting only TABLE SET query
-    if (strncmp(pQuery, "TABLE SET", 9)) return -1;
-    pQuery += 10; // Skip "TABLE SET" and space;
+    pSend->opcode = IORING_OP_SENDMSG;
+    pSend->fd = nClientFD;
+    pSend->addr = (uint64_t)(uintptr_t)&msg;
+    pSend->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    pSend->flags = IOSQE_IO_LINK;
+    pSend->user_data = 1;
 
-    UpdateSet setList[pDB->nColumnCount];
-    UpdateSet condition;
-    int nColumnCount = 0;
+    pClose->opcode = IORING_OP_CLOSE;
+    pClose->fd = nClientFD;
+    pClose->user_data = 2;
 
-    // Parse condition from query
-    char *pWhere = strstr(pQuery, "WHERE");
-    if (pWhere == NULL) return -1;
-    if (!parseEquality(pDB, &condition, pWhere + 6)) return -1;
+    ssize_t nSent = -1;
+    unsigned nTaken = 2;
+    int nCompleted = 0, nClosed = 0, isSendTaken = 1;
 
-    if (strstr(pQuery, ",") != NULL)
+    // Message must stay alive until every entry taken by kernel is completed
+    while (nCompleted < (int)nTaken)
     {
-        char *savePtr = NULL;
-        char *ptr = strtok_r(pQuery, ",", &savePtr);
-        if (ptr == NULL) return -1;
-
-        while (ptr != NULL)
+        int nResult = ringSubmit(pRing, nTaken - nCompleted);
+        if (nResult < 0 && nResult != -EINTR)
         {
-            if (nColumnCount >= pDB->nColumnCount) break;
+            errno = -nResult;
+            logToFile(ERROR, "Can not submit response");
+
+            // Entries which kernel did not take are withdrawn, taken ones are still waited
+            nTaken = ringWithdraw(pRing, nTail);
+            isSendTaken = nTaken > 0;
+            continue;
+        }
 
-            // Initialize update instruction set
-            UpdateSet *pSet = &setList[nColumnCount++];
-            if (!parseEquality(pDB, pSet, ptr)) return -1;
+        struct io_uring_cqe *pCqe;
+        while ((pCqe = ringPeekCqe(pRing)) != NULL)
+        {
+            if (pCqe->user_data == 1) nSent = pCqe->res < 0 ? -1 : pCqe->res;
+            else nClosed = pCqe->res == 0;
 
-            // Parse another column
-            ptr = strtok_r(NULL, ",", &savePtr);
+            ringSeenCqe(pRing);
+            nCompleted++;
         }
     }
-    else
-    {
-        char *savePtr = NULL;
-        char *ptr = strtok_r(pQuery, " ", &savePtr);
-        if (ptr == NULL) return -1;
 
-        UpdateSet *pSet = &setList[nColumnCount++];
-        if (!parseEquality(pDB, pSet, ptr)) return -1;
+    // Response whose send was not taken is written by blocking I/O
+    if (!isSendTaken) return writeAndClose(nClientFD, pIov, nCount);
+
+    // Close is cancelled by failed send or it was withdrawn
+    if (!nClosed)
+    {
+        close(nClientFD);
+        statsSyscalls(1);
     }
 
-    // Lock database for writing
-    lockWrite(&pDB->rwLock);
+    return nSent;
+}
 
-    nRecordCount = updateDatabase(pDB, setList, nColumnCount, &condition);
+////////////////////////////////////////////////////////////////////////
+// LOCAL TRANSPORT
+////////////////////////////////////////////////////////////////////////
 
-    char sResponse[DATA_MAX]; // Create response
-    int nLen = snprintf(sResponse, sizeof(sResponse), "Updated %d recordings", nRecordCount);
-    if (nRecordCount) stringAppend(pResponse, sResponse, nLen);
+// This function returns queue key of local client without ID, clients are told apart by process ID
+uint64_t localPeerKey(int nClientFD)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    memset(&cred, 0, sizeof(cred));
+    getsockopt(nClientFD, SOL_SOCKET, SO_PEERCRED, &cred, &len);
+    return ((uint64_t)2 << 32) | (uint32_t)cred.pid;
+}
 
-    // Unlock database for writing
-    unlockRW(&pDB->rwLock);
-    return nRecordCount;
+// Local acceptor thread accepts co-located clients with blocking accept in any I/O engine,
+// query is read with recvmsg() so memfd of shared memory client can be passed along
+void* localThread(void *pArg)
+{
+    LocalListener *pLocal = (LocalListener*)pArg;
+    logToFile(INFO, "Accepting local connections on %s", pLocal->pPath);
+
+    // Shutdown of socket by stopLocalListener() ends the loop
+    acceptLoop(&g_queue, pLocal->nSocket, 1, pLocal->nTimeout, &pLocal->isThreadInit);
+    return NULL;
+}
+
+// This function creates local listener and runs its acceptor thread
+void startLocalListener(LocalListener *pLocal, const char *pPath, int nTimeout)
+{
+    pLocal->nSocket = createLocalSocket(pPath);
+    pLocal->pPath = pPath;
+    pLocal->nTimeout = nTimeout;
+    pLocal->isThreadInit = 1;
+
+    if (pthread_create(&pLocal->thread, NULL, localThread, pLocal))
+    {
+        logToFile(ERROR, "Can not create local acceptor thread");
+        pLocal->isThreadInit = 0;
+        exitFailure(NULL);
+    }
+}
+
+// This function wakes up local acceptor by shutting down its socket, waits it and removes socket file
+void stopLocalListener(LocalListener *pLocal)
+{
+    if (pLocal->nSocket < 0) return;
+
+    if (pLocal->isThreadInit)
+    {
+        __atomic_store_n(&pLocal->isThreadInit, 0, __ATOMIC_RELAXED);
+        shutdown(pLocal->nSocket, SHUT_RDWR);
+        pthread_join(pLocal->thread, NULL);
+    }
+
+    close(pLocal->nSocket);
+    unlink(pLocal->pPath);
+    pLocal->nSocket = -1;
 }
 
 ////////////////////////////////////////////////////////////////////////
@@ -924,47 +10050,35 @@ int executeUpdateQuery(Database *pDB, char *pQuery, String *pResponse)
 // This function initializes worker thread associated variables
 void initWorker(WorkerContext *pCtx, int nID)
 {
-    // Init mutex variable
-    if (pthread_mutex_init(&pCtx->mutex, NULL))
-    {
-        logToFile(ERROR, "Failed to init pthread mutex");
-        exitFailure(NULL);
-    }
-
-    // Init condition variable
-    if (pthread_cond_init(&pCtx->cond, NULL))
+    // Statistics are allocated separately, histograms are too big for the stack
+    pCtx->pStats = calloc(1, sizeof(WorkerStats));
+    if (pCtx->pStats == NULL)
     {
-        logToFile(ERROR, "Failed to init condition variable");
-        pthread_mutex_destroy(&pCtx->mutex);
+        logToFile(ERROR, "Can not alloc memory for worker stats");
         exitFailure(NULL);
     }
 
     // Init worker thread related stuff
-    pCtx->nInterrupt = 0;
     pCtx->nWorkerID = nID;
     pCtx->nClientFD = -1;
+    pCtx->nState = WORKER_STOPPED;
+    pCtx->nLiveTime = 0;
     pCtx->isInit = 1;
-    pCtx->nBusy = 0;
 }
 
-// This function destrois worker thread associated variables
+// This function destrois worker thread associated variables, worker
+// must be released by shutdownQueue() before, here we only wait it
 void destroyWorker(WorkerContext *pCtx)
 {
     if (pCtx->isInit)
     {
-        // Activate interrupt flag for worker thread
-        lockMutex(&pCtx->mutex);
-        pCtx->nInterrupt = 1;
-        unlockMutex(&pCtx->mutex);
+        // Wait thread to finish ongoing query, worker can not wait itself
+        if (pCtx->nState != WORKER_STOPPED && !pthread_equal(pCtx->thread, pthread_self()))
+            pthread_join(pCtx->thread, NULL);
 
-        // Wait thread to be interrupted
-        signalCondition(&pCtx->cond);
-        waitCondition(&pCtx->cond, &pCtx->mutex);
-
-        // Destroy condition variable and mutex
-        pthread_mutex_destroy(&pCtx->mutex);
-        pthread_cond_destroy(&pCtx->cond);
         pCtx->isInit = 0;
+        free(pCtx->pStats);
+        pCtx->pStats = NULL;
     }
 
     // Close client connection if active
@@ -975,83 +10089,373 @@ void destroyWorker(WorkerContext *pCtx)
     }
 }
 
+// This function executes query of the request and sends response to the client
+void processRequest(WorkerContext *pCtx, Request *pReq)
+{
+    uint64_t nStartTime = monotonicTime();
+    histogramRecord(&t_pStats->queueWait, nStartTime - pReq->nAcceptTime);
+    traceStart(pReq->nAcceptTime, nStartTime);
+
+    char *buffer = pReq->sData;
+    int nStatus = -1;
+    logToFile(INFO, "Thread #%d: received query '%s'", pCtx->nWorkerID, buffer);
+
+    // Deadline is counted from accept, so time spent in queue is included
+    QueryContext query;
+    query.nDeadline = pReq->nTimeout > 0 ? pReq->nAcceptTime + (uint64_t)pReq->nTimeout * 1000 : 0;
+    query.nClientFD = pReq->nClientFD;
+    query.nCancelled = 0;
+    query.nPeerClosed = 0;
+    query.nTicks = 0;
+    t_pQuery = &query;
+
+    // Response buffer of worker is reused, it keeps size reached by earlier queries
+    String response = pCtx->output;
+    response.nUsed = 0;
+    response.pData[0] = '\0';
+
+    char sKey[DATA_MAX];
+    int isSelect = !strncmp(buffer, "SELECT", 6);
+    int isUpdate = !strncmp(buffer, "UPDATE", 6);
+    int isBatch = !strncmp(buffer, "BATCH ", 6);
+    int isInsert = !strncmp(buffer, "INSERT ", 7);
+    int isDelete = !strncmp(buffer, "DELETE ", 7);
+    int isReload = !strcmp(buffer, "RELOAD") || !strncmp(buffer, "RELOAD ", 7);
+    int isReplicate = !strcmp(buffer, "REPLICATE");
+    int isWrite = isUpdate || isInsert || isDelete;
+    int isRouted = g_router.nCount > 0 && strncmp(buffer, "STATS", 5) && strcmp(buffer, "LOCKS");
+    int nType = QUERY_INVALID;
+
+    // Route query to its table, joined table is the second one
+    Database *pDB = NULL, *pJoin = NULL;
+    if ((isSelect || isWrite) && !isRouted) pDB = findQueryTable(&g_catalog, buffer, isSelect ? &pJoin : NULL);
+    unsigned long nVersion = 0;
+
+    if (isSelect)
+    {
+        // Version is taken before execution, so response can only be tagged with older
+        // version than its data, which is invalidated by next lookup in the worst case
+        normalizeQuery(sKey, sizeof(sKey), buffer);
+        if (pDB != NULL) nVersion = __atomic_load_n(&pDB->nVersion, __ATOMIC_ACQUIRE);
+
+        // Versions only grow, so their sum changes whenever any joined table is updated
+        if (pJoin != NULL) nVersion += __atomic_load_n(&pJoin->nVersion, __ATOMIC_ACQUIRE);
+    }
+
+    if (isQueryCancelled())
+    {
+        // Deadline passed while request was waiting in queue
+        nStatus = STATUS_CANCELLED;
+    }
+    else if (g_replica.pPrimary != NULL && (isWrite || isBatch || isReload))
+    {
+        // Follower changes only by writes of its primary
+        char *pMessage = "Follower is read only, writes are served by primary";
+        stringAppend(&response, pMessage, strlen(pMessage));
+        nStatus = STATUS_INVALID;
+    }
+    else if ((isSelect || isWrite) && !isRouted && pDB == NULL)
+    {
+        stringAppend(&response, "Unknown table", 13);
+        nStatus = STATUS_INVALID;
+    }
+    else if (isSelect && !isRouted && cacheLookup(&g_cache, sKey, nVersion, &response, &nStatus))
+    {
+        // Hits are not logged, log file is opened by every line. Hit ratio is shown by STATS and at shutdown
+    }
+    else
+    {
+        // Determine request type, parse query and send response to the clienrt
+        // Router has no tables, versions of shards are not known so its responses are not cached
+        if (isRouted) nStatus = executeRouterQuery(&g_router, pReq, &response);
+        else if (pJoin != NULL) nStatus = executeJoinQuery(pDB, pJoin, buffer, &response);
+        else if (isSelect) nStatus = executeSelectQuery(pDB, buffer, &response);
+        else if (isUpdate) nStatus = executeUpdateQuery(pDB, buffer, &response);
+        else if (isInsert) nStatus = executeInsertQuery(pDB, buffer, &response);
+        else if (isDelete) nStatus = executeDeleteQuery(pDB, buffer, &response);
+        else if (isBatch) nStatus = executeBatchQuery(&g_catalog, pReq, &response);
+        else if (isReload) nStatus = executeReloadQuery(&g_catalog, buffer, &response);
+        else if (isReplicate) nStatus = executeReplicateQuery(&g_catalog, pReq, &response);
+        else if (!strncmp(buffer, "STATS", 5)) nStatus = executeStatsQuery(&response);
+#ifdef LOCK_PROFILE
+        else if (!strcmp(buffer, "LOCKS")) nStatus = executeLocksQuery(&response);
+#endif
+
+        // Partial response of cancelled query is dropped
+        if (query.nCancelled)
+        {
+            char sMessage[DATA_MAX];
+            int nLen = snprintf(sMessage, sizeof(sMessage), "Query cancelled: %s",
+                                query.nPeerClosed ? "client closed connection" : "deadline exceeded");
+            if (!isSelect && nStatus > 0) nLen += snprintf(sMessage + nLen, sizeof(sMessage) - nLen,
+                                                           " after %d recordings were updated", nStatus);
+
+            response.nUsed = 0;
+            stringAppend(&response, sMessage, nLen);
+            nStatus = STATUS_CANCELLED;
+        }
+
+        // Router passes through messages of shards, which are complete already
+        if (nStatus == STATUS_INVALID && !isRouted) stringAppend(&response, "Invalid or unsupported query", 28);
+        if (!response.nUsed) stringAppend(&response, "No recordings found for query", 29);
+        else logToFile(INFO, "query completed, %d records have been returned.", nStatus < 0 ? 0 : nStatus);
+
+        if (isSelect && !isRouted && nStatus >= 0) cacheStore(&g_cache, sKey, nVersion, &response, nStatus);
+    }
+
+    // Version replaced by reload is freed when its last query ends
+    releaseTable(pDB);
+    releaseTable(pJoin);
+
+    if (nStatus == STATUS_CANCELLED)
+    {
+        logToFile(INFO, "Thread #%d: query cancelled, %s.", pCtx->nWorkerID,
+                  query.nPeerClosed ? "client closed connection" : "deadline exceeded");
+        __atomic_fetch_add(&g_stats.nCancelled, 1, __ATOMIC_RELAXED);
+        if (response.nUsed == 0) stringAppend(&response, "Query cancelled: deadline exceeded", 34);
+    }
+
+    // Send status and response to the client with single write and close connection
+    ssize_t nSent = 0;
+    uint64_t nSendTime = traceTime();
+    if (pReq->nClientFD < 0)
+    {
+        // Connection became replication stream
+    }
+    else if (!query.nPeerClosed)
+    {
+        nSent = replyRequest(pReq, nStatus, response.pData, response.nUsed);
+        if (nSent < 0) logToFile(ERROR, "Can not send response to client");
+    }
+    else
+    {
+        close(pCtx->nClientFD);
+        statsSyscalls(1);
+    }
+
+    traceSpan("send", nSendTime);
+    traceQuery(buffer, nStatus, nStartTime);
+    pCtx->nClientFD = -1;
+
+    // Buffer grown by a huge response is not kept
+    if (response.nSize > OUTPUT_KEEP_MAX)
+    {
+        stringClear(&response);
+        stringInit(&response, DATA_MAX);
+    }
+
+    pCtx->output = response;
+    t_pQuery = NULL;
+
+    // Update statistics of this worker, cancelled queries are counted by type too
+    if (nStatus >= 0 || nStatus == STATUS_CANCELLED)
+    {
+        if (isSelect) nType = QUERY_SELECT;
+        else if (isWrite || isBatch) nType = QUERY_UPDATE;
+        else nType = QUERY_STATS;
+    }
+
+    uint64_t nEndTime = monotonicTime();
+    histogramRecord(&t_pStats->latency[nType], nEndTime - pReq->nAcceptTime);
+    statsAdd(&t_pStats->nBusyTime, nEndTime - nStartTime);
+    if (nSent > 0) statsAdd(&t_pStats->nBytesSent, nSent);
+}
+
 // This is the worker thread function
 void* werkerThread(void *pArg)
 {
     WorkerContext *pCtx = (WorkerContext*)pArg;
     logToFile(INFO, "Thread #%d: Waiting for connection", pCtx->nWorkerID);
+    t_pStats = pCtx->pStats;
+    pinWorker(&g_topology, pCtx->nWorkerID);
+
+    // Worker without ring falls back to blocking send
+    Ring ring;
+    if (g_workers.nEngine == ENGINE_URING && ringInit(&ring, 4)) t_pRing = &ring;
+
+    // Temporaries of every query are allocated from arena, which is reset after response is sent
+    Arena arena;
+    initArena(&arena);
+    t_pArena = &arena;
+    stringInit(&pCtx->output, DATA_MAX);
+
+    // Plans of repeated queries are reused without parsing
+    PlanCache plans;
+    initPlanCache(&plans);
+    t_pPlans = &plans;
+
+    // Sampled queries are traced into buffer of worker
+    TraceBuffer trace;
+    if (g_trace.isInit)
+    {
+        initTraceBuffer(&trace, pCtx->nWorkerID);
+        t_pTrace = &trace;
+    }
 
-    while (!pCtx->nInterrupt)
+    Request *pReq;
+    int nRetired = 0;
+
+    while ((pReq = dequeueRequest(&g_queue, g_workers.nIdleTimeout, &nRetired)) != NULL)
     {
-        // Lock mutex and wait for activity
-        lockMutex(&pCtx->mutex);
-        waitCondition(&pCtx->cond, &pCtx->mutex);
+        logToFile(INFO, "A connection has been delegated to thread id #%d", pCtx->nWorkerID);
+        pCtx->nClientFD = pReq->nClientFD;
+
+        // Long wait of this request means other requests wait too
+        if (monotonicTime() - pReq->nAcceptTime >= (uint64_t)g_workers.nSpawnWait * 1000) growPool(&g_workers, &g_queue);
+
+        // Connection is closed after response is sent
+        processRequest(pCtx, pReq);
+        freeRequest(pReq);
+        resetArena(&arena);
+
+        // Sleep 0.5 econds to simulate intensive database execution
+        uint64_t nSleepTime = traceTime();
+        usleep(500000);
+        traceSpan("sleep", nSleepTime);
+        traceEnd();
+    }
 
-        // Check if thread is interrupted by exit handler
-        if (pCtx->nInterrupt)
-        {
-            unlockMutex(&pCtx->mutex);
-            signalCondition(&pCtx->cond);
-            break;
-        }
+    // Slot is left for the next spawned worker, it joins this thread
+    lockMutex(&g_workers.mutex);
+    pCtx->nLiveTime += monotonicTime() - pCtx->nSpawnTime;
+    pCtx->nState = WORKER_RETIRED;
+    if (nRetired)
+    {
+        g_workers.nRetired++;
+        logToFile(INFO, "Thread #%d: retired after being idle, %d threads are left.", pCtx->nWorkerID, g_workers.nWorkerCount);
+    }
 
-        // Activate busy flag and unlock mutex
-        pCtx->nBusy = 1;
-        unlockMutex(&pCtx->mutex);
+    unlockMutex(&g_workers.mutex);
 
-        // Check if worker has active connection
-        if (pCtx->nClientFD >= 0)
-        {
-            char buffer[DATA_MAX];
-            int nLen = read(pCtx->nClientFD, buffer, sizeof(buffer));
-            if (nLen <= 0)
-            {
-                logToFile(ERROR,  "Can not read query from client");
-                break;
-            }
+    if (t_pRing != NULL) ringDestroy(t_pRing);
+    t_pRing = NULL;
+
+    t_pPlans = NULL;
+    destroyPlanCache(&plans);
 
-            int nStatus = -1;
-            buffer[nLen] = '\0';
-            logToFile(INFO, "Thread #%d: received query '%s'", pCtx->nWorkerID, buffer);
-            
-            String response; // Initialize response
-            stringInit(&response, DATA_MAX);
+    if (t_pTrace != NULL) destroyTraceBuffer(t_pTrace);
+    t_pTrace = NULL;
 
-            // Determine request type, parse query and send response to the clienrt
-            if (!strncmp(buffer, "SELECT", 6)) nStatus = executeSelectQuery(&g_dataBase, buffer, &response);
-            else if (!strncmp(buffer, "UPDATE", 6)) nStatus = executeUpdateQuery(&g_dataBase, buffer, &response);
+    t_pArena = NULL;
+    destroyArena(&arena);
+    stringClear(&pCtx->output);
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////
+// WORKER POOL
+////////////////////////////////////////////////////////////////////////
+
+// This function initializes worker pool, threads are spawned later
+void initPool(WorkerThreads *pPool, ServerConfig *pConf)
+{
+    initMutex(&pPool->mutex);
+    pPool->pWorkers = calloc(pConf->nMaxPoolSize, sizeof(WorkerContext*));
+    if (pPool->pWorkers == NULL)
+    {
+        logToFile(ERROR, "Can not alloc memory for worker pool");
+        pthread_mutex_destroy(&pPool->mutex);
+        exitFailure(NULL);
+    }
+
+    pPool->nSpawned = 0;
+    pPool->nRetired = 0;
+    pPool->nLastSpawn = 0;
+    pPool->nSlotCount = 0;
+    pPool->nWorkerCount = 0;
+    pPool->nMinWorkers = pConf->nPoolSize;
+    pPool->nMaxWorkers = pConf->nMaxPoolSize;
+    pPool->nSpawnWait = pConf->nSpawnWait;
+    pPool->nEngine = pConf->nEngine;
+    pPool->nIdleTimeout = pConf->nMaxPoolSize > pConf->nPoolSize ? pConf->nIdleTimeout : 0;
+    pPool->isInit = 1;
+}
 
-            if (nStatus < 0) stringAppend(&response, "Invalid or unsupported query", 28);
-            if (!response.nUsed) stringAppend(&response, "No recordings found for query", 29);
-            else logToFile(INFO, "query completed, %d records have been returned.", nStatus < 0 ? 0 : nStatus);
+// This function runs new worker thread in a free slot, pool mutex must be locked
+int spawnWorker(WorkerThreads *pPool)
+{
+    WorkerContext *pWorker = NULL;
+    int i;
+
+    // Reuse slot of retired worker first, its thread is already exited
+    for (i = 0; i < pPool->nSlotCount && pWorker == NULL; i++)
+    {
+        WorkerContext *pSlot = pPool->pWorkers[i];
+        if (pSlot->nState == WORKER_RUNNING) continue;
+        if (pSlot->nState == WORKER_RETIRED) pthread_join(pSlot->thread, NULL);
 
-            // Send response to the client
-            if (write(pCtx->nClientFD, &nStatus, sizeof(nStatus)) < 0) break;
-            if (write(pCtx->nClientFD, response.pData, response.nUsed) < 0) break;
-            stringClear(&response); // Clear response
+        pSlot->nState = WORKER_STOPPED;
+        pWorker = pSlot;
+    }
 
-            // Close connection
-            close(pCtx->nClientFD);
-            pCtx->nClientFD = -1;
+    if (pWorker == NULL)
+    {
+        if (pPool->nSlotCount >= pPool->nMaxWorkers) return 0;
 
-            // Sleep 0.5 econds to simulate intensive database execution
-            usleep(500000);
+        pWorker = calloc(1, sizeof(WorkerContext));
+        if (pWorker == NULL)
+        {
+            logToFile(ERROR, "Can not alloc memory for worker");
+            return 0;
         }
 
-        // Mark worker as free
-        lockMutex(&pCtx->mutex);
-        pCtx->nBusy = 0;
-        unlockMutex(&pCtx->mutex);
+        initWorker(pWorker, pPool->nSlotCount);
+        pPool->pWorkers[pPool->nSlotCount] = pWorker;
+        __atomic_store_n(&pPool->nSlotCount, pPool->nSlotCount + 1, __ATOMIC_RELEASE);
+    }
+
+    pWorker->nSpawnTime = monotonicTime();
+    pWorker->nState = WORKER_RUNNING;
+    __atomic_add_fetch(&pPool->nWorkerCount, 1, __ATOMIC_RELAXED);
 
-        // Notify main thread that worker is free
-        signalCondition(&g_cond);
+    // Run worker thread, it is joined on exit or when its slot is reused
+    if (pthread_create(&pWorker->thread, NULL, werkerThread, pWorker))
+    {
+        logToFile(ERROR, "Can not create worker thread");
+        pWorker->nState = WORKER_STOPPED;
+        __atomic_sub_fetch(&pPool->nWorkerCount, 1, __ATOMIC_RELAXED);
+        return 0;
     }
 
-    // Release any waiter sto this thread
-    signalCondition(&g_cond);
-    signalCondition(&pCtx->cond);
+    pPool->nSpawned++;
+    pPool->nLastSpawn = pWorker->nSpawnTime;
+    return 1;
+}
+
+// This function spawns new worker if requests wait in queue longer than spawn threshold,
+// at most one worker is spawned per threshold so new workers have time to drain the queue
+void growPool(WorkerThreads *pPool, RequestQueue *pQueue)
+{
+    if (__atomic_load_n(&pPool->nWorkerCount, __ATOMIC_RELAXED) >= pPool->nMaxWorkers) return;
+
+    uint64_t nNow = monotonicTime();
+    uint64_t nThreshold = (uint64_t)pPool->nSpawnWait * 1000;
+    uint64_t nWait = queueWaitTime(pQueue, nNow);
+    if (nWait < nThreshold) return;
 
-    return NULL;
+    lockMutex(&pPool->mutex);
+    if (pPool->isInit && pPool->nWorkerCount < pPool->nMaxWorkers &&
+        nNow - pPool->nLastSpawn >= nThreshold && spawnWorker(pPool))
+    {
+        logToFile(INFO, "Requests wait %lu msecs, worker pool grows to %d threads.",
+                  (unsigned long)(nWait / 1000), pPool->nWorkerCount);
+    }
+
+    unlockMutex(&pPool->mutex);
+}
+
+// This function takes one worker from pool if pool is above its minimum,
+// caller worker exits when non-zero is returned
+int shrinkPool(WorkerThreads *pPool)
+{
+    int nCount = __atomic_load_n(&pPool->nWorkerCount, __ATOMIC_RELAXED);
+    while (nCount > pPool->nMinWorkers)
+    {
+        if (__atomic_compare_exchange_n(&pPool->nWorkerCount, &nCount, nCount - 1, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return 1;
+    }
+
+    return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////
@@ -1062,8 +10466,32 @@ void* werkerThread(void *pArg)
 void parseArgs(int argc, char *argv[], ServerConfig *pConf)
 {
     int nOpt = 0, nCount = 0;
-
-    while ((nOpt = getopt(argc, argv, "p:o:l:d:")) != -1) 
+    pConf->nCacheSize = CACHE_SIZE_DEFAULT;
+    pConf->nStatsInterval = STATS_INTERVAL;
+    pConf->nQueueLimit = QUEUE_LIMIT_DEFAULT;
+    pConf->nQueryTimeout = QUERY_TIMEOUT_DEFAULT;
+    pConf->nMaxPoolSize = 0;
+    pConf->nSpawnWait = SPAWN_WAIT_DEFAULT;
+    pConf->nIdleTimeout = IDLE_TIMEOUT_DEFAULT;
+
+    pConf->nPinning = 0;
+    pConf->nNuma = 0;
+    pConf->nEngine = ENGINE_BLOCKING;
+    pConf->pLocalPath = NULL;
+    pConf->pBloomColumns = NULL;
+    pConf->nBloomBits = BLOOM_BITS_DEFAULT;
+    pConf->nCompactPercent = COMPACT_PERCENT_DEFAULT;
+    pConf->pDBPath = NULL;
+    pConf->pPrimary = NULL;
+    pConf->pShards = NULL;
+    pConf->pShardKey = NULL;
+    pConf->nShard = 0;
+    pConf->nShardCount = 0;
+    pConf->pTracePath = NULL;
+    pConf->nTraceSample = TRACE_SAMPLE_DEFAULT;
+    int nSources = 0;
+
+    while ((nOpt = getopt(argc, argv, "p:o:l:d:c:s:q:t:L:w:e:ANE:U:B:b:C:F:R:S:K:T:r:")) != -1) 
     {
         switch (nOpt)
         {
@@ -1081,18 +10509,94 @@ void parseArgs(int argc, char *argv[], ServerConfig *pConf)
                 break;
             case 'd':
                 pConf->pDBPath = optarg;
+                nSources++;
+                nCount++;
+                break;
+            case 'c':
+                pConf->nCacheSize = atoi(optarg);
+                break;
+            case 's':
+                pConf->nStatsInterval = atoi(optarg);
+                break;
+            case 'q':
+                pConf->nQueueLimit = atoi(optarg);
+                break;
+            case 't':
+                pConf->nQueryTimeout = atoi(optarg);
+                break;
+            case 'L':
+                pConf->nMaxPoolSize = atoi(optarg);
+                break;
+            case 'w':
+                pConf->nSpawnWait = atoi(optarg);
+                break;
+            case 'e':
+                pConf->nIdleTimeout = atoi(optarg);
+                break;
+            case 'A':
+                pConf->nPinning = 1;
+                break;
+            case 'N':
+                pConf->nNuma = 1;
+                break;
+            case 'E':
+                if (!strcmp(optarg, "uring")) pConf->nEngine = ENGINE_URING;
+                else if (strcmp(optarg, "blocking")) pConf->nEngine = -1;
+                break;
+            case 'U':
+                pConf->pLocalPath = optarg;
+                break;
+            case 'B':
+                pConf->pBloomColumns = optarg;
+                break;
+            case 'b':
+                pConf->nBloomBits = atoi(optarg);
+                break;
+            case 'C':
+                pConf->nCompactPercent = atoi(optarg);
+                break;
+            case 'F':
+                pConf->pPrimary = optarg;
+                nSources++;
+                nCount++;
+                break;
+            case 'R':
+                pConf->pShards = optarg;
+                nSources++;
                 nCount++;
                 break;
+            case 'S':
+                if (sscanf(optarg, "%d/%d", &pConf->nShard, &pConf->nShardCount) != 2) pConf->nShardCount = -1;
+                break;
+            case 'K':
+                pConf->pShardKey = optarg;
+                break;
+            case 'T':
+                pConf->pTracePath = optarg;
+                break;
+            case 'r':
+                pConf->nTraceSample = atoi(optarg);
+                break;
             default:
                 break;
         }
     }
 
-    // Validate command line arguments
-    if (nCount != 4 || pConf->nPoolSize < 2)
+    // Pool size is fixed unless maximum is given
+    if (!pConf->nMaxPoolSize) pConf->nMaxPoolSize = pConf->nPoolSize;
+
+    // Validate command line arguments, follower gets tables from primary instead of dataset and router has no tables.
+    // Shard loads its part of dataset, shard and router need column which rows are sharded by
+    if (nCount != 4 || nSources != 1 || pConf->nPoolSize < 2 || pConf->nQueueLimit < 1 ||
+        pConf->nShardCount < 0 || (pConf->nShardCount && (pConf->pDBPath == NULL || pConf->nShard < 0 ||
+        pConf->nShard >= pConf->nShardCount || pConf->nShardCount > SHARDS_MAX)) ||
+        ((pConf->nShardCount || pConf->pShards != NULL) != (pConf->pShardKey != NULL)) ||
+        pConf->nMaxPoolSize < pConf->nPoolSize || pConf->nSpawnWait < 0 || pConf->nEngine < 0 ||
+        pConf->nBloomBits < 1 || pConf->nBloomBits > BLOOM_BITS_MAX ||
+        pConf->nCompactPercent < 0 || pConf->nCompactPercent > 100 || pConf->nTraceSample < 1)
     {
         printf("Invalid or missing command line parameters\n");
-        printf("Usage: %s -p PORT -o pathToLogFile –l poolSize –d datasetPath\n", argv[0]);
+        printf("Usage: %s -p PORT -o pathToLogFile –l poolSize –d datasetDir|dataset1.csv,dataset2.csv|-F primaryHost:port|-R shard1Host:port,shard2Host:port [-S shard/shardCount] [-K shardKeyColumn] [-c cacheSize] [-s statsInterval] [-q queueLimit] [-t queryTimeoutMs] [-L maxPoolSize] [-w spawnWaitMs] [-e idleTimeoutMs] [-A] [-N] [-E blocking|uring] [-U localSocketPath] [-B bloomColumns] [-b bloomBitsPerKey] [-C compactPercent] [-T traceFile] [-r traceSampleRate]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 }
@@ -1100,10 +10604,27 @@ void parseArgs(int argc, char *argv[], ServerConfig *pConf)
 // MAIN function
 int main(int argc, char *argv[])
 {
+#ifdef LOCK_PROFILE
+    // Locks are counted from the first one
+    initLockRegistry(&g_locks);
+#endif
+
     // Init global stats
     g_logger.isInit = 0;
+    g_trace.isInit = 0;
     g_workers.isInit = 0;
-    g_dataBase.isInit = 0;
+    g_catalog.isInit = 0;
+    g_catalog.isCompactInit = 0;
+    g_catalog.isReloadInit = 0;
+    g_catalog.isSignalInit = 0;
+    g_replica.isInit = 0;
+    g_router.nCount = 0;
+    g_router.pList = NULL;
+    g_cache.isInit = 0;
+    g_stats.isInit = 0;
+    g_queue.isInit = 0;
+    g_local.nSocket = -1;
+    g_local.isThreadInit = 0;
 
     // Intialize signal handler
     struct sigaction sigAct;
@@ -1115,6 +10636,11 @@ int main(int argc, char *argv[])
     if (sigaction(SIGINT, &sigAct, NULL) != 0)
         exitFailure("Failed to setup SIGINT handler");
 
+    // Clients may close connection before response, write must fail instead of killing server
+    sigAct.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &sigAct, NULL) != 0)
+        exitFailure("Failed to ignore SIGPIPE signal");
+
     // Parse command line arguments
     ServerConfig config;
     parseArgs(argc, argv, &config);
@@ -1129,7 +10655,30 @@ int main(int argc, char *argv[])
     logToFile(INFO, "-p %d", config.nPort);
     logToFile(INFO, "-o %s", config.pLogFile);
     logToFile(INFO, "-l %d", config.nPoolSize);
-    logToFile(INFO, "-d %s", config.pDBPath);
+    if (config.pDBPath != NULL) logToFile(INFO, "-d %s", config.pDBPath);
+    if (config.pPrimary != NULL) logToFile(INFO, "-F %s", config.pPrimary);
+    if (config.pShards != NULL) logToFile(INFO, "-R %s", config.pShards);
+    if (config.nShardCount) logToFile(INFO, "-S %d/%d", config.nShard, config.nShardCount);
+    if (config.pShardKey != NULL) logToFile(INFO, "-K %s", config.pShardKey);
+    logToFile(INFO, "-c %d", config.nCacheSize);
+    logToFile(INFO, "-s %d", config.nStatsInterval);
+    logToFile(INFO, "-q %d", config.nQueueLimit);
+    logToFile(INFO, "-t %d", config.nQueryTimeout);
+    logToFile(INFO, "-L %d", config.nMaxPoolSize);
+    logToFile(INFO, "-w %d", config.nSpawnWait);
+    logToFile(INFO, "-e %d", config.nIdleTimeout);
+    if (config.nPinning) logToFile(INFO, "-A");
+    if (config.nNuma) logToFile(INFO, "-N");
+    logToFile(INFO, "-E %s", config.nEngine == ENGINE_URING ? "uring" : "blocking");
+    if (config.pLocalPath != NULL) logToFile(INFO, "-U %s", config.pLocalPath);
+    if (config.pBloomColumns != NULL) logToFile(INFO, "-B %s", config.pBloomColumns);
+    logToFile(INFO, "-b %d", config.nBloomBits);
+    logToFile(INFO, "-C %d", config.nCompactPercent);
+    if (config.pTracePath != NULL) logToFile(INFO, "-T %s", config.pTracePath);
+    if (config.pTracePath != NULL) logToFile(INFO, "-r %d", config.nTraceSample);
+
+    // Trace file is opened before daemon() changes directory, so relative path works
+    if (config.pTracePath != NULL) initTracer(&g_trace, config.pTracePath, config.nTraceSample);
 
     // Run in background and detach from terminal
     // after this server will no longer own the shell
@@ -1139,128 +10688,128 @@ int main(int argc, char *argv[])
         exitFailure(NULL);
     }
 
+    g_trace.nPid = getpid();
+
+    // SIGHUP is taken only by signal thread, so it is blocked before any thread starts
+    sigset_t hupSet;
+    sigemptyset(&hupSet);
+    sigaddset(&hupSet, SIGHUP);
+    if (pthread_sigmask(SIG_BLOCK, &hupSet, NULL) != 0)
+        exitFailure("Failed to block SIGHUP signal");
+
     // Create listener socket
     g_nListenerSock = createServerSocket(config.nPort);
 
-    // Load input dataset from tsv file
-    initDatabase(&g_dataBase);
-    loadDatabase(config.pDBPath, &g_dataBase);
-    if (g_nInterrupted) exitFailure(NULL);
+    // Detect CPUs and NUMA nodes before tables are loaded and placed
+    initTopology(&g_topology, config.nPinning, config.nNuma);
+
+    // Load input datasets from csv files, every file is a table
+    if (!initCatalog(&g_catalog, config.pDBPath)) exitFailure(NULL);
+    g_catalog.pBloomColumns = config.pBloomColumns;
+    g_catalog.nBloomBits = config.nBloomBits;
+    g_catalog.nCompactPercent = config.nCompactPercent;
+    g_catalog.pShardKey = config.pShardKey;
+    g_catalog.nShard = config.nShard;
+    g_catalog.nShardCount = config.nShardCount;
+    initReplication(&g_replica, config.pPrimary);
+    initRouter(&g_router, config.pShards, config.pShardKey);
+
+    if (config.pDBPath != NULL && !loadCatalog(&g_catalog)) exitFailure(NULL);
+
+    // Follower serves queries after it has snapshots of all tables of primary
+    if (config.pPrimary != NULL)
+    {
+        logToFile(INFO, "Waiting for snapshots of primary %s...", config.pPrimary);
+        g_replica.isThreadInit = 1;
+        if (pthread_create(&g_replica.thread, NULL, followerThread, &g_catalog))
+        {
+            logToFile(ERROR, "Can not create follower thread");
+            g_replica.isThreadInit = 0;
+            exitFailure(NULL);
+        }
+
+        while (!__atomic_load_n(&g_replica.isSynced, __ATOMIC_ACQUIRE) && !g_nInterrupted) usleep(10000);
+        if (g_nInterrupted) exitFailure(NULL);
+    }
+
+    // Run compaction of deleted rows unless it is disabled
+    if (config.nCompactPercent > 0)
+    {
+        g_catalog.isCompactInit = 1;
+        if (pthread_create(&g_catalog.compactThread, NULL, compactThread, &g_catalog))
+        {
+            logToFile(ERROR, "Can not create compaction thread");
+            g_catalog.isCompactInit = 0;
+            exitFailure(NULL);
+        }
+    }
+
+    // Init cache of SELECT responses
+    initCache(&g_cache, config.nCacheSize);
+
+    // Init server statistics and run periodic stats dump
+    memset(&g_stats, 0, sizeof(g_stats));
+    g_stats.nStartTime = monotonicTime();
+    g_stats.isInit = 1;
 
-    // Init general mutex
-    if (pthread_mutex_init(&g_mutex, NULL))
+    if (config.nStatsInterval > 0 && pthread_create(&g_stats.statsThread, NULL, statsThread, &config.nStatsInterval))
     {
-        logToFile(ERROR, "Failed to init general pthread mutex");
+        logToFile(ERROR, "Can not create stats thread");
         exitFailure(NULL);
     }
 
-    // Init general condition variable
-    if (pthread_cond_init(&g_cond, NULL))
+    g_stats.isThreadInit = config.nStatsInterval > 0;
+
+    // SIGHUP reloads all datasets without downtime, same as RELOAD query
+    g_catalog.isSignalInit = 1;
+    if (pthread_create(&g_catalog.signalThread, NULL, signalThread, &g_catalog))
     {
-        logToFile(ERROR, "Failed to init general condition variable");
-        pthread_mutex_destroy(&g_mutex);
+        logToFile(ERROR, "Can not create signal thread");
+        g_catalog.isSignalInit = 0;
         exitFailure(NULL);
     }
 
-    // Mark global sync variables as initialized so we can 
-    // destroy those variables later according to this flag
-    g_syncInit = 1;
+    // Init queue of pending requests
+    initQueue(&g_queue, config.nQueueLimit);
+
+    // Blocking I/O is used if kernel does not support io_uring engine
+    if (config.nEngine == ENGINE_URING && !uringSupported())
+    {
+        logToFile(INFO, "Kernel does not support io_uring engine, blocking I/O is used.");
+        config.nEngine = ENGINE_BLOCKING;
+    }
 
-    // Initialize worker threads context
-    WorkerContext threads[config.nPoolSize];
-    g_workers.nWorkerCount = 0;
-    g_workers.pWorkers = threads;
+    // Initialize worker pool, contexts are allocated on heap as pool grows
+    initPool(&g_workers, &config);
     int i;
 
-    // Initialize and run worker threads
+    // Run minimum count of worker threads
     for (i = 0; i < config.nPoolSize; i++)
     {
         // Check if interrupted
         if (g_nInterrupted) exitFailure(NULL);
 
-        // Initialize current worker thread
-        WorkerContext *pWorker = &threads[i];
-        initWorker(pWorker, i);
+        lockMutex(&g_workers.mutex);
+        int nSpawned = spawnWorker(&g_workers);
+        unlockMutex(&g_workers.mutex);
 
-        pthread_attr_t pattr;
-        pthread_t threadId;
-
-        // Run worker thread as detached
-        if (pthread_attr_init(&pattr) ||
-            pthread_attr_setdetachstate(&pattr, PTHREAD_CREATE_DETACHED) ||
-            pthread_create(&threadId, &pattr, werkerThread, pWorker) ||
-            pthread_attr_destroy(&pattr))
+        if (!nSpawned)
         {
-            logToFile(ERROR, "Can not create worker thread");
-            destroyWorker(pWorker);
             globalDestroy();
             return 1;
         }
-
-        // Update global stat variables
-        g_workers.nWorkerCount++;
-        g_workers.isInit = 1;
     }
 
-    // Main loop
-    while (!g_nInterrupted)
-    {
-        socklen_t len = sizeof(struct sockaddr);
-        struct sockaddr_in inAddr;
-    
-        /* Acceot to the new connection request */
-        int nClientFD = accept(g_nListenerSock, (struct sockaddr*)&inAddr, &len);
-        if (nClientFD < 0)
-        {
-            logToFile(ERROR, "Can not accept to the socket");
-            break;
-        }
-
-        int nAssigned = 0;
-        while (!nAssigned)
-        {
-            // Interate workers and check if any is not busy
-            for (i = 0; i < g_workers.nWorkerCount; i++)
-            {
-                // Get workeker and lock
-                WorkerContext *pWorker = &threads[i];
-                lockMutex(&pWorker->mutex);
-
-                // Check if worker is busy
-                if (pWorker->nBusy)
-                {
-                    // This worker is busy, unlock and try another one
-                    unlockMutex(&pWorker->mutex);
-                    continue;
-                }
-
-                // At this case, found worker is not busy
-                // we can use it for this connection
-                pWorker->nClientFD = nClientFD;
-                unlockMutex(&pWorker->mutex);
-
-                // Notify worker about new connection
-                signalCondition(&pWorker->cond);
-                logToFile(INFO, "A connection has been delegated to thread id #%d", pWorker->nWorkerID);
+    // Co-located clients connect to AF_UNIX socket, it is served by its own acceptor
+    if (config.pLocalPath != NULL) startLocalListener(&g_local, config.pLocalPath, config.nQueryTimeout);
 
-                // Update assigned flag
-                nAssigned = 1;
-                break;
-            }
+    // Main loop of io_uring engine, it returns only on interrupt or if kernel lacks multishot accept
+    if (config.nEngine == ENGINE_URING && !uringAcceptLoop(&g_queue, config.nQueryTimeout))
+        logToFile(INFO, "Can not accept with io_uring engine, blocking accept is used.");
 
-            // At this case all workers are busy so we must
-            // wait any worker thread to finish processing
-            if (!nAssigned)
-            {
-                lockMutex(&g_mutex);
-                // When worker finishes, it will send signal to 
-                // this condition variable, so main will wake
-                logToFile(INFO, "No thread is available! Waiting...");
-                waitCondition(&g_cond, &g_mutex);
-                unlockMutex(&g_mutex);
-            }
-        }
-    }
+    // Main loop, queries are read and queued for workers, query is rejected when queue is full
+    int isRunning = 1;
+    acceptLoop(&g_queue, g_nListenerSock, 0, config.nQueryTimeout, &isRunning);
 
     // Cleanup any allocared variable and exit
     globalDestroy();